@@ -0,0 +1,484 @@
+/*
+MD3 and/or BSP to OBJ converter
+Written by Leszek Godlewski <github@inequation.org>
+The code in this file is placed in the public domain.
+*/
+
+/*
+Compact MD3 animation container. Everything is little-endian:
+
+	char	magic[4]			"MD3A"
+	int		version				MD3_ANIM_VERSION
+	int		num_surfaces
+	int		first_frame			index of the first exported frame in the source MD3
+	int		num_frames
+	for each surface:
+		char	name[MAX_QPATH]
+		int		num_verts, num_triangles
+		short	indexes[num_triangles * 3]
+		float	st[num_verts * 2]
+		short	rest[num_verts * 4]		xyz and normal of the first frame, as in md3XyzNormal_t
+	for each following frame, for each surface:
+		byte	flags					ANIM_POSITIONS, ANIM_WIDE, ANIM_NORMALS
+		if ANIM_POSITIONS:
+			byte	mask[(num_verts + 7) / 8]	vertices whose xyz changed since the previous frame
+			char or short (if ANIM_WIDE)	delta[3] per vertex set in the mask
+		if ANIM_NORMALS:
+			byte	mask[(num_verts + 7) / 8]	vertices whose normal changed
+			short	normal per vertex set in the mask
+
+Deltas are taken against the previous frame in the same quantized units
+as the MD3 itself, so decoding is lossless.
+*/
+
+#ifdef _MSC_VER
+	#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "md3bsp2ase.h"
+
+#define MD3_ANIM_IDENT		"MD3A"
+#define MD3_ANIM_VERSION	1
+
+#define ANIM_POSITIONS		1
+#define ANIM_WIDE			2
+#define ANIM_NORMALS		4
+
+typedef struct
+{
+	unsigned char *data;
+	size_t size, capacity;
+	int failed;
+} byte_buffer_t;
+
+// Decoded animation, one contiguous block of md3XyzNormal_t-like shorts per surface.
+typedef struct
+{
+	int num_surfaces;
+	int first_frame, num_frames;
+	int *num_verts;
+	short **frames;			// per surface: num_frames * num_verts * 4
+} md3_anim_t;
+
+static unsigned char *reserve(byte_buffer_t *b, size_t count)
+{
+	unsigned char *p;
+
+	if (b->failed)
+		return NULL;
+	if (b->size + count > b->capacity)
+	{
+		size_t capacity = b->capacity ? b->capacity : 4096;
+		while (capacity < b->size + count)
+			capacity *= 2;
+		if (!(p = realloc(b->data, capacity)))
+		{
+			b->failed = 1;
+			return NULL;
+		}
+		b->data = p;
+		b->capacity = capacity;
+	}
+	p = b->data + b->size;
+	b->size += count;
+	return p;
+}
+
+static void put_byte(byte_buffer_t *b, int v)
+{
+	unsigned char *p = reserve(b, 1);
+	if (p)
+		p[0] = (unsigned char)v;
+}
+
+static void put_short(byte_buffer_t *b, int v)
+{
+	unsigned char *p = reserve(b, 2);
+	if (p)
+	{
+		p[0] = v & 0xFF;
+		p[1] = (v >> 8) & 0xFF;
+	}
+}
+
+static void put_long(byte_buffer_t *b, int v)
+{
+	unsigned char *p = reserve(b, 4);
+	if (p)
+	{
+		p[0] = v & 0xFF;
+		p[1] = (v >> 8) & 0xFF;
+		p[2] = (v >> 16) & 0xFF;
+		p[3] = (v >> 24) & 0xFF;
+	}
+}
+
+static void put_float(byte_buffer_t *b, float f)
+{
+	union { float f; int i; } v;
+	v.f = f;
+	put_long(b, v.i);
+}
+
+static void put_bytes(byte_buffer_t *b, const void *data, size_t count)
+{
+	unsigned char *p = reserve(b, count);
+	if (p)
+		memcpy(p, data, count);
+}
+
+// Bounds-checked reads for the decoder; any overrun latches the error flag.
+typedef struct
+{
+	const unsigned char *p, *end;
+	int failed;
+} byte_reader_t;
+
+static const unsigned char *take(byte_reader_t *r, size_t count)
+{
+	const unsigned char *p = r->p;
+	if (r->failed || (size_t)(r->end - r->p) < count)
+	{
+		r->failed = 1;
+		return NULL;
+	}
+	r->p += count;
+	return p;
+}
+
+static int get_byte(byte_reader_t *r)
+{
+	const unsigned char *p = take(r, 1);
+	return p ? p[0] : 0;
+}
+
+static int get_short(byte_reader_t *r)
+{
+	const unsigned char *p = take(r, 2);
+	return p ? (short)(p[0] | (p[1] << 8)) : 0;
+}
+
+static int get_long(byte_reader_t *r)
+{
+	const unsigned char *p = take(r, 4);
+	return p ? (int)(p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24)) : 0;
+}
+
+static void encode_frame(byte_buffer_t *b, const md3XyzNormal_t *prev, const md3XyzNormal_t *cur, int num_verts)
+{
+	unsigned char *mask;
+	size_t mask_offset;
+	int mask_size = (num_verts + 7) / 8;
+	int flags = 0, i, k, d;
+
+	for (i = 0; i < num_verts; ++i)
+	{
+		for (k = 0; k < 3; ++k)
+		{
+			d = cur[i].xyz[k] - prev[i].xyz[k];
+			if (d)
+				flags |= ANIM_POSITIONS;
+			if (d < -128 || d > 127)
+				flags |= ANIM_WIDE;
+		}
+		if (cur[i].normal != prev[i].normal)
+			flags |= ANIM_NORMALS;
+	}
+	put_byte(b, flags);
+
+	if (flags & ANIM_POSITIONS)
+	{
+		if ((mask = reserve(b, mask_size)) == NULL)
+			return;
+		// appending the deltas may move the buffer, so keep the mask's offset rather than its address
+		mask_offset = mask - b->data;
+		memset(mask, 0, mask_size);
+		for (i = 0; i < num_verts; ++i)
+		{
+			if (cur[i].xyz[0] != prev[i].xyz[0] || cur[i].xyz[1] != prev[i].xyz[1]
+				|| cur[i].xyz[2] != prev[i].xyz[2])
+			{
+				mask[i >> 3] |= 1 << (i & 7);
+			}
+		}
+		for (i = 0; i < num_verts && !b->failed; ++i)
+		{
+			if (!(b->data[mask_offset + (i >> 3)] & (1 << (i & 7))))
+				continue;
+			for (k = 0; k < 3; ++k)
+			{
+				d = cur[i].xyz[k] - prev[i].xyz[k];
+				if (flags & ANIM_WIDE)
+					put_short(b, d);
+				else
+					put_byte(b, d & 0xFF);
+			}
+		}
+	}
+
+	if (flags & ANIM_NORMALS)
+	{
+		if ((mask = reserve(b, mask_size)) == NULL)
+			return;
+		memset(mask, 0, mask_size);
+		for (i = 0; i < num_verts; ++i)
+		{
+			if (cur[i].normal != prev[i].normal)
+				mask[i >> 3] |= 1 << (i & 7);
+		}
+		for (i = 0; i < num_verts; ++i)
+		{
+			if (cur[i].normal != prev[i].normal)
+				put_short(b, cur[i].normal);
+		}
+	}
+}
+
+static void free_md3_anim(md3_anim_t *anim)
+{
+	int i;
+
+	if (anim->frames)
+	{
+		for (i = 0; i < anim->num_surfaces; ++i)
+			free(anim->frames[i]);
+	}
+	free(anim->frames);
+	free(anim->num_verts);
+	memset(anim, 0, sizeof(*anim));
+}
+
+// Decodes a whole container into full frames. Returns 0 on success.
+static int decode_md3_anim(const unsigned char *data, size_t size, md3_anim_t *anim)
+{
+	byte_reader_t r;
+	const unsigned char *mask;
+	short *prev, *cur;
+	int surf_index, frame, num_verts, mask_size, flags, i, k;
+
+	memset(anim, 0, sizeof(*anim));
+	r.p = data;
+	r.end = data + size;
+	r.failed = 0;
+
+	if (!(mask = take(&r, 4)) || memcmp(mask, MD3_ANIM_IDENT, 4) || get_long(&r) != MD3_ANIM_VERSION)
+		return 1;
+	anim->num_surfaces = get_long(&r);
+	anim->first_frame = get_long(&r);
+	anim->num_frames = get_long(&r);
+	if (r.failed || anim->num_surfaces < 1 || anim->num_surfaces > MD3_MAX_SURFACES
+		|| anim->num_frames < 1 || anim->num_frames > MD3_MAX_FRAMES)
+	{
+		return 1;
+	}
+
+	anim->num_verts = calloc(anim->num_surfaces, sizeof(*anim->num_verts));
+	anim->frames = calloc(anim->num_surfaces, sizeof(*anim->frames));
+	if (!anim->num_verts || !anim->frames)
+	{
+		free_md3_anim(anim);
+		return 1;
+	}
+
+	for (surf_index = 0; surf_index < anim->num_surfaces; ++surf_index)
+	{
+		take(&r, MAX_QPATH);
+		num_verts = anim->num_verts[surf_index] = get_long(&r);
+		k = get_long(&r);
+		if (r.failed || num_verts < 0 || num_verts > MD3_MAX_VERTS || k < 0 || k > MD3_MAX_TRIANGLES)
+		{
+			free_md3_anim(anim);
+			return 1;
+		}
+		take(&r, k * 3 * 2 + num_verts * 2 * 4);
+		anim->frames[surf_index] = malloc(sizeof(short) * 4 * num_verts * anim->num_frames + 1);
+		if (!anim->frames[surf_index])
+		{
+			free_md3_anim(anim);
+			return 1;
+		}
+		for (i = 0; i < num_verts * 4; ++i)
+			anim->frames[surf_index][i] = (short)get_short(&r);
+	}
+
+	for (frame = 1; frame < anim->num_frames && !r.failed; ++frame)
+	{
+		for (surf_index = 0; surf_index < anim->num_surfaces; ++surf_index)
+		{
+			num_verts = anim->num_verts[surf_index];
+			mask_size = (num_verts + 7) / 8;
+			prev = anim->frames[surf_index] + (frame - 1) * num_verts * 4;
+			cur = prev + num_verts * 4;
+			memcpy(cur, prev, sizeof(*cur) * num_verts * 4);
+
+			flags = get_byte(&r);
+			if ((flags & ANIM_POSITIONS) && (mask = take(&r, mask_size)) != NULL)
+			{
+				for (i = 0; i < num_verts; ++i)
+				{
+					if (!(mask[i >> 3] & (1 << (i & 7))))
+						continue;
+					for (k = 0; k < 3; ++k)
+					{
+						cur[i * 4 + k] = (short)(cur[i * 4 + k]
+							+ ((flags & ANIM_WIDE) ? get_short(&r) : (signed char)get_byte(&r)));
+					}
+				}
+			}
+			if ((flags & ANIM_NORMALS) && (mask = take(&r, mask_size)) != NULL)
+			{
+				for (i = 0; i < num_verts; ++i)
+				{
+					if (mask[i >> 3] & (1 << (i & 7)))
+						cur[i * 4 + 3] = (short)get_short(&r);
+				}
+			}
+		}
+	}
+
+	if (r.failed)
+	{
+		free_md3_anim(anim);
+		return 1;
+	}
+	return 0;
+}
+
+// Parses "N" (N to the end) or "N-M" (inclusive); no frame argument means all frames.
+static void parse_frame_range(const char *range, int num_frames, int *first, int *last)
+{
+	*first = 0;
+	*last = num_frames - 1;
+	if (!range)
+		return;
+	if (sscanf(range, "%d-%d", first, last) < 2)
+		*last = num_frames - 1;
+	*first = max(0, min(*first, num_frames - 1));
+	*last = max(*first, min(*last, num_frames - 1));
+}
+
+int convert_md3_to_anim(const md3_model_t *model, const char *frame_range, const sink_t *sink)
+{
+	const md3Surface_t *surf;
+	const md3Triangle_t *tri;
+	const md3St_t *st;
+	const md3XyzNormal_t *xyz;
+	output_t out;
+	md3_anim_t anim;
+	byte_buffer_t b;
+	int first, last, frame, num_surfaces, num_verts, total_verts = 0, i, j, retcode = 0;
+
+	parse_frame_range(frame_range, model->header->numFrames, &first, &last);
+	num_surfaces = model->header->numSurfaces;
+	memset(&b, 0, sizeof(b));
+
+	put_bytes(&b, MD3_ANIM_IDENT, 4);
+	put_long(&b, MD3_ANIM_VERSION);
+	put_long(&b, num_surfaces);
+	put_long(&b, first);
+	put_long(&b, last - first + 1);
+
+	// surface headers, topology and the rest frame
+	for (i = 0, surf = first_md3_surface(model);
+		i < num_surfaces;
+		++i, surf = next_md3_surface(surf))
+	{
+		num_verts = surf->numVerts;
+		total_verts += num_verts;
+		put_bytes(&b, surf->name, MAX_QPATH);
+		put_long(&b, num_verts);
+		put_long(&b, surf->numTriangles);
+
+		tri = (const md3Triangle_t *)(((const unsigned char *)surf) + surf->ofsTriangles);
+		for (j = 0; j < surf->numTriangles; ++j, ++tri)
+		{
+			put_short(&b, tri->indexes[0]);
+			put_short(&b, tri->indexes[1]);
+			put_short(&b, tri->indexes[2]);
+		}
+
+		st = (const md3St_t *)(((const unsigned char *)surf) + surf->ofsSt);
+		for (j = 0; j < num_verts; ++j, ++st)
+		{
+			put_float(&b, st->st[0]);
+			put_float(&b, st->st[1]);
+		}
+
+		xyz = (const md3XyzNormal_t *)(((const unsigned char *)surf) + surf->ofsXyzNormals) + first * num_verts;
+		for (j = 0; j < num_verts; ++j, ++xyz)
+		{
+			put_short(&b, xyz->xyz[0]);
+			put_short(&b, xyz->xyz[1]);
+			put_short(&b, xyz->xyz[2]);
+			put_short(&b, xyz->normal);
+		}
+	}
+
+	// deltas, frame-major so a frame can be decoded in one sequential read
+	for (frame = first + 1; frame <= last; ++frame)
+	{
+		for (i = 0, surf = first_md3_surface(model);
+			i < num_surfaces;
+			++i, surf = next_md3_surface(surf))
+		{
+			num_verts = surf->numVerts;
+			xyz = (const md3XyzNormal_t *)(((const unsigned char *)surf) + surf->ofsXyzNormals);
+			encode_frame(&b, xyz + (frame - 1) * num_verts, xyz + frame * num_verts, num_verts);
+		}
+	}
+
+	if (b.failed)
+	{
+		sink_log(sink, LOG_ERROR, "Memory allocation failed");
+		free(b.data);
+		return 11;
+	}
+
+	// validate the round trip before handing the file over
+	if (decode_md3_anim(b.data, b.size, &anim))
+	{
+		sink_log(sink, LOG_ERROR, "Animation container failed to decode");
+		retcode = 16;
+	}
+	else
+	{
+		for (i = 0, surf = first_md3_surface(model);
+			i < num_surfaces && !retcode;
+			++i, surf = next_md3_surface(surf))
+		{
+			num_verts = surf->numVerts;
+			xyz = (const md3XyzNormal_t *)(((const unsigned char *)surf) + surf->ofsXyzNormals) + first * num_verts;
+			for (j = 0; j < num_verts * anim.num_frames; ++j)
+			{
+				const short *decoded = anim.frames[i] + j * 4;
+				if (decoded[0] != xyz[j].xyz[0] || decoded[1] != xyz[j].xyz[1]
+					|| decoded[2] != xyz[j].xyz[2] || decoded[3] != xyz[j].normal)
+				{
+					sink_log(sink, LOG_ERROR, "Animation round trip mismatch: surface #%d, frame #%d, vertex #%d",
+						i, first + j / num_verts, j % num_verts);
+					retcode = 16;
+					break;
+				}
+			}
+		}
+		free_md3_anim(&anim);
+	}
+
+	if (!retcode && (retcode = open_output(&out, sink, NULL)) == 0)
+	{
+		output_write(&out, b.data, b.size);
+		if ((retcode = close_output(&out)) == 0)
+		{
+			sink_log(sink, LOG_INFO, "Animation: frames %d-%d, %d bytes (%d bytes of raw MD3 frame data), round trip verified",
+				first, last, (int)b.size, (int)sizeof(md3XyzNormal_t) * total_verts * (last - first + 1));
+		}
+	}
+
+	free(b.data);
+
+	return retcode;
+}
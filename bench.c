@@ -0,0 +1,318 @@
+/*
+MD3 and/or BSP to OBJ converter
+Written by Leszek Godlewski <github@inequation.org>
+The code in this file is placed in the public domain.
+*/
+
+/*
+Benchmark. Generates a synthetic map and model (see synth.c), converts each
+of them a few times through a sink that discards what it is given, and
+reports the stage timings of the fastest run along with the throughput. No
+files are read or written unless --emit is given, so it runs anywhere.
+*/
+
+#ifdef _MSC_VER
+	#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "md3bsp2ase.h"
+
+typedef enum
+{
+	CASE_BSP,
+	CASE_MD3,
+	CASE_ANIM,
+	NUM_CASES
+} bench_case_t;
+
+static const char *const case_names[NUM_CASES] = { "bsp", "md3", "anim" };
+
+static const char *const stage_labels[NUM_STAGES] =
+{
+	"load", "validate", "tessellate", "normals", "merge", "simplify", "format", "compress", "write", "total"
+};
+
+// Outputs go nowhere; the sink only needs a handle that isn't NULL.
+static void *null_open(void *context, const char *name)
+{
+	(void)name;
+	return context;
+}
+
+static int null_write(void *context, void *stream, const void *data, size_t size)
+{
+	(void)context;
+	(void)stream;
+	(void)data;
+	(void)size;
+	return 0;
+}
+
+static int null_close(void *context, void *stream)
+{
+	(void)context;
+	(void)stream;
+	return 0;
+}
+
+static void bench_log(void *context, int level, const char *message)
+{
+	(void)context;
+	(void)level;
+	fprintf(stderr, "%s\n", message);
+}
+
+static int run_case(bench_case_t which, const unsigned char *data, size_t size, const options_t *options,
+	const sink_t *sink)
+{
+	bsp_t bsp;
+	md3_model_t model;
+	int retcode;
+
+	if (which == CASE_BSP)
+	{
+		if ((retcode = load_bsp("synth.bsp", data, size, sink, &bsp)) != 0)
+			return retcode;
+		retcode = convert_bsp_to_obj(&bsp, options, sink);
+		free_bsp(&bsp);
+		return retcode;
+	}
+
+	if ((retcode = load_md3("synth.md3", data, size, 0, sink, &model)) != 0)
+		return retcode;
+	if (which == CASE_MD3)
+		retcode = convert_md3_to_obj(&model, 0, NULL, NULL, sink);
+	else
+		retcode = convert_md3_to_anim(&model, NULL, sink);
+	free_md3(&model);
+	return retcode;
+}
+
+// Runs a case the given number of times and keeps the stats of the fastest run.
+static int bench_case(bench_case_t which, const unsigned char *data, size_t size, int iterations,
+	const options_t *options, sink_t *sink, stats_t *best)
+{
+	stats_t stats;
+	double start;
+	int i, retcode;
+
+	memset(best, 0, sizeof(*best));
+	for (i = 0; i < iterations; ++i)
+	{
+		memset(&stats, 0, sizeof(stats));
+		sink->stats = &stats;
+		start = get_time();
+		retcode = run_case(which, data, size, options, sink);
+		add_time(&stats, STAGE_TOTAL, get_time() - start);
+		sink->stats = NULL;
+		if (retcode != 0)
+			return retcode;
+		if (!i || stats.seconds[STAGE_TOTAL] < best->seconds[STAGE_TOTAL])
+			*best = stats;
+	}
+	return 0;
+}
+
+static void print_case(bench_case_t which, size_t in_size, const stats_t *stats)
+{
+	double total = stats->seconds[STAGE_TOTAL] > 0 ? stats->seconds[STAGE_TOTAL] : 1e-9;
+	int i;
+
+	printf("%s: %.2f MB in\n", case_names[which], in_size / 1048576.0);
+	for (i = 0; i < NUM_STAGES; ++i)
+	{
+		if (stats->seconds[i] > 0)
+			printf("  %-12s %10.4f s\n", stage_labels[i], stats->seconds[i]);
+	}
+	printf("  %lld surfaces, %lld vertices, %lld triangles, %.2f MB out in %lld outputs\n",
+		stats->counts[COUNT_SURFACES], stats->counts[COUNT_VERTICES], stats->counts[COUNT_TRIANGLES],
+		stats->counts[COUNT_BYTES_OUT] / 1048576.0, stats->counts[COUNT_OUTPUTS]);
+	printf("  %.3f Mtris/s, %.1f MB/s out\n\n",
+		stats->counts[COUNT_TRIANGLES] / total / 1e6, stats->counts[COUNT_BYTES_OUT] / total / 1048576.0);
+}
+
+static int emit_file(const char *dir, const char *name, const unsigned char *data, size_t size)
+{
+	char path[1024];
+	FILE *f;
+	int failed;
+
+	sprintf(path, "%.1000s/%s", dir, name);
+	if (!(f = fopen(path, "wb")))
+	{
+		fprintf(stderr, "Failed to open file %s\n", path);
+		return 4;
+	}
+	failed = fwrite(data, 1, size, f) != size;
+	failed |= fclose(f) != 0;
+	if (failed)
+	{
+		fprintf(stderr, "Failed to write file %s\n", path);
+		return 18;
+	}
+	return 0;
+}
+
+static void print_usage(const char *exe)
+{
+	printf("Usage: %s [options]\n"
+		"Options:\n"
+		"  --planar <n>      planar surfaces in the map (default: 2000)\n"
+		"  --soups <n>       triangle soup surfaces in the map (default: 2000)\n"
+		"  --patches <n>     patch surfaces in the map (default: 1000)\n"
+		"  --grid <n>        vertices along each side of planar and soup surfaces\n"
+		"                    (default: 12)\n"
+		"  --tiles <n>       cut each planar surface into n x n coplanar fragments\n"
+		"  --patch-size <min> <max>\n"
+		"                    range of patch control grid sizes (default: 3 17)\n"
+		"  --md3 <surfaces> <vertices> <frames>\n"
+		"                    model size (default: 8 1000 64)\n"
+		"  --seed <n>        generator seed (default: 1)\n"
+		"  --iterations <n>  runs per case, the fastest is reported (default: 3)\n"
+		"  --gzip-level <n>  compress the outputs as well\n"
+		"  --merge-planar    merge coplanar planar surfaces in the map case\n"
+		"  --json            print the stats of every case as JSON\n"
+		"  --emit <dir>      write the generated synth.bsp and synth.md3 to <dir>\n"
+		"                    instead of benchmarking\n",
+		exe);
+}
+
+int main(int argc, char *argv[])
+{
+	synth_bsp_t bsp_params;
+	synth_md3_t md3_params;
+	unsigned char *inputs[NUM_CASES];
+	size_t sizes[NUM_CASES];
+	stats_t stats[NUM_CASES];
+	options_t options;
+	const char *emit_dir = NULL;
+	sink_t sink;
+	output_t json;
+	int iterations = 3, print_json = 0, compression = 0, retcode = 0, arg, i;
+
+	memset(&bsp_params, 0, sizeof(bsp_params));
+	bsp_params.planar = 2000;
+	bsp_params.soups = 2000;
+	bsp_params.patches = 1000;
+	bsp_params.grid = 12;
+	bsp_params.patch_min = 3;
+	bsp_params.patch_max = 17;
+	bsp_params.seed = 1;
+	md3_params.surfaces = 8;
+	md3_params.verts = 1000;
+	md3_params.frames = 64;
+	md3_params.tags = 2;
+	md3_params.seed = 1;
+	memset(&options, 0, sizeof(options));
+
+	for (arg = 1; arg < argc; ++arg)
+	{
+		if (!strcmp(argv[arg], "--planar") && arg + 1 < argc)
+			bsp_params.planar = atoi(argv[++arg]);
+		else if (!strcmp(argv[arg], "--soups") && arg + 1 < argc)
+			bsp_params.soups = atoi(argv[++arg]);
+		else if (!strcmp(argv[arg], "--patches") && arg + 1 < argc)
+			bsp_params.patches = atoi(argv[++arg]);
+		else if (!strcmp(argv[arg], "--grid") && arg + 1 < argc)
+			bsp_params.grid = atoi(argv[++arg]);
+		else if (!strcmp(argv[arg], "--tiles") && arg + 1 < argc)
+			bsp_params.tiles = atoi(argv[++arg]);
+		else if (!strcmp(argv[arg], "--patch-size") && arg + 2 < argc)
+		{
+			bsp_params.patch_min = atoi(argv[++arg]);
+			bsp_params.patch_max = atoi(argv[++arg]);
+		}
+		else if (!strcmp(argv[arg], "--md3") && arg + 3 < argc)
+		{
+			md3_params.surfaces = atoi(argv[++arg]);
+			md3_params.verts = atoi(argv[++arg]);
+			md3_params.frames = atoi(argv[++arg]);
+		}
+		else if (!strcmp(argv[arg], "--seed") && arg + 1 < argc)
+			bsp_params.seed = md3_params.seed = (unsigned int)strtoul(argv[++arg], NULL, 0);
+		else if (!strcmp(argv[arg], "--iterations") && arg + 1 < argc)
+			iterations = atoi(argv[++arg]);
+		else if (!strcmp(argv[arg], "--gzip-level") && arg + 1 < argc)
+			compression = atoi(argv[++arg]);
+		else if (!strcmp(argv[arg], "--merge-planar"))
+			options.merge_planar = 1;
+		else if (!strcmp(argv[arg], "--json"))
+			print_json = 1;
+		else if (!strcmp(argv[arg], "--emit") && arg + 1 < argc)
+			emit_dir = argv[++arg];
+		else
+		{
+			printf("Unknown option %s\n", argv[arg]);
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+	iterations = max(iterations, 1);
+	bsp_params.planar = max(bsp_params.planar, 0);
+	bsp_params.soups = max(bsp_params.soups, 0);
+	bsp_params.patches = max(bsp_params.patches, 0);
+
+	// the model cases share one input
+	inputs[CASE_BSP] = generate_bsp(&bsp_params, &sizes[CASE_BSP]);
+	inputs[CASE_MD3] = generate_md3(&md3_params, &sizes[CASE_MD3]);
+	inputs[CASE_ANIM] = inputs[CASE_MD3];
+	sizes[CASE_ANIM] = sizes[CASE_MD3];
+	if (!inputs[CASE_BSP] || !inputs[CASE_MD3])
+	{
+		fprintf(stderr, "Memory allocation failed\n");
+		free(inputs[CASE_BSP]);
+		free(inputs[CASE_MD3]);
+		return 11;
+	}
+
+	if (emit_dir)
+	{
+		retcode = emit_file(emit_dir, "synth.bsp", inputs[CASE_BSP], sizes[CASE_BSP]);
+		if (!retcode)
+			retcode = emit_file(emit_dir, "synth.md3", inputs[CASE_MD3], sizes[CASE_MD3]);
+		free(inputs[CASE_BSP]);
+		free(inputs[CASE_MD3]);
+		return retcode;
+	}
+
+	memset(&sink, 0, sizeof(sink));
+	sink.context = &sink;
+	sink.open = null_open;
+	sink.write = null_write;
+	sink.close = null_close;
+	sink.log = bench_log;
+	sink.log_level = LOG_WARNING;
+	sink.compression = max(0, min(compression, 9));
+
+	for (i = 0; i < NUM_CASES && !retcode; ++i)
+	{
+		if ((retcode = bench_case((bench_case_t)i, inputs[i], sizes[i], iterations, &options, &sink,
+			&stats[i])) != 0)
+			fprintf(stderr, "Case %s failed with code %d\n", case_names[i], retcode);
+		else if (!print_json)
+			print_case((bench_case_t)i, sizes[i], &stats[i]);
+	}
+
+	if (!retcode && print_json && open_memory_output(&json) == 0)
+	{
+		output_printf(&json, "{\n");
+		for (i = 0; i < NUM_CASES; ++i)
+		{
+			output_printf(&json, "\"%s\": ", case_names[i]);
+			write_stats_json(&json, &stats[i]);
+			if (i < NUM_CASES - 1)
+				output_printf(&json, ",\n");
+		}
+		output_printf(&json, "}\n");
+		fwrite(json.buf, 1, json.used, stdout);
+		close_output(&json);
+	}
+
+	free(inputs[CASE_BSP]);
+	free(inputs[CASE_MD3]);
+	return retcode;
+}
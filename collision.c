@@ -0,0 +1,326 @@
+/*
+MD3 and/or BSP to OBJ converter
+Written by Leszek Godlewski <github@inequation.org>
+The code in this file is placed in the public domain.
+*/
+
+#ifdef _MSC_VER
+	#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "md3bsp2ase.h"
+
+#define ON_EPSILON		0.1		// same as q3map's
+#define WELD_EPSILON	0.01
+#define MAX_BRUSH_WINDING	256		// brushes with more sides than this minus 4 are skipped
+
+// Windings are clipped in double precision; the base winding spans the whole world and floats lose too much there.
+typedef double dvec3_t[3];
+
+// Convex hull of a single brush: welded vertices plus polygons indexing them.
+typedef struct
+{
+	dvec3_t *verts;
+	int num_verts;
+	int *face_indexes;		// all polygons back to back
+	int *face_sizes;
+	int num_faces;
+	int num_face_indexes;
+} brush_hull_t;
+
+// Builds a quad on the plane large enough to cover the entire world, wound clockwise like the game's.
+static int base_winding_for_plane(const dplane_t *plane, dvec3_t *w)
+{
+	dvec3_t normal, up, right, org;
+	double d, len;
+	int i, axis = 0;
+
+	for (i = 0; i < 3; ++i)
+		normal[i] = plane->normal[i];
+	for (i = 1; i < 3; ++i)
+	{
+		if (fabs(normal[i]) > fabs(normal[axis]))
+			axis = i;
+	}
+
+	up[0] = up[1] = up[2] = 0.0;
+	up[axis == 2 ? 0 : 2] = 1.0;
+	d = DotProduct(up, normal);
+	for (i = 0; i < 3; ++i)
+		up[i] -= d * normal[i];
+	len = sqrt(DotProduct(up, up));
+	if (len < 1e-6)
+		return 0;
+	for (i = 0; i < 3; ++i)
+		up[i] *= WORLD_SIZE / len;
+
+	right[0] = (up[1] * normal[2] - up[2] * normal[1]);
+	right[1] = (up[2] * normal[0] - up[0] * normal[2]);
+	right[2] = (up[0] * normal[1] - up[1] * normal[0]);
+
+	d = plane->dist;
+	for (i = 0; i < 3; ++i)
+	{
+		org[i] = normal[i] * d;
+		w[0][i] = org[i] - right[i] + up[i];
+		w[1][i] = org[i] + right[i] + up[i];
+		w[2][i] = org[i] + right[i] - up[i];
+		w[3][i] = org[i] - right[i] - up[i];
+	}
+
+	return 4;
+}
+
+#define SIDE_FRONT		0
+#define SIDE_BACK		1
+#define SIDE_ON			2
+
+/*
+Clips the winding in place, keeping the part behind the plane, the way q3map's
+ClipWindingEpsilon does: points within ON_EPSILON of the plane are on it and
+kept as they are, and only edges running from strictly in front to strictly
+behind, or back, are split. Returns the new point count.
+*/
+static int clip_winding(dvec3_t *w, int count, const dplane_t *plane, dvec3_t *scratch)
+{
+	double dists[MAX_BRUSH_WINDING + 1], d;
+	int sides[MAX_BRUSH_WINDING + 1], counts[3] = { 0, 0, 0 };
+	dvec3_t normal;
+	int i, j, out = 0;
+
+	for (i = 0; i < 3; ++i)
+		normal[i] = plane->normal[i];
+	d = plane->dist;
+
+	for (i = 0; i < count; ++i)
+	{
+		dists[i] = DotProduct(w[i], normal) - d;
+		if (dists[i] > ON_EPSILON)
+			sides[i] = SIDE_FRONT;
+		else if (dists[i] < -ON_EPSILON)
+			sides[i] = SIDE_BACK;
+		else
+			sides[i] = SIDE_ON;
+		++counts[sides[i]];
+	}
+	if (!counts[SIDE_FRONT])
+		return count;
+	if (!counts[SIDE_BACK])
+		return 0;
+	dists[count] = dists[0];
+	sides[count] = sides[0];
+
+	for (i = 0; i < count; ++i)
+	{
+		const double *p1 = w[i], *p2 = w[(i + 1) % count];
+
+		if (sides[i] == SIDE_ON)
+		{
+			VectorCopy(p1, scratch[out]);
+			++out;
+			continue;
+		}
+		if (sides[i] == SIDE_BACK)
+		{
+			VectorCopy(p1, scratch[out]);
+			++out;
+		}
+		if (sides[i + 1] == SIDE_ON || sides[i + 1] == sides[i])
+			continue;
+
+		// the edge crosses the plane, emit the intersection point; axial planes get it exactly on them
+		d = dists[i] / (dists[i] - dists[i + 1]);
+		for (j = 0; j < 3; ++j)
+		{
+			if (normal[j] == 1.0)
+				scratch[out][j] = plane->dist;
+			else if (normal[j] == -1.0)
+				scratch[out][j] = -plane->dist;
+			else
+				scratch[out][j] = p1[j] + d * (p2[j] - p1[j]);
+		}
+		++out;
+	}
+
+	memcpy(w, scratch, sizeof(*w) * out);
+	return out;
+}
+
+static int weld_vertex(brush_hull_t *hull, const dvec3_t p)
+{
+	int i;
+
+	for (i = 0; i < hull->num_verts; ++i)
+	{
+		if (fabs(hull->verts[i][0] - p[0]) < WELD_EPSILON
+			&& fabs(hull->verts[i][1] - p[1]) < WELD_EPSILON
+			&& fabs(hull->verts[i][2] - p[2]) < WELD_EPSILON)
+		{
+			return i;
+		}
+	}
+	VectorCopy(p, hull->verts[hull->num_verts]);
+	return hull->num_verts++;
+}
+
+// Polygonizes a brush by clipping a base winding for each side against all the other sides. Returns 0 or 11.
+static int build_brush_hull(const dbrush_t *brush, const dbrushside_t *sides, const dplane_t *planes,
+	brush_hull_t *hull)
+{
+	dvec3_t w[MAX_BRUSH_WINDING], scratch[MAX_BRUSH_WINDING];
+	int num_sides = brush->numSides;
+	int first_side = brush->firstSide;
+	int i, j, count, plane_num;
+
+	memset(hull, 0, sizeof(*hull));
+	if (num_sides < 4 || num_sides + 4 > MAX_BRUSH_WINDING)
+		return 0;
+
+	// every face has at most one point per side plus the base quad's four
+	hull->verts = malloc(sizeof(*hull->verts) * num_sides * (num_sides + 4));
+	hull->face_indexes = malloc(sizeof(*hull->face_indexes) * num_sides * (num_sides + 4));
+	hull->face_sizes = malloc(sizeof(*hull->face_sizes) * num_sides);
+	if (!hull->verts || !hull->face_indexes || !hull->face_sizes)
+		return 11;
+
+	for (i = 0; i < num_sides; ++i)
+	{
+		plane_num = sides[first_side + i].planeNum;
+		count = base_winding_for_plane(&planes[plane_num], w);
+		for (j = 0; j < num_sides && count >= 3; ++j)
+		{
+			int other = sides[first_side + j].planeNum;
+			// planes come in pairs, x ^ 1 is always the opposite of x
+			if (j == i || other == plane_num || other == (plane_num ^ 1))
+				continue;
+			count = clip_winding(w, count, &planes[other], scratch);
+		}
+		if (count < 3)
+			continue;
+
+		for (j = 0; j < count; ++j)
+			hull->face_indexes[hull->num_face_indexes++] = weld_vertex(hull, w[j]);
+		hull->face_sizes[hull->num_faces++] = count;
+	}
+	return 0;
+}
+
+static void free_brush_hull(brush_hull_t *hull)
+{
+	free(hull->verts);
+	free(hull->face_indexes);
+	free(hull->face_sizes);
+}
+
+int export_model_collision(const bsp_t *bsp, int model_index, const options_t *options, const sink_t *sink)
+{
+	const unsigned char *buf = bsp->buf;
+	const dmodel_t *model;
+	const dbrush_t *brushes;
+	const dbrushside_t *sides;
+	const dplane_t *planes;
+	const dshader_t *shaders;
+	brush_hull_t *hulls;
+	char name[32];
+	output_t out;
+	int num_brushes, i, j, k, piece, vert_index_cum, retcode = 0, failed = 0;
+
+	model = get_bsp_model(bsp, model_index);
+	brushes = (const dbrush_t *)(buf + bsp->header->lumps[LUMP_BRUSHES].fileofs)
+		+ model->firstBrush;
+	sides = (const dbrushside_t *)(buf + bsp->header->lumps[LUMP_BRUSHSIDES].fileofs);
+	planes = (const dplane_t *)(buf + bsp->header->lumps[LUMP_PLANES].fileofs);
+	shaders = get_bsp_shader(bsp, 0);
+	num_brushes = model->numBrushes;
+
+	if (!(hulls = calloc(num_brushes, sizeof(*hulls))))
+	{
+		sink_log(sink, LOG_ERROR, "Memory allocation failed");
+		return 11;
+	}
+
+	// brushes are independent of each other, so polygonize them in parallel
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic, 16) reduction(|:failed)
+#endif
+	for (i = 0; i < num_brushes; ++i)
+	{
+		const dshader_t *shader = &shaders[brushes[i].shaderNum];
+		if (shader->contentFlags & options->collision_contents)
+			failed |= build_brush_hull(&brushes[i], sides, planes, &hulls[i]);
+	}
+
+	for (i = 0, piece = 0; i < num_brushes; ++i)
+	{
+		if (hulls[i].num_faces >= 4)
+			++piece;
+	}
+
+	if (failed)
+		sink_log(sink, LOG_ERROR, "Memory allocation failed");
+	// brushes, but none of them of the contents asked for: no collision OBJ rather than an empty one
+	else if (!piece)
+		sink_log(sink, LOG_INFO, "\tCollision: no convex pieces out of %d brushes", num_brushes);
+	sprintf(name, "%04d_collision.obj", model_index);
+	if (failed || !piece || (retcode = open_output(&out, sink, name)) != 0)
+	{
+		for (i = 0; i < num_brushes; ++i)
+			free_brush_hull(&hulls[i]);
+		free(hulls);
+		return failed ? 11 : retcode;
+	}
+
+	output_printf(&out, "# generated by md3bsp2ase from %s model #%d collision\n", bsp->name, model_index);
+
+	// each brush is written as a separate convex piece
+	for (i = 0, piece = 0, vert_index_cum = 0; i < num_brushes; ++i)
+	{
+		const brush_hull_t *hull = &hulls[i];
+		const int *index = hull->face_indexes;
+
+		if (hull->num_faces < 4)
+			continue;
+
+		output_printf(&out,
+			"\n"
+			"# brush %d, %s\n"
+			"o brush%d\n"
+			"\n",
+			i, shaders[brushes[i].shaderNum].shader, i);
+
+		for (j = 0; j < hull->num_verts; ++j)
+		{
+			output_printf(&out, "v %f %f %f\n",
+				(float)hull->verts[j][0], (float)hull->verts[j][1], (float)hull->verts[j][2]);
+		}
+
+		output_printf(&out, "\n");
+
+		// windings are clockwise, OBJ wants them counter-clockwise
+		for (j = 0; j < hull->num_faces; index += hull->face_sizes[j++])
+		{
+			output_printf(&out, "f");
+			for (k = hull->face_sizes[j] - 1; k >= 0; --k)
+				output_printf(&out, " %d", 1 + index[k] + vert_index_cum);
+			output_printf(&out, "\n");
+		}
+
+		vert_index_cum += hull->num_verts;
+		++piece;
+	}
+
+	retcode = close_output(&out);
+
+	sink_log(sink, LOG_INFO, "\tCollision: %d convex pieces out of %d brushes", piece, num_brushes);
+
+	for (i = 0; i < num_brushes; ++i)
+		free_brush_hull(&hulls[i]);
+	free(hulls);
+
+	return retcode;
+}
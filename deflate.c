@@ -0,0 +1,835 @@
+/*
+MD3 and/or BSP to OBJ converter
+Written by Leszek Godlewski <github@inequation.org>
+The code in this file is placed in the public domain.
+*/
+
+/*
+Self-contained deflate (RFC 1951) encoder for gzip output. Every chunk is
+compressed on its own, without a dictionary from the previous one, and ends
+byte aligned, so chunks can be compressed on any number of threads and simply
+concatenated, pigz style. Each chunk becomes a single block, dynamic, fixed
+or stored, whichever is smallest.
+*/
+
+#ifdef _MSC_VER
+	#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "md3bsp2ase.h"
+
+// SSE4.2 and AVX2 versions of the match finder, picked at run time; NO_SIMD_KERNELS leaves just the portable one.
+#if !defined(NO_SIMD_KERNELS) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define SIMD_KERNELS
+	#include <immintrin.h>
+	#define FORCE_INLINE	__attribute__((always_inline)) inline
+#else
+	#define FORCE_INLINE
+#endif
+
+#define WINDOW_SIZE			32768
+#define HASH_BITS			15
+#define HASH_SIZE			(1 << HASH_BITS)
+#define MIN_MATCH			3
+#define MAX_MATCH			258
+#define MAX_STORED			65535
+#define NUM_LITLEN			286
+#define NUM_FIXED_LITLEN	288
+#define NUM_DIST			30
+#define NUM_CODELEN			19
+#define END_OF_BLOCK		256
+#define MAX_CODE_BITS		15
+#define MAX_CODELEN_BITS	7
+#define MAX_TREE_DEPTH		63
+
+static const unsigned int crc_table[256] =
+{
+	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
+	0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
+	0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
+	0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+	0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
+	0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
+	0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
+	0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+	0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
+	0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+	0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
+	0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+	0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
+	0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
+	0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
+	0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+	0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
+	0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
+	0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
+	0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+	0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
+	0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
+	0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
+	0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+	0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
+	0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
+	0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
+	0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+	0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
+	0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+	0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
+	0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+	0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
+	0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
+	0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
+	0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+	0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
+	0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
+	0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
+	0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+	0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
+	0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
+	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d,
+};
+
+// search effort per level, after zlib: hash chain length, the longest match still worth trying to better
+// one position later (0 for greedy matching), and the match length that ends the search
+static const struct
+{
+	int max_chain, lazy, nice;
+} levels[10] =
+{
+	{ 0, 0, 0 },
+	{ 4, 0, 8 }, { 5, 0, 16 }, { 6, 0, 32 },
+	{ 16, 4, 16 }, { 32, 16, 32 }, { 128, 16, 128 },
+	{ 256, 32, 128 }, { 1024, 128, MAX_MATCH }, { 4096, MAX_MATCH, MAX_MATCH }
+};
+
+// order in which the code length code lengths are transmitted
+static const unsigned char codelen_order[NUM_CODELEN] =
+{
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+typedef struct
+{
+	unsigned char *p;
+	unsigned long long bits;
+	int count;
+} bit_writer_t;
+
+typedef struct
+{
+	unsigned char len[NUM_FIXED_LITLEN];
+	unsigned short code[NUM_FIXED_LITLEN];
+} huffman_t;
+
+typedef struct
+{
+	unsigned int freq;
+	unsigned short sym;
+} huffman_sym_t;
+
+unsigned int crc32_update(unsigned int crc, const void *data, size_t size)
+{
+	const unsigned char *p = data;
+
+	crc = ~crc;
+	while (size--)
+		crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+static unsigned int gf2_matrix_times(const unsigned int *mat, unsigned int vec)
+{
+	unsigned int sum = 0;
+
+	for (; vec; vec >>= 1, ++mat)
+	{
+		if (vec & 1)
+			sum ^= *mat;
+	}
+	return sum;
+}
+
+static void gf2_matrix_square(unsigned int *square, const unsigned int *mat)
+{
+	int n;
+
+	for (n = 0; n < 32; ++n)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+// The CRC of two spans concatenated, given the CRC of each and the length of the second, as in zlib.
+unsigned int crc32_combine(unsigned int crc1, unsigned int crc2, size_t len2)
+{
+	unsigned int even[32], odd[32], row;
+	int n;
+
+	if (!len2)
+		return crc1;
+
+	// odd holds the operator for one zero bit
+	odd[0] = 0xEDB88320;
+	for (n = 1, row = 1; n < 32; ++n, row <<= 1)
+		odd[n] = row;
+	gf2_matrix_square(even, odd);	// two zero bits
+	gf2_matrix_square(odd, even);	// four zero bits
+
+	// apply len2 zero bytes to crc1
+	do
+	{
+		gf2_matrix_square(even, odd);
+		if (len2 & 1)
+			crc1 = gf2_matrix_times(even, crc1);
+		len2 >>= 1;
+		if (!len2)
+			break;
+		gf2_matrix_square(odd, even);
+		if (len2 & 1)
+			crc1 = gf2_matrix_times(odd, crc1);
+		len2 >>= 1;
+	} while (len2);
+
+	return crc1 ^ crc2;
+}
+
+size_t deflate_bound(size_t size)
+{
+	// stored blocks, plus the sync or final block and the bit padding
+	return size + 5 * (size / MAX_STORED + 1) + 8;
+}
+
+static void put_bits(bit_writer_t *w, unsigned int value, int count)
+{
+	w->bits |= (unsigned long long)value << w->count;
+	w->count += count;
+	while (w->count >= 8)
+	{
+		*w->p++ = (unsigned char)w->bits;
+		w->bits >>= 8;
+		w->count -= 8;
+	}
+}
+
+static void align_bits(bit_writer_t *w)
+{
+	if (w->count)
+		put_bits(w, 0, 8 - w->count);
+}
+
+// Lengths 3-258 map onto symbols 257-285, each with a base and up to 5 extra bits.
+static int length_symbol(int len, int *extra_bits, int *extra)
+{
+	int l = len - MIN_MATCH, b;
+
+	if (len == MAX_MATCH)
+	{
+		*extra_bits = *extra = 0;
+		return 285;
+	}
+	if (l < 8)
+	{
+		*extra_bits = *extra = 0;
+		return 257 + l;
+	}
+	for (b = 3; (l >> b) > 1; ++b)
+		;
+	*extra_bits = b - 2;
+	*extra = l - ((4 | ((l >> (b - 2)) & 3)) << (b - 2));
+	return 257 + 4 * (b - 1) + ((l >> (b - 2)) & 3);
+}
+
+// Distances 1-32768 map onto symbols 0-29, each with a base and up to 13 extra bits.
+static int dist_symbol(int dist, int *extra_bits, int *extra)
+{
+	int x = dist - 1, b;
+
+	if (x < 4)
+	{
+		*extra_bits = *extra = 0;
+		return x;
+	}
+	for (b = 2; (x >> b) > 1; ++b)
+		;
+	*extra_bits = b - 1;
+	*extra = x - ((2 | ((x >> (b - 1)) & 1)) << (b - 1));
+	return 2 * b + ((x >> (b - 1)) & 1);
+}
+
+static int compare_syms(const void *a, const void *b)
+{
+	const huffman_sym_t *x = a, *y = b;
+
+	if (x->freq != y->freq)
+		return x->freq < y->freq ? -1 : 1;
+	return x->sym - y->sym;
+}
+
+/*
+Length-limited Huffman code lengths: the in-place minimum redundancy
+algorithm of Moffat and Katajainen over the symbols sorted by frequency, then
+the deepest codes are folded back under the limit while keeping the code
+complete.
+*/
+static void build_lengths(const unsigned int *freq, int num, int limit, unsigned char *len)
+{
+	huffman_sym_t syms[NUM_LITLEN];
+	int num_codes[MAX_TREE_DEPTH + 1];
+	int n = 0, i, j, root, leaf, next, avbl, used, depth;
+	unsigned int total;
+
+	memset(len, 0, num);
+	for (i = 0; i < num; ++i)
+	{
+		if (freq[i])
+		{
+			syms[n].freq = freq[i];
+			syms[n++].sym = (unsigned short)i;
+		}
+	}
+	// a code needs at least two symbols to be complete
+	for (i = 0; n < 2; ++i)
+	{
+		if (!freq[i])
+		{
+			syms[n].freq = 1;
+			syms[n++].sym = (unsigned short)i;
+		}
+	}
+	qsort(syms, n, sizeof(*syms), compare_syms);
+
+	// first pass: parent pointers, second: internal node depths, third: leaf depths
+	syms[0].freq += syms[1].freq;
+	root = 0;
+	leaf = 2;
+	for (next = 1; next < n - 1; ++next)
+	{
+		if (leaf >= n || syms[root].freq < syms[leaf].freq)
+		{
+			syms[next].freq = syms[root].freq;
+			syms[root++].freq = next;
+		}
+		else
+			syms[next].freq = syms[leaf++].freq;
+		if (leaf >= n || (root < next && syms[root].freq < syms[leaf].freq))
+		{
+			syms[next].freq += syms[root].freq;
+			syms[root++].freq = next;
+		}
+		else
+			syms[next].freq += syms[leaf++].freq;
+	}
+	syms[n - 2].freq = 0;
+	for (next = n - 3; next >= 0; --next)
+		syms[next].freq = syms[syms[next].freq].freq + 1;
+	avbl = 1;
+	used = depth = 0;
+	root = n - 2;
+	next = n - 1;
+	while (avbl > 0)
+	{
+		while (root >= 0 && (int)syms[root].freq == depth)
+		{
+			++used;
+			--root;
+		}
+		while (avbl > used)
+		{
+			syms[next--].freq = depth;
+			--avbl;
+		}
+		avbl = 2 * used;
+		++depth;
+		used = 0;
+	}
+
+	// fold everything deeper than the limit under it, then fix up the Kraft sum
+	memset(num_codes, 0, sizeof(num_codes));
+	for (i = 0; i < n; ++i)
+		++num_codes[min((int)syms[i].freq, MAX_TREE_DEPTH)];
+	for (i = limit + 1; i <= MAX_TREE_DEPTH; ++i)
+		num_codes[limit] += num_codes[i];
+	for (i = limit, total = 0; i > 0; --i)
+		total += (unsigned int)num_codes[i] << (limit - i);
+	while (total != 1u << limit)
+	{
+		--num_codes[limit];
+		for (i = limit - 1; i > 0; --i)
+		{
+			if (num_codes[i])
+			{
+				--num_codes[i];
+				num_codes[i + 1] += 2;
+				break;
+			}
+		}
+		--total;
+	}
+
+	// the most frequent symbols get the shortest codes
+	for (i = 1, j = n; i <= limit; ++i)
+	{
+		for (used = num_codes[i]; used > 0; --used)
+			len[syms[--j].sym] = (unsigned char)i;
+	}
+}
+
+// Canonical codes, bit reversed since deflate sends Huffman codes most significant bit first.
+static void build_codes(huffman_t *h, int num)
+{
+	int count[MAX_CODE_BITS + 1], next_code[MAX_CODE_BITS + 1];
+	int i, b, code;
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < num; ++i)
+		++count[h->len[i]];
+	count[0] = 0;
+	for (b = 1, code = 0; b <= MAX_CODE_BITS; ++b)
+	{
+		code = (code + count[b - 1]) << 1;
+		next_code[b] = code;
+	}
+	for (i = 0; i < num; ++i)
+	{
+		int reversed = 0;
+
+		if (!h->len[i])
+			continue;
+		code = next_code[h->len[i]]++;
+		for (b = 0; b < h->len[i]; ++b)
+			reversed |= ((code >> b) & 1) << (h->len[i] - 1 - b);
+		h->code[i] = (unsigned short)reversed;
+	}
+}
+
+// The fixed code also counts the two unused symbols 286 and 287, which shifts the 9-bit codes.
+static void build_fixed(huffman_t *litlen, huffman_t *dist)
+{
+	int i;
+
+	for (i = 0; i < NUM_FIXED_LITLEN; ++i)
+		litlen->len[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+	for (i = 0; i < NUM_DIST; ++i)
+		dist->len[i] = 5;
+	build_codes(litlen, NUM_FIXED_LITLEN);
+	build_codes(dist, NUM_DIST);
+}
+
+static size_t block_bits(const huffman_t *litlen, const huffman_t *dist, const unsigned int *lit_freq,
+	const unsigned int *dist_freq)
+{
+	static const unsigned char length_extra[29] =
+		{ 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+	size_t bits = 0;
+	int i;
+
+	for (i = 0; i < NUM_LITLEN; ++i)
+		bits += (size_t)lit_freq[i] * (litlen->len[i] + (i > END_OF_BLOCK ? length_extra[i - 257] : 0));
+	for (i = 0; i < NUM_DIST; ++i)
+		bits += (size_t)dist_freq[i] * (dist->len[i] + (i < 4 ? 0 : i / 2 - 1));
+	return bits;
+}
+
+/*
+Run-length codes the literal/length and distance code lengths with symbols
+16 (repeat the previous length 3-6 times), 17 (3-10 zeros) and 18 (11-138
+zeros). Returns the number of symbols; extras get the repeat counts.
+*/
+static int rle_lengths(const unsigned char *lens, int count, unsigned char *syms, unsigned char *extras)
+{
+	int i = 0, run, n = 0;
+
+	while (i < count)
+	{
+		for (run = 1; i + run < count && lens[i + run] == lens[i]; ++run)
+			;
+		if (!lens[i] && run >= 3)
+		{
+			run = min(run, 138);
+			syms[n] = run >= 11 ? 18 : 17;
+			extras[n++] = (unsigned char)(run >= 11 ? run - 11 : run - 3);
+			i += run;
+			continue;
+		}
+		syms[n] = lens[i];
+		extras[n++] = 0;
+		++i;
+		if (lens[i - 1] && run >= 4)
+		{
+			// the first one went out as is, the rest are repeats
+			for (run -= 1; run >= 3; run -= min(run, 6))
+			{
+				syms[n] = 16;
+				extras[n++] = (unsigned char)(min(run, 6) - 3);
+				i += min(run, 6);
+			}
+		}
+	}
+	return n;
+}
+
+static void write_symbols(bit_writer_t *w, const unsigned short *lits, const unsigned short *dists, int num_syms,
+	const huffman_t *litlen, const huffman_t *dist)
+{
+	int i, sym, extra_bits, extra;
+
+	for (i = 0; i < num_syms; ++i)
+	{
+		if (!dists[i])
+		{
+			put_bits(w, litlen->code[lits[i]], litlen->len[lits[i]]);
+			continue;
+		}
+		sym = length_symbol(lits[i], &extra_bits, &extra);
+		put_bits(w, litlen->code[sym], litlen->len[sym]);
+		if (extra_bits)
+			put_bits(w, extra, extra_bits);
+		sym = dist_symbol(dists[i], &extra_bits, &extra);
+		put_bits(w, dist->code[sym], dist->len[sym]);
+		if (extra_bits)
+			put_bits(w, extra, extra_bits);
+	}
+	put_bits(w, litlen->code[END_OF_BLOCK], litlen->len[END_OF_BLOCK]);
+}
+
+static int hash3(const unsigned char *p)
+{
+	return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & (HASH_SIZE - 1);
+}
+
+// Eight bytes at a time while they agree, then byte by byte.
+static int match_length(const unsigned char *a, const unsigned char *b, int max_len)
+{
+	unsigned long long x, y;
+	int len = 0;
+
+	for (; len + 8 <= max_len; len += 8)
+	{
+		memcpy(&x, a + len, sizeof(x));
+		memcpy(&y, b + len, sizeof(y));
+		if (x != y)
+			break;
+	}
+	for (; len < max_len && a[len] == b[len]; ++len)
+		;
+	return len;
+}
+
+#ifdef SIMD_KERNELS
+// PCMPESTRI finds the first byte that differs in 16 at once.
+__attribute__((target("sse4.2")))
+static int match_length_sse42(const unsigned char *a, const unsigned char *b, int max_len)
+{
+	int len = 0, i;
+
+	for (; len + 16 <= max_len; len += 16)
+	{
+		i = _mm_cmpestri(_mm_loadu_si128((const __m128i *)(a + len)), 16,
+			_mm_loadu_si128((const __m128i *)(b + len)), 16,
+			_SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_EACH | _SIDD_NEGATIVE_POLARITY | _SIDD_LEAST_SIGNIFICANT);
+		if (i < 16)
+			return len + i;
+	}
+	return len + match_length(a + len, b + len, max_len - len);
+}
+
+// 32 bytes per compare, the first mismatch is the lowest clear bit of the equality mask.
+__attribute__((target("avx2")))
+static int match_length_avx2(const unsigned char *a, const unsigned char *b, int max_len)
+{
+	unsigned int diff;
+	int len = 0;
+
+	for (; len + 32 <= max_len; len += 32)
+	{
+		diff = ~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+			_mm256_loadu_si256((const __m256i *)(a + len)), _mm256_loadu_si256((const __m256i *)(b + len))));
+		if (diff)
+			return len + __builtin_ctz(diff);
+	}
+	return len + match_length(a + len, b + len, max_len - len);
+}
+#endif
+
+typedef int (*match_length_t)(const unsigned char *a, const unsigned char *b, int max_len);
+
+// Inlined into every version of the match finder, so that match is a direct call in each.
+static FORCE_INLINE int longest_match(const unsigned char *in, int n, int pos, int level, const int *head,
+	const int *prev, int *dist, match_length_t match)
+{
+	int chain = levels[level].max_chain, max_len = min(MAX_MATCH, n - pos), nice, best = 0, cand, len;
+
+	if (max_len < MIN_MATCH)
+		return 0;
+	nice = min(levels[level].nice, max_len);
+	for (cand = head[hash3(in + pos)]; cand >= 0 && pos - cand <= WINDOW_SIZE && chain--; cand = prev[cand])
+	{
+		// cheap rejection: a longer match has to agree at the current best length first
+		if (in[cand + best] != in[pos + best] || in[cand] != in[pos])
+			continue;
+		len = match(in + cand, in + pos, max_len);
+		if (len > best)
+		{
+			best = len;
+			*dist = pos - cand;
+			if (best >= nice)
+				break;
+		}
+	}
+	return best < MIN_MATCH ? 0 : best;
+}
+
+// Greedy or lazy LZ77 over one chunk with hash chains. Returns the number of symbols.
+static FORCE_INLINE int find_matches_with(const unsigned char *in, size_t size, int level, int *head, int *prev,
+	unsigned short *lits, unsigned short *dists, match_length_t match)
+{
+	int pos = 0, next_insert = 0, num_syms = 0, n = (int)size;
+	int len, dist = 0, len2 = 0, dist2 = 0, searched = 0;
+
+	for (len = 0; len < HASH_SIZE; ++len)
+		head[len] = -1;
+
+	while (pos < n)
+	{
+		// the chains hold every position before the one being searched
+		for (; next_insert < pos; ++next_insert)
+		{
+			if (next_insert + MIN_MATCH <= n)
+			{
+				int h = hash3(in + next_insert);
+				prev[next_insert] = head[h];
+				head[h] = next_insert;
+			}
+		}
+		// a lazy search one position ahead is reused rather than repeated
+		if (searched)
+		{
+			len = len2;
+			dist = dist2;
+			searched = 0;
+		}
+		else
+			len = longest_match(in, n, pos, level, head, prev, &dist, match);
+
+		if (len >= MIN_MATCH && len < levels[level].lazy && pos + 1 < n)
+		{
+			if (pos + MIN_MATCH <= n)
+			{
+				int h = hash3(in + pos);
+				prev[pos] = head[h];
+				head[h] = pos;
+			}
+			next_insert = pos + 1;
+			len2 = longest_match(in, n, pos + 1, level, head, prev, &dist2, match);
+			if (len2 > len)
+			{
+				len = 0;
+				searched = 1;
+			}
+		}
+
+		if (len >= MIN_MATCH)
+		{
+			lits[num_syms] = (unsigned short)len;
+			dists[num_syms++] = (unsigned short)dist;
+			pos += len;
+		}
+		else
+		{
+			lits[num_syms] = in[pos];
+			dists[num_syms++] = 0;
+			++pos;
+		}
+	}
+
+	return num_syms;
+}
+
+static int find_matches_generic(const unsigned char *in, size_t size, int level, int *head, int *prev,
+	unsigned short *lits, unsigned short *dists)
+{
+	return find_matches_with(in, size, level, head, prev, lits, dists, match_length);
+}
+
+#ifdef SIMD_KERNELS
+__attribute__((target("sse4.2")))
+static int find_matches_sse42(const unsigned char *in, size_t size, int level, int *head, int *prev,
+	unsigned short *lits, unsigned short *dists)
+{
+	return find_matches_with(in, size, level, head, prev, lits, dists, match_length_sse42);
+}
+
+__attribute__((target("avx2")))
+static int find_matches_avx2(const unsigned char *in, size_t size, int level, int *head, int *prev,
+	unsigned short *lits, unsigned short *dists)
+{
+	return find_matches_with(in, size, level, head, prev, lits, dists, match_length_avx2);
+}
+#endif
+
+// All versions find exactly the same matches, they only differ in speed.
+static int find_matches(const unsigned char *in, size_t size, int level, int *head, int *prev,
+	unsigned short *lits, unsigned short *dists)
+{
+#ifdef SIMD_KERNELS
+	if (__builtin_cpu_supports("avx2"))
+		return find_matches_avx2(in, size, level, head, prev, lits, dists);
+	if (__builtin_cpu_supports("sse4.2"))
+		return find_matches_sse42(in, size, level, head, prev, lits, dists);
+#endif
+	return find_matches_generic(in, size, level, head, prev, lits, dists);
+}
+
+static void write_stored(bit_writer_t *w, const unsigned char *in, size_t size, int last)
+{
+	size_t len;
+
+	do
+	{
+		len = min(size, MAX_STORED);
+		put_bits(w, last && len == size, 1);
+		put_bits(w, 0, 2);
+		align_bits(w);
+		*w->p++ = (unsigned char)(len & 0xFF);
+		*w->p++ = (unsigned char)(len >> 8);
+		*w->p++ = (unsigned char)(~len & 0xFF);
+		*w->p++ = (unsigned char)((~len >> 8) & 0xFF);
+		memcpy(w->p, in, len);
+		w->p += len;
+		in += len;
+		size -= len;
+	} while (size);
+}
+
+/*
+Compresses one chunk into out, which needs room for deflate_bound(size)
+bytes. The last chunk of a stream gets the final block flag, all others end
+with an empty stored block so that the next chunk starts on a byte boundary.
+Returns the compressed size, or 0 if memory ran out.
+*/
+size_t deflate_chunk(const unsigned char *in, size_t size, int level, int last, unsigned char *out)
+{
+	static const unsigned char codelen_extra[NUM_CODELEN] =
+		{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7 };
+	unsigned int lit_freq[NUM_LITLEN], dist_freq[NUM_DIST], codelen_freq[NUM_CODELEN];
+	huffman_t litlen, dist, codelen, fixed_litlen, fixed_dist;
+	unsigned char lens[NUM_LITLEN + NUM_DIST], rle_syms[NUM_LITLEN + NUM_DIST], rle_extras[NUM_LITLEN + NUM_DIST];
+	unsigned short *lits = NULL, *dists = NULL;
+	int *head = NULL, *prev = NULL;
+	size_t dynamic_bits, fixed_bits, stored_bits;
+	int num_syms = 0, num_rle, hlit, hdist, hclen, i, sym, extra_bits, extra;
+	bit_writer_t w;
+
+	w.p = out;
+	w.bits = 0;
+	w.count = 0;
+	level = max(1, min(level, 9));
+
+	if (size)
+	{
+		head = malloc(HASH_SIZE * sizeof(*head));
+		prev = malloc(size * sizeof(*prev));
+		lits = malloc(size * sizeof(*lits));
+		dists = malloc(size * sizeof(*dists));
+		if (!head || !prev || !lits || !dists)
+		{
+			free(head);
+			free(prev);
+			free(lits);
+			free(dists);
+			return 0;
+		}
+		num_syms = find_matches(in, size, level, head, prev, lits, dists);
+		free(head);
+		free(prev);
+	}
+
+	memset(lit_freq, 0, sizeof(lit_freq));
+	memset(dist_freq, 0, sizeof(dist_freq));
+	for (i = 0; i < num_syms; ++i)
+	{
+		if (!dists[i])
+		{
+			++lit_freq[lits[i]];
+			continue;
+		}
+		++lit_freq[length_symbol(lits[i], &extra_bits, &extra)];
+		++dist_freq[dist_symbol(dists[i], &extra_bits, &extra)];
+	}
+	lit_freq[END_OF_BLOCK] = 1;
+
+	// dynamic block: the two codes, themselves run-length and Huffman coded
+	build_lengths(lit_freq, NUM_LITLEN, MAX_CODE_BITS, litlen.len);
+	build_lengths(dist_freq, NUM_DIST, MAX_CODE_BITS, dist.len);
+	for (hlit = NUM_LITLEN; hlit > 257 && !litlen.len[hlit - 1]; --hlit)
+		;
+	for (hdist = NUM_DIST; hdist > 1 && !dist.len[hdist - 1]; --hdist)
+		;
+	memcpy(lens, litlen.len, hlit);
+	memcpy(lens + hlit, dist.len, hdist);
+	num_rle = rle_lengths(lens, hlit + hdist, rle_syms, rle_extras);
+	memset(codelen_freq, 0, sizeof(codelen_freq));
+	for (i = 0; i < num_rle; ++i)
+		++codelen_freq[rle_syms[i]];
+	build_lengths(codelen_freq, NUM_CODELEN, MAX_CODELEN_BITS, codelen.len);
+	for (hclen = NUM_CODELEN; hclen > 4 && !codelen.len[codelen_order[hclen - 1]]; --hclen)
+		;
+	build_codes(&litlen, NUM_LITLEN);
+	build_codes(&dist, NUM_DIST);
+	build_codes(&codelen, NUM_CODELEN);
+	build_fixed(&fixed_litlen, &fixed_dist);
+
+	dynamic_bits = 3 + 5 + 5 + 4 + hclen * 3 + block_bits(&litlen, &dist, lit_freq, dist_freq);
+	for (i = 0; i < NUM_CODELEN; ++i)
+		dynamic_bits += (size_t)codelen_freq[i] * (codelen.len[i] + codelen_extra[i]);
+	fixed_bits = 3 + block_bits(&fixed_litlen, &fixed_dist, lit_freq, dist_freq);
+	stored_bits = (size / MAX_STORED + 1) * (3 + 7 + 32) + size * 8;
+
+	if (size && stored_bits < dynamic_bits && stored_bits < fixed_bits)
+	{
+		write_stored(&w, in, size, last);
+	}
+	else if (dynamic_bits < fixed_bits)
+	{
+		put_bits(&w, last, 1);
+		put_bits(&w, 2, 2);
+		put_bits(&w, hlit - 257, 5);
+		put_bits(&w, hdist - 1, 5);
+		put_bits(&w, hclen - 4, 4);
+		for (i = 0; i < hclen; ++i)
+			put_bits(&w, codelen.len[codelen_order[i]], 3);
+		for (i = 0; i < num_rle; ++i)
+		{
+			sym = rle_syms[i];
+			put_bits(&w, codelen.code[sym], codelen.len[sym]);
+			if (codelen_extra[sym])
+				put_bits(&w, rle_extras[i], codelen_extra[sym]);
+		}
+		write_symbols(&w, lits, dists, num_syms, &litlen, &dist);
+	}
+	else
+	{
+		put_bits(&w, last, 1);
+		put_bits(&w, 1, 2);
+		write_symbols(&w, lits, dists, num_syms, &fixed_litlen, &fixed_dist);
+	}
+	free(lits);
+	free(dists);
+
+	if (!last)
+	{
+		// sync flush: an empty stored block
+		put_bits(&w, 0, 1);
+		put_bits(&w, 0, 2);
+		align_bits(&w);
+		*w.p++ = 0x00;
+		*w.p++ = 0x00;
+		*w.p++ = 0xFF;
+		*w.p++ = 0xFF;
+	}
+	align_bits(&w);
+
+	return w.p - out;
+}
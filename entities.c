@@ -0,0 +1,379 @@
+/*
+MD3 and/or BSP to OBJ converter
+Written by Leszek Godlewski <github@inequation.org>
+The code in this file is placed in the public domain.
+*/
+
+#ifdef _MSC_VER
+	#define _CRT_SECURE_NO_WARNINGS
+	#define strcasecmp	_stricmp
+	#define strncasecmp	_strnicmp
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#ifndef _USE_MATH_DEFINES
+	#define _USE_MATH_DEFINES
+#endif
+#include <math.h>
+
+#include "md3bsp2ase.h"
+
+#define MAX_ENTITY_EPAIRS	64	// same as the game's MAX_SPAWN_VARS
+
+// A span of the entity lump; never NUL-terminated, never copied.
+typedef struct
+{
+	const char *s;
+	int len;
+} token_t;
+
+typedef struct
+{
+	const char *p;
+	const char *end;
+} entity_lexer_t;
+
+typedef struct
+{
+	token_t keys[MAX_ENTITY_EPAIRS];
+	token_t values[MAX_ENTITY_EPAIRS];
+	int num_epairs;
+} entity_t;
+
+// A unique misc_model MD3, converted to OBJ only once no matter how many times it is placed.
+typedef struct
+{
+	char path[MAX_QPATH];
+	char name[MAX_QPATH + 8];	// md3_<index>_<file name>, the OBJ output is <name>.obj
+	int resolved;
+} instanced_mesh_t;
+
+// Fetches the next token: a brace, a quoted string (without the quotes) or a bare word. Returns 0 at the end of the lump.
+static int next_token(entity_lexer_t *lex, token_t *tok)
+{
+	const char *p = lex->p;
+
+	for (;;)
+	{
+		while (p < lex->end && *p && (unsigned char)*p <= ' ')
+			++p;
+		// skip // comments, the game's parser tolerates them
+		if (p + 1 < lex->end && p[0] == '/' && p[1] == '/')
+		{
+			while (p < lex->end && *p && *p != '\n')
+				++p;
+			continue;
+		}
+		break;
+	}
+
+	if (p >= lex->end || !*p)
+	{
+		lex->p = p;
+		return 0;
+	}
+
+	if (*p == '{' || *p == '}')
+	{
+		tok->s = p;
+		tok->len = 1;
+		lex->p = p + 1;
+		return 1;
+	}
+
+	if (*p == '"')
+	{
+		tok->s = ++p;
+		while (p < lex->end && *p && *p != '"')
+			++p;
+		tok->len = (int)(p - tok->s);
+		lex->p = p < lex->end && *p == '"' ? p + 1 : p;
+		return 1;
+	}
+
+	tok->s = p;
+	while (p < lex->end && (unsigned char)*p > ' ' && *p != '{' && *p != '}' && *p != '"')
+		++p;
+	tok->len = (int)(p - tok->s);
+	lex->p = p;
+	return 1;
+}
+
+// Parses the next "{ key value ... }" block. Returns 1 on success, 0 at the end of the lump and -1 on a syntax error.
+static int next_entity(entity_lexer_t *lex, entity_t *ent)
+{
+	token_t tok, value;
+
+	ent->num_epairs = 0;
+
+	if (!next_token(lex, &tok))
+		return 0;
+	if (tok.len != 1 || *tok.s != '{')
+		return -1;
+
+	for (;;)
+	{
+		if (!next_token(lex, &tok))
+			return -1;
+		if (tok.len == 1 && *tok.s == '}')
+			return 1;
+		if (!next_token(lex, &value) || (value.len == 1 && (*value.s == '{' || *value.s == '}')))
+			return -1;
+		if (ent->num_epairs < MAX_ENTITY_EPAIRS)
+		{
+			ent->keys[ent->num_epairs] = tok;
+			ent->values[ent->num_epairs] = value;
+			++ent->num_epairs;
+		}
+	}
+}
+
+static int token_equals(const token_t *tok, const char *s)
+{
+	int i;
+
+	for (i = 0; i < tok->len; ++i)
+	{
+		if (!s[i] || tolower((unsigned char)tok->s[i]) != tolower((unsigned char)s[i]))
+			return 0;
+	}
+	return !s[i];
+}
+
+static const token_t *value_for_key(const entity_t *ent, const char *key)
+{
+	int i;
+
+	for (i = 0; i < ent->num_epairs; ++i)
+	{
+		if (token_equals(&ent->keys[i], key))
+			return &ent->values[i];
+	}
+	return NULL;
+}
+
+// Reads up to count whitespace-separated floats from a token. Returns the number actually read.
+static int token_to_floats(const token_t *tok, float *out, int count)
+{
+	char num[32];
+	const char *p = tok->s, *end = tok->s + tok->len, *start;
+	int i;
+
+	for (i = 0; i < count; ++i)
+	{
+		while (p < end && (unsigned char)*p <= ' ')
+			++p;
+		if (p >= end)
+			break;
+		for (start = p; p < end && (unsigned char)*p > ' '; ++p)
+			;
+		if (p - start >= (int)sizeof(num))
+			break;
+		memcpy(num, start, p - start);
+		num[p - start] = 0;
+		out[i] = (float)atof(num);
+	}
+	return i;
+}
+
+// Same as the game's AnglesToAxis (pitch, yaw, roll in degrees).
+static void angles_to_axis(const vec3_t angles, vec3_t axis[3])
+{
+	float sp, cp, sy, cy, sr, cr;
+
+	sp = sinf(angles[0] * (float)M_PI / 180.f);
+	cp = cosf(angles[0] * (float)M_PI / 180.f);
+	sy = sinf(angles[1] * (float)M_PI / 180.f);
+	cy = cosf(angles[1] * (float)M_PI / 180.f);
+	sr = sinf(angles[2] * (float)M_PI / 180.f);
+	cr = cosf(angles[2] * (float)M_PI / 180.f);
+
+	// forward
+	axis[0][0] = cp * cy;
+	axis[0][1] = cp * sy;
+	axis[0][2] = -sp;
+	// left, i.e. negated right
+	axis[1][0] = sr * sp * cy - cr * sy;
+	axis[1][1] = sr * sp * sy + cr * cy;
+	axis[1][2] = sr * cp;
+	// up
+	axis[2][0] = cr * sp * cy + sr * sy;
+	axis[2][1] = cr * sp * sy - sr * cy;
+	axis[2][2] = cr * cp;
+}
+
+// Resolves a misc_model path to an index into the mesh table, converting the MD3 the first time it is seen.
+static int resolve_mesh(const token_t *model, instanced_mesh_t **meshes, int *num_meshes,
+	const char *base_path, const options_t *options, const sink_t *sink, output_t *instances)
+{
+	instanced_mesh_t *mesh;
+	md3_model_t md3;
+	char *path, obj_name[MAX_QPATH + 16];
+	const char *base_name;
+	int i, len;
+
+	for (i = 0; i < *num_meshes; ++i)
+	{
+		if (token_equals(model, (*meshes)[i].path))
+			return i;
+	}
+
+	mesh = realloc(*meshes, sizeof(**meshes) * (*num_meshes + 1));
+	if (!mesh)
+		return -1;
+	*meshes = mesh;
+	mesh += (*num_meshes)++;
+
+	len = min(model->len, MAX_QPATH - 1);
+	memcpy(mesh->path, model->s, len);
+	mesh->path[len] = 0;
+	mesh->resolved = 0;
+
+	if (len < 4 || strcasecmp(mesh->path + len - 4, ".md3"))
+	{
+		sink_log(sink, LOG_WARNING, "WARNING: misc_model %s is not an MD3, skipping", mesh->path);
+		return i;
+	}
+
+	if (!(path = malloc(strlen(base_path) + 1 + len + 1)))
+		return -1;
+	if ((base_name = strrchr(mesh->path, '/')) == NULL)
+		base_name = mesh->path;
+	else
+		++base_name;
+	sprintf(mesh->name, "md3_%03d_%.*s", i, (int)(strlen(base_name) - 4), base_name);
+	sprintf(path, "%s%s%s", base_path, *base_path ? "/" : "", mesh->path);
+	sprintf(obj_name, "%s.obj", mesh->name);
+
+	if (read_md3(path, 0, sink, &md3) != 0)
+	{
+		sink_log(sink, LOG_WARNING, "WARNING: failed to open misc_model %s, its instances will not resolve", path);
+	}
+	else
+	{
+		sink_log(sink, LOG_INFO, "Converting misc_model #%d %s", i, path);
+		mesh->resolved = convert_md3_to_obj(&md3, 0, obj_name, options, sink) == 0;
+		if (mesh->resolved)
+			output_printf(instances, "mesh %s %s %s\n", mesh->name, obj_name, mesh->path);
+		free_md3(&md3);
+	}
+
+	free(path);
+	return i;
+}
+
+// Strips "maps/<name>.bsp" from the BSP path; misc_model paths and shader scripts are relative to what remains.
+void guess_base_path(const char *in_name, char *out, size_t out_size)
+{
+	const char *p, *dir;
+
+	out[0] = 0;
+	if ((p = strrchr(in_name, '/')) == NULL && (p = strrchr(in_name, '\\')) == NULL)
+		return;
+	for (dir = p; dir > in_name && dir[-1] != '/' && dir[-1] != '\\'; --dir)
+		;
+	if (p - dir == 4 && !strncasecmp(dir, "maps", 4))
+		p = dir > in_name ? dir - 1 : dir;
+	if ((size_t)(p - in_name) < out_size)
+	{
+		memcpy(out, in_name, p - in_name);
+		out[p - in_name] = 0;
+	}
+}
+
+int export_bsp_entities(const bsp_t *bsp, const options_t *options, const sink_t *sink,
+	output_t *instances)
+{
+	entity_lexer_t lex;
+	entity_t ent;
+	instanced_mesh_t *meshes = NULL;
+	const token_t *classname, *model, *value;
+	char base_path_buf[1024];
+	const char *base_path;
+	vec3_t origin, angles, scale, axis[3];
+	int num_meshes = 0, num_instances = 0, num_bmodels = 0, mesh_index, result, i;
+
+	lex.p = (const char *)bsp->buf + bsp->header->lumps[LUMP_ENTITIES].fileofs;
+	lex.end = lex.p + bsp->header->lumps[LUMP_ENTITIES].filelen;
+
+	if (options->base_path)
+	{
+		base_path = options->base_path;
+	}
+	else
+	{
+		guess_base_path(bsp->name, base_path_buf, sizeof(base_path_buf));
+		base_path = base_path_buf;
+	}
+
+	while ((result = next_entity(&lex, &ent)) > 0)
+	{
+		classname = value_for_key(&ent, "classname");
+		model = value_for_key(&ent, "model");
+		if (!classname || !model || model->len < 1)
+			continue;
+
+		VectorClear(origin);
+		if ((value = value_for_key(&ent, "origin")) != NULL)
+			token_to_floats(value, origin, 3);
+
+		// brush entities reference inline models, whose geometry is stored relative to the origin
+		if (model->s[0] == '*')
+		{
+			// the token is followed by a quote or whitespace, so atoi stops there
+			output_printf(instances, "bmodel %d %.*s %f %f %f\n",
+				atoi(model->s + 1), classname->len, classname->s,
+				origin[0], origin[1], origin[2]);
+			++num_bmodels;
+			continue;
+		}
+
+		if (!token_equals(classname, "misc_model"))
+			continue;
+
+		mesh_index = resolve_mesh(model, &meshes, &num_meshes, base_path, options, sink, instances);
+		if (mesh_index < 0)
+		{
+			sink_log(sink, LOG_ERROR, "Memory allocation failed");
+			break;
+		}
+		if (!meshes[mesh_index].resolved)
+			continue;
+
+		VectorClear(angles);
+		if ((value = value_for_key(&ent, "angles")) != NULL)
+			token_to_floats(value, angles, 3);
+		else if ((value = value_for_key(&ent, "angle")) != NULL)
+			token_to_floats(value, &angles[1], 1);
+
+		scale[0] = scale[1] = scale[2] = 1.f;
+		if ((value = value_for_key(&ent, "modelscale_vec")) != NULL)
+			token_to_floats(value, scale, 3);
+		else if ((value = value_for_key(&ent, "modelscale")) != NULL && token_to_floats(value, scale, 1) == 1)
+			scale[1] = scale[2] = scale[0];
+
+		angles_to_axis(angles, axis);
+		for (i = 0; i < 3; ++i)
+			VectorScale(axis[i], scale[i], axis[i]);
+
+		// MD3 OBJs have Y and Z swapped, so the mesh's OBJ Y axis is the model's Z axis and vice versa
+		output_printf(instances, "instance %s", meshes[mesh_index].name);
+		for (i = 0; i < 3; ++i)
+			output_printf(instances, " %f %f %f %f", axis[0][i], axis[2][i], axis[1][i], origin[i]);
+		output_printf(instances, "\n");
+		++num_instances;
+	}
+
+	if (result < 0)
+		sink_log(sink, LOG_WARNING, "WARNING: syntax error in the entity lump, entities past it were ignored");
+
+	sink_log(sink, LOG_INFO, "Entities: %d misc_model instances of %d unique MD3s, %d brush entities",
+		num_instances, num_meshes, num_bmodels);
+
+	free(meshes);
+
+	return 0;
+}
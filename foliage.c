@@ -0,0 +1,111 @@
+/*
+MD3 and/or BSP to OBJ converter
+Written by Leszek Godlewski <github@inequation.org>
+The code in this file is placed in the public domain.
+*/
+
+#ifdef _MSC_VER
+	#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "md3bsp2ase.h"
+
+/*
+Foliage surfaces store the mesh followed by one extra vertex per instance:
+patchHeight is the number of mesh vertices, patchWidth the number of instances,
+and the xyz of each extra vertex is the instance origin. load_bsp has already
+made sure the indexes only ever reference the mesh vertices.
+*/
+int export_foliage_surface(const bsp_t *bsp, const bsp_surface_info_t *info, int model_index, int surf_index,
+	const sink_t *sink, output_t *instances)
+{
+	const dshader_t *shader = info->shader;
+	const drawVert_t *vert;
+	const int *tri;
+	char name[32];
+	output_t out;
+	int mesh_verts, num_instances, tri_count, i, retcode;
+
+	vert = (const drawVert_t *)(bsp->buf + bsp->header->lumps[LUMP_DRAWVERTS].fileofs)
+		+ info->first_vert;
+	tri = (const int *)(bsp->buf + bsp->header->lumps[LUMP_DRAWINDEXES].fileofs)
+		+ info->first_index;
+	mesh_verts = info->surf->patchHeight;
+	num_instances = info->surf->patchWidth;
+	tri_count = info->num_indexes / 3;
+
+	if (mesh_verts < 3 || num_instances < 1 || mesh_verts + num_instances > info->num_verts)
+	{
+		sink_log(sink, LOG_WARNING, "WARNING: malformed foliage surface #%d in model #%d, skipping",
+			surf_index, model_index);
+		return 0;
+	}
+
+	sprintf(name, "foliage_%04d_%05d.obj", model_index, surf_index);
+	if ((retcode = open_output(&out, sink, name)) != 0)
+		return retcode;
+
+	sink_log(sink, LOG_VERBOSE, "\tProcessing surface #%d: type %s, %d vertices, %d indices, %d instances",
+		surf_index, get_bsp_surface_type(info->type),
+		mesh_verts, tri_count * 3, num_instances);
+
+	// the mesh is written only once, in the same space as the map's OBJ
+	output_printf(&out,
+		"# generated by md3bsp2ase from %s model #%d foliage surface #%d\n"
+		"\n"
+		"usemtl %s\n"
+		"g foliage%d\n"
+		"o foliage%d\n"
+		"\n",
+		bsp->name, model_index, surf_index, shader->shader, surf_index, surf_index);
+
+	for (i = 0; i < mesh_verts; ++i)
+		output_printf(&out, "v %f %f %f\n", vert[i].xyz[0], vert[i].xyz[1], vert[i].xyz[2]);
+	output_printf(&out, "\n");
+	for (i = 0; i < mesh_verts; ++i)
+		output_printf(&out, "vt %f %f\n", vert[i].st[0], 1.f - vert[i].st[1]);
+	output_printf(&out, "\n");
+	for (i = 0; i < mesh_verts; ++i)
+		output_printf(&out, "vn %f %f %f\n", vert[i].normal[0], vert[i].normal[1], vert[i].normal[2]);
+	output_printf(&out,
+		"\n"
+		"s 1\n");
+
+	for (i = 0; i < tri_count; ++i, tri += 3)
+	{
+		output_printf(&out,
+			"f %d/%d/%d %d/%d/%d %d/%d/%d\n",
+			1 + tri[2], 1 + tri[2], 1 + tri[2],
+			1 + tri[1], 1 + tri[1], 1 + tri[1],
+			1 + tri[0], 1 + tri[0], 1 + tri[0]);
+	}
+
+	if ((retcode = close_output(&out)) != 0)
+		return retcode;
+
+	// foliage instances are only ever translated
+	output_printf(instances, "mesh foliage_%04d_%05d %s %s\n", model_index, surf_index, name, shader->shader);
+	for (i = 0, vert += mesh_verts; i < num_instances; ++i, ++vert)
+	{
+		output_printf(instances, "instance foliage_%04d_%05d 1 0 0 %f 0 1 0 %f 0 0 1 %f\n",
+			model_index, surf_index, vert->xyz[0], vert->xyz[1], vert->xyz[2]);
+	}
+
+	return 0;
+}
+
+// Flares carry no geometry: the origin lives in lightmapOrigin, the color in lightmapVecs[0] and the normal in lightmapVecs[2].
+void export_flare_surface(const bsp_surface_info_t *info, output_t *instances)
+{
+	const dsurface_t *surf = info->surf;
+
+	output_printf(instances, "flare %s %f %f %f %f %f %f %f %f %f\n",
+		info->shader->shader,
+		surf->lightmapOrigin[0], surf->lightmapOrigin[1], surf->lightmapOrigin[2],
+		surf->lightmapVecs[0][0], surf->lightmapVecs[0][1], surf->lightmapVecs[0][2],
+		surf->lightmapVecs[2][0], surf->lightmapVecs[2][1], surf->lightmapVecs[2][2]);
+}
@@ -0,0 +1,1390 @@
+/*
+MD3 and/or BSP to OBJ converter
+Written by Leszek Godlewski <github@inequation.org>
+The code in this file is placed in the public domain.
+*/
+
+#ifdef _MSC_VER
+	#define _CRT_SECURE_NO_WARNINGS
+	#define strcasecmp	_stricmp
+#endif
+#ifdef __linux__
+	#define _GNU_SOURCE		// struct ucred
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+	#include <io.h>
+#else
+	#include <dirent.h>
+	#include <errno.h>
+	#include <fcntl.h>
+	#include <signal.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/socket.h>
+	#include <sys/time.h>
+	#include <sys/un.h>
+#endif
+#ifdef __linux__
+	#include <poll.h>
+	#include <sys/inotify.h>
+#endif
+
+#include "md3bsp2ase.h"
+
+// Backs the library's sink with files named after the output path.
+typedef struct
+{
+	const char *out_name;		// the primary output, as given on the command line
+	char *out_base;				// out_name without the extension; the other outputs are <out_base>_<name>
+	const char *suffix;			// appended to the other outputs' names, ".gz" when compressing
+	FILE *console;				// where messages go: stdout, or the client of a server
+} file_sink_t;
+
+static void *file_open(void *context, const char *name)
+{
+	const file_sink_t *files = context;
+	char *path;
+	FILE *f;
+
+	if (!name)
+	{
+		if (!(f = fopen(files->out_name, "wb")))
+			fprintf(files->console, "Failed to open file %s\n", files->out_name);
+		return f;
+	}
+
+	if (!(path = malloc(strlen(files->out_base) + 1 + strlen(name) + strlen(files->suffix) + 1)))
+		return NULL;
+	sprintf(path, "%s_%s%s", files->out_base, name, files->suffix);
+	if (!(f = fopen(path, "wb")))
+		fprintf(files->console, "Failed to open file %s\n", path);
+	free(path);
+	return f;
+}
+
+// The outputs all land in one directory, so they refer to each other by file name alone.
+static void file_reference(void *context, const char *name, char *buf, size_t size)
+{
+	const file_sink_t *files = context;
+	const char *base = name ? files->out_base : files->out_name, *p;
+
+	for (p = base; *p; ++p)
+	{
+		if (*p == '/' || *p == '\\')
+			base = p + 1;
+	}
+	if (name)
+		snprintf(buf, size, "%s_%s%s", base, name, files->suffix);
+	else
+		snprintf(buf, size, "%s", base);
+}
+
+static int file_write(void *context, void *stream, const void *data, size_t size)
+{
+	(void)context;
+	return fwrite(data, 1, size, stream) != size;
+}
+
+static int file_close(void *context, void *stream)
+{
+	(void)context;
+	return fclose(stream) != 0;
+}
+
+static void file_log(void *context, int level, const char *message)
+{
+	const file_sink_t *files = context;
+
+	(void)level;
+	fprintf(files->console, "%s\n", message);
+}
+
+// One line per report, the library already keeps them few enough for logs that are collected.
+static void file_progress(void *context, const char *what, int done, int total)
+{
+	const file_sink_t *files = context;
+
+	fprintf(files->console, "\t%s: %d/%d surfaces (%d%%)\n", what, done, total, (int)(100LL * done / max(total, 1)));
+}
+
+// Loads the whole file into memory. Returns 0 or the tool's exit code for the failure.
+static int file_read(void *context, const char *path, const unsigned char **data, size_t *size)
+{
+	unsigned char *buf;
+	FILE *f;
+	long len;
+
+	(void)context;
+	if (!(f = fopen(path, "rb")))
+		return 3;
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	// one spare byte so that empty files still get a valid pointer
+	if (len < 0 || !(buf = malloc(len + 1)))
+	{
+		fclose(f);
+		return 11;
+	}
+	if (fread(buf, 1, len, f) != (size_t)len)
+	{
+		free(buf);
+		fclose(f);
+		return 12;
+	}
+	fclose(f);
+	*data = buf;
+	*size = (size_t)len;
+	return 0;
+}
+
+static void file_release(void *context, const unsigned char *data)
+{
+	(void)context;
+	free((void *)data);
+}
+
+static int read_input(const char *path, stats_t *stats, const unsigned char **data, size_t *size)
+{
+	double start = get_time();
+	int retcode;
+
+	retcode = file_read(NULL, path, data, size);
+	add_time(stats, STAGE_LOAD, get_time() - start);
+	return retcode;
+}
+
+// Mesh caches are used in place: mapped, only the pages the exporters get to are ever read.
+static int map_input(const char *path, stats_t *stats, const unsigned char **data, size_t *size, int *mapped)
+{
+#ifndef _WIN32
+	struct stat st;
+	void *p;
+	double start = get_time();
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return 3;
+	// empty files can't be mapped, they are read like any other
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+	{
+		p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED)
+			return 12;
+		add_time(stats, STAGE_LOAD, get_time() - start);
+		*data = p;
+		*size = (size_t)st.st_size;
+		*mapped = 1;
+		return 0;
+	}
+	close(fd);
+#endif
+	*mapped = 0;
+	return read_input(path, stats, data, size);
+}
+
+static void unmap_input(const unsigned char *data, size_t size)
+{
+#ifndef _WIN32
+	munmap((void *)data, size);
+#else
+	(void)data;
+	(void)size;
+#endif
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void free_names(char **names, int num_names)
+{
+	int i;
+
+	for (i = 0; i < num_names; ++i)
+		free(names[i]);
+	free(names);
+}
+
+// Lists the .shader files in dir, sorted by name. Returns 0 (a missing directory has none) or 11.
+static int list_shader_scripts(const char *dir, char ***names_out, int *num_names_out)
+{
+	char pattern[1024], **names = NULL, **grown;
+	int num_names = 0, max_names = 0, retcode = 0;
+#ifdef _WIN32
+	struct _finddata_t found;
+	intptr_t handle;
+
+	snprintf(pattern, sizeof(pattern), "%s/*.shader", dir);
+	if ((handle = _findfirst(pattern, &found)) == -1)
+	{
+		*names_out = NULL;
+		*num_names_out = 0;
+		return 0;
+	}
+	do
+	{
+		const char *name = found.name;
+#else
+	DIR *d;
+	struct dirent *entry;
+	size_t len;
+
+	(void)pattern;
+	if (!(d = opendir(dir)))
+	{
+		*names_out = NULL;
+		*num_names_out = 0;
+		return 0;
+	}
+	while ((entry = readdir(d)) != NULL)
+	{
+		const char *name = entry->d_name;
+
+		if ((len = strlen(name)) < 7 || strcasecmp(name + len - 7, ".shader"))
+			continue;
+#endif
+		if (num_names == max_names)
+		{
+			max_names = max_names ? max_names * 2 : 64;
+			if (!(grown = realloc(names, max_names * sizeof(*names))))
+			{
+				retcode = 11;
+				break;
+			}
+			names = grown;
+		}
+		if (!(names[num_names] = malloc(strlen(name) + 1)))
+		{
+			retcode = 11;
+			break;
+		}
+		strcpy(names[num_names++], name);
+#ifdef _WIN32
+	} while (_findnext(handle, &found) == 0);
+	_findclose(handle);
+#else
+	}
+	closedir(d);
+#endif
+
+	if (retcode)
+	{
+		free_names(names, num_names);
+		return retcode;
+	}
+	qsort(names, num_names, sizeof(*names), compare_paths);
+	*names_out = names;
+	*num_names_out = num_names;
+	return 0;
+}
+
+static unsigned int hash_bytes(unsigned int h, const void *data, size_t size)
+{
+	const unsigned char *p = data;
+
+	while (size--)
+		h = (h ^ *p++) * 16777619u;
+	return h;
+}
+
+static unsigned int hash_file_stat(unsigned int h, const char *path)
+{
+	struct stat st;
+	long long stamp[2] = { -1, -1 };
+
+	if (!stat(path, &st))
+	{
+		stamp[0] = (long long)st.st_mtime;
+		stamp[1] = (long long)st.st_size;
+	}
+	h = hash_bytes(h, path, strlen(path));
+	return hash_bytes(h, stamp, sizeof(stamp));
+}
+
+// Fingerprints the scripts of a game directory by their names, sizes and modification times; 0 if unknown.
+static unsigned int get_scripts_stamp(const char *base_path)
+{
+	char dir[1024], path[1280], **names;
+	unsigned int h = 2166136261u;
+	int num_names, i;
+
+	snprintf(dir, sizeof(dir), "%s%sscripts", base_path, *base_path ? "/" : "");
+	snprintf(path, sizeof(path), "%s/shaderlist.txt", dir);
+	h = hash_file_stat(h, path);
+	if (list_shader_scripts(dir, &names, &num_names) != 0)
+		return 0;
+	for (i = 0; i < num_names; ++i)
+	{
+		snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+		h = hash_file_stat(h, path);
+	}
+	free_names(names, num_names);
+	return h ? h : 1;
+}
+
+// Without a shaderlist.txt, q3map2 and the engine take every .shader in scripts/; so do we, in name order.
+static int load_shader_dir(shader_index_t *index, const char *base_path, const sink_t *sink)
+{
+	char dir[1024], **names, *path;
+	int num_names, retcode, i;
+
+	snprintf(dir, sizeof(dir), "%s%sscripts", base_path, *base_path ? "/" : "");
+	if ((retcode = list_shader_scripts(dir, &names, &num_names)) != 0)
+		return retcode;
+	for (i = 0; i < num_names && !retcode; ++i)
+	{
+		if (!(path = malloc(strlen(dir) + strlen(names[i]) + 2)))
+		{
+			retcode = 11;
+			break;
+		}
+		sprintf(path, "%s/%s", dir, names[i]);
+		if ((retcode = load_shader_script(index, path, sink)) != 0 && retcode != 11)
+		{
+			sink_log(sink, LOG_WARNING, "WARNING: failed to read shader script %s", path);
+			retcode = 0;
+		}
+		free(path);
+	}
+	free_names(names, num_names);
+	return retcode;
+}
+
+#define SHADER_CACHE_SIZE	8
+
+// A shader index of one game directory, reused for as long as its scripts stay the same.
+typedef struct
+{
+	char *base_path;			// absolute, NULL if the entry is free
+	unsigned int stamp;			// see get_scripts_stamp
+	double last_used;
+	shader_index_t index;
+} cached_shaders_t;
+
+// For the command line tool, one run's worth; for a server, all of its jobs'.
+typedef struct
+{
+	cached_shaders_t entries[SHADER_CACHE_SIZE];
+} shader_cache_t;
+
+static void free_cached_shaders(cached_shaders_t *entry)
+{
+	free_shader_index(&entry->index);
+	free(entry->base_path);
+	memset(entry, 0, sizeof(*entry));
+}
+
+static void free_shader_cache(shader_cache_t *cache)
+{
+	int i;
+
+	for (i = 0; i < SHADER_CACHE_SIZE; ++i)
+		free_cached_shaders(&cache->entries[i]);
+}
+
+// Entries are keyed by absolute path, as a server's jobs each run in their client's directory.
+static void get_cache_key(const char *base_path, char *key, size_t size)
+{
+#ifndef _WIN32
+	char cwd[1024];
+
+	if (base_path[0] != '/' && getcwd(cwd, sizeof(cwd)))
+	{
+		snprintf(key, size, "%s/%s", cwd, base_path);
+		return;
+	}
+#endif
+	snprintf(key, size, "%s", base_path);
+}
+
+// Finds or builds the shader index the input resolves materials against. Returns 0 or 11.
+static int get_shaders(shader_cache_t *cache, const char *in_name, const char *base_path, const sink_t *sink,
+	const shader_index_t **shaders)
+{
+	cached_shaders_t *entry = NULL;
+	char guessed[1024], key[2048];
+	unsigned int stamp;
+	int retcode, i;
+
+	if (!base_path)
+	{
+		// a map knows where the game directory is, a model alone doesn't
+		if (!strcasecmp(strrchr(in_name, '.'), ".bsp"))
+			guess_base_path(in_name, guessed, sizeof(guessed));
+		else
+			guessed[0] = 0;
+		base_path = guessed;
+	}
+
+	get_cache_key(base_path, key, sizeof(key));
+	stamp = get_scripts_stamp(base_path);
+	for (i = 0; i < SHADER_CACHE_SIZE && !entry; ++i)
+	{
+		if (cache->entries[i].base_path && !strcmp(cache->entries[i].base_path, key))
+			entry = &cache->entries[i];
+	}
+	if (entry && stamp && entry->stamp == stamp)
+	{
+		sink_log(sink, LOG_INFO, "Reusing %d shaders from %d scripts", entry->index.num_defs,
+			entry->index.num_scripts);
+		entry->last_used = get_time();
+		*shaders = &entry->index;
+		return 0;
+	}
+
+	// the directory's previous index, a free entry or the least recently used one
+	for (i = 0; i < SHADER_CACHE_SIZE && !entry; ++i)
+	{
+		if (!cache->entries[i].base_path)
+			entry = &cache->entries[i];
+	}
+	if (!entry)
+	{
+		entry = &cache->entries[0];
+		for (i = 1; i < SHADER_CACHE_SIZE; ++i)
+		{
+			if (cache->entries[i].last_used < entry->last_used)
+				entry = &cache->entries[i];
+		}
+	}
+	free_cached_shaders(entry);
+
+	if (!(entry->base_path = malloc(strlen(key) + 1)))
+		retcode = 11;
+	else if ((retcode = load_shader_list(&entry->index, base_path, sink)) == 3)
+		retcode = load_shader_dir(&entry->index, base_path, sink);
+	if (retcode == 11)
+	{
+		sink_log(sink, LOG_ERROR, "Memory allocation failed");
+		free_cached_shaders(entry);
+		return retcode;
+	}
+	strcpy(entry->base_path, key);
+	entry->stamp = stamp;
+	entry->last_used = get_time();
+
+	if (!entry->index.num_scripts)
+	{
+		sink_log(sink, LOG_WARNING, "WARNING: no shader scripts in %s/scripts, all shaders are taken as textures",
+			*base_path ? base_path : ".");
+	}
+	else
+	{
+		sink_log(sink, LOG_INFO, "Loaded %d shaders from %d scripts", entry->index.num_defs,
+			entry->index.num_scripts);
+	}
+	*shaders = &entry->index;
+	return 0;
+}
+
+static void print_stats_json(FILE *console, const stats_t *stats)
+{
+	output_t out;
+
+	if (open_memory_output(&out) != 0)
+		return;
+	write_stats_json(&out, stats);
+	fwrite(out.buf, 1, out.used, console);
+	close_output(&out);
+}
+
+static void print_usage(FILE *console, const char *exe)
+{
+	fprintf(console, "Usage: %s [options] <infile> <outfile> [frame number | first-last with --anim]\n"
+		"Options:\n"
+		"  --basepath <dir>  game directory to resolve misc_model MD3s and shaders\n"
+		"                    against\n"
+		"                    (default: the directory above the BSP's maps/)\n"
+		"  --collision       also export brushes as convex collision pieces\n"
+		"  --collision-contents <mask>\n"
+		"                    content flags a brush needs to be exported\n"
+		"                    (default: 0x%x, solid and player clip)\n"
+		"  --mtl             write materials to .mtl libraries the OBJs refer to,\n"
+		"                    resolving shaders through the scripts/*.shader files\n"
+		"                    of the base path\n"
+		"  --merge-planar    merge coplanar planar map surfaces that share a shader\n"
+		"                    and texture mapping, and retriangulate them with fewer\n"
+		"                    vertices and triangles\n"
+		"  --attach <tag> <md3>\n"
+		"                    attach another MD3 to the first part carrying the\n"
+		"                    tag, e.g. --attach tag_torso upper.md3; repeatable\n"
+		"  --tags            write all MD3 tags and part transforms to\n"
+		"                    <outfile>_tags.txt\n"
+		"  --vat             bake all MD3 frames into vertex animation textures\n"
+		"                    <outfile>_vat_pos.dds and <outfile>_vat_nrm.dds;\n"
+		"                    <outfile> gets the base mesh\n"
+		"  --anim            write the MD3's frames (all, or the given range) to\n"
+		"                    <outfile> as a compact delta-encoded container\n"
+		"  --lods            gather <name>.md3, <name>_1.md3, <name>_2.md3... into\n"
+		"                    a single OBJ with LOD<N>_ prefixed objects\n"
+		"  --simplify <ratio>\n"
+		"                    simplify map meshes and MD3 surfaces down to the given\n"
+		"                    fraction of their triangles, keeping their outlines,\n"
+		"                    seams and material boundaries\n"
+		"  --simplify-error <units>\n"
+		"                    stop simplifying where the surface would move further\n"
+		"                    than this; alone, simplify as far as that allows\n"
+		"  --gzip            gzip every output; <outfile> is used as given, the\n"
+		"                    other outputs get a .gz suffix\n"
+		"  --gzip-level <n>  gzip with compression level 1-9 (default: 6)\n"
+		"  --stats json      print stage timings and counters as JSON once done\n"
+#ifdef __linux__
+		"  --watch           keep the map's outputs up to date: convert it again\n"
+		"                    whenever it is written, only writing the OBJs and\n"
+		"                    collision of the models that changed; stop with Ctrl+C\n"
+#endif
+		"  --quiet           only print warnings and errors\n"
+		"  --verbose         also print every surface processed, instead of\n"
+		"                    progress updates\n"
+		"\n"
+		"A map converted to an <outfile> ending in .mcache goes to a mesh cache: its\n"
+		"models' meshes, tessellated, merged and simplified as asked, ready to be\n"
+		"converted again to OBJs with the cache as the <infile>.\n",
+		exe, CONTENTS_SOLID | CONTENTS_PLAYERCLIP);
+#ifndef _WIN32
+	fprintf(console, "\n"
+		"       %s --serve <socket>\n"
+		"                    convert the jobs sent to the UNIX socket, one at a time,\n"
+		"                    keeping shader indexes warm across them\n"
+		"       %s --connect <socket> [options] <infile> <outfile> [frame]\n"
+		"                    have the server listening on the socket do the\n"
+		"                    conversion\n",
+		exe, exe);
+#endif
+}
+
+#ifndef _WIN32
+// Set by SIGINT and SIGTERM in the modes that run until stopped.
+static volatile sig_atomic_t stop_requested;
+
+static void handle_stop(int sig)
+{
+	(void)sig;
+	stop_requested = 1;
+}
+
+// No SA_RESTART, so that a signal gets a blocking call out of the way.
+static void catch_stop_signals(void)
+{
+	struct sigaction action;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handle_stop;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+}
+#endif
+
+#ifdef __linux__
+/*
+Watch mode: once the map is converted, the tool waits for it to be written
+again, e.g. by every stage of a q3map2 compile, and converts it again. Only
+the models that changed since the last conversion get their OBJ and collision
+written; hash_bsp_models tells them apart. Placements, foliage and entities
+are cheap and always redone, as moving a misc_model only touches the entity
+string. The directory is watched rather than the file, so that a compiler
+that writes a temporary file and renames it over the map is seen as well.
+The outputs of models that changed or are gone are removed before the map is
+converted again, which writes back the ones that still apply, so a model that
+lost all its surfaces or brushes leaves no stale OBJ behind.
+*/
+
+#define WATCH_SETTLE_MS		250		// quiet time after the last write before the map is read again
+
+static const char *const model_outputs[] = { "%04d.obj", "%04d_collision.obj" };
+
+#define NUM_MODEL_OUTPUTS	(sizeof(model_outputs) / sizeof(model_outputs[0]))
+
+// The path the file sink writes output of the model to. Returns 0 if it doesn't fit.
+static int get_model_output_path(const file_sink_t *files, unsigned int output, int model_index, char *path,
+	size_t size)
+{
+	char name[32];
+	int len;
+
+	sprintf(name, model_outputs[output], model_index);
+	len = snprintf(path, size, "%s_%s%s", files->out_base, name, files->suffix);
+	return len >= 0 && (size_t)len < size;
+}
+
+// Removes the outputs of the last map's models that changed or are gone; removed gets a bit for each that was there.
+static void remove_model_outputs(const file_sink_t *files, int num_models, const unsigned char *changed,
+	int num_new_models, unsigned char *removed)
+{
+	char path[4096];
+	unsigned int j;
+	int i;
+
+	for (i = 0; i < num_models; ++i)
+	{
+		removed[i] = 0;
+		if (i < num_new_models && !changed[i])
+			continue;
+		for (j = 0; j < NUM_MODEL_OUTPUTS; ++j)
+		{
+			if (get_model_output_path(files, j, i, path, sizeof(path)) && remove(path) == 0)
+				removed[i] |= 1 << j;
+		}
+	}
+}
+
+// Logs the removed outputs the conversion didn't write back.
+static void log_stale_outputs(const file_sink_t *files, int num_models, const unsigned char *removed,
+	int num_new_models, const sink_t *sink)
+{
+	struct stat st;
+	char path[4096];
+	unsigned int j;
+	int i;
+
+	for (i = 0; i < num_models; ++i)
+	{
+		for (j = 0; j < NUM_MODEL_OUTPUTS; ++j)
+		{
+			if (!(removed[i] & (1 << j)) || !get_model_output_path(files, j, i, path, sizeof(path))
+				|| stat(path, &st) == 0)
+			{
+				continue;
+			}
+			sink_log(sink, LOG_INFO, "Removed %s, model #%d %s", path, i,
+				i < num_new_models ? "no longer has anything to export to it" : "is gone");
+		}
+	}
+}
+
+// Waits until the file in the watched directory has been written and left alone. Returns 0 if stopped.
+static int wait_for_write(int fd, const char *file)
+{
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	struct pollfd pfd;
+	ssize_t len;
+	char *p;
+	int written = 0, ready;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (!stop_requested)
+	{
+		// block until the first write, then only until the writes settle
+		if ((ready = poll(&pfd, 1, written ? WATCH_SETTLE_MS : -1)) == 0)
+			return 1;
+		if (ready < 0 || (len = read(fd, events, sizeof(events))) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		for (p = events; p < events + len; p += sizeof(*event) + event->len)
+		{
+			event = (const struct inotify_event *)p;
+			// the directory itself is gone
+			if (event->mask & IN_IGNORED)
+				return 0;
+			if (event->len && !strcmp(event->name, file))
+				written = 1;
+		}
+	}
+	return 0;
+}
+
+// Keeps converting the map as it changes, until stopped. bsp and data are the last map read.
+static int watch_bsp(const char *path, bsp_t *bsp, const unsigned char **data, options_t *options,
+	const sink_t *sink)
+{
+	char dir[1024];
+	const char *file;
+	const file_sink_t *files = sink->context;
+	const unsigned char *new_data;
+	unsigned int *hashes, *new_hashes;
+	unsigned char *changed, *removed;
+	size_t size;
+	bsp_t new_bsp;
+	double start;
+	int fd, num_changed, retcode = 0, i;
+
+	if ((file = strrchr(path, '/')) != NULL)
+		snprintf(dir, sizeof(dir), "%.*s", (int)(file - path), path);
+	else
+		strcpy(dir, ".");
+	file = file ? file + 1 : path;
+	if (!dir[0])
+		strcpy(dir, "/");
+
+	if ((fd = inotify_init1(IN_CLOEXEC)) < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+	{
+		sink_log(sink, LOG_ERROR, "Failed to watch directory %s", dir);
+		if (fd >= 0)
+			close(fd);
+		return 20;
+	}
+	if (!(hashes = malloc(bsp->num_models * sizeof(*hashes) + 1)))
+	{
+		sink_log(sink, LOG_ERROR, "Memory allocation failed");
+		close(fd);
+		return 11;
+	}
+	hash_bsp_models(bsp, hashes);
+	catch_stop_signals();
+
+	sink_log(sink, LOG_INFO, "Watching %s for changes", path);
+	while (!retcode && wait_for_write(fd, file))
+	{
+		start = get_time();
+		// the map may be half written or gone for good; either way the next write is worth waiting for
+		if ((retcode = file_read(NULL, path, &new_data, &size)) != 0)
+		{
+			sink_log(sink, LOG_WARNING, "WARNING: failed to read %s, waiting for the next write", path);
+			retcode = retcode == 11 ? 11 : 0;
+			continue;
+		}
+		if (load_bsp(path, new_data, size, sink, &new_bsp) != 0)
+		{
+			sink_log(sink, LOG_WARNING, "WARNING: failed to load %s, waiting for the next write", path);
+			file_release(NULL, new_data);
+			continue;
+		}
+		if (!(new_hashes = malloc(new_bsp.num_models * (sizeof(*new_hashes) + sizeof(*changed))
+			+ bsp->num_models * sizeof(*removed) + 1)))
+		{
+			sink_log(sink, LOG_ERROR, "Memory allocation failed");
+			free_bsp(&new_bsp);
+			file_release(NULL, new_data);
+			retcode = 11;
+			break;
+		}
+		changed = (unsigned char *)(new_hashes + new_bsp.num_models);
+		removed = changed + new_bsp.num_models;
+		hash_bsp_models(&new_bsp, new_hashes);
+		for (i = 0, num_changed = 0; i < new_bsp.num_models; ++i)
+		{
+			changed[i] = i >= bsp->num_models || new_hashes[i] != hashes[i];
+			num_changed += changed[i];
+		}
+
+		remove_model_outputs(files, bsp->num_models, changed, new_bsp.num_models, removed);
+		options->export_models = changed;
+		retcode = convert_bsp_to_obj(&new_bsp, options, sink);
+		options->export_models = NULL;
+		if (!retcode)
+			log_stale_outputs(files, bsp->num_models, removed, new_bsp.num_models, sink);
+
+		// the new map is the one the next change is compared against
+		free_bsp(bsp);
+		file_release(NULL, *data);
+		*bsp = new_bsp;
+		*data = new_data;
+		free(hashes);
+		hashes = new_hashes;
+
+		if (!retcode)
+		{
+			sink_log(sink, LOG_INFO, "Re-exported %d of %d models in %.3f s", num_changed, bsp->num_models,
+				get_time() - start);
+		}
+	}
+	if (!retcode && !stop_requested)
+	{
+		sink_log(sink, LOG_ERROR, "Lost the watch on directory %s", dir);
+		retcode = 20;
+	}
+
+	free(hashes);
+	close(fd);
+	return retcode;
+}
+#endif
+
+// Runs one conversion as given on the command line, messages going to the console.
+static int run_job(int argc, char *argv[], FILE *console, shader_cache_t *cache)
+{
+	const unsigned char *data = NULL;
+	size_t size;
+	char *in_ext, *out_ext, *p;
+	const char *exe = argv[0];
+	options_t options;
+	file_sink_t files;
+	sink_t sink;
+	stats_t stats;
+	double start = get_time(), start_shaders;
+	int retcode, arg, frame, compression = 0, print_stats = 0, log_level = LOG_INFO, watch = 0, to_cache, mapped = 0;
+
+	memset(&options, 0, sizeof(options));
+	options.collision_contents = CONTENTS_SOLID | CONTENTS_PLAYERCLIP;
+	// with only --simplify given, the error doesn't hold it back; with only --simplify-error, the ratio doesn't
+	options.simplify.max_error = FLT_MAX;
+	for (arg = 1; arg < argc && !strncmp(argv[arg], "--", 2); ++arg)
+	{
+		if (!strcmp(argv[arg], "--basepath") && arg + 1 < argc)
+		{
+			options.base_path = argv[++arg];
+		}
+		else if (!strcmp(argv[arg], "--collision"))
+		{
+			options.collision = 1;
+		}
+		else if (!strcmp(argv[arg], "--merge-planar"))
+		{
+			options.merge_planar = 1;
+		}
+		else if (!strcmp(argv[arg], "--mtl"))
+		{
+			options.materials = 1;
+		}
+		else if (!strcmp(argv[arg], "--attach") && arg + 2 < argc
+			&& options.num_md3_attachments < MAX_MD3_ATTACHMENTS)
+		{
+			options.md3_attachments[options.num_md3_attachments].tag = argv[++arg];
+			options.md3_attachments[options.num_md3_attachments].path = argv[++arg];
+			++options.num_md3_attachments;
+		}
+		else if (!strcmp(argv[arg], "--tags"))
+		{
+			options.md3_tags = 1;
+		}
+		else if (!strcmp(argv[arg], "--lods"))
+		{
+			options.md3_lods = 1;
+		}
+		else if (!strcmp(argv[arg], "--anim"))
+		{
+			options.md3_anim = 1;
+		}
+		else if (!strcmp(argv[arg], "--vat"))
+		{
+			options.md3_vat = 1;
+		}
+		else if (!strcmp(argv[arg], "--collision-contents") && arg + 1 < argc)
+		{
+			options.collision = 1;
+			options.collision_contents = (int)strtoul(argv[++arg], NULL, 0);
+		}
+		else if (!strcmp(argv[arg], "--simplify") && arg + 1 < argc)
+		{
+			options.simplify.enabled = 1;
+			options.simplify.ratio = (float)atof(argv[++arg]);
+			options.simplify.ratio = max(0.f, min(options.simplify.ratio, 1.f));
+		}
+		else if (!strcmp(argv[arg], "--simplify-error") && arg + 1 < argc)
+		{
+			options.simplify.enabled = 1;
+			options.simplify.max_error = (float)atof(argv[++arg]);
+			options.simplify.max_error = max(options.simplify.max_error, 0.f);
+		}
+#ifdef __linux__
+		// a server's job would never end
+		else if (!strcmp(argv[arg], "--watch") && console == stdout)
+		{
+			watch = 1;
+		}
+#endif
+		else if (!strcmp(argv[arg], "--gzip"))
+		{
+			compression = 6;
+		}
+		else if (!strcmp(argv[arg], "--quiet"))
+		{
+			log_level = LOG_WARNING;
+		}
+		else if (!strcmp(argv[arg], "--verbose"))
+		{
+			log_level = LOG_VERBOSE;
+		}
+		else if (!strcmp(argv[arg], "--stats") && arg + 1 < argc && !strcmp(argv[arg + 1], "json"))
+		{
+			print_stats = 1;
+			++arg;
+		}
+		else if (!strcmp(argv[arg], "--gzip-level") && arg + 1 < argc)
+		{
+			compression = atoi(argv[++arg]);
+			compression = max(1, min(compression, 9));
+		}
+		else
+		{
+			fprintf(console, "Unknown option %s\n", argv[arg]);
+			print_usage(console, exe);
+			return 1;
+		}
+	}
+	// shift the positional arguments into place
+	argc -= arg - 1;
+	argv += arg - 1;
+
+	if (argc < 3)
+	{
+		print_usage(console, exe);
+		return 1;
+	}
+
+	in_ext = strrchr(argv[1], '.');
+	if (in_ext == NULL)
+	{
+		fprintf(console, "File %s appears to have no extension\n", argv[1]);
+		return 2;
+	}
+	++in_ext;
+	// a map goes to a mesh cache instead of OBJs if the output is named like one
+	out_ext = strrchr(argv[2], '.');
+	to_cache = out_ext && !strcasecmp(out_ext, ".mcache") && !strcasecmp(in_ext, "bsp");
+	if (watch && (strcasecmp(in_ext, "bsp") || to_cache))
+	{
+		fprintf(console, "Only maps converted to OBJ can be watched\n");
+		return 1;
+	}
+#ifdef __linux__
+	// each change gets reported as it's dealt with, even into a pipe
+	if (watch)
+		setvbuf(console, NULL, _IOLBF, 0);
+#endif
+
+	// the extension is cut off the output name to derive the names of any additional outputs
+	files.out_name = argv[2];
+	files.console = console;
+	files.suffix = compression ? ".gz" : "";
+	if (!(files.out_base = malloc(strlen(argv[2]) + 1)))
+	{
+		fprintf(console, "Memory allocation failed\n");
+		return 11;
+	}
+	strcpy(files.out_base, argv[2]);
+	if ((p = strrchr(files.out_base, '.')) != NULL)
+		*p = 0;
+
+	memset(&sink, 0, sizeof(sink));
+	sink.context = &files;
+	sink.open = file_open;
+	sink.write = file_write;
+	sink.close = file_close;
+	sink.log = file_log;
+	sink.log_level = log_level;
+	// per-surface messages make progress updates redundant, and quiet means quiet
+	if (log_level == LOG_INFO)
+		sink.progress = file_progress;
+	sink.read = file_read;
+	sink.release = file_release;
+	sink.reference = file_reference;
+	sink.compression = compression;
+	memset(&stats, 0, sizeof(stats));
+	sink.stats = &stats;
+
+	frame = argc > 3 ? atoi(argv[3]) : 0;
+
+	// one index serves the map and every model it places, and later runs of a server
+	if (options.materials && !to_cache
+		&& (!strcasecmp(in_ext, "md3") || !strcasecmp(in_ext, "bsp") || !strcasecmp(in_ext, "mcache")))
+	{
+		start_shaders = get_time();
+		retcode = get_shaders(cache, argv[1], options.base_path, &sink, &options.shaders);
+		add_time(&stats, STAGE_LOAD, get_time() - start_shaders);
+		if (retcode != 0)
+		{
+			free(files.out_base);
+			return retcode;
+		}
+	}
+
+	if (!strcasecmp(in_ext, "md3") && options.md3_lods)
+	{
+		// the LODs are all read through the sink
+		retcode = convert_md3_lods_to_obj(argv[1], frame, &options, &sink);
+	}
+	else if (strcasecmp(in_ext, "md3") && strcasecmp(in_ext, "bsp") && strcasecmp(in_ext, "mcache"))
+	{
+		fprintf(console, "Unknown extension %s in file %s\n", in_ext, argv[1]);
+		retcode = 5;
+	}
+	else if ((retcode = !strcasecmp(in_ext, "mcache") ? map_input(argv[1], &stats, &data, &size, &mapped)
+		: read_input(argv[1], &stats, &data, &size)) != 0)
+	{
+		if (retcode == 3)
+			fprintf(console, "Failed to open file %s\n", argv[1]);
+		else if (retcode == 11)
+			fprintf(console, "Memory allocation failed\n");
+		else
+			fprintf(console, "Failed to read file %s into buffer\n", argv[1]);
+	}
+	else if (!strcasecmp(in_ext, "md3"))
+	{
+		md3_model_t model;
+
+		// animation exports take all frames, the frame argument is a range for --anim
+		if ((retcode = load_md3(argv[1], data, size, options.md3_anim || options.md3_vat ? 0 : frame,
+			&sink, &model)) == 0)
+		{
+			if (options.md3_anim)
+			{
+				retcode = convert_md3_to_anim(&model, argc > 3 ? argv[3] : NULL, &sink);
+			}
+			else if (options.md3_vat)
+			{
+				retcode = bake_md3_vat(&model, &sink);
+			}
+			else
+			{
+				retcode = convert_md3_parts_to_obj(&model, frame, &options, &sink);
+			}
+			free_md3(&model);
+		}
+	}
+	else if (!strcasecmp(in_ext, "mcache"))
+	{
+		mesh_cache_t mesh_cache;
+
+		if ((retcode = open_mesh_cache(argv[1], data, size, &sink, &mesh_cache)) == 0)
+		{
+			retcode = convert_mesh_cache_to_obj(&mesh_cache, &options, &sink);
+			free_mesh_cache(&mesh_cache);
+		}
+	}
+	else if (to_cache)
+	{
+		bsp_t bsp;
+
+		if ((retcode = load_bsp(argv[1], data, size, &sink, &bsp)) == 0)
+		{
+			retcode = convert_bsp_to_mesh_cache(&bsp, &options, &sink);
+			free_bsp(&bsp);
+		}
+	}
+	else
+	{
+		bsp_t bsp;
+
+		if ((retcode = load_bsp(argv[1], data, size, &sink, &bsp)) == 0)
+		{
+			retcode = convert_bsp_to_obj(&bsp, &options, &sink);
+#ifdef __linux__
+			if (!retcode && watch)
+				retcode = watch_bsp(argv[1], &bsp, &data, &options, &sink);
+#endif
+			free_bsp(&bsp);
+		}
+	}
+
+	if (mapped)
+		unmap_input(data, size);
+	else if (data)
+		file_release(NULL, data);
+	free(files.out_base);
+
+	add_time(&stats, STAGE_TOTAL, get_time() - start);
+	if (print_stats)
+		print_stats_json(console, &stats);
+
+	return retcode;
+}
+
+#ifndef _WIN32
+/*
+Server mode, for tools that convert over and over (e.g. on every map save):
+one process takes the jobs, so startup is paid once, OpenMP's thread team
+stays up between jobs and shader indexes are only rebuilt once their scripts
+change. A job is a connection to the UNIX socket. The client sends the
+directory to run the job in, then the job's command line (options, input,
+output and frame, without the executable), one argument per line, followed
+by an empty line. The server runs the job, streams back what the command
+line tool would print, then a "Job took <seconds> s" line and finally
+"exit <code>". Jobs are taken one at a time; each already uses every core.
+*/
+
+#define MAX_JOB_ARGS		64
+#define JOB_READ_TIMEOUT	10		// seconds a client gets to send its job
+
+// Reads one line without its terminator. Returns 0 at the end of the stream, on a timeout or if the line
+// doesn't fit, i.e. unless a whole line came in.
+static int read_job_line(FILE *in, char *line, size_t size)
+{
+	size_t len;
+
+	if (!fgets(line, (int)size, in))
+		return 0;
+	len = strlen(line);
+	if (!len || line[len - 1] != '\n')
+		return 0;
+	line[--len] = 0;
+	return 1;
+}
+
+// Reads the job's arguments up to the empty line that ends them. Returns NULL or what is wrong with them.
+static const char *read_job_args(FILE *in, char **args, int *num_args)
+{
+	char line[4096];
+
+	for (;;)
+	{
+		if (!read_job_line(in, line, sizeof(line)))
+			return "The job's command line was cut short";
+		if (!line[0])
+			return NULL;
+		if (*num_args == MAX_JOB_ARGS)
+			return "The job has too many arguments";
+		if (!(args[*num_args] = malloc(strlen(line) + 1)))
+			return "Memory allocation failed";
+		strcpy(args[(*num_args)++], line);
+	}
+}
+
+// Returns 1 if a job was run, 0 if the client hung up before sending one or it was rejected.
+static int serve_job(int client, const char *exe, shader_cache_t *cache, int job)
+{
+	FILE *in, *console;
+	char cwd[4096], saved_cwd[4096], *args[MAX_JOB_ARGS + 1];
+	const char *error;
+	struct timeval timeout;
+	double start, seconds;
+	int num_args = 1, retcode = 1, dup_client, i;
+
+	timeout.tv_sec = JOB_READ_TIMEOUT;
+	timeout.tv_usec = 0;
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	if ((dup_client = dup(client)) < 0 || !(in = fdopen(client, "r")))
+	{
+		close(client);
+		if (dup_client >= 0)
+			close(dup_client);
+		return 0;
+	}
+	if (!(console = fdopen(dup_client, "w")))
+	{
+		close(dup_client);
+		fclose(in);
+		return 0;
+	}
+	// messages are streamed to the client as they come
+	setvbuf(console, NULL, _IOLBF, 0);
+
+	args[0] = (char *)exe;
+	if (!read_job_line(in, cwd, sizeof(cwd)))
+	{
+		fclose(console);
+		fclose(in);
+		return 0;
+	}
+	// a job that didn't come in whole isn't run, it could write outputs with the wrong options
+	if ((error = read_job_args(in, args, &num_args)) != NULL)
+	{
+		fprintf(console, "%s\nexit 1\n", error);
+		printf("Rejected a job in %s: %s\n", cwd, error);
+		fflush(stdout);
+		for (i = 1; i < num_args; ++i)
+			free(args[i]);
+		fclose(console);
+		fclose(in);
+		return 0;
+	}
+	args[num_args] = NULL;
+
+	start = get_time();
+	if (!getcwd(saved_cwd, sizeof(saved_cwd)) || chdir(cwd) != 0)
+	{
+		fprintf(console, "Failed to change to directory %s\n", cwd);
+		retcode = 3;
+	}
+	else
+	{
+		retcode = run_job(num_args, args, console, cache);
+		if (chdir(saved_cwd) != 0)
+			printf("Failed to change back to directory %s\n", saved_cwd);
+	}
+	seconds = get_time() - start;
+	fprintf(console, "Job took %.3f s\nexit %d\n", seconds, retcode);
+
+	printf("Job #%d in %s:", job, cwd);
+	for (i = 1; i < num_args; ++i)
+	{
+		printf(" %s", args[i]);
+		free(args[i]);
+	}
+	printf("\n\texit code %d, %.3f s\n", retcode, seconds);
+	fflush(stdout);
+
+	fclose(console);
+	fclose(in);
+	return 1;
+}
+
+static int open_socket(const char *socket_path, struct sockaddr_un *addr)
+{
+	int fd;
+
+	if (strlen(socket_path) >= sizeof(addr->sun_path))
+	{
+		printf("Socket path %s is too long\n", socket_path);
+		return -1;
+	}
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, socket_path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		printf("Failed to create a socket\n");
+	return fd;
+}
+
+// Jobs run with the server's rights, so only its own user may send them.
+static int is_own_user(int client)
+{
+#ifdef __linux__
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	return getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+#else
+	uid_t uid;
+	gid_t gid;
+
+	return getpeereid(client, &uid, &gid) == 0 && uid == getuid();
+#endif
+}
+
+static int serve(const char *socket_path, const char *exe)
+{
+	static shader_cache_t cache;
+	struct sockaddr_un addr;
+	mode_t saved_umask;
+	int listener, client, jobs = 0, bound;
+
+	if ((listener = open_socket(socket_path, &addr)) < 0)
+		return 20;
+	// a socket nobody answers on is left over from a server that is gone
+	if (connect(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+	{
+		printf("A server is already listening on %s\n", socket_path);
+		close(listener);
+		return 20;
+	}
+	close(listener);
+	unlink(socket_path);
+	if ((listener = open_socket(socket_path, &addr)) < 0)
+		return 20;
+	// the socket is created accessible to this user only
+	saved_umask = umask(077);
+	bound = bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+	umask(saved_umask);
+	if (!bound || listen(listener, 16) != 0)
+	{
+		printf("Failed to listen on %s\n", socket_path);
+		close(listener);
+		return 20;
+	}
+
+	// a signal gets accept out of the way
+	catch_stop_signals();
+	// a client that hangs up mid-job only loses its messages
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("Listening on %s\n", socket_path);
+	fflush(stdout);
+	while (!stop_requested)
+	{
+		if ((client = accept(listener, NULL, NULL)) < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			printf("Failed to accept a connection\n");
+			break;
+		}
+		if (!is_own_user(client))
+		{
+			printf("Rejected a connection from another user\n");
+			fflush(stdout);
+			close(client);
+			continue;
+		}
+		jobs += serve_job(client, exe, &cache, jobs + 1);
+	}
+
+	close(listener);
+	unlink(socket_path);
+	free_shader_cache(&cache);
+	printf("Stopped after %d jobs\n", jobs);
+	return 0;
+}
+
+// Sends a job to a server and relays what it prints. Returns the job's exit code.
+static int run_remote_job(const char *socket_path, int argc, char *argv[])
+{
+	struct sockaddr_un addr;
+	FILE *request, *response;
+	char line[4096];
+	int fd, at_line_start = 1, retcode = -1, i;
+
+	for (i = 0; i < argc; ++i)
+	{
+		if (strchr(argv[i], '\n'))
+		{
+			printf("Arguments can't span lines: %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if ((fd = open_socket(socket_path, &addr)) < 0)
+		return 20;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		printf("Failed to connect to %s\n", socket_path);
+		close(fd);
+		return 20;
+	}
+	if (!getcwd(line, sizeof(line)) || !(request = fdopen(fd, "w")))
+	{
+		close(fd);
+		return 20;
+	}
+	if (!(response = fdopen(dup(fd), "r")))
+	{
+		fclose(request);
+		return 20;
+	}
+
+	fprintf(request, "%s\n", line);
+	for (i = 0; i < argc; ++i)
+		fprintf(request, "%s\n", argv[i]);
+	fprintf(request, "\n");
+	fflush(request);
+
+	while (fgets(line, sizeof(line), response))
+	{
+		if (at_line_start && !strncmp(line, "exit ", 5))
+			retcode = atoi(line + 5);
+		else
+			fputs(line, stdout);
+		at_line_start = strchr(line, '\n') != NULL;
+	}
+	fclose(response);
+	fclose(request);
+
+	if (retcode < 0)
+	{
+		printf("The server hung up before the job was done\n");
+		return 20;
+	}
+	return retcode;
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+	static shader_cache_t cache;
+	int retcode;
+
+#ifndef _WIN32
+	if (argc == 3 && !strcmp(argv[1], "--serve"))
+		return serve(argv[2], argv[0]);
+	if (argc > 2 && !strcmp(argv[1], "--connect"))
+		return run_remote_job(argv[2], argc - 3, argv + 3);
+#endif
+
+	retcode = run_job(argc, argv, stdout, &cache);
+	free_shader_cache(&cache);
+	return retcode;
+}
@@ -0,0 +1,933 @@
+/*
+MD3 and/or BSP to OBJ converter
+Written by Leszek Godlewski <github@inequation.org>
+The code in this file is placed in the public domain.
+*/
+
+#ifdef _MSC_VER
+	#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _USE_MATH_DEFINES
+	#define _USE_MATH_DEFINES
+#endif
+#include <math.h>
+
+#include "md3bsp2ase.h"
+
+// OBJ output swaps Y with Z (for Blender), this maps an OBJ axis to the MD3 one
+static const int obj_axis[3] = { 0, 2, 1 };
+
+/*
+Walks the header and the whole surface chain once, so that the writers can
+follow ofsEnd and index the vertex arrays without checking anything.
+*/
+static int validate_md3(const unsigned char *data, size_t size, const sink_t *sink)
+{
+	const md3Header_t *md3 = (const md3Header_t *)data;
+	const md3Surface_t *surf;
+	const md3Tag_t *tags;
+	const md3Triangle_t *tri;
+	long long offset;
+	int num_frames = md3->numFrames, num_tags = md3->numTags;
+	int i, j, num_verts, num_triangles;
+
+	if (num_frames > MD3_MAX_FRAMES || num_tags < 0 || num_tags > MD3_MAX_TAGS
+		|| md3->numSurfaces > MD3_MAX_SURFACES
+		|| !check_range(md3->ofsFrames, num_frames, sizeof(md3Frame_t), size)
+		|| !check_range(md3->ofsTags, (long long)num_frames * num_tags, sizeof(md3Tag_t), size)
+		|| (md3->ofsTags & 3))
+	{
+		sink_log(sink, LOG_ERROR, "Corrupt MD3: frames or tags are out of bounds");
+		return 19;
+	}
+
+	// tag names are compared and printed as C strings
+	tags = (const md3Tag_t *)(data + md3->ofsTags);
+	for (i = 0; i < num_frames * num_tags; ++i)
+	{
+		if (!memchr(tags[i].name, 0, sizeof(tags[i].name)))
+		{
+			sink_log(sink, LOG_ERROR, "Corrupt MD3: tag #%d has an unterminated name", i % num_tags);
+			return 19;
+		}
+	}
+
+	offset = md3->ofsSurfaces;
+	for (i = 0; i < md3->numSurfaces; ++i)
+	{
+		if (!check_range(offset, 1, sizeof(md3Surface_t), size) || (offset & 3))
+		{
+			sink_log(sink, LOG_ERROR, "Corrupt MD3: surface #%d is out of bounds", i);
+			return 19;
+		}
+		surf = (const md3Surface_t *)(data + offset);
+		num_verts = surf->numVerts;
+		num_triangles = surf->numTriangles;
+		if (!memchr(surf->name, 0, sizeof(surf->name))
+			|| num_verts < 0 || num_verts > MD3_MAX_VERTS
+			|| num_triangles < 0 || num_triangles > MD3_MAX_TRIANGLES
+			|| surf->ofsEnd < (int)sizeof(md3Surface_t) || (surf->ofsEnd & 3)
+			|| !check_range(surf->ofsTriangles, num_triangles, sizeof(md3Triangle_t), size - offset)
+			|| !check_range(surf->ofsSt, num_verts, sizeof(md3St_t), size - offset)
+			|| !check_range(surf->ofsXyzNormals, (long long)num_verts * num_frames,
+				sizeof(md3XyzNormal_t), size - offset)
+			|| ((surf->ofsTriangles | surf->ofsSt | surf->ofsXyzNormals) & 3))
+		{
+			sink_log(sink, LOG_ERROR, "Corrupt MD3: surface #%d is malformed", i);
+			return 19;
+		}
+
+		tri = (const md3Triangle_t *)((const unsigned char *)surf + surf->ofsTriangles);
+		for (j = 0; j < num_triangles; ++j, ++tri)
+		{
+			if ((unsigned int)tri->indexes[0] >= (unsigned int)num_verts
+				|| (unsigned int)tri->indexes[1] >= (unsigned int)num_verts
+				|| (unsigned int)tri->indexes[2] >= (unsigned int)num_verts)
+			{
+				sink_log(sink, LOG_ERROR, "Corrupt MD3: surface #%d has out of range indexes", i);
+				return 19;
+			}
+		}
+
+		offset += surf->ofsEnd;
+	}
+
+	return 0;
+}
+
+static int check_md3_header(const md3Header_t *md3, int frame, const sink_t *sink)
+{
+	if (md3->ident != MD3_IDENT)
+	{
+		sink_log(sink, LOG_ERROR, "Not a valid MD3 file");
+		return 6;
+	}
+
+	if (md3->version > MD3_VERSION)
+	{
+		sink_log(sink, LOG_ERROR, "Unsupported MD3 version");
+		return 7;
+	}
+
+	if (md3->numFrames < 1)
+	{
+		sink_log(sink, LOG_ERROR, "MD3 has no frames");
+		return 8;
+	}
+
+	if (md3->numFrames <= frame)
+	{
+		sink_log(sink, LOG_ERROR, "Cannot extract frame #%d from a model that has %d frames",
+			frame, md3->numFrames);
+		return 9;
+	}
+
+	if (md3->numSurfaces < 1)
+	{
+		sink_log(sink, LOG_ERROR, "MD3 has no surfaces");
+		return 10;
+	}
+
+	return 0;
+}
+
+static int parse_md3(const char *in_name, const unsigned char *data, size_t size, int frame,
+	const sink_t *sink, md3_model_t *model)
+{
+	const md3Header_t *md3 = (const md3Header_t *)data;
+	double start;
+	int retcode;
+
+	memset(model, 0, sizeof(*model));
+
+	if (size < sizeof(md3Header_t))
+	{
+		sink_log(sink, LOG_ERROR, "Not a valid MD3 file");
+		return 6;
+	}
+
+	// everything past this point reads the file in native byte order
+	model->file = data;
+	if (HOST_BIG_ENDIAN)
+	{
+		if (!(model->native = malloc(size)))
+		{
+			sink_log(sink, LOG_ERROR, "Memory allocation failed");
+			return 11;
+		}
+		memcpy(model->native, data, size);
+		swap_md3(model->native, size);
+		data = model->native;
+		md3 = (const md3Header_t *)data;
+	}
+
+	// MD3 sanity checking
+	start = get_time();
+	if ((retcode = check_md3_header(md3, frame, sink)) == 0)
+		retcode = validate_md3(data, size, sink);
+	add_time(sink->stats, STAGE_VALIDATE, get_time() - start);
+	if (retcode != 0)
+	{
+		free(model->native);
+		memset(model, 0, sizeof(*model));
+		return retcode;
+	}
+
+	model->name = in_name;
+	model->buf = data;
+	model->size = size;
+	model->header = md3;
+
+	return 0;
+}
+
+int load_md3(const char *in_name, const unsigned char *data, size_t size, int frame,
+	const sink_t *sink, md3_model_t *model)
+{
+	double start = get_time();
+	int retcode;
+
+	retcode = parse_md3(in_name, data, size, frame, sink, model);
+	add_time(sink->stats, STAGE_LOAD, get_time() - start);
+	return retcode;
+}
+
+// Fetches the MD3 through the sink. A missing file is not logged, callers decide how bad that is.
+int read_md3(const char *path, int frame, const sink_t *sink, md3_model_t *model)
+{
+	const unsigned char *data;
+	size_t size;
+	double start;
+	int retcode;
+
+	memset(model, 0, sizeof(*model));
+	if (!sink->read)
+		return 3;
+	start = get_time();
+	retcode = sink->read(sink->context, path, &data, &size);
+	add_time(sink->stats, STAGE_LOAD, get_time() - start);
+	if (retcode != 0)
+		return retcode;
+	if ((retcode = load_md3(path, data, size, frame, sink, model)) != 0)
+	{
+		if (sink->release)
+			sink->release(sink->context, data);
+		return retcode;
+	}
+	model->owner = sink;
+	return 0;
+}
+
+void free_md3(md3_model_t *model)
+{
+	if (model->owner && model->owner->release)
+		model->owner->release(model->owner->context, model->file);
+	free(model->native);
+	memset(model, 0, sizeof(*model));
+}
+
+const md3Surface_t *first_md3_surface(const md3_model_t *model)
+{
+	return (const md3Surface_t *)(model->buf + model->header->ofsSurfaces);
+}
+
+const md3Surface_t *next_md3_surface(const md3Surface_t *surf)
+{
+	return (const md3Surface_t *)((const unsigned char *)surf + surf->ofsEnd);
+}
+
+const md3Tag_t *find_md3_tag(const md3_model_t *model, int frame, const char *name)
+{
+	const md3Tag_t *tag;
+	int i, num_tags = model->header->numTags;
+
+	tag = (const md3Tag_t *)(model->buf + model->header->ofsTags) + frame * num_tags;
+	for (i = 0; i < num_tags; ++i, ++tag)
+	{
+		if (!strcmp(tag->name, name))
+			return tag;
+	}
+	return NULL;
+}
+
+void tag_to_transform(const md3Tag_t *tag, float transform[3][4])
+{
+	int i, j;
+
+	for (i = 0; i < 3; ++i)
+	{
+		for (j = 0; j < 3; ++j)
+			transform[i][j] = tag->axis[j][i];
+		transform[i][3] = tag->origin[i];
+	}
+}
+
+void concat_transforms(const float a[3][4], const float b[3][4], float out[3][4])
+{
+	int i, j;
+
+	for (i = 0; i < 3; ++i)
+	{
+		for (j = 0; j < 4; ++j)
+		{
+			out[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j] + a[i][2] * b[2][j];
+		}
+		out[i][3] += a[i][3];
+	}
+}
+
+// Writes a transform given in MD3 space as a 3x4 row-major matrix in OBJ space.
+void write_obj_space_transform(output_t *out, const float transform[3][4])
+{
+	int i, j;
+
+	for (i = 0; i < 3; ++i)
+	{
+		for (j = 0; j < 3; ++j)
+			output_printf(out, " %f", transform[obj_axis[i]][obj_axis[j]]);
+		output_printf(out, " %f", transform[obj_axis[i]][3]);
+	}
+}
+
+// A surface's simplified triangles, and which of its vertices they still use.
+typedef struct
+{
+	int *order;					// original index of each remaining vertex
+	int num_verts;
+	int *indexes;				// into order
+	int num_indexes;
+} simplified_surface_t;
+
+static void free_simplified_surface(simplified_surface_t *simplified)
+{
+	free(simplified->order);
+	free(simplified->indexes);
+	memset(simplified, 0, sizeof(*simplified));
+}
+
+// Simplifies the surface as it stands in the given frame. Returns 0 or 11 if memory ran out.
+static int simplify_md3_surface(const md3Surface_t *surf, int frame, const simplify_t *params,
+	simplified_surface_t *simplified)
+{
+	const md3XyzNormal_t *vert = (const md3XyzNormal_t *)(((const unsigned char *)surf)
+		+ surf->ofsXyzNormals
+		+ frame * surf->numVerts * sizeof(*vert));
+	const md3St_t *st = (const md3St_t *)(((const unsigned char *)surf) + surf->ofsSt);
+	const md3Triangle_t *tri = (const md3Triangle_t *)(((const unsigned char *)surf) + surf->ofsTriangles);
+	float *xyz, *attributes;
+	int j, k, retcode = 11;
+
+	memset(simplified, 0, sizeof(*simplified));
+	xyz = malloc(max(surf->numVerts, 1) * 3 * sizeof(*xyz));
+	attributes = malloc(max(surf->numVerts, 1) * 3 * sizeof(*attributes));
+	simplified->indexes = malloc(max(surf->numTriangles, 1) * 3 * sizeof(*simplified->indexes));
+	simplified->order = malloc(max(surf->numVerts, 1) * sizeof(*simplified->order));
+	if (xyz && attributes && simplified->indexes && simplified->order)
+	{
+		for (j = 0; j < surf->numVerts; ++j)
+		{
+			for (k = 0; k < 3; ++k)
+				xyz[j * 3 + k] = (float)vert[j].xyz[k] * MD3_XYZ_SCALE;
+			// the packed normal is as good as the decoded one for telling seams apart
+			attributes[j * 3 + 0] = st[j].st[0];
+			attributes[j * 3 + 1] = st[j].st[1];
+			attributes[j * 3 + 2] = (float)vert[j].normal;
+		}
+		simplified->num_indexes = simplify_mesh(xyz, attributes, 3, surf->numVerts, tri->indexes,
+			surf->numTriangles * 3, params, simplified->indexes);
+		if (simplified->num_indexes >= 0)
+		{
+			simplified->num_verts = compact_mesh(simplified->indexes, simplified->num_indexes, surf->numVerts,
+				simplified->order);
+			if (simplified->num_verts >= 0)
+				retcode = 0;
+		}
+	}
+	free(xyz);
+	free(attributes);
+	if (retcode)
+		free_simplified_surface(simplified);
+	return retcode;
+}
+
+// Simplifies all surfaces in parallel. Returns NULL if memory ran out; the surfaces are then written as they are.
+static simplified_surface_t *simplify_md3_surfaces(const md3_model_t *model, int frame, const simplify_t *params,
+	stats_t *stats)
+{
+	const md3Surface_t **surfs;
+	simplified_surface_t *simplified;
+	int i, failed = 0, num_surfaces = model->header->numSurfaces;
+	double start = get_time();
+
+	surfs = malloc(max(num_surfaces, 1) * sizeof(*surfs));
+	simplified = calloc(max(num_surfaces, 1), sizeof(*simplified));
+	if (!surfs || !simplified)
+	{
+		free(surfs);
+		free(simplified);
+		return NULL;
+	}
+	for (i = 0, surfs[0] = first_md3_surface(model); i + 1 < num_surfaces; ++i)
+		surfs[i + 1] = next_md3_surface(surfs[i]);
+
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic) reduction(|:failed)
+#endif
+	for (i = 0; i < num_surfaces; ++i)
+	{
+		failed |= simplify_md3_surface(surfs[i], frame, params, &simplified[i]) != 0;
+	}
+
+	if (failed)
+	{
+		for (i = 0; i < num_surfaces; ++i)
+			free_simplified_surface(&simplified[i]);
+		free(simplified);
+		simplified = NULL;
+	}
+	free(surfs);
+	add_time(stats, STAGE_SIMPLIFY, get_time() - start);
+	return simplified;
+}
+
+// The shader a surface is drawn with: its first one, or for models skinned at run time, the surface's name.
+static const char *get_md3_material(const md3_model_t *model, const md3Surface_t *surf)
+{
+	const md3Shader_t *shader;
+	long long offset = (const unsigned char *)surf - model->buf;
+
+	// shaders aren't validated on load, nothing else reads them
+	if (surf->numShaders < 1 || (surf->ofsShaders & 3)
+		|| !check_range(offset + surf->ofsShaders, 1, sizeof(*shader), model->size))
+	{
+		return surf->name;
+	}
+	shader = (const md3Shader_t *)((const unsigned char *)surf + surf->ofsShaders);
+	if (!shader->name[0] || !memchr(shader->name, 0, sizeof(shader->name)))
+		return surf->name;
+	return shader->name;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Writes one material for every shader the models' surfaces use, sorted by name.
+static int write_md3_materials(const md3_model_t *models, int num_models, const shader_index_t *shaders,
+	const char *mtl_name, const sink_t *sink)
+{
+	const md3Surface_t *surf;
+	const char **names;
+	output_t out;
+	int num_names = 0, retcode, i, j;
+
+	for (i = 0; i < num_models; ++i)
+		num_names += models[i].header->numSurfaces;
+	if (!(names = malloc(max(num_names, 1) * sizeof(*names))))
+	{
+		sink_log(sink, LOG_ERROR, "Memory allocation failed");
+		return 11;
+	}
+	for (i = 0, num_names = 0; i < num_models; ++i)
+	{
+		for (j = 0, surf = first_md3_surface(&models[i]); j < models[i].header->numSurfaces;
+			++j, surf = next_md3_surface(surf))
+		{
+			names[num_names++] = get_md3_material(&models[i], surf);
+		}
+	}
+	qsort(names, num_names, sizeof(*names), compare_names);
+
+	if ((retcode = open_output(&out, sink, mtl_name)) == 0)
+	{
+		output_printf(&out, "# generated by md3bsp2ase from %s\n", models[0].name);
+		for (i = 0; i < num_names; ++i)
+		{
+			if (!i || strcmp(names[i], names[i - 1]))
+				write_mtl_material(&out, shaders, names[i]);
+		}
+		retcode = close_output(&out);
+	}
+	free(names);
+	return retcode;
+}
+
+int write_md3_obj(const md3_model_t *model, output_t *out, int frame, const float transform[3][4],
+	const char *prefix, int vert_index_cum, const simplify_t *simplify, int materials)
+{
+	const md3Surface_t *surf;
+	const md3XyzNormal_t *verts, *vert;
+	const md3St_t *st;
+	const int *tri;
+	simplified_surface_t *simplified = NULL;
+	double p[3], n[3], start;
+	int i, j, k, num_verts, num_indexes;
+
+	if (simplify && simplify->enabled && !(simplified = simplify_md3_surfaces(model, frame, simplify, out->sink->stats)))
+		sink_log(out->sink, LOG_WARNING, "WARNING: out of memory simplifying %s, writing it as it is", model->name);
+	start = get_time();
+
+	// geometry - iterate over all the MD3 surfaces
+	for (i = 0, surf = first_md3_surface(model);
+		i < model->header->numSurfaces;
+		++i, surf = next_md3_surface(surf))
+	{
+		num_verts = simplified ? simplified[i].num_verts : surf->numVerts;
+		num_indexes = simplified ? simplified[i].num_indexes : surf->numTriangles * 3;
+
+		sink_log(out->sink, LOG_VERBOSE, "Processing surface #%d, \"%s\": %d vertices, %d triangles",
+			i, surf->name, num_verts,
+			num_indexes / 3);
+
+		// start a group
+		output_printf(out, "\n# surface #%d\n", i);
+		if (materials)
+			output_printf(out, "usemtl %s\n", get_md3_material(model, surf));
+		output_printf(out,
+			"g %s%s\n"
+			"o %s%s\n"
+			"\n",
+				prefix, surf->name, prefix, surf->name);
+
+		// output the vertex list
+		verts = (const md3XyzNormal_t *)(((const unsigned char *)surf)
+			+ surf->ofsXyzNormals
+			+ frame * surf->numVerts * sizeof(*verts));
+		for (j = 0; j < num_verts; ++j)
+		{
+			vert = verts + (simplified ? simplified[i].order[j] : j);
+			for (k = 0; k < 3; ++k)
+				p[k] = (float)vert->xyz[k] * MD3_XYZ_SCALE;
+			if (transform)
+			{
+				for (k = 0; k < 3; ++k)
+				{
+					n[k] = transform[k][0] * p[0] + transform[k][1] * p[1]
+						+ transform[k][2] * p[2] + transform[k][3];
+				}
+				VectorCopy(n, p);
+			}
+			output_printf(out,
+				"v %f %f %f\n",
+					p[0], p[2], p[1]);
+		}
+
+		output_printf(out, "\n");
+
+		// output the texture vertex list
+		for (j = 0; j < num_verts; ++j)
+		{
+			st = (const md3St_t *)(((const unsigned char *)surf)
+				+ surf->ofsSt) + (simplified ? simplified[i].order[j] : j);
+			output_printf(out,
+				"vt %f %f\n", st->st[0], 1.f - st->st[1]);
+		}
+
+		output_printf(out, "\n");
+
+		// output the normals
+		for (j = 0; j < num_verts; ++j)
+		{
+			float lat, lng;
+			vert = verts + (simplified ? simplified[i].order[j] : j);
+			// a step is 1/256th of a turn, as in the engine
+			lat = ((vert->normal >> 8) & 0xFF) * ((float)M_PI * 2.f / 256.f);
+			lng = (vert->normal & 0xFF) * ((float)M_PI * 2.f / 256.f);
+			// decode X as cos( lat ) * sin( long )
+			// decode Y as sin( lat ) * sin( long )
+			// decode Z as cos( long )
+			n[0] = cos(lat) * sin(lng);
+			n[1] = sin(lat) * sin(lng);
+			n[2] = cos(lng);
+			if (transform)
+			{
+				for (k = 0; k < 3; ++k)
+				{
+					p[k] = transform[k][0] * n[0] + transform[k][1] * n[1]
+						+ transform[k][2] * n[2];
+				}
+				VectorCopy(p, n);
+			}
+			// swap Y with Z for Blender
+			output_printf(out,
+				"vn %f %f %f\n",
+					n[0], n[2], n[1]);
+		}
+
+		output_printf(out,
+			"\n"
+			"s 1\n");
+
+		// output the triangle list
+		tri = simplified ? simplified[i].indexes
+			: ((const md3Triangle_t *)(((const unsigned char *)surf) + surf->ofsTriangles))->indexes;
+		for (j = 0; j < num_indexes; j += 3, tri += 3)
+		{
+			output_printf(out,
+				"f %d/%d/%d %d/%d/%d %d/%d/%d\n",
+					1 + tri[0] + vert_index_cum,
+					1 + tri[0] + vert_index_cum,
+					1 + tri[0] + vert_index_cum,
+					1 + tri[1] + vert_index_cum,
+					1 + tri[1] + vert_index_cum,
+					1 + tri[1] + vert_index_cum,
+					1 + tri[2] + vert_index_cum,
+					1 + tri[2] + vert_index_cum,
+					1 + tri[2] + vert_index_cum);
+		}
+
+		// Keep track of cumulative vertex index so that multiple surfaces in the same file may coexist.
+		vert_index_cum += num_verts;
+		add_count(out->sink->stats, COUNT_SURFACES, 1);
+		add_count(out->sink->stats, COUNT_VERTICES, num_verts);
+		add_count(out->sink->stats, COUNT_TRIANGLES, num_indexes / 3);
+		if (simplified)
+			free_simplified_surface(&simplified[i]);
+	}
+	free(simplified);
+
+	// includes whatever writes the output's buffer had to flush meanwhile
+	add_time(out->sink->stats, STAGE_FORMAT, get_time() - start);
+	return vert_index_cum;
+}
+
+static void print_md3_stats(const md3_model_t *model, const sink_t *sink)
+{
+	sink_log(sink, LOG_INFO, "MD3 stats:\n"
+		"%d surfaces\n"
+		"%d tags\n"
+		"%d frames",
+		model->header->numSurfaces, model->header->numTags,
+		model->header->numFrames);
+}
+
+// The material library of an output: <name>.mtl next to <name>.obj, materials.mtl for the primary output.
+static void get_mtl_name(const char *out_name, char *mtl_name)
+{
+	char *p;
+
+	if (!out_name)
+	{
+		strcpy(mtl_name, "materials.mtl");
+		return;
+	}
+	strcpy(mtl_name, out_name);
+	if ((p = strrchr(mtl_name, '.')) != NULL && !strchr(p, '/'))
+		*p = 0;
+	strcat(mtl_name, ".mtl");
+}
+
+// Writes a single MD3 to its own output; name is NULL for the sink's primary output, options may be NULL.
+int convert_md3_to_obj(const md3_model_t *model, int frame, const char *out_name, const options_t *options,
+	const sink_t *sink)
+{
+	output_t out;
+	char *mtl_name = NULL;
+	int materials = options && options->materials, retcode;
+
+	print_md3_stats(model, sink);
+
+	if (materials)
+	{
+		if (!(mtl_name = malloc((out_name ? strlen(out_name) : 0) + 16)))
+		{
+			sink_log(sink, LOG_ERROR, "Memory allocation failed");
+			return 11;
+		}
+		get_mtl_name(out_name, mtl_name);
+		if ((retcode = write_md3_materials(model, 1, options->shaders, mtl_name, sink)) != 0)
+		{
+			free(mtl_name);
+			return retcode;
+		}
+	}
+
+	if ((retcode = open_output(&out, sink, out_name)) == 0)
+	{
+		// begin OBJ data
+		output_printf(&out,
+			"# generated by md3bsp2ase from %s\n", model->name);
+		if (materials)
+			write_mtllib(&out, sink, mtl_name);
+
+		write_md3_obj(model, &out, frame, NULL, "", 0, options ? &options->simplify : NULL, materials);
+
+		retcode = close_output(&out);
+	}
+	free(mtl_name);
+	return retcode;
+}
+
+// Writes every tag of every frame, in OBJ space, followed by how each part hangs off its parent.
+static int write_md3_tags(const md3_model_t *parts, const int *parents, const char **parent_tags,
+	float (*transforms)[3][4], int num_parts, const sink_t *sink)
+{
+	const md3Tag_t *tag;
+	float transform[3][4];
+	output_t out;
+	int i, frame, t, retcode;
+
+	if ((retcode = open_output(&out, sink, "tags.txt")) != 0)
+		return retcode;
+
+	output_printf(&out,
+		"# generated by md3bsp2ase\n"
+		"# tag <part> <frame> <name> <3x4 row-major transform in the part's OBJ space>\n"
+		"# part <index> <MD3 path> <parent index or -1> <parent tag> <3x4 row-major transform to the root's OBJ space>\n");
+
+	for (i = 0; i < num_parts; ++i)
+	{
+		output_printf(&out, "\n");
+		for (frame = 0; frame < parts[i].header->numFrames; ++frame)
+		{
+			tag = (const md3Tag_t *)(parts[i].buf + parts[i].header->ofsTags)
+				+ frame * parts[i].header->numTags;
+			for (t = 0; t < parts[i].header->numTags; ++t, ++tag)
+			{
+				tag_to_transform(tag, transform);
+				output_printf(&out, "tag %d %d %s", i, frame, tag->name);
+				write_obj_space_transform(&out, transform);
+				output_printf(&out, "\n");
+			}
+		}
+	}
+
+	output_printf(&out, "\n");
+	for (i = 0; i < num_parts; ++i)
+	{
+		output_printf(&out, "part %d %s %d %s", i, parts[i].name, parents[i], parents[i] < 0 ? "-" : parent_tags[i]);
+		write_obj_space_transform(&out, transforms[i]);
+		output_printf(&out, "\n");
+	}
+
+	return close_output(&out);
+}
+
+int convert_md3_parts_to_obj(const md3_model_t *model, int frame, const options_t *options,
+	const sink_t *sink)
+{
+	md3_model_t parts[1 + MAX_MD3_ATTACHMENTS];
+	float transforms[1 + MAX_MD3_ATTACHMENTS][3][4], tag_transform[3][4];
+	int parents[1 + MAX_MD3_ATTACHMENTS], frames[1 + MAX_MD3_ATTACHMENTS];
+	const char *parent_tags[1 + MAX_MD3_ATTACHMENTS];
+	const md3Tag_t *tag;
+	char prefix[MAX_QPATH + 2];
+	output_t out;
+	int num_parts, vert_index_cum, retcode = 0, closed, i, j;
+
+	// the root part belongs to the caller, the copy doesn't own it
+	parts[0] = *model;
+	parts[0].owner = NULL;
+	parts[0].native = NULL;
+	print_md3_stats(&parts[0], sink);
+	memset(transforms[0], 0, sizeof(transforms[0]));
+	transforms[0][0][0] = transforms[0][1][1] = transforms[0][2][2] = 1.f;
+	parents[0] = -1;
+	parent_tags[0] = NULL;
+	frames[0] = frame;
+	num_parts = 1;
+
+	// all the parts are parsed once up front, then attached to whichever earlier part carries the tag
+	for (i = 0; i < options->num_md3_attachments; ++i)
+	{
+		md3_model_t *part = &parts[num_parts];
+
+		retcode = read_md3(options->md3_attachments[i].path, 0, sink, part);
+		if (retcode == 3 || retcode == 11 || retcode == 12)
+			sink_log(sink, LOG_ERROR, "Failed to read file %s", options->md3_attachments[i].path);
+		if (retcode)
+			break;
+		print_md3_stats(part, sink);
+
+		// parts animate independently, so clamp the frame to what this one has
+		frames[num_parts] = min(frame, part->header->numFrames - 1);
+
+		for (j = 0, tag = NULL; j < num_parts && !tag; ++j)
+			tag = find_md3_tag(&parts[j], frames[j], options->md3_attachments[i].tag);
+		if (!tag)
+		{
+			sink_log(sink, LOG_ERROR, "No part has tag %s to attach %s to",
+				options->md3_attachments[i].tag, options->md3_attachments[i].path);
+			free_md3(part);
+			retcode = 15;
+			break;
+		}
+		--j;
+
+		tag_to_transform(tag, tag_transform);
+		concat_transforms(transforms[j], tag_transform, transforms[num_parts]);
+		parents[num_parts] = j;
+		parent_tags[num_parts] = options->md3_attachments[i].tag;
+		++num_parts;
+	}
+
+	if (!retcode && options->materials)
+		retcode = write_md3_materials(parts, num_parts, options->shaders, "materials.mtl", sink);
+
+	if (!retcode && (retcode = open_output(&out, sink, NULL)) == 0)
+	{
+		// begin OBJ data
+		output_printf(&out,
+			"# generated by md3bsp2ase from %s\n", model->name);
+		for (i = 1; i < num_parts; ++i)
+			output_printf(&out, "# attached %s to %s\n", parts[i].name, parent_tags[i]);
+		if (options->materials)
+			write_mtllib(&out, sink, "materials.mtl");
+
+		for (i = 0, vert_index_cum = 0; i < num_parts; ++i)
+		{
+			if (num_parts > 1)
+				sprintf(prefix, "part%d_", i);
+			else
+				prefix[0] = 0;
+			vert_index_cum = write_md3_obj(&parts[i], &out, frames[i], i ? transforms[i] : NULL,
+				prefix, vert_index_cum, &options->simplify, options->materials);
+		}
+
+		retcode = close_output(&out);
+
+		if (options->md3_tags)
+		{
+			closed = write_md3_tags(parts, parents, parent_tags, transforms, num_parts, sink);
+			retcode = retcode ? retcode : closed;
+		}
+	}
+
+	for (i = 1; i < num_parts; ++i)
+		free_md3(&parts[i]);
+
+	return retcode;
+}
+
+// Strips ".md3" and a trailing "_N" LOD suffix, so that any LOD of the model may be passed in. The suffix
+// stays unless <base>.md3 is there, as in a model that is just named "_1"; path is room for the probe.
+static void get_lod_base_name(const char *in_name, char *base, char *path, const sink_t *sink)
+{
+	const unsigned char *data;
+	size_t size;
+	char *p;
+	int len, retcode;
+
+	strcpy(base, in_name);
+	if ((p = strrchr(base, '.')) != NULL)
+		*p = 0;
+	len = (int)strlen(base);
+	if (len <= 2 || base[len - 2] != '_' || base[len - 1] < '1' || base[len - 1] >= '0' + MD3_MAX_LODS)
+		return;
+	sprintf(path, "%.*s.md3", len - 2, base);
+	if (!sink->read || (retcode = sink->read(sink->context, path, &data, &size)) == 3)
+		return;
+	if (!retcode && sink->release)
+		sink->release(sink->context, data);
+	base[len - 2] = 0;
+}
+
+int convert_md3_lods_to_obj(const char *in_name, int frame, const options_t *options, const sink_t *sink)
+{
+	md3_model_t lods[MD3_MAX_LODS];
+	const md3Surface_t *surf, *surf0;
+	char *base, *paths[MD3_MAX_LODS];
+	output_t out;
+	int retcodes[MD3_MAX_LODS], num_lods, vert_index_cum, retcode = 0, i, j;
+
+	base = malloc(strlen(in_name) + 1);
+	for (i = 0, j = !base; i < MD3_MAX_LODS; ++i)
+	{
+		paths[i] = malloc(strlen(in_name) + 8);
+		j |= !paths[i];
+	}
+	if (j)
+	{
+		sink_log(sink, LOG_ERROR, "Memory allocation failed");
+		for (i = 0; i < MD3_MAX_LODS; ++i)
+			free(paths[i]);
+		free(base);
+		return 11;
+	}
+
+	get_lod_base_name(in_name, base, paths[0], sink);
+	sprintf(paths[0], "%s.md3", base);
+	for (i = 1; i < MD3_MAX_LODS; ++i)
+		sprintf(paths[i], "%s_%d.md3", base, i);
+
+	// the LODs are independent files, fetch and parse them concurrently
+#ifdef _OPENMP
+	#pragma omp parallel for
+#endif
+	for (i = 0; i < MD3_MAX_LODS; ++i)
+		retcodes[i] = read_md3(paths[i], frame, sink, &lods[i]);
+
+	// the chain ends at the first missing LOD; one that is there but doesn't load fails the export
+	for (num_lods = 0; num_lods < MD3_MAX_LODS && !retcodes[num_lods]; ++num_lods)
+		;
+	if (!num_lods || (num_lods < MD3_MAX_LODS && retcodes[num_lods] != 3))
+	{
+		sink_log(sink, LOG_ERROR, "Failed to load LOD %d from %s", num_lods, paths[num_lods]);
+		retcode = retcodes[num_lods];
+	}
+
+	// every LOD must provide the same surfaces, in the same order
+	for (i = 1; i < num_lods && !retcode; ++i)
+	{
+		if (lods[i].header->numSurfaces != lods[0].header->numSurfaces)
+		{
+			sink_log(sink, LOG_ERROR, "LOD %d has %d surfaces, LOD 0 has %d", i,
+				lods[i].header->numSurfaces, lods[0].header->numSurfaces);
+			retcode = 17;
+			break;
+		}
+		for (j = 0, surf = first_md3_surface(&lods[i]), surf0 = first_md3_surface(&lods[0]);
+			j < lods[0].header->numSurfaces;
+			++j, surf = next_md3_surface(surf), surf0 = next_md3_surface(surf0))
+		{
+			if (strcmp(surf->name, surf0->name))
+			{
+				sink_log(sink, LOG_ERROR, "LOD %d surface #%d is \"%s\", LOD 0 has \"%s\"",
+					i, j, surf->name, surf0->name);
+				retcode = 17;
+				break;
+			}
+		}
+	}
+
+	if (!retcode && options->materials)
+		retcode = write_md3_materials(lods, num_lods, options->shaders, "materials.mtl", sink);
+
+	if (!retcode && (retcode = open_output(&out, sink, NULL)) == 0)
+	{
+		output_printf(&out,
+			"# generated by md3bsp2ase from %s\n", in_name);
+		for (i = 0; i < num_lods; ++i)
+			output_printf(&out, "# LOD %d: %s\n", i, paths[i]);
+		if (options->materials)
+			write_mtllib(&out, sink, "materials.mtl");
+
+		for (i = 0, vert_index_cum = 0; i < num_lods; ++i)
+		{
+			char prefix[16];
+			sink_log(sink, LOG_INFO, "LOD %d:", i);
+			print_md3_stats(&lods[i], sink);
+			sprintf(prefix, "LOD%d_", i);
+			// the LODs are already authored, leave them be
+			vert_index_cum = write_md3_obj(&lods[i], &out, frame, NULL, prefix, vert_index_cum, NULL,
+				options->materials);
+		}
+
+		retcode = close_output(&out);
+	}
+
+	for (i = 0; i < MD3_MAX_LODS; ++i)
+	{
+		if (!retcodes[i])
+			free_md3(&lods[i]);
+		free(paths[i]);
+	}
+	free(base);
+
+	return retcode;
+}
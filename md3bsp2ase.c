@@ -6,7 +6,6 @@ The code in this file is placed in the public domain.
 
 #ifdef _MSC_VER
 	#define _CRT_SECURE_NO_WARNINGS
-	#define strcasecmp	_stricmp
 #endif
 
 #include <stdio.h>
@@ -20,26 +19,7 @@ The code in this file is placed in the public domain.
 
 #include "md3bsp2ase.h"
 
-#ifndef BYTE_ORDER
-	#if !defined(LITTLE_ENDIAN) && !defined(BIG_ENDIAN)
-		#define LITTLE_ENDIAN	1
-		#define BIG_ENDIAN		2
-	#endif
-
-	// if not provided by system headers, you should #define byte order here
-	#define BYTE_ORDER			LITTLE_ENDIAN
-#endif // BYTE ORDER
-
-#if BYTE_ORDER == BIG_ENDIAN
-	#define little_short(x)		((((x) << 8) & 0xFF00) | (((x) >> 8) & 0x00FF))
-	#define little_long(x)		((((x) << 24) & 0xFF000000)			\
-									| (((x) << 8) & 0x00FF0000)		\
-									| (((x) >> 8) & 0x0000FF00)		\
-									| (((x) >> 24) & 0x000000FF))
-#else
-	#define little_short
-	#define little_long
-#endif // BIG_ENDIAN
+#define PATCH_SUBDIVISIONS	20		// TODO: Variable LOD. ET values are 4, 12 and 20 for high, medium & low, respectively. Promote to commandline switches or to LOD meshes.
 
 float normalize_vector(const vec3_t in, vec3_t out)
 {
@@ -80,576 +60,1189 @@ const char *get_bsp_surface_type(mapSurfaceType_t t)
 	}
 }
 
-int convert_bsp_to_obj(const char *in_name, FILE *in, char *out_name)
+int check_range(long long offset, long long count, size_t elem_size, size_t total)
 {
-	dheader_t *bsp;
-	dmodel_t *model;
-	dsurface_t *surf;
-	dshader_t *shader;
-	drawVert_t *vert;
-	int *tri;
-	int model_index, surf_index, surf_index_actual, vert_index, vert_index_cum, tri_index;
-	int count, vert_count, tri_count;
-	unsigned char *buf;
-	char *out_name_buf, *p;
-	size_t out_name_buf_len;
-	char format_buf[20];
-	FILE *out;
-	// TODO: Promote these to command-line switches.
-	const int split_models = 0;
-	const int skip_planar = 0;
-	const int skip_tris = 0;
-	const int skip_patches = 0;		// WIP
-	const int skip_collision = 1;	// TODO
+	if (offset < 0 || count < 0 || (unsigned long long)offset > total)
+		return 0;
+	return (unsigned long long)count <= (total - (size_t)offset) / elem_size;
+}
+
+// Checks that the indexes of a surface only reference its own vertices.
+static int check_indexes(const int *indexes, int count, int num_verts)
+{
+	int i;
 
-	// load the file contents into a buffer
-	fseek(in, 0, SEEK_END);
-	count = ftell(in);
-	fseek(in, 0, SEEK_SET);
-	buf = malloc(count);
-	if (!buf)
+	for (i = 0; i < count; ++i)
 	{
-		printf("Memory allocation failed\n");
-		return 11;
+		if ((unsigned int)indexes[i] >= (unsigned int)num_verts)
+			return 0;
 	}
-	if (fread(buf, 1, count, in) != (size_t)count)
-	{
-		printf("Failed to read file (%d bytes) into buffer\n", count);
-		return 12;
-	}
-
-	// allocate a string buffer large enough to hold the filename extended by
-	// the maximum model index
-	// max length of model index
-	model_index = 1 + (int)floorf(log10f(MAX_MAP_MODELS));
-	// max length of surface index
-	surf_index = 1 + (int)floorf(log10f(10240));
-	out_name_buf_len = strlen(out_name) + 1 + model_index + 1 + surf_index + 4 + 1;
-	out_name_buf = malloc(out_name_buf_len);
-	// MSVC is retarded and disallows just #defining snprintf.
-#if _MSC_VER
-	_snprintf
-#else
-	snprintf
-#endif
-		(format_buf, sizeof(format_buf),
-			split_models ? "%%s_%%0%dd_%%0%dd.obj\x00" : "%%s_%%0%dd.obj\x00",
-			model_index, surf_index);
-	// find and cut the extension off
-	if ((p = strrchr(out_name, '.')) != NULL)
-		*p = 0;
+	return 1;
+}
 
-	// BSP sanity checking
-	bsp = (dheader_t *)buf;
+/*
+Proves that everything the exporters dereference lies within the buffer:
+lumps, model, brush and surface ranges, shader and plane numbers, and every
+draw index. Past this point, none of the conversion loops check anything.
+*/
+static int validate_bsp(const bsp_t *bsp, const sink_t *sink)
+{
+	const lump_t *lumps = bsp->header->lumps;
+	const dshader_t *shaders;
+	const dmodel_t *models;
+	const dbrush_t *brushes;
+	const dbrushside_t *sides;
+	const dsurface_t *surfs;
+	const int *indexes;
+	int num_shaders, num_planes, num_models, num_brushes, num_sides, num_surfs, num_verts, num_indexes;
+	int i, type, width, height, limit;
+
+	for (i = 0; i < HEADER_LUMPS; ++i)
+	{
+		// everything but the entity string is made of 4-byte fields
+		if (!check_range(lumps[i].fileofs, lumps[i].filelen, 1, bsp->size)
+			|| (i != LUMP_ENTITIES && (lumps[i].fileofs & 3)))
+		{
+			sink_log(sink, LOG_ERROR, "Corrupt BSP: lump #%d is out of bounds", i);
+			return 19;
+		}
+	}
 
-	if (little_long(bsp->ident != BSP_IDENT))
+	num_shaders = lumps[LUMP_SHADERS].filelen / (int)sizeof(dshader_t);
+	num_planes = lumps[LUMP_PLANES].filelen / (int)sizeof(dplane_t);
+	num_models = lumps[LUMP_MODELS].filelen / (int)sizeof(dmodel_t);
+	num_brushes = lumps[LUMP_BRUSHES].filelen / (int)sizeof(dbrush_t);
+	num_sides = lumps[LUMP_BRUSHSIDES].filelen / (int)sizeof(dbrushside_t);
+	num_surfs = lumps[LUMP_SURFACES].filelen / (int)sizeof(dsurface_t);
+	num_verts = lumps[LUMP_DRAWVERTS].filelen / (int)sizeof(drawVert_t);
+	num_indexes = lumps[LUMP_DRAWINDEXES].filelen / (int)sizeof(int);
+
+	shaders = (const dshader_t *)(bsp->buf + lumps[LUMP_SHADERS].fileofs);
+	models = (const dmodel_t *)(bsp->buf + lumps[LUMP_MODELS].fileofs);
+	brushes = (const dbrush_t *)(bsp->buf + lumps[LUMP_BRUSHES].fileofs);
+	sides = (const dbrushside_t *)(bsp->buf + lumps[LUMP_BRUSHSIDES].fileofs);
+	surfs = (const dsurface_t *)(bsp->buf + lumps[LUMP_SURFACES].fileofs);
+	indexes = (const int *)(bsp->buf + lumps[LUMP_DRAWINDEXES].fileofs);
+
+	// shader names are printed as C strings
+	for (i = 0; i < num_shaders; ++i)
 	{
-		printf("Not a valid BSP file\n");
-		return 13;
+		if (!memchr(shaders[i].shader, 0, sizeof(shaders[i].shader)))
+		{
+			sink_log(sink, LOG_ERROR, "Corrupt BSP: shader #%d has an unterminated name", i);
+			return 19;
+		}
 	}
 
-	if (little_long(bsp->version != BSP_VERSION))
+	for (i = 0; i < num_models; ++i)
 	{
-		printf("Unsupported BSP version\n");
-		return 14;
+		if (!check_range(models[i].firstSurface, models[i].numSurfaces, 1, num_surfs)
+			|| !check_range(models[i].firstBrush, models[i].numBrushes, 1, num_brushes))
+		{
+			sink_log(sink, LOG_ERROR, "Corrupt BSP: model #%d references missing surfaces or brushes", i);
+			return 19;
+		}
 	}
 
-	// iterate over all the models
-	for (model_index = 0, model = (dmodel_t *)(buf
-		+ little_long(bsp->lumps[LUMP_MODELS].fileofs));
-		model_index < little_long(bsp->lumps[LUMP_MODELS].filelen)
-		/ (int)sizeof(dmodel_t);
-		++model_index, ++model)
+	for (i = 0; i < num_brushes; ++i)
 	{
+		if ((unsigned int)brushes[i].shaderNum >= (unsigned int)num_shaders
+			|| !check_range(brushes[i].firstSide, brushes[i].numSides, 1, num_sides))
+		{
+			sink_log(sink, LOG_ERROR, "Corrupt BSP: brush #%d references missing sides or shaders", i);
+			return 19;
+		}
+	}
 
-		if (little_long(model->numSurfaces) < 1
-			&& (skip_collision || little_long(model->numBrushes) < 1))
+	for (i = 0; i < num_sides; ++i)
+	{
+		if ((unsigned int)sides[i].planeNum >= (unsigned int)num_planes)
 		{
-			continue;
+			sink_log(sink, LOG_ERROR, "Corrupt BSP: brush side #%d references a missing plane", i);
+			return 19;
 		}
+	}
 
-		// count exportable surfaces
-		for (surf_index = 0, count = 0, surf = (dsurface_t *)(buf
-			+ little_long(bsp->lumps[LUMP_SURFACES].fileofs)
-			+ little_long(model->firstSurface) * sizeof(dsurface_t));
-			surf_index < little_long(model->numSurfaces);
-			++surf_index, ++surf)
+	for (i = 0; i < num_surfs; ++i)
+	{
+		type = surfs[i].surfaceType;
+		if ((unsigned int)surfs[i].shaderNum >= (unsigned int)num_shaders)
+		{
+			sink_log(sink, LOG_ERROR, "Corrupt BSP: surface #%d references a missing shader", i);
+			return 19;
+		}
+		// flares and unknown types carry no geometry we would read
+		if (type != MST_PLANAR && type != MST_TRIANGLE_SOUP && type != MST_PATCH && type != MST_FOLIAGE)
+			continue;
+		if (!check_range(surfs[i].firstVert, surfs[i].numVerts, 1, num_verts)
+			|| !check_range(surfs[i].firstIndex, surfs[i].numIndexes, 1, num_indexes))
+		{
+			sink_log(sink, LOG_ERROR, "Corrupt BSP: surface #%d references missing vertices or indexes", i);
+			return 19;
+		}
+		if (type == MST_PATCH)
 		{
-			if ((skip_planar && little_long(surf->surfaceType) == MST_PLANAR)
-				|| (skip_tris && little_long(surf->surfaceType) == MST_TRIANGLE_SOUP)
-				|| (skip_patches && little_long(surf->surfaceType) == MST_PATCH))
+			width = surfs[i].patchWidth;
+			height = surfs[i].patchHeight;
+			if (width < 3 || height < 3 || width > MAX_PATCH_SIZE || height > MAX_PATCH_SIZE
+				|| width * height > surfs[i].numVerts)
 			{
-				continue;
+				sink_log(sink, LOG_ERROR, "Corrupt BSP: patch surface #%d has a bad %d x %d control grid", i,
+					width, height);
+				return 19;
 			}
-			else if (little_long(surf->surfaceType) != MST_PLANAR
-				&& little_long(surf->surfaceType) != MST_TRIANGLE_SOUP
-				&& little_long(surf->surfaceType) != MST_PATCH)
+		}
+		else
+		{
+			// foliage indexes may only reference the mesh, not the trailing instance origins
+			limit = surfs[i].numVerts;
+			if (type == MST_FOLIAGE && surfs[i].patchHeight >= 3
+				&& surfs[i].patchHeight < limit)
 			{
-				static char warned[1 << (sizeof(char) * 8)] = { 0 };
-				if (surf->surfaceType > sizeof(warned) || !warned[surf->surfaceType])
-				{
-					warned[surf->surfaceType] = 1;
-					printf("WARNING: cannot handle %s surfaces yet, skipping\n",
-						get_bsp_surface_type(little_long(surf->surfaceType)));
-				}
-				continue;
+				limit = surfs[i].patchHeight;
 			}
-			++count;
+			if (check_indexes(indexes + surfs[i].firstIndex, surfs[i].numIndexes, limit))
+				continue;
+			sink_log(sink, LOG_ERROR, "Corrupt BSP: surface #%d has out of range indexes", i);
+			return 19;
 		}
+	}
+
+	return 0;
+}
 
-		// apparently there's nothing to export, get rid of the file
-		if (count == 0)
+// Upper bound on the grid lines R_SubdividePatchToGrid ends up with along one direction of the control
+// grid. A quadratic segment's midpoint strays from its chord by at most |p0 - 2 p1 + p2| / 4, and every
+// subdivision quarters that, which is what the game's loop keeps checking against the subdivision limit.
+static int estimate_patch_lines(const drawVert_t *ctrl, int count, int across, int stride, int across_stride)
+{
+	const drawVert_t *p;
+	float max_dev, dev;
+	vec3_t d;
+	int lines = 1, levels, i, j, k;
+
+	for (i = 0; i + 2 < count; i += 2)
+	{
+		max_dev = 0.f;
+		for (j = 0; j < across; ++j)
 		{
-			fclose(out);
-			//printf("\tNo exportable surfaces, skipping\n");
+			p = ctrl + i * stride + j * across_stride;
+			for (k = 0; k < 3; ++k)
+				d[k] = (p[0].xyz[k] - 2.f * p[stride].xyz[k] + p[2 * stride].xyz[k]) * 0.25f;
+			dev = VectorLength(d);
+			max_dev = max(max_dev, dev);
+		}
+		// collinear segments lose their middle line
+		if (max_dev < 0.1f)
+		{
+			++lines;
 			continue;
 		}
+		// the grid tops out long before 8 levels, which also stops garbage control points from looping forever
+		for (levels = 0; max_dev > PATCH_SUBDIVISIONS && levels < 8; max_dev *= 0.25f)
+			++levels;
+		lines += 2 << levels;
+	}
 
-		printf("Processing model #%d: %d exportable surfaces\n", model_index, count);
+	return min(lines, MAX_GRID_SIZE);
+}
 
-		if (!split_models)
-		{
-			// Start the output.
-			snprintf(out_name_buf, out_name_buf_len, format_buf, out_name, model_index);
-			out = fopen(out_name_buf, "w");
+// Fills in a surface's index entry; flags, counts and bounds are derived once, here.
+static void classify_bsp_surface(const bsp_t *bsp, const dsurface_t *surf, bsp_surface_info_t *info)
+{
+	// TODO: Promote these to command-line switches.
+	const int skip_planar = 0;
+	const int skip_tris = 0;
+	const int skip_patches = 0;		// WIP
+	int width, height;
+
+	info->surf = surf;
+	info->shader = get_bsp_shader(bsp, surf->shaderNum);
+	info->type = surf->surfaceType;
+	info->surface_flags = info->shader->surfaceFlags;
+	info->content_flags = info->shader->contentFlags;
+	info->first_vert = surf->firstVert;
+	info->num_verts = surf->numVerts;
+	info->first_index = surf->firstIndex;
+	info->num_indexes = surf->numIndexes / 3 * 3;
+	info->out_verts = info->num_verts;
+	info->out_indexes = info->num_indexes;
+
+	switch (info->type)
+	{
+		case MST_PLANAR:
+		case MST_TRIANGLE_SOUP:
+		case MST_PATCH:
+			if ((skip_planar && info->type == MST_PLANAR)
+				|| (skip_tris && info->type == MST_TRIANGLE_SOUP)
+				|| (skip_patches && info->type == MST_PATCH)
+				// Skip non-drawable surfaces (i.e. collision), brushes cover those.
+				|| (info->surface_flags & SURF_NODRAW))
+			{
+				info->kind = SURFACE_SKIP;
+			}
+			else
+			{
+				info->kind = SURFACE_MESH;
+			}
+			break;
+		// foliage and flares are instanced rather than baked into the model's OBJ
+		case MST_FOLIAGE:
+			info->kind = SURFACE_FOLIAGE;
+			break;
+		case MST_FLARE:
+			info->kind = SURFACE_FLARE;
+			break;
+		default:
+			info->kind = SURFACE_UNKNOWN;
+			break;
+	}
+
+	if (info->type == MST_PATCH)
+	{
+		const drawVert_t *ctrl = (const drawVert_t *)(bsp->buf
+			+ bsp->header->lumps[LUMP_DRAWVERTS].fileofs) + info->first_vert;
+		int patch_width = surf->patchWidth, patch_height = surf->patchHeight;
+
+		width = estimate_patch_lines(ctrl, patch_width, patch_height, 1, patch_width);
+		height = estimate_patch_lines(ctrl, patch_height, patch_width, patch_width, 1);
+		info->out_verts = width * height;
+		info->out_indexes = (width - 1) * (height - 1) * 6;
+	}
+}
 
-			// Begin OBJ data.
-			fprintf(out, "# generated by md3bsp2ase from %s model #%d\n", in_name, model_index);
+static int parse_bsp(const char *in_name, const unsigned char *data, size_t size, const sink_t *sink, bsp_t *bsp)
+{
+	const dheader_t *header = (const dheader_t *)data;
+	const dmodel_t *model;
+	const dsurface_t *surfs;
+	bsp_surface_info_t *info;
+	bsp_model_info_t *model_info;
+	double start;
+	int i, j;
+
+	memset(bsp, 0, sizeof(*bsp));
+
+	if (size < sizeof(dheader_t))
+	{
+		sink_log(sink, LOG_ERROR, "Not a valid BSP file");
+		return 13;
+	}
 
-			vert_index_cum = 0;
+	// everything past this point reads the file in native byte order
+	if (HOST_BIG_ENDIAN)
+	{
+		if (!(bsp->native = malloc(size)))
+		{
+			sink_log(sink, LOG_ERROR, "Memory allocation failed");
+			return 11;
 		}
-		surf_index_actual = 0;
+		memcpy(bsp->native, data, size);
+		swap_bsp(bsp->native, size);
+		data = bsp->native;
+		header = (const dheader_t *)data;
+	}
+
+	// BSP sanity checking
+	if (header->ident != BSP_IDENT)
+	{
+		sink_log(sink, LOG_ERROR, "Not a valid BSP file");
+		free_bsp(bsp);
+		return 13;
+	}
 
-		// iterate over all the BSP drawable surfaces
-		for (surf_index = 0, surf = (dsurface_t *)(buf
-			+ little_long(bsp->lumps[LUMP_SURFACES].fileofs)
-			+ little_long(model->firstSurface) * sizeof(dsurface_t));
-			surf_index < little_long(model->numSurfaces);
-			++surf_index, ++surf)
+	if (header->version != BSP_VERSION)
+	{
+		sink_log(sink, LOG_ERROR, "Unsupported BSP version");
+		free_bsp(bsp);
+		return 14;
+	}
+
+	bsp->name = in_name;
+	bsp->buf = data;
+	bsp->size = size;
+	bsp->header = header;
+
+	start = get_time();
+	i = validate_bsp(bsp, sink);
+	add_time(sink->stats, STAGE_VALIDATE, get_time() - start);
+	if (i != 0)
+	{
+		free_bsp(bsp);
+		return i;
+	}
+
+	// classify every surface once, the exporters only ever look at the index
+	bsp->num_models = header->lumps[LUMP_MODELS].filelen / (int)sizeof(dmodel_t);
+	bsp->num_surfaces = header->lumps[LUMP_SURFACES].filelen / (int)sizeof(dsurface_t);
+	bsp->models = calloc(bsp->num_models + 1, sizeof(*bsp->models));
+	bsp->surfaces = calloc(bsp->num_surfaces + 1, sizeof(*bsp->surfaces));
+	if (!bsp->models || !bsp->surfaces)
+	{
+		sink_log(sink, LOG_ERROR, "Memory allocation failed");
+		free_bsp(bsp);
+		return 11;
+	}
+
+	surfs = (const dsurface_t *)(data + header->lumps[LUMP_SURFACES].fileofs);
+	for (i = 0, info = bsp->surfaces; i < bsp->num_surfaces; ++i, ++info)
+		classify_bsp_surface(bsp, &surfs[i], info);
+
+	for (i = 0, model_info = bsp->models; i < bsp->num_models; ++i, ++model_info)
+	{
+		model = get_bsp_model(bsp, i);
+		model_info->first_surface = model->firstSurface;
+		model_info->num_surfaces = model->numSurfaces;
+		for (j = 0, info = bsp->surfaces + model_info->first_surface; j < model_info->num_surfaces; ++j, ++info)
 		{
-			if ((skip_planar && little_long(surf->surfaceType) == MST_PLANAR)
-				|| (skip_tris && little_long(surf->surfaceType) == MST_TRIANGLE_SOUP)
-				|| (skip_patches && little_long(surf->surfaceType) == MST_PATCH))
-			{
-				continue;
-			}
-			else if (little_long(surf->surfaceType) != MST_PLANAR
-				&& little_long(surf->surfaceType) != MST_TRIANGLE_SOUP
-				&& little_long(surf->surfaceType) != MST_PATCH)
-			{
+			if (info->kind != SURFACE_MESH)
 				continue;
-			}
+			++model_info->num_meshes;
+			model_info->out_verts += info->out_verts;
+			model_info->out_indexes += info->out_indexes;
+		}
+	}
 
-			shader = (dshader_t *)(buf
-				+ little_long(bsp->lumps[LUMP_SHADERS].fileofs)
-				+ little_long(surf->shaderNum) * sizeof(dshader_t));
+	return 0;
+}
 
-			// Skip non-drawable surfaces (i.e. collision).
-			if (skip_collision && (little_long(shader->surfaceFlags) & SURF_NODRAW))
-			{
-				continue;
-			}
+int load_bsp(const char *in_name, const unsigned char *data, size_t size, const sink_t *sink, bsp_t *bsp)
+{
+	double start = get_time();
+	int retcode;
 
-			++surf_index_actual;
+	retcode = parse_bsp(in_name, data, size, sink, bsp);
+	add_time(sink->stats, STAGE_LOAD, get_time() - start);
+	return retcode;
+}
 
-			vert = (drawVert_t *)(buf
-				+ little_long(bsp->lumps[LUMP_DRAWVERTS].fileofs)
-				+ little_long(surf->firstVert) * sizeof(drawVert_t));
-			vert_count = little_long(surf->numVerts);
+void free_bsp(bsp_t *bsp)
+{
+	free(bsp->surfaces);
+	free(bsp->models);
+	free(bsp->native);
+	memset(bsp, 0, sizeof(*bsp));
+}
+
+const dmodel_t *get_bsp_model(const bsp_t *bsp, int model_index)
+{
+	return (const dmodel_t *)(bsp->buf + bsp->header->lumps[LUMP_MODELS].fileofs) + model_index;
+}
 
-			tri = (int *)(buf
-				+ little_long(bsp->lumps[LUMP_DRAWINDEXES].fileofs)
-				+ little_long(surf->firstIndex) * sizeof(int));
-			tri_count = little_long(surf->numIndexes) / 3;
+const dshader_t *get_bsp_shader(const bsp_t *bsp, int shader_num)
+{
+	return (const dshader_t *)(bsp->buf + bsp->header->lumps[LUMP_SHADERS].fileofs) + shader_num;
+}
 
-			// Tesselate patches.
-			if (little_long(surf->surfaceType) == MST_PATCH)
-			{
-				srfGridMesh_t *grid;
-				int width_table[MAX_GRID_SIZE], height_table[MAX_GRID_SIZE], lod_width, lod_height;
-				int index, row, column;
-
-				const int subdivisions = 20;	// TODO: Variable LOD. ET values are 4, 12 and 20 for high, medium & low, respectively. Promote to commandline switches or to LOD meshes.
-				const float lod_error = 0.f;// 1.0f / 100000.f;	// TODO: Variable LOD. Promote to commandline switches.
-
-				// TODO: Remove dependency on this GPL-ed code so that all of this project stays in the public domain.
-				// For the time being, call WolfET's subdivision code to get actual tesselated geometry.
-				grid = R_SubdividePatchToGrid(little_long(surf->patchWidth), little_long(surf->patchHeight), vert, subdivisions);
-				
-				width_table[0] = 0;
-				lod_width = 1;
-				for (index = 1; index < grid->width - 1; ++index)
-				{
-					if (grid->widthLodError[index] <= lod_error)
-					{
-						width_table[lod_width++] = index;
-					}
-				}
-				width_table[lod_width++] = grid->width - 1;
-				assert(lod_width <= MAX_GRID_SIZE);
+// Makes sure the mesh can hold tessellated geometry of the given size without reallocating.
+int reserve_bsp_mesh(bsp_mesh_t *mesh, int num_verts, int num_indexes)
+{
+	size_t size = sizeof(drawVert_t) * num_verts + sizeof(int) * num_indexes;
+	void *storage;
 
-				height_table[0] = 0;
-				lod_height = 1;
-				for (index = 1; index < grid->height - 1; ++index)
-				{
-					if (grid->heightLodError[index] <= lod_error)
-					{
-						height_table[lod_height++] = index;
-					}
-				}
-				height_table[lod_height++] = grid->height - 1;
-				assert(lod_height <= MAX_GRID_SIZE);
+	if (size <= mesh->storage_size)
+		return 0;
+	if (!(storage = realloc(mesh->storage, size)))
+		return 11;
+	mesh->storage = storage;
+	mesh->storage_size = size;
+	return 0;
+}
 
-				// We've generated new geometry, so create buffers to hold it for the code later on to read.
-				vert_count = lod_height * lod_width;
-				vert = malloc(sizeof(*vert) * vert_count);
-				tri_count = (lod_height - 1) * (lod_width - 1) * 2;
-				tri = malloc(sizeof(*tri) * tri_count * 3);
+void free_bsp_mesh_grid(bsp_mesh_t *mesh)
+{
+	if (!mesh->grid)
+		return;
+	free(mesh->grid->widthLodError);
+	free(mesh->grid->heightLodError);
+	free(mesh->grid);
+	mesh->grid = NULL;
+}
 
-				for (row = 0; row < lod_height; ++row)
-				{
-					for (column = 0; column < lod_width; ++column)
-					{
-						index = row * lod_width + column;
-						assert(index < vert_count);
-						vert_index = height_table[row] * grid->width + width_table[column];
-						vert[index] = grid->verts[vert_index];
-
-						if (row < lod_height - 1 && column < lod_width - 1)
-						{
-							index = (row * (lod_width - 1) + column) * 6;
-							assert(index + 5 < tri_count * 3);
-							vert_index = row * lod_width + column;
+/*
+Replaces the mesh's control points with the tessellated grid. The grid is
+kept as it is, along with the rows and columns of it that make the mesh, so
+that the exporters can stream the vertices and triangles out of it row by
+row instead of going through a copy and an index array first.
+*/
+static int tessellate_patch(bsp_mesh_t *mesh, int patch_width, int patch_height, stats_t *stats)
+{
+	srfGridMesh_t *grid;
+	int index;
 
-							tri[index + 0] = vert_index;
-							tri[index + 1] = vert_index + lod_width;
-							tri[index + 2] = vert_index + 1;
+	const float lod_error = 0.f;// 1.0f / 100000.f;	// TODO: Variable LOD. Promote to commandline switches.
 
-							tri[index + 3] = vert_index + 1;
-							tri[index + 4] = vert_index + lod_width;
-							tri[index + 5] = vert_index + lod_width + 1;
-						}
-					}
-				}
-				assert(((row - 2) * (lod_width - 1) + (column - 2)) * 6 + 6 == tri_count * 3);
-			}
+	// TODO: Remove dependency on this GPL-ed code so that all of this project stays in the public domain.
+	// For the time being, call WolfET's subdivision code to get actual tesselated geometry.
+	if (!(grid = R_SubdividePatchToGrid(patch_width, patch_height, (drawVert_t *)mesh->verts, PATCH_SUBDIVISIONS,
+		stats)))
+	{
+		return 11;
+	}
 
-			if (split_models)
-			{
-				// Start the surface output.
-				snprintf(out_name_buf, out_name_buf_len, format_buf, out_name, model_index, surf_index);
-				out = fopen(out_name_buf, "w");
+	mesh->grid_columns[0] = 0;
+	mesh->num_columns = 1;
+	for (index = 1; index < grid->width - 1; ++index)
+	{
+		if (grid->widthLodError[index] <= lod_error)
+		{
+			mesh->grid_columns[mesh->num_columns++] = index;
+		}
+	}
+	mesh->grid_columns[mesh->num_columns++] = grid->width - 1;
+	assert(mesh->num_columns <= MAX_GRID_SIZE);
 
-				// Begin OBJ data.
-				fprintf(out, "# generated by md3bsp2ase from %s model #%d surface #%d\n", in_name, model_index, surf_index);
+	mesh->grid_rows[0] = 0;
+	mesh->num_rows = 1;
+	for (index = 1; index < grid->height - 1; ++index)
+	{
+		if (grid->heightLodError[index] <= lod_error)
+		{
+			mesh->grid_rows[mesh->num_rows++] = index;
+		}
+	}
+	mesh->grid_rows[mesh->num_rows++] = grid->height - 1;
+	assert(mesh->num_rows <= MAX_GRID_SIZE);
 
-				vert_index_cum = 0;
-			}
+	mesh->grid = grid;
+	mesh->verts = NULL;
+	mesh->num_verts = mesh->num_rows * mesh->num_columns;
+	mesh->indexes = NULL;
+	mesh->num_indexes = (mesh->num_rows - 1) * (mesh->num_columns - 1) * 6;
 
-			printf("\tProcessing surface #%d: type %s, %d vertices, "
-				"%d indices\n",
-				surf_index, get_bsp_surface_type(little_long(surf->surfaceType)),
-				vert_count, tri_count * 3);
-
-			// start a group
-			fprintf(out,
-				"\n"
-				"# surface %d/%d (#%d, %s)\n"
-				"usemtl %s\n"
-				"g surf%d\n"
-				"o surf%d\n"
-				"\n",
-				surf_index_actual, count, surf_index, get_bsp_surface_type(little_long(surf->surfaceType)), shader->shader, surf_index, surf_index);
-
-			// Output the vertex list.
-			for (vert_index = 0; vert_index < vert_count; ++vert_index, ++vert)
-			{
-				fprintf(out,
-					"v %f %f %f\n",
-					(float)vert->xyz[0],
-					(float)vert->xyz[1],
-					(float)vert->xyz[2]);
-			}
+	return 0;
+}
 
-			fprintf(out, "\n");
+// Turns a patch's grid into a vertex and an index array, for those that need the mesh as arrays.
+int expand_bsp_mesh(bsp_mesh_t *mesh)
+{
+	const srfGridMesh_t *grid = mesh->grid;
+	drawVert_t *vert;
+	int *tri;
+	int row, column, index, vert_index;
 
-			// output the texture vertex list
-			vert = (drawVert_t *)(buf
-				+ little_long(bsp->lumps[LUMP_DRAWVERTS].fileofs)
-				+ little_long(surf->firstVert) * sizeof(drawVert_t));
-			for (vert_index = 0; vert_index < vert_count; ++vert_index, ++vert)
-			{
-				fprintf(out, "vt %f %f\n", vert->st[0], 1.f - vert->st[1]);
-			}
+	if (!grid)
+		return 0;
+	// The index's estimate is an upper bound, so this is normally already large enough.
+	if (reserve_bsp_mesh(mesh, mesh->num_verts, mesh->num_indexes) != 0)
+		return 11;
+	vert = mesh->storage;
+	tri = (int *)(vert + mesh->num_verts);
 
-			fprintf(out, "\n");
+	for (row = 0; row < mesh->num_rows; ++row)
+	{
+		for (column = 0; column < mesh->num_columns; ++column)
+		{
+			*vert++ = grid->verts[mesh->grid_rows[row] * grid->width + mesh->grid_columns[column]];
 
-			// output the normals
-			vert = (drawVert_t *)(buf
-				+ little_long(bsp->lumps[LUMP_DRAWVERTS].fileofs)
-				+ little_long(surf->firstVert) * sizeof(drawVert_t));
-			for (vert_index = 0; vert_index < vert_count; ++vert_index, ++vert)
+			if (row < mesh->num_rows - 1 && column < mesh->num_columns - 1)
 			{
-				fprintf(out,
-					"vn %f %f %f\n",
-					vert->normal[0], vert->normal[1], vert->normal[2]);
+				index = (row * (mesh->num_columns - 1) + column) * 6;
+				vert_index = row * mesh->num_columns + column;
+
+				tri[index + 0] = vert_index;
+				tri[index + 1] = vert_index + mesh->num_columns;
+				tri[index + 2] = vert_index + 1;
+
+				tri[index + 3] = vert_index + 1;
+				tri[index + 4] = vert_index + mesh->num_columns;
+				tri[index + 5] = vert_index + mesh->num_columns + 1;
 			}
+		}
+	}
+
+	free_bsp_mesh_grid(mesh);
+	mesh->verts = mesh->storage;
+	mesh->indexes = tri;
+
+	return 0;
+}
+
+int get_bsp_mesh(const bsp_t *bsp, const bsp_surface_info_t *info, const sink_t *sink, bsp_mesh_t *mesh)
+{
+	double start;
+	int retcode;
+
+	free_bsp_mesh_grid(mesh);
+	mesh->info = info;
+	mesh->verts = (const drawVert_t *)(bsp->buf + bsp->header->lumps[LUMP_DRAWVERTS].fileofs)
+		+ info->first_vert;
+	mesh->num_verts = info->num_verts;
+	mesh->indexes = (const int *)(bsp->buf + bsp->header->lumps[LUMP_DRAWINDEXES].fileofs)
+		+ info->first_index;
+	mesh->num_indexes = info->num_indexes;
+
+	// Tesselate patches.
+	if (info->type != MST_PATCH)
+		return 0;
+	start = get_time();
+	retcode = tessellate_patch(mesh, info->surf->patchWidth, info->surf->patchHeight, sink->stats);
+	add_time(sink->stats, STAGE_TESSELLATE, get_time() - start);
+	return retcode;
+}
+
+void free_bsp_mesh(bsp_mesh_t *mesh)
+{
+	free_bsp_mesh_grid(mesh);
+	free(mesh->storage);
+	memset(mesh, 0, sizeof(*mesh));
+}
 
-			fprintf(out,
-				"\n"
-				"s 1\n");
+// Replaces the mesh's geometry with a simplified copy. Only what the OBJ gets, st and normal, keeps vertices apart.
+int simplify_bsp_mesh(bsp_mesh_t *mesh, const simplify_t *params)
+{
+	float *xyz, *attributes;
+	int *indexes, *order;
+	drawVert_t *verts;
+	int i, num_verts, num_indexes, retcode = 11;
 
-			// output the triangle list
-			for (tri_index = 0; tri_index < tri_count; ++tri_index, tri += 3)
+	if (expand_bsp_mesh(mesh) != 0)
+		return 11;
+	xyz = malloc(max(mesh->num_verts, 1) * 3 * sizeof(*xyz));
+	attributes = malloc(max(mesh->num_verts, 1) * 5 * sizeof(*attributes));
+	indexes = malloc(max(mesh->num_indexes, 1) * sizeof(*indexes));
+	order = malloc(max(mesh->num_verts, 1) * sizeof(*order));
+	verts = NULL;
+	if (xyz && attributes && indexes && order)
+	{
+		for (i = 0; i < mesh->num_verts; ++i)
+		{
+			VectorCopy(mesh->verts[i].xyz, xyz + i * 3);
+			attributes[i * 5 + 0] = mesh->verts[i].st[0];
+			attributes[i * 5 + 1] = mesh->verts[i].st[1];
+			VectorCopy(mesh->verts[i].normal, attributes + i * 5 + 2);
+		}
+		num_indexes = simplify_mesh(xyz, attributes, 5, mesh->num_verts, mesh->indexes, mesh->num_indexes, params,
+			indexes);
+		if (num_indexes >= 0 && (num_verts = compact_mesh(indexes, num_indexes, mesh->num_verts, order)) >= 0
+			&& (verts = malloc(max(num_verts, 1) * sizeof(*verts))) != NULL)
+		{
+			// the old geometry may live in the storage that is about to be reallocated
+			for (i = 0; i < num_verts; ++i)
+				verts[i] = mesh->verts[order[i]];
+			if (reserve_bsp_mesh(mesh, num_verts, num_indexes) == 0)
 			{
-				fprintf(out,
-					"f %d/%d/%d %d/%d/%d %d/%d/%d\n",
-					1 + little_long(tri[2]) + vert_index_cum,
-					1 + little_long(tri[2]) + vert_index_cum,
-					1 + little_long(tri[2]) + vert_index_cum,
-					1 + little_long(tri[1]) + vert_index_cum,
-					1 + little_long(tri[1]) + vert_index_cum,
-					1 + little_long(tri[1]) + vert_index_cum,
-					1 + little_long(tri[0]) + vert_index_cum,
-					1 + little_long(tri[0]) + vert_index_cum,
-					1 + little_long(tri[0]) + vert_index_cum);
+				memcpy(mesh->storage, verts, num_verts * sizeof(*verts));
+				memcpy((drawVert_t *)mesh->storage + num_verts, indexes, num_indexes * sizeof(*indexes));
+				mesh->verts = mesh->storage;
+				mesh->num_verts = num_verts;
+				mesh->indexes = (const int *)((drawVert_t *)mesh->storage + num_verts);
+				mesh->num_indexes = num_indexes;
+				retcode = 0;
 			}
+		}
+	}
+	free(xyz);
+	free(attributes);
+	free(indexes);
+	free(order);
+	free(verts);
+	return retcode;
+}
 
-			// Keep track of cumulative vertex index so that multiple surfaces in the same file may coexist.
-			vert_index_cum += vert_count;
-			
-			if (split_models)
+// Goes over a patch's grid row by row, writing one attribute of every vertex of the mesh.
+static void write_grid_attribute_obj(output_t *out, const bsp_mesh_t *mesh, char attribute)
+{
+	const srfGridMesh_t *grid = mesh->grid;
+	const drawVert_t *row_verts, *vert;
+	int row, column;
+
+	for (row = 0; row < mesh->num_rows; ++row)
+	{
+		row_verts = grid->verts + mesh->grid_rows[row] * grid->width;
+		for (column = 0; column < mesh->num_columns; ++column)
+		{
+			vert = row_verts + mesh->grid_columns[column];
+			switch (attribute)
 			{
-				fclose(out);
+				case 'v':
+					output_printf(out, "v %f %f %f\n", vert->xyz[0], vert->xyz[1], vert->xyz[2]);
+					break;
+				case 't':
+					output_printf(out, "vt %f %f\n", vert->st[0], 1.f - vert->st[1]);
+					break;
+				case 'n':
+					output_printf(out, "vn %f %f %f\n", vert->normal[0], vert->normal[1], vert->normal[2]);
+					break;
 			}
 		}
+	}
+}
 
-		if (!split_models)
+// A patch is written straight from its grid; the triangles follow from the rows and columns.
+static void write_grid_mesh_obj(output_t *out, const bsp_mesh_t *mesh, int vert_index_cum)
+{
+	int row, column, index, next_row;
+
+	write_grid_attribute_obj(out, mesh, 'v');
+	output_printf(out, "\n");
+	write_grid_attribute_obj(out, mesh, 't');
+	output_printf(out, "\n");
+	write_grid_attribute_obj(out, mesh, 'n');
+	output_printf(out,
+		"\n"
+		"s 1\n");
+
+	// two triangles per grid cell, in the order expand_bsp_mesh lists them
+	for (row = 0; row < mesh->num_rows - 1; ++row)
+	{
+		for (column = 0; column < mesh->num_columns - 1; ++column)
 		{
-			fclose(out);
+			index = 1 + vert_index_cum + row * mesh->num_columns + column;
+			next_row = index + mesh->num_columns;
+			output_printf(out,
+				"f %d/%d/%d %d/%d/%d %d/%d/%d\n"
+				"f %d/%d/%d %d/%d/%d %d/%d/%d\n",
+				index + 1, index + 1, index + 1,
+				next_row, next_row, next_row,
+				index, index, index,
+				next_row + 1, next_row + 1, next_row + 1,
+				next_row, next_row, next_row,
+				index + 1, index + 1, index + 1);
 		}
 	}
-
-	free(out_name_buf);
-
-	return 0;
 }
 
-int convert_md3_to_obj(const char *in_name, FILE *in, FILE *out, int frame)
+static void write_bsp_mesh_obj(output_t *out, const bsp_mesh_t *mesh, int vert_index_cum)
 {
-	md3Header_t *md3;
-	md3Surface_t *surf;
-	md3XyzNormal_t *vert;
-	md3Triangle_t *tri;
-	md3St_t *st;
-	int i, j;
-	unsigned char *buf;
+	const drawVert_t *vert;
+	const int *tri;
+	int i;
 
-	// load the file contents into a buffer
-	fseek(in, 0, SEEK_END);
-	i = ftell(in);
-	fseek(in, 0, SEEK_SET);
-	buf = malloc(i);
-	if (!buf)
+	if (mesh->grid)
 	{
-		printf("Memory allocation failed\n");
-		return 11;
+		write_grid_mesh_obj(out, mesh, vert_index_cum);
+		return;
+	}
+
+	// Output the vertex list.
+	for (i = 0, vert = mesh->verts; i < mesh->num_verts; ++i, ++vert)
+	{
+		output_printf(out,
+			"v %f %f %f\n",
+			(float)vert->xyz[0],
+			(float)vert->xyz[1],
+			(float)vert->xyz[2]);
 	}
-	if (fread(buf, 1, i, in) != (size_t)i)
+
+	output_printf(out, "\n");
+
+	// output the texture vertex list
+	for (i = 0, vert = mesh->verts; i < mesh->num_verts; ++i, ++vert)
 	{
-		printf("Failed to read file (%d bytes) into buffer\n", i);
-		return 12;
+		output_printf(out, "vt %f %f\n", vert->st[0], 1.f - vert->st[1]);
 	}
 
-	// MD3 sanity checking
-	md3 = (md3Header_t *)buf;
+	output_printf(out, "\n");
 
-	if (little_long(md3->ident != MD3_IDENT))
+	// output the normals
+	for (i = 0, vert = mesh->verts; i < mesh->num_verts; ++i, ++vert)
 	{
-		printf("Not a valid MD3 file\n");
-		return 6;
+		output_printf(out,
+			"vn %f %f %f\n",
+			vert->normal[0], vert->normal[1], vert->normal[2]);
 	}
 
-	if (little_long(md3->version > MD3_VERSION))
+	output_printf(out,
+		"\n"
+		"s 1\n");
+
+	// output the triangle list
+	for (i = 0, tri = mesh->indexes; i < mesh->num_indexes; i += 3, tri += 3)
+	{
+		output_printf(out,
+			"f %d/%d/%d %d/%d/%d %d/%d/%d\n",
+			1 + tri[2] + vert_index_cum,
+			1 + tri[2] + vert_index_cum,
+			1 + tri[2] + vert_index_cum,
+			1 + tri[1] + vert_index_cum,
+			1 + tri[1] + vert_index_cum,
+			1 + tri[1] + vert_index_cum,
+			1 + tri[0] + vert_index_cum,
+			1 + tri[0] + vert_index_cum,
+			1 + tri[0] + vert_index_cum);
+	}
+}
+
+/*
+Mesh surfaces go through three stages: the batch's meshes are built on this
+thread, merged with their coplanar neighbours and simplified if asked to and
+formatted to text in parallel, then appended to the model's OBJ in order,
+from where the output's writer thread takes them to the sink.
+*/
+#define MESH_BATCH_SIZE		64
+
+typedef struct
+{
+	const bsp_surface_info_t *info;
+	int surf_index, surf_index_actual;
+	int vert_index_cum;
+	int merge;					// the mesh is still to be merged from the surface's planar group
+	bsp_mesh_t mesh;
+	output_t text;
+} mesh_batch_slot_t;
+
+static void free_mesh_batch(mesh_batch_slot_t *slots)
+{
+	int i;
+
+	for (i = 0; i < MESH_BATCH_SIZE; ++i)
 	{
-		printf("Unsupported MD3 version\n");
-		return 7;
+		free_bsp_mesh(&slots[i].mesh);
+		close_output(&slots[i].text);
 	}
+	free(slots);
+}
+
+// The slots keep their mesh and text storage from batch to batch.
+static mesh_batch_slot_t *alloc_mesh_batch(void)
+{
+	mesh_batch_slot_t *slots;
+	int i;
 
-	if (little_long(md3->numFrames) < 1)
+	if (!(slots = calloc(MESH_BATCH_SIZE, sizeof(*slots))))
+		return NULL;
+	for (i = 0; i < MESH_BATCH_SIZE; ++i)
 	{
-		printf("MD3 has no frames\n");
-		return 8;
+		if (open_memory_output(&slots[i].text) != 0)
+		{
+			free_mesh_batch(slots);
+			return NULL;
+		}
 	}
+	return slots;
+}
 
-	if (little_long(md3->numFrames) <= frame)
+static int merge_mesh_batch(const bsp_t *bsp, const bsp_model_info_t *model_info, const planar_groups_t *groups,
+	mesh_batch_slot_t *slots, int count)
+{
+	int i, failed = 0;
+
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic) reduction(|:failed)
+#endif
+	for (i = 0; i < count; ++i)
 	{
-		printf("Cannot extract frame #%d from a model that has %d frames\n",
-			frame, little_long(md3->numFrames));
-		return 9;
+		if (slots[i].merge)
+			failed |= merge_planar_group(bsp, model_info, groups, slots[i].surf_index, &slots[i].mesh) != 0;
 	}
 
-	if (little_long(md3->numSurfaces) < 1)
+	return failed ? 11 : 0;
+}
+
+static int simplify_mesh_batch(mesh_batch_slot_t *slots, int count, const simplify_t *params)
+{
+	int i, failed = 0;
+
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic) reduction(|:failed)
+#endif
+	for (i = 0; i < count; ++i)
 	{
-		printf("MD3 has no surfaces\n");
-		return 10;
+		failed |= simplify_bsp_mesh(&slots[i].mesh, params) != 0;
 	}
 
-	printf("MD3 stats:\n"
-		"%d surfaces\n"
-		"%d tags\n"
-		"%d frames\n",
-		little_long(md3->numSurfaces), little_long(md3->numTags),
-		little_long(md3->numFrames));
+	return failed ? 11 : 0;
+}
 
-	// begin OBJ data
-	fprintf(out,
-		"# generated by md3bsp2ase from %s\n", in_name);
+static int format_mesh_batch(int num_meshes, mesh_batch_slot_t *slots, int count)
+{
+	int i, failed = 0;
 
-	// geometry - iterate over all the MD3 surfaces
-	for (i = 0, surf = (md3Surface_t *)(buf + little_long(md3->ofsSurfaces));
-		i < little_long(md3->numSurfaces);
-		++i, surf += little_long(surf->ofsEnd))
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic) reduction(|:failed)
+#endif
+	for (i = 0; i < count; ++i)
 	{
-		printf("Processing surface #%d, \"%s\": %d vertices, %d triangles\n",
-			i, surf->name, little_long(surf->numVerts),
-			little_long(surf->numTriangles));
+		mesh_batch_slot_t *slot = &slots[i];
+		const bsp_surface_info_t *info = slot->info;
+
+		slot->text.used = 0;
 
 		// start a group
-		fprintf(out,
+		output_printf(&slot->text,
 			"\n"
-			"# surface #%d\n"
-			"g %s\n"
-			"o %s\n"
+			"# surface %d/%d (#%d, %s)\n"
+			"usemtl %s\n"
+			"g surf%d\n"
+			"o surf%d\n"
 			"\n",
-				i, surf->name, surf->name);
+			slot->surf_index_actual, num_meshes, slot->surf_index, get_bsp_surface_type(info->type), info->shader->shader, slot->surf_index, slot->surf_index);
 
-		// output the vertex list
-		vert = (md3XyzNormal_t *)(((unsigned char *)surf)
-			+ little_long(surf->ofsXyzNormals)
-			+ frame * little_long(surf->numVerts));
-		for (j = 0; j < little_long(surf->numVerts); ++j, ++vert)
-		{
-			fprintf(out,
-				"v %f %f %f\n",
-					(float)vert->xyz[0] * MD3_XYZ_SCALE,
-					(float)vert->xyz[2] * MD3_XYZ_SCALE,
-					(float)vert->xyz[1] * MD3_XYZ_SCALE);
-		}
+		write_bsp_mesh_obj(&slot->text, &slot->mesh, slot->vert_index_cum);
+		failed |= slot->text.failed;
+		// the text is all that's needed of a patch from here on
+		free_bsp_mesh_grid(&slot->mesh);
+	}
 
-		fprintf(out, "\n");
+	return failed ? 11 : 0;
+}
 
-		// output the texture vertex list
-		st = (md3St_t *)(((unsigned char *)surf)
-			+ little_long(surf->ofsSt));
-		for (j = 0; j < little_long(surf->numVerts); ++j, ++st)
+/*
+Fingerprints what each model's OBJ and collision are made of, so that after a
+recompile only the models that changed need exporting again. Offsets into the
+lumps are left out, as they shift whenever an earlier model grows or shrinks,
+and so is lighting, which the light stage rewrites without moving anything.
+*/
+void hash_bsp_models(const bsp_t *bsp, unsigned int *hashes)
+{
+	const lump_t *lumps = bsp->header->lumps;
+	const drawVert_t *verts = (const drawVert_t *)(bsp->buf + lumps[LUMP_DRAWVERTS].fileofs);
+	const int *indexes = (const int *)(bsp->buf + lumps[LUMP_DRAWINDEXES].fileofs);
+	const dbrush_t *brushes = (const dbrush_t *)(bsp->buf + lumps[LUMP_BRUSHES].fileofs);
+	const dbrushside_t *sides = (const dbrushside_t *)(bsp->buf + lumps[LUMP_BRUSHSIDES].fileofs);
+	const dplane_t *planes = (const dplane_t *)(bsp->buf + lumps[LUMP_PLANES].fileofs);
+	int i;
+
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
+	for (i = 0; i < bsp->num_models; ++i)
+	{
+		const dmodel_t *model = get_bsp_model(bsp, i);
+		const bsp_model_info_t *model_info = &bsp->models[i];
+		unsigned int h;
+		int j, k;
+
+		h = crc32_update(0, model->mins, sizeof(model->mins));
+		h = crc32_update(h, model->maxs, sizeof(model->maxs));
+		h = crc32_update(h, &model->numSurfaces, sizeof(model->numSurfaces));
+		for (j = 0; j < model_info->num_surfaces; ++j)
 		{
-			fprintf(out,
-				"vt %f %f\n", st->st[0], 1.f - st->st[1]);
-		}
-
-		fprintf(out, "\n");
+			const bsp_surface_info_t *info = &bsp->surfaces[model_info->first_surface + j];
+			const dsurface_t *surf = info->surf;
+			int shape[5];
+
+			shape[0] = surf->surfaceType;
+			shape[1] = surf->numVerts;
+			shape[2] = surf->numIndexes;
+			shape[3] = surf->patchWidth;
+			shape[4] = surf->patchHeight;
+			h = crc32_update(h, shape, sizeof(shape));
+			h = crc32_update(h, info->shader, sizeof(*info->shader));
+			for (k = 0; k < info->num_verts; ++k)
+			{
+				const drawVert_t *vert = &verts[info->first_vert + k];
 
-		// output the normals
-		vert = (md3XyzNormal_t *)(((unsigned char *)surf)
-			+ little_long(surf->ofsXyzNormals)
-			+ frame * little_long(surf->numVerts));
-		for (j = 0; j < little_long(surf->numVerts); ++j, ++vert)
-		{
-			float lat, lng;
-			lat = (vert->normal >> 8)	/ 255.f * (float)M_PI * 2.f;
-			lng = (vert->normal & 0xFF) / 255.f * (float)M_PI * 2.f;
-			// decode X as cos( lat ) * sin( long )
-			// decode Y as sin( lat ) * sin( long )
-			// decode Z as cos( long )
-			// swap Y with Z for Blender
-			fprintf(out,
-				"vn %f %f %f\n",
-					cos(lat) * sin(lng), cos(lng), sin(lat) * sin(lng));
+				h = crc32_update(h, vert->xyz, sizeof(vert->xyz));
+				h = crc32_update(h, vert->st, sizeof(vert->st));
+				h = crc32_update(h, vert->normal, sizeof(vert->normal));
+			}
+			h = crc32_update(h, indexes + info->first_index, info->num_indexes * sizeof(*indexes));
 		}
 
-		fprintf(out,
-			"\n"
-			"s 1\n");
-
-		// output the triangle list
-		tri = (md3Triangle_t *)(((unsigned char *)surf)
-			+ little_long(surf->ofsTriangles));
-		for (j = 0; j < little_long(surf->numTriangles); ++j, ++tri)
+		h = crc32_update(h, &model->numBrushes, sizeof(model->numBrushes));
+		for (j = 0; j < model->numBrushes; ++j)
 		{
-			fprintf(out,
-				"f %d/%d/%d %d/%d/%d %d/%d/%d\n",
-					1 + little_long(tri->indexes[0]),
-					1 + little_long(tri->indexes[0]),
-					1 + little_long(tri->indexes[0]),
-					1 + little_long(tri->indexes[1]),
-					1 + little_long(tri->indexes[1]),
-					1 + little_long(tri->indexes[1]),
-					1 + little_long(tri->indexes[2]),
-					1 + little_long(tri->indexes[2]),
-					1 + little_long(tri->indexes[2]));
+			const dbrush_t *brush = &brushes[model->firstBrush + j];
+
+			h = crc32_update(h, get_bsp_shader(bsp, brush->shaderNum), sizeof(dshader_t));
+			h = crc32_update(h, &brush->numSides, sizeof(brush->numSides));
+			for (k = 0; k < brush->numSides; ++k)
+				h = crc32_update(h, &planes[sides[brush->firstSide + k].planeNum], sizeof(dplane_t));
 		}
+
+		hashes[i] = h;
 	}
+}
 
-	return 0;
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
 }
 
-int main(int argc, char *argv[])
+// One material for every shader the map's meshes use, sorted by name.
+static int write_bsp_materials(const bsp_t *bsp, const options_t *options, const sink_t *sink)
 {
-	FILE *infile;
-	char *in_ext, *out_ext;
-	int retcode;
+	const char **names;
+	output_t out;
+	int num_names = 0, retcode, i;
 
-	if (argc < 3)
+	if (!(names = malloc(max(bsp->num_surfaces, 1) * sizeof(*names))))
 	{
-		printf("Usage: %s <infile> <outfile> [frame number]\n", argv[0]);
-		return 1;
+		sink_log(sink, LOG_ERROR, "Memory allocation failed");
+		return 11;
 	}
-
-	in_ext = strrchr(argv[1], '.');
-	if (in_ext == NULL)
+	for (i = 0; i < bsp->num_surfaces; ++i)
 	{
-		printf("File %s appears to have no extension\n", argv[1]);
-		return 2;
+		if (bsp->surfaces[i].kind == SURFACE_MESH)
+			names[num_names++] = bsp->surfaces[i].shader->shader;
 	}
-	++in_ext;
+	qsort(names, num_names, sizeof(*names), compare_names);
 
-	out_ext = strrchr(argv[2], '.');
-	if (out_ext != NULL)
+	if ((retcode = open_output(&out, sink, "materials.mtl")) == 0)
 	{
-		++out_ext;
+		output_printf(&out, "# generated by md3bsp2ase from %s\n", bsp->name);
+		for (i = 0; i < num_names; ++i)
+		{
+			if (!i || strcmp(names[i], names[i - 1]))
+				write_mtl_material(&out, options->shaders, names[i]);
+		}
+		retcode = close_output(&out);
 	}
+	free(names);
+	return retcode;
+}
+
+int convert_bsp_to_obj(const bsp_t *bsp, const options_t *options, const sink_t *sink)
+{
+	const dmodel_t *model;
+	const bsp_model_info_t *model_info;
+	const bsp_surface_info_t *info;
+	mesh_batch_slot_t *slots;
+	planar_groups_t groups;
+	output_t out, instances;
+	char warned[16], name[32], progress_name[32];
+	int model_index, surf_index, surf_index_actual, vert_index_cum = 0;
+	int retcode, closed, count, num_meshes, write_model, i;
+	double start, next_report = 0;
+	// TODO: Promote this to a command-line switch.
+	const int split_models = 0;
+
+	memset(warned, 0, sizeof(warned));
+	memset(&groups, 0, sizeof(groups));
 
-	if (!(infile = fopen(argv[1], "rb")))
+	if (!(slots = alloc_mesh_batch()))
 	{
-		printf("Failed to open file %s\n", argv[1]);
-		return 3;
+		sink_log(sink, LOG_ERROR, "Memory allocation failed");
+		return 11;
 	}
 
-	if (!strcasecmp(in_ext, "md3"))
+	if (options->materials && (retcode = write_bsp_materials(bsp, options, sink)) != 0)
 	{
-		FILE *outfile = fopen(argv[2], "w");
-		if (!outfile)
-		{
-			printf("Failed to open file %s\n", argv[2]);
-			fclose(infile);
-			return 4;
-		}
-		retcode = convert_md3_to_obj(argv[1], infile, outfile,
-			argc > 3 ? atoi(argv[3]) : 0);
-		fclose(outfile);
+		free_mesh_batch(slots);
+		return retcode;
 	}
-	else if (!strcasecmp(in_ext, "bsp"))
+
+	// misc_models, foliage and flares all end up in the instance list
+	if ((retcode = open_output(&instances, sink, "instances.txt")) != 0)
 	{
-		retcode = convert_bsp_to_obj(argv[1], infile, argv[2]);
+		free_mesh_batch(slots);
+		return retcode;
 	}
-	else
+	output_printf(&instances,
+		"# generated by md3bsp2ase from %s\n"
+		"# mesh <name> <OBJ output> <source>\n"
+		"# instance <mesh name> <3x4 row-major transform from mesh OBJ space to map OBJ space>\n"
+		"# bmodel <model index> <classname> <origin>\n"
+		"# flare <shader> <origin> <color> <normal>\n"
+		"\n",
+		bsp->name);
+
+	// iterate over all the models
+	for (model_index = 0, model_info = bsp->models; model_index < bsp->num_models && !retcode;
+		++model_index, ++model_info)
 	{
-		printf("Unknown extension %s in file %s\n", in_ext, argv[1]);
-		retcode = 5;
+		model = get_bsp_model(bsp, model_index);
+
+		if (model_info->num_surfaces < 1
+			&& (!options->collision || model->numBrushes < 1))
+		{
+			continue;
+		}
+
+		// models left out still place their foliage, flares and entities in instances.txt
+		write_model = !options->export_models || options->export_models[model_index];
+
+		if (write_model && options->collision && model->numBrushes > 0)
+		{
+			sink_log(sink, LOG_INFO, "Processing model #%d: %d brushes",
+				model_index, model->numBrushes);
+			if ((retcode = export_model_collision(bsp, model_index, options, sink)) != 0)
+				break;
+		}
+
+		num_meshes = write_model ? model_info->num_meshes : 0;
+		if (options->merge_planar && num_meshes > 1)
+		{
+			start = get_time();
+			retcode = group_planar_surfaces(bsp, model_info, &groups);
+			add_time(sink->stats, STAGE_MERGE, get_time() - start);
+			if (retcode != 0)
+			{
+				sink_log(sink, LOG_ERROR, "Memory allocation failed");
+				break;
+			}
+			num_meshes = groups.num_meshes;
+			if (groups.num_groups > 0)
+			{
+				sink_log(sink, LOG_VERBOSE, "Model #%d: %d surfaces merge into %d groups",
+					model_index, model_info->num_meshes - num_meshes + groups.num_groups, groups.num_groups);
+			}
+		}
+
+		// the index already knows whether there's anything for the model's OBJ
+		if (write_model && model_info->num_meshes > 0)
+		{
+			sink_log(sink, LOG_INFO, "Processing model #%d: %d exportable surfaces",
+				model_index, num_meshes);
+
+			if (!split_models)
+			{
+				// Start the output.
+				sprintf(name, "%04d.obj", model_index);
+				if ((retcode = open_output(&out, sink, name)) != 0)
+					break;
+
+				// Begin OBJ data.
+				output_printf(&out, "# generated by md3bsp2ase from %s model #%d\n", bsp->name, model_index);
+				if (options->materials)
+					write_mtllib(&out, sink, "materials.mtl");
+
+				vert_index_cum = 0;
+			}
+		}
+		surf_index_actual = 0;
+		sprintf(progress_name, "model #%d", model_index);
+
+		// iterate over all the BSP surfaces, in a single pass, a batch of meshes at a time
+		for (surf_index = 0, info = bsp->surfaces + model_info->first_surface;
+			surf_index < model_info->num_surfaces && !retcode;)
+		{
+			// build stage: everything but meshes is dealt with right away
+			for (count = 0; count < MESH_BATCH_SIZE && surf_index < model_info->num_surfaces && !retcode;
+				++surf_index, ++info)
+			{
+				switch (info->kind)
+				{
+					case SURFACE_SKIP:
+						continue;
+					case SURFACE_FOLIAGE:
+						retcode = export_foliage_surface(bsp, info, model_index, surf_index, sink, &instances);
+						continue;
+					case SURFACE_FLARE:
+						export_flare_surface(info, &instances);
+						continue;
+					case SURFACE_UNKNOWN:
+						if ((unsigned int)info->type >= sizeof(warned) || !warned[info->type])
+						{
+							if ((unsigned int)info->type < sizeof(warned))
+								warned[info->type] = 1;
+							sink_log(sink, LOG_WARNING, "WARNING: cannot handle %s surfaces yet, skipping",
+								get_bsp_surface_type(info->type));
+						}
+						continue;
+					case SURFACE_MESH:
+						if (!write_model)
+							continue;
+						break;
+				}
+
+				// merged surfaces come with the first surface of their group
+				if (groups.folded && groups.folded[surf_index])
+					continue;
+				slots[count].merge = groups.next && groups.next[surf_index] >= 0;
+				// simplification expands the mesh into the slot's storage, which the index's estimate sizes
+				// up front so that it doesn't grow on the worker threads
+				if (!slots[count].merge
+					&& ((options->simplify.enabled
+							&& (retcode = reserve_bsp_mesh(&slots[count].mesh, info->out_verts, info->out_indexes)) != 0)
+						|| (retcode = get_bsp_mesh(bsp, info, sink, &slots[count].mesh)) != 0))
+				{
+					sink_log(sink, LOG_ERROR, "Memory allocation failed");
+					break;
+				}
+				slots[count].info = info;
+				slots[count].surf_index = surf_index;
+				slots[count].surf_index_actual = ++surf_index_actual;
+				++count;
+			}
+			if (retcode || !count)
+				break;
+
+			// merge stage
+			if (groups.next)
+			{
+				start = get_time();
+				retcode = merge_mesh_batch(bsp, model_info, &groups, slots, count);
+				add_time(sink->stats, STAGE_MERGE, get_time() - start);
+				if (retcode != 0)
+				{
+					sink_log(sink, LOG_ERROR, "Memory allocation failed");
+					break;
+				}
+			}
+
+			// simplify stage
+			if (options->simplify.enabled)
+			{
+				start = get_time();
+				retcode = simplify_mesh_batch(slots, count, &options->simplify);
+				add_time(sink->stats, STAGE_SIMPLIFY, get_time() - start);
+				if (retcode != 0)
+				{
+					sink_log(sink, LOG_ERROR, "Memory allocation failed");
+					break;
+				}
+			}
+
+			// Keep track of cumulative vertex index so that multiple surfaces in the same file may coexist.
+			for (i = 0; i < count; ++i)
+			{
+				slots[i].vert_index_cum = split_models ? 0 : vert_index_cum;
+				vert_index_cum += slots[i].mesh.num_verts;
+			}
+
+			// format stage
+			start = get_time();
+			retcode = format_mesh_batch(num_meshes, slots, count);
+			add_time(sink->stats, STAGE_FORMAT, get_time() - start);
+			if (retcode != 0)
+			{
+				sink_log(sink, LOG_ERROR, "Memory allocation failed");
+				break;
+			}
+
+			// write stage
+			for (i = 0; i < count && !retcode; ++i)
+			{
+				if (split_models)
+				{
+					// Start the surface output.
+					sprintf(name, "%04d_%05d.obj", model_index, slots[i].surf_index);
+					if ((retcode = open_output(&out, sink, name)) != 0)
+						break;
+
+					// Begin OBJ data.
+					output_printf(&out, "# generated by md3bsp2ase from %s model #%d surface #%d\n",
+						bsp->name, model_index, slots[i].surf_index);
+					if (options->materials)
+						write_mtllib(&out, sink, "materials.mtl");
+				}
+
+				sink_log(sink, LOG_VERBOSE, "\tProcessing surface #%d: type %s, %d vertices, "
+					"%d indices",
+					slots[i].surf_index, get_bsp_surface_type(slots[i].info->type),
+					slots[i].mesh.num_verts, slots[i].mesh.num_indexes);
+
+				output_write(&out, slots[i].text.buf, slots[i].text.used);
+				add_count(sink->stats, COUNT_SURFACES, 1);
+				add_count(sink->stats, COUNT_VERTICES, slots[i].mesh.num_verts);
+				add_count(sink->stats, COUNT_TRIANGLES, slots[i].mesh.num_indexes / 3);
+
+				if (split_models)
+				{
+					retcode = close_output(&out);
+				}
+			}
+			sink_progress(sink, &next_report, progress_name, slots[count - 1].surf_index_actual, num_meshes);
+		}
+		free_planar_groups(&groups);
+
+		if (!split_models && write_model && model_info->num_meshes > 0)
+		{
+			closed = close_output(&out);
+			retcode = retcode ? retcode : closed;
+		}
 	}
 
-	fclose(infile);
+	// resolve misc_model placements and brush entity origins
+	if (!retcode)
+		retcode = export_bsp_entities(bsp, options, sink, &instances);
 
-	return retcode;
+	free_mesh_batch(slots);
+
+	closed = close_output(&instances);
+
+	return retcode ? retcode : closed;
 }
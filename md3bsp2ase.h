@@ -7,6 +7,7 @@ The code in this file, unless otherwise noted, is placed in the public domain.
 #pragma once
 
 #include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
 typedef float vec_t;
 typedef vec_t vec2_t[2];
@@ -21,8 +22,14 @@ typedef vec_t vec3_t[3];
 #define VectorLengthSquared(v)		DotProduct((v), (v))
 #define VectorLength(v)				sqrtf(VectorLengthSquared(v))
 #define VectorNormalize2(a, b)		normalize_vector(a, b)
-#define VectorNormalize(v)			{float length = VectorLength(v); VectorScale(v, length, v);}
+#define VectorNormalize(v)			normalize_vector(v, v)
 #define ClearBounds(a, b)			(VectorClear((a)), VectorClear((b)))
+#ifndef min
+	#define min(a, b)				((a) < (b) ? (a) : (b))
+#endif
+#ifndef max
+	#define max(a, b)				((a) > (b) ? (a) : (b))
+#endif
 #define AddPointToBounds(p, a, b)	((a)[0] = min((a)[0], (p)[0]), (a)[1] = min((a)[1], (p)[1]), (a)[2] = min((a)[2], (p)[2]), (b)[0] = max((b)[0], (p)[0]), (b)[1] = max((b)[1], (p)[1]), (b)[2] = max((b)[2], (p)[2]))
 typedef vec_t vec4_t[4];
 typedef vec_t vec5_t[5];
@@ -36,6 +43,19 @@ enum
 #include "qfiles.h"
 #include "surfaceflags.h"
 
+// Files are always little-endian. On big-endian hosts they are byte swapped into a native-order copy once,
+// when loaded, so nothing past load_bsp and load_md3 ever swaps anything.
+#ifndef HOST_BIG_ENDIAN
+	#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__)
+		#define HOST_BIG_ENDIAN		(__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	#elif defined(BYTE_ORDER) && defined(BIG_ENDIAN)
+		#define HOST_BIG_ENDIAN		(BYTE_ORDER == BIG_ENDIAN)
+	#else
+		// if not provided by the compiler or system headers, you should #define the byte order here
+		#define HOST_BIG_ENDIAN		0
+	#endif
+#endif
+
 #define MAX_GRID_SIZE	129
 #define MAX_PATCH_SIZE	32
 #define PATCH_STITCHING
@@ -43,6 +63,470 @@ enum
 extern float normalize_vector(const vec3_t in, vec3_t out);
 extern void cross_product(const vec3_t a, const vec3_t b, vec3_t out);
 
+#define MAX_MD3_ATTACHMENTS	MD3_MAX_TAGS
+
+typedef struct
+{
+	const char *tag;			// tag on an already loaded part to attach to
+	const char *path;			// MD3 to attach
+} md3_attachment_t;
+
+// Mesh simplification settings; simplification is off unless enabled is set.
+typedef struct
+{
+	int enabled;
+	float ratio;				// fraction of the triangles to aim for, 0 to go as far as max_error allows
+	float max_error;			// how far, in model units, the surface may move; FLT_MAX for no limit
+} simplify_t;
+
+typedef struct shader_index_s shader_index_t;
+
+// Conversion settings gathered from the command line.
+typedef struct options_s
+{
+	const char *base_path;		// game directory that misc_model paths are relative to; NULL to guess from the BSP path
+	int collision;				// export brushes as convex collision pieces
+	int collision_contents;		// only brushes with any of these content flags are exported
+	md3_attachment_t md3_attachments[MAX_MD3_ATTACHMENTS];
+	int num_md3_attachments;
+	int md3_tags;				// write MD3 tags and the part hierarchy to a text file
+	int md3_vat;				// bake MD3 animation into vertex animation textures
+	int md3_anim;				// write MD3 animation to a compact delta-encoded container
+	int md3_lods;				// gather <name>_1.md3, <name>_2.md3... into one multi-LOD OBJ
+	simplify_t simplify;		// map meshes and MD3 surfaces
+	int merge_planar;			// merge coplanar planar map surfaces that share a shader and texture mapping
+	int materials;				// write .mtl material libraries next to the OBJs
+	const shader_index_t *shaders;	// shader scripts to resolve materials with; NULL treats every shader as implicit
+	const unsigned char *export_models;	// per map model, nonzero to write its OBJ and collision; NULL for all
+} options_t;
+
+/*
+Library interface. The converters never touch the file system or stdout:
+inputs are memory spans and everything they produce goes through a sink.
+main.c is just a command line front end that backs the sink with files.
+*/
+
+enum
+{
+	LOG_ERROR,
+	LOG_WARNING,
+	LOG_INFO,
+	LOG_VERBOSE					// per-surface chatter
+};
+
+// Where the time goes. Stages nest: validate is part of load, normals part of tessellate.
+enum
+{
+	STAGE_LOAD,					// reading and parsing inputs
+	STAGE_VALIDATE,
+	STAGE_TESSELLATE,			// patches, R_SubdividePatchToGrid and all
+	STAGE_NORMALS,
+	STAGE_MERGE,				// coplanar planar surfaces
+	STAGE_SIMPLIFY,
+	STAGE_FORMAT,				// geometry to text
+	STAGE_COMPRESS,
+	STAGE_WRITE,				// the sink's write callback
+	STAGE_TOTAL,				// left to the caller
+	NUM_STAGES
+};
+
+enum
+{
+	COUNT_SURFACES,				// drawable surfaces written, map meshes and MD3 surfaces
+	COUNT_VERTICES,
+	COUNT_TRIANGLES,
+	COUNT_OUTPUTS,
+	COUNT_BYTES_OUT,			// as handed to the sink, after compression
+	NUM_COUNTERS
+};
+
+typedef struct
+{
+	double seconds[NUM_STAGES];
+	long long counts[NUM_COUNTERS];
+} stats_t;
+
+#define PROGRESS_RATE	4		// progress reports per second, at most
+
+typedef struct sink_s
+{
+	void *context;
+	// Starts an output and returns a handle for it, or NULL on failure. name is NULL for the primary
+	// output (the OBJ of an MD3 and the like), otherwise a suffix such as "0000.obj" or "instances.txt"
+	// that the sink maps onto its own naming; the command line tool writes <outfile>_<name>.
+	void *(*open)(void *context, const char *name);
+	// Returns 0 on success. Once an output outgrows its first buffer, its writes come from a dedicated
+	// writer thread; calls for one stream are always in order and never concurrent.
+	int (*write)(void *context, void *stream, const void *data, size_t size);
+	int (*close)(void *context, void *stream);
+	// Optional. One message per call, without the trailing line break. May be called from worker threads.
+	void (*log)(void *context, int level, const char *message);
+	// Messages above this LOG_ level are dropped before they are even formatted.
+	int log_level;
+	// Optional. How far a map conversion got: done out of total surfaces of the named model. Called from
+	// the converting thread only, at most PROGRESS_RATE times per second and always once a model is done.
+	void (*progress)(void *context, const char *what, int done, int total);
+	// Optional. Fetches an additional input (misc_model MD3s, attached parts, LODs), which must stay
+	// valid until released. Returns 0 on success. May be called from worker threads.
+	int (*read)(void *context, const char *path, const unsigned char **data, size_t *size);
+	void (*release)(void *context, const unsigned char *data);
+	// Optional. How one output refers to another (an OBJ to its .mtl library): the name that output, given
+	// the same name as open, goes by. Without it the name is used as is.
+	void (*reference)(void *context, const char *name, char *buf, size_t size);
+	// Optional. A gzip level from 1 to 9 compresses every output, 0 writes them as is.
+	int compression;
+	// Optional. Stage timings and counters are added up here, zero it before the first conversion.
+	stats_t *stats;
+} sink_t;
+
+// sink.c
+// Buffers writes to one sink output so that the callbacks see large blocks rather than single lines.
+// Memory outputs have no sink or stream and just grow; rewind one by zeroing used.
+typedef struct output_queue_s output_queue_t;
+typedef struct output_gzip_s output_gzip_t;
+typedef struct
+{
+	const sink_t *sink;
+	void *stream;
+	char *buf;
+	size_t used, capacity;
+	int failed;
+	output_queue_t *queue;		// full buffers on their way to the writer thread
+	int synchronous;			// the writer thread couldn't be started, write in place
+	output_gzip_t *gzip;		// compression state, NULL for outputs written as is
+} output_t;
+
+extern int open_output(output_t *out, const sink_t *sink, const char *name);
+extern int open_memory_output(output_t *out);
+extern void output_printf(output_t *out, const char *format, ...);
+extern void output_write(output_t *out, const void *data, size_t size);
+extern int close_output(output_t *out);
+extern void sink_log(const sink_t *sink, int level, const char *format, ...);
+extern void sink_progress(const sink_t *sink, double *next_report, const char *what, int done, int total);
+extern void sink_reference(const sink_t *sink, const char *name, char *buf, size_t size);
+
+// deflate.c
+extern unsigned int crc32_update(unsigned int crc, const void *data, size_t size);
+extern unsigned int crc32_combine(unsigned int crc1, unsigned int crc2, size_t len2);
+extern size_t deflate_bound(size_t size);
+extern size_t deflate_chunk(const unsigned char *in, size_t size, int level, int last, unsigned char *out);
+
+// shaders.c
+#define MAX_SHADER_STAGES	8	// as in the renderer
+
+// How a stage, or a whole shader by its first stage, blends with what is behind it.
+enum
+{
+	BLEND_OPAQUE,
+	BLEND_ALPHA_TEST,
+	BLEND_ALPHA,
+	BLEND_ADD,
+	BLEND_FILTER,				// multiplies, like lightmaps and decals
+	BLEND_OTHER
+};
+
+typedef struct
+{
+	const char *map;			// texture, NULL for generated ones
+	int blend;
+	int lightmap;				// the stage draws $lightmap
+} shader_stage_t;
+
+typedef struct
+{
+	const char *name;			// normalized: lower case, forward slashes, no extension
+	const char *script;			// file it came from
+	const char *editor_image;	// NULL if not given
+	const char *diffuse;		// the texture the surface shows, NULL if there's none
+	unsigned int surface_flags, content_flags;	// from surfaceparms
+	int blend;
+	int two_sided;
+	shader_stage_t *stages;
+	int num_stages;
+} shader_def_t;
+
+typedef struct shader_arena_s shader_arena_t;
+struct shader_index_s
+{
+	shader_def_t *defs;
+	int num_defs, max_defs;
+	int *table;					// open addressing, indexes into defs or -1
+	int table_size;
+	shader_arena_t *arena;		// names, paths and stages
+	int num_scripts;
+};
+
+// zero the index to initialize it
+extern int add_shader_script(shader_index_t *index, const char *script_name, const char *text, size_t size,
+	const sink_t *sink);
+extern int load_shader_script(shader_index_t *index, const char *path, const sink_t *sink);
+extern int load_shader_list(shader_index_t *index, const char *base_path, const sink_t *sink);
+extern void free_shader_index(shader_index_t *index);
+extern const shader_def_t *find_shader(const shader_index_t *index, const char *name);
+extern void write_mtl_material(output_t *out, const shader_index_t *index, const char *name);
+extern void write_mtllib(output_t *out, const sink_t *sink, const char *mtl_name);
+
+// simplify.c
+extern int simplify_mesh(const float *xyz, const float *attributes, int num_attributes, int num_verts,
+	const int *indexes, int num_indexes, const simplify_t *params, int *out_indexes);
+extern int compact_mesh(int *indexes, int num_indexes, int num_verts, int *order);
+
+// stats.c
+extern double get_time(void);
+extern void add_time(stats_t *stats, int stage, double seconds);
+extern void add_count(stats_t *stats, int counter, long long value);
+extern long long get_peak_memory(void);
+extern void write_stats_json(output_t *out, const stats_t *stats);
+
+// swap.c
+extern void swap_longs(void *data, size_t count);
+extern void swap_shorts(void *data, size_t count);
+extern void swap_bsp(unsigned char *buf, size_t size);
+extern void swap_md3(unsigned char *buf, size_t size);
+extern void swap_mesh_cache(unsigned char *buf, size_t size);
+
+// md3bsp2ase.c
+// What the exporters do with a surface, decided once when the BSP is loaded.
+typedef enum
+{
+	SURFACE_SKIP,				// not drawn, brushes cover it
+	SURFACE_MESH,				// planar, triangle soup or patch, goes into the model's OBJ
+	SURFACE_FOLIAGE,
+	SURFACE_FLARE,
+	SURFACE_UNKNOWN				// a type we cannot handle yet
+} surface_kind_t;
+
+typedef struct
+{
+	const dsurface_t *surf;
+	const dshader_t *shader;
+	surface_kind_t kind;
+	int type;					// mapSurfaceType_t
+	int surface_flags;
+	int content_flags;
+	int first_vert, num_verts;
+	int first_index, num_indexes;
+	int out_verts, out_indexes;	// what ends up in the OBJ; an upper bound for patches
+} bsp_surface_info_t;
+
+typedef struct
+{
+	int first_surface, num_surfaces;
+	int num_meshes;				// SURFACE_MESH surfaces
+	int out_verts, out_indexes;	// sums over the meshes
+} bsp_model_info_t;
+
+typedef struct
+{
+	const char *name;
+	const unsigned char *buf;	// native byte order view of the file
+	size_t size;
+	const dheader_t *header;
+	unsigned char *native;		// byte swapped copy backing buf, big-endian hosts only
+	// surface classification index, built by load_bsp once the ranges are validated, and shared by all the exporters
+	bsp_surface_info_t *surfaces;
+	int num_surfaces;
+	bsp_model_info_t *models;
+	int num_models;
+} bsp_t;
+
+// A drawable surface as a triangle list. Patches are tessellated, everything else points into the BSP.
+// Zero it before first use; it may then be reused for any number of surfaces, keeping its storage.
+typedef struct
+{
+	const bsp_surface_info_t *info;
+	const drawVert_t *verts;
+	int num_verts;
+	const int *indexes;
+	int num_indexes;
+	void *storage;				// tessellated geometry, owned by the mesh
+	size_t storage_size;
+	// A tessellated patch stays the grid it was subdivided to, verts and indexes NULL, until expand_bsp_mesh.
+	// The mesh is made of the listed rows and columns of it, two triangles per cell.
+	struct srfGridMesh_s *grid;
+	int grid_rows[MAX_GRID_SIZE], grid_columns[MAX_GRID_SIZE];
+	int num_rows, num_columns;
+} bsp_mesh_t;
+
+extern const char *get_bsp_surface_type(mapSurfaceType_t t);
+extern int check_range(long long offset, long long count, size_t elem_size, size_t total);
+extern int load_bsp(const char *in_name, const unsigned char *data, size_t size, const sink_t *sink, bsp_t *bsp);
+extern void free_bsp(bsp_t *bsp);
+extern const dmodel_t *get_bsp_model(const bsp_t *bsp, int model_index);
+extern const dshader_t *get_bsp_shader(const bsp_t *bsp, int shader_num);
+extern int reserve_bsp_mesh(bsp_mesh_t *mesh, int num_verts, int num_indexes);
+extern int get_bsp_mesh(const bsp_t *bsp, const bsp_surface_info_t *info, const sink_t *sink, bsp_mesh_t *mesh);
+extern int expand_bsp_mesh(bsp_mesh_t *mesh);
+extern void free_bsp_mesh_grid(bsp_mesh_t *mesh);
+extern void free_bsp_mesh(bsp_mesh_t *mesh);
+extern int simplify_bsp_mesh(bsp_mesh_t *mesh, const simplify_t *params);
+extern void hash_bsp_models(const bsp_t *bsp, unsigned int *hashes);
+extern int convert_bsp_to_obj(const bsp_t *bsp, const options_t *options, const sink_t *sink);
+
+// meshcache.c
+#define MESH_CACHE_IDENT	"MBMC"
+#define MESH_CACHE_VERSION	1
+
+// What the meshes went through, in the header's flags.
+enum
+{
+	MESH_CACHE_MERGED = 1,
+	MESH_CACHE_SIMPLIFIED = 2
+};
+
+typedef struct
+{
+	char ident[4];
+	int version;
+	int flags;
+	int num_models;
+} mesh_cache_header_t;
+
+// At the very end of the file, which is written in one pass.
+typedef struct
+{
+	unsigned int models_ofs;	// mesh_cache_model_t[num_models of the header]
+	unsigned int materials_ofs;	// dshader_t[num_materials]
+	int num_materials;
+	char ident[4];
+} mesh_cache_trailer_t;
+
+// One per BSP model, those without meshes included. The offsets are from the start of the file.
+typedef struct
+{
+	int num_verts, num_indexes, num_surfaces;
+	unsigned int hash;			// hash_bsp_models of the source model
+	unsigned int xyz_ofs, st_ofs, normal_ofs;	// float[num_verts * 3], [num_verts * 2], [num_verts * 3]
+	unsigned int indexes_ofs;	// unsigned int[num_indexes], model relative
+	unsigned int surfaces_ofs;	// mesh_cache_surface_t[num_surfaces]
+} mesh_cache_model_t;
+
+// A mesh of the model, as a range of its streams.
+typedef struct
+{
+	int material;				// into the material table
+	int surface;				// model relative index of the BSP surface, the first one of a merged group
+	int type;					// mapSurfaceType_t
+	int surface_flags;
+	int first_vert, num_verts;
+	int first_index, num_indexes;
+} mesh_cache_surface_t;
+
+// An opened cache, everything pointing into the file.
+typedef struct
+{
+	const char *name;
+	const unsigned char *buf;	// native byte order view of the file
+	size_t size;
+	unsigned char *native;		// byte swapped copy backing buf, big-endian hosts only
+	int flags;
+	const mesh_cache_model_t *models;
+	int num_models;
+	const dshader_t *materials;
+	int num_materials;
+} mesh_cache_t;
+
+typedef struct
+{
+	const float *xyz, *st, *normal;
+	const unsigned int *indexes;
+	const mesh_cache_surface_t *surfaces;
+} mesh_cache_streams_t;
+
+extern int convert_bsp_to_mesh_cache(const bsp_t *bsp, const options_t *options, const sink_t *sink);
+extern int open_mesh_cache(const char *in_name, const unsigned char *data, size_t size, const sink_t *sink,
+	mesh_cache_t *cache);
+extern void free_mesh_cache(mesh_cache_t *cache);
+extern void get_mesh_cache_streams(const mesh_cache_t *cache, int model_index, mesh_cache_streams_t *streams);
+extern int convert_mesh_cache_to_obj(const mesh_cache_t *cache, const options_t *options, const sink_t *sink);
+
+// collision.c
+extern int export_model_collision(const bsp_t *bsp, int model_index, const options_t *options, const sink_t *sink);
+
+// merge.c
+// Groups of coplanar planar surfaces of one model, each exported as a single mesh where its first surface would be.
+typedef struct
+{
+	int *next;					// next surface of the group, -1 after the last one; indexes are model relative
+	unsigned char *folded;		// set for surfaces exported as part of an earlier one's group
+	int num_meshes;				// meshes the model is left with
+	int num_groups;				// groups of more than one surface
+} planar_groups_t;
+
+extern int group_planar_surfaces(const bsp_t *bsp, const bsp_model_info_t *model_info, planar_groups_t *groups);
+extern void free_planar_groups(planar_groups_t *groups);
+extern int merge_planar_group(const bsp_t *bsp, const bsp_model_info_t *model_info, const planar_groups_t *groups,
+	int surf_index, bsp_mesh_t *mesh);
+
+// md3.c
+typedef struct
+{
+	const char *name;
+	const unsigned char *buf;	// native byte order view of the file
+	size_t size;
+	const md3Header_t *header;
+	const unsigned char *file;	// the span handed to load_md3, same as buf on little-endian hosts
+	unsigned char *native;		// byte swapped copy backing buf, big-endian hosts only
+	const sink_t *owner;		// set if file came from the sink's read callback
+} md3_model_t;
+
+extern int load_md3(const char *in_name, const unsigned char *data, size_t size, int frame,
+	const sink_t *sink, md3_model_t *model);
+extern int read_md3(const char *path, int frame, const sink_t *sink, md3_model_t *model);
+extern void free_md3(md3_model_t *model);
+extern const md3Surface_t *first_md3_surface(const md3_model_t *model);
+extern const md3Surface_t *next_md3_surface(const md3Surface_t *surf);
+extern const md3Tag_t *find_md3_tag(const md3_model_t *model, int frame, const char *name);
+extern void tag_to_transform(const md3Tag_t *tag, float transform[3][4]);
+extern void concat_transforms(const float a[3][4], const float b[3][4], float out[3][4]);
+extern void write_obj_space_transform(output_t *out, const float transform[3][4]);
+extern int write_md3_obj(const md3_model_t *model, output_t *out, int frame, const float transform[3][4],
+	const char *prefix, int vert_index_cum, const simplify_t *simplify, int materials);
+extern int convert_md3_to_obj(const md3_model_t *model, int frame, const char *out_name, const options_t *options,
+	const sink_t *sink);
+extern int convert_md3_parts_to_obj(const md3_model_t *model, int frame, const options_t *options,
+	const sink_t *sink);
+extern int convert_md3_lods_to_obj(const char *in_name, int frame, const options_t *options, const sink_t *sink);
+
+// anim.c
+extern int convert_md3_to_anim(const md3_model_t *model, const char *frame_range, const sink_t *sink);
+
+// vat.c
+extern int bake_md3_vat(const md3_model_t *model, const sink_t *sink);
+
+// entities.c
+extern void guess_base_path(const char *in_name, char *out, size_t out_size);
+extern int export_bsp_entities(const bsp_t *bsp, const options_t *options, const sink_t *sink,
+	output_t *instances);
+
+// foliage.c
+extern int export_foliage_surface(const bsp_t *bsp, const bsp_surface_info_t *info, int model_index, int surf_index,
+	const sink_t *sink, output_t *instances);
+extern void export_flare_surface(const bsp_surface_info_t *info, output_t *instances);
+
+// synth.c, for the benchmark and the regression harness; not part of the library
+typedef struct
+{
+	int planar, soups, patches;	// surfaces of each type
+	int grid;					// vertices along each side of planar and soup surfaces
+	int patch_min, patch_max;	// range of the patches' control grid sizes, 3 to MAX_PATCH_SIZE
+	unsigned int seed;
+	int tiles;					// planar surfaces are cut into tiles x tiles coplanar fragments, like a BSP compiler does
+	int brushes;				// solid boxes with a corner bevelled off, for collision
+	int foliage, flares;		// foliage surfaces of a few instances each, and flares
+	int misc_models;			// misc_model entities placing synth.md3 at various angles and scales
+} synth_bsp_t;
+
+typedef struct
+{
+	int surfaces, verts, frames, tags;
+	unsigned int seed;
+} synth_md3_t;
+
+// Both return a malloc'ed file image, or NULL if memory ran out.
+extern unsigned char *generate_bsp(const synth_bsp_t *params, size_t *size);
+extern unsigned char *generate_md3(const synth_md3_t *params, size_t *size);
+
 /// BEGIN GPL WOLFENSTEIN: ENEMY TERRITORY CODE
 typedef struct cplane_s {
 	vec3_t normal;
@@ -82,5 +566,5 @@ typedef struct srfGridMesh_s
 
 extern srfGridMesh_t *R_SubdividePatchToGrid( int width, int height,
 	drawVert_t points[MAX_PATCH_SIZE*MAX_PATCH_SIZE],
-	int r_subdivisions );
+	int r_subdivisions, stats_t *stats );
 /// END GPL WOLFENSTEIN: ENEMY TERRITORY CODE
\ No newline at end of file
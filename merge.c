@@ -0,0 +1,395 @@
+/*
+MD3 and/or BSP to OBJ converter
+Written by Leszek Godlewski <github@inequation.org>
+The code in this file is placed in the public domain.
+*/
+
+/*
+Coplanar planar surface merging. The BSP compiler splits brush faces along
+the BSP tree and fans every fragment on its own, so one wall easily becomes
+dozens of surfaces with the same shader, plane and texture projection, and
+every split line leaves its vertices in the OBJ.
+
+Planar surfaces that are flat (all normals along the plane), connected by
+shared vertex positions, on the same plane, with the same shader and the
+same affine texture mapping are grouped. Each group is welded into one mesh
+and retriangulated from its outline: the simplifier collapses the vertices
+the fragments' shared edges left inside it, while the outline, including any
+T-junction vertices that neighbouring surfaces may rely on, is locked.
+Texture coordinates are affine across the plane, so the bigger triangles
+interpolate the same ones the fragments did.
+*/
+
+#ifdef _MSC_VER
+	#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "md3bsp2ase.h"
+
+#define PLANE_EPSILON		0.01	// in map units
+#define NORMAL_EPSILON		0.00001	// 1 - the cosine between planes that are the same
+#define VERT_NORMAL_EPSILON	0.001	// 1 - the cosine between a vertex normal and its plane
+#define ST_EPSILON			0.001	// in texture repeats
+
+// A planar surface's plane and texture mapping, st = mapping * (xyz, 1).
+typedef struct
+{
+	int candidate;
+	double normal[3], dist;
+	double mapping[2][4];
+} planar_fit_t;
+
+// A vertex position in the table, as the surface and vertex it was first seen at.
+typedef struct
+{
+	int surf, vert;
+} position_t;
+
+static const drawVert_t *get_surface_verts(const bsp_t *bsp, const bsp_surface_info_t *info)
+{
+	return (const drawVert_t *)(bsp->buf + bsp->header->lumps[LUMP_DRAWVERTS].fileofs) + info->first_vert;
+}
+
+static const int *get_surface_indexes(const bsp_t *bsp, const bsp_surface_info_t *info)
+{
+	return (const int *)(bsp->buf + bsp->header->lumps[LUMP_DRAWINDEXES].fileofs) + info->first_index;
+}
+
+static double map_st(const planar_fit_t *fit, int k, const vec3_t xyz)
+{
+	return fit->mapping[k][0] * xyz[0] + fit->mapping[k][1] * xyz[1] + fit->mapping[k][2] * xyz[2]
+		+ fit->mapping[k][3];
+}
+
+// Whether all of a surface's vertices lie on the fit's plane with the texture coordinates its mapping gives them.
+static int verts_fit(const planar_fit_t *fit, const drawVert_t *verts, int num_verts)
+{
+	int i, k;
+
+	for (i = 0; i < num_verts; ++i)
+	{
+		if (fabs(DotProduct(fit->normal, verts[i].xyz) - fit->dist) > PLANE_EPSILON)
+			return 0;
+		for (k = 0; k < 2; ++k)
+		{
+			if (fabs(map_st(fit, k, verts[i].xyz) - verts[i].st[k]) > ST_EPSILON)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+Derives a planar surface's plane from its biggest triangle and solves for
+the texture mapping that reproduces that triangle's st without depending on
+the distance from the plane. Leaves fit->candidate clear for surfaces that
+can't be merged: not planar, curved normals, or a mapping that isn't affine.
+*/
+static void fit_planar_surface(const bsp_t *bsp, const bsp_surface_info_t *info, planar_fit_t *fit)
+{
+	const drawVert_t *verts = get_surface_verts(bsp, info), *a, *b, *c;
+	const int *indexes = get_surface_indexes(bsp, info);
+	double e1[3], e2[3], n[3], d1[3], d2[3], len, best = 0, det, ds1, ds2;
+	int i, k, tri = -1;
+
+	fit->candidate = 0;
+	if (info->kind != SURFACE_MESH || info->type != MST_PLANAR || info->num_indexes < 3)
+		return;
+
+	for (i = 0; i < info->num_indexes; i += 3)
+	{
+		a = &verts[indexes[i]];
+		b = &verts[indexes[i + 1]];
+		c = &verts[indexes[i + 2]];
+		VectorSubtract(b->xyz, a->xyz, e1);
+		VectorSubtract(c->xyz, a->xyz, e2);
+		n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+		n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+		n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+		len = DotProduct(n, n);
+		if (len > best)
+		{
+			best = len;
+			tri = i;
+		}
+	}
+	if (tri < 0 || best < 1e-6)
+		return;
+
+	a = &verts[indexes[tri]];
+	b = &verts[indexes[tri + 1]];
+	c = &verts[indexes[tri + 2]];
+	VectorSubtract(b->xyz, a->xyz, e1);
+	VectorSubtract(c->xyz, a->xyz, e2);
+	n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+	n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+	n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+	len = sqrt(best);
+	for (k = 0; k < 3; ++k)
+		fit->normal[k] = n[k] / len;
+	fit->dist = DotProduct(fit->normal, a->xyz);
+
+	// dual basis of the triangle's edges within the plane: d1 . e1 = 1, d1 . e2 = 0 and the other way round
+	d1[0] = e2[1] * fit->normal[2] - e2[2] * fit->normal[1];
+	d1[1] = e2[2] * fit->normal[0] - e2[0] * fit->normal[2];
+	d1[2] = e2[0] * fit->normal[1] - e2[1] * fit->normal[0];
+	d2[0] = fit->normal[1] * e1[2] - fit->normal[2] * e1[1];
+	d2[1] = fit->normal[2] * e1[0] - fit->normal[0] * e1[2];
+	d2[2] = fit->normal[0] * e1[1] - fit->normal[1] * e1[0];
+	det = len;
+	for (k = 0; k < 2; ++k)
+	{
+		ds1 = (double)b->st[k] - a->st[k];
+		ds2 = (double)c->st[k] - a->st[k];
+		for (i = 0; i < 3; ++i)
+			fit->mapping[k][i] = (ds1 * d1[i] + ds2 * d2[i]) / det;
+		fit->mapping[k][3] = a->st[k] - (fit->mapping[k][0] * a->xyz[0] + fit->mapping[k][1] * a->xyz[1]
+			+ fit->mapping[k][2] * a->xyz[2]);
+	}
+
+	for (i = 0; i < info->num_verts; ++i)
+	{
+		if (DotProduct(fit->normal, verts[i].normal) < 1 - VERT_NORMAL_EPSILON)
+			return;
+	}
+	fit->candidate = verts_fit(fit, verts, info->num_verts);
+}
+
+static int same_plane(const bsp_surface_info_t *a, const planar_fit_t *fa, const bsp_surface_info_t *b,
+	const planar_fit_t *fb)
+{
+	return a->surf->shaderNum == b->surf->shaderNum
+		&& DotProduct(fa->normal, fb->normal) >= 1 - NORMAL_EPSILON
+		&& fabs(fa->dist - fb->dist) <= PLANE_EPSILON;
+}
+
+static int find_root(int *parent, int i)
+{
+	while (parent[i] != i)
+	{
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	return i;
+}
+
+// Joins the groups of two surfaces if their first surfaces map textures the same way.
+static void join_groups(const bsp_t *bsp, const bsp_surface_info_t *infos, const planar_fit_t *fits, int *parent,
+	int a, int b)
+{
+	a = find_root(parent, a);
+	b = find_root(parent, b);
+	if (a == b
+		|| !verts_fit(&fits[a], get_surface_verts(bsp, &infos[b]), infos[b].num_verts)
+		|| !verts_fit(&fits[b], get_surface_verts(bsp, &infos[a]), infos[a].num_verts))
+	{
+		return;
+	}
+	// the lowest surface index leads, it's where the group is exported
+	if (a < b)
+		parent[b] = a;
+	else
+		parent[a] = b;
+}
+
+static unsigned int hash_position(const float *xyz, int shader)
+{
+	unsigned int h = 2166136261u ^ (unsigned int)shader, bits;
+	int i;
+
+	for (i = 0; i < 3; ++i)
+	{
+		// +0 and -0 are the same position
+		bits = 0;
+		if (xyz[i] != 0)
+			memcpy(&bits, &xyz[i], sizeof(bits));
+		h = (h ^ bits) * 16777619u;
+		h ^= h >> 15;
+	}
+	return h;
+}
+
+/*
+Groups the model's mergeable planar surfaces. Surfaces are joined when they
+have a vertex at the same position and share the plane, the shader and the
+texture mapping. Returns 0 on success, 11 if memory ran out.
+*/
+int group_planar_surfaces(const bsp_t *bsp, const bsp_model_info_t *model_info, planar_groups_t *groups)
+{
+	const bsp_surface_info_t *infos = bsp->surfaces + model_info->first_surface;
+	const drawVert_t *verts;
+	planar_fit_t *fits;
+	position_t *table = NULL, *other;
+	int *parent, *tail;
+	int num_surfaces = model_info->num_surfaces, total_verts = 0, size = 16, i, j, slot, root;
+
+	memset(groups, 0, sizeof(*groups));
+	groups->num_meshes = model_info->num_meshes;
+	fits = malloc(max(num_surfaces, 1) * sizeof(*fits));
+	parent = malloc(max(num_surfaces, 1) * sizeof(*parent));
+	tail = malloc(max(num_surfaces, 1) * sizeof(*tail));
+	groups->next = malloc(max(num_surfaces, 1) * sizeof(*groups->next));
+	groups->folded = calloc(max(num_surfaces, 1), 1);
+	if (fits && parent && tail && groups->next && groups->folded)
+	{
+		for (i = 0; i < num_surfaces; ++i)
+		{
+			fit_planar_surface(bsp, &infos[i], &fits[i]);
+			parent[i] = i;
+			if (fits[i].candidate)
+				total_verts += infos[i].num_verts;
+		}
+		while (size < total_verts * 2)
+			size *= 2;
+		table = malloc(size * sizeof(*table));
+	}
+	if (!table)
+	{
+		free(fits);
+		free(parent);
+		free(tail);
+		free_planar_groups(groups);
+		return 11;
+	}
+
+	// every vertex position on a plane points at the first surface seen there
+	for (i = 0; i < size; ++i)
+		table[i].surf = -1;
+	for (i = 0; i < num_surfaces; ++i)
+	{
+		if (!fits[i].candidate)
+			continue;
+		verts = get_surface_verts(bsp, &infos[i]);
+		for (j = 0; j < infos[i].num_verts; ++j)
+		{
+			const float *p = verts[j].xyz;
+
+			for (slot = hash_position(p, infos[i].surf->shaderNum) & (size - 1);
+				(other = &table[slot])->surf >= 0; slot = (slot + 1) & (size - 1))
+			{
+				const float *q = get_surface_verts(bsp, &infos[other->surf])[other->vert].xyz;
+
+				if (p[0] == q[0] && p[1] == q[1] && p[2] == q[2]
+					&& same_plane(&infos[i], &fits[i], &infos[other->surf], &fits[other->surf]))
+				{
+					break;
+				}
+			}
+			if (other->surf < 0)
+			{
+				other->surf = i;
+				other->vert = j;
+			}
+			else if (other->surf != i)
+			{
+				join_groups(bsp, infos, fits, parent, i, other->surf);
+			}
+		}
+	}
+
+	// chain every group's surfaces in order behind its first one
+	for (i = 0; i < num_surfaces; ++i)
+	{
+		groups->next[i] = -1;
+		tail[i] = i;
+		root = find_root(parent, i);
+		if (root == i)
+			continue;
+		if (groups->next[root] < 0)
+			++groups->num_groups;
+		groups->next[tail[root]] = i;
+		tail[root] = i;
+		groups->folded[i] = 1;
+		--groups->num_meshes;
+	}
+
+	free(table);
+	free(fits);
+	free(parent);
+	free(tail);
+	return 0;
+}
+
+void free_planar_groups(planar_groups_t *groups)
+{
+	free(groups->next);
+	free(groups->folded);
+	memset(groups, 0, sizeof(*groups));
+}
+
+/*
+Builds the mesh of the group led by the given model surface: its surfaces'
+triangles, welded and retriangulated from the outline. Returns 0 on success,
+11 if memory ran out.
+*/
+int merge_planar_group(const bsp_t *bsp, const bsp_model_info_t *model_info, const planar_groups_t *groups,
+	int surf_index, bsp_mesh_t *mesh)
+{
+	const bsp_surface_info_t *infos = bsp->surfaces + model_info->first_surface;
+	const simplify_t params = { 1, 0.f, PLANE_EPSILON };
+	const drawVert_t *src_verts;
+	const int *src_indexes;
+	drawVert_t *verts;
+	float *xyz;
+	int *indexes, *out_indexes, *order;
+	int num_verts = 0, num_indexes = 0, i, j, retcode = 11;
+
+	// the mesh may still hold the grid of a patch it was used for before
+	free_bsp_mesh_grid(mesh);
+	for (i = surf_index; i >= 0; i = groups->next[i])
+	{
+		num_verts += infos[i].num_verts;
+		num_indexes += infos[i].num_indexes;
+	}
+
+	verts = malloc(max(num_verts, 1) * sizeof(*verts));
+	xyz = malloc(max(num_verts, 1) * 3 * sizeof(*xyz));
+	indexes = malloc(max(num_indexes, 1) * sizeof(*indexes));
+	out_indexes = malloc(max(num_indexes, 1) * sizeof(*out_indexes));
+	order = malloc(max(num_verts, 1) * sizeof(*order));
+	if (verts && xyz && indexes && out_indexes && order)
+	{
+		num_verts = num_indexes = 0;
+		for (i = surf_index; i >= 0; i = groups->next[i])
+		{
+			src_verts = get_surface_verts(bsp, &infos[i]);
+			src_indexes = get_surface_indexes(bsp, &infos[i]);
+			for (j = 0; j < infos[i].num_verts; ++j)
+			{
+				verts[num_verts + j] = src_verts[j];
+				VectorCopy(src_verts[j].xyz, xyz + (num_verts + j) * 3);
+			}
+			for (j = 0; j < infos[i].num_indexes; ++j)
+				indexes[num_indexes + j] = src_indexes[j] + num_verts;
+			num_verts += infos[i].num_verts;
+			num_indexes += infos[i].num_indexes;
+		}
+
+		// the surfaces' vertices at one position weld into the first one, the others only differ within the epsilons
+		num_indexes = simplify_mesh(xyz, NULL, 0, num_verts, indexes, num_indexes, &params, out_indexes);
+		if (num_indexes >= 0 && (num_verts = compact_mesh(out_indexes, num_indexes, num_verts, order)) >= 0
+			&& reserve_bsp_mesh(mesh, num_verts, num_indexes) == 0)
+		{
+			for (i = 0; i < num_verts; ++i)
+				((drawVert_t *)mesh->storage)[i] = verts[order[i]];
+			memcpy((drawVert_t *)mesh->storage + num_verts, out_indexes, num_indexes * sizeof(*out_indexes));
+			mesh->info = &infos[surf_index];
+			mesh->verts = mesh->storage;
+			mesh->num_verts = num_verts;
+			mesh->indexes = (const int *)((drawVert_t *)mesh->storage + num_verts);
+			mesh->num_indexes = num_indexes;
+			retcode = 0;
+		}
+	}
+	free(verts);
+	free(xyz);
+	free(indexes);
+	free(out_indexes);
+	free(order);
+	return retcode;
+}
@@ -0,0 +1,770 @@
+/*
+MD3 and/or BSP to OBJ converter
+Written by Leszek Godlewski <github@inequation.org>
+The code in this file is placed in the public domain.
+*/
+
+/*
+Mesh cache: the meshes a map's models convert to, tessellated, merged and
+simplified as asked, stored so that exporters can use them straight from a
+memory mapped file instead of going through the BSP again. Everything is
+little-endian and made of 32-bit fields, except for the identifiers and the
+material names; every block starts at a multiple of 16 bytes:
+
+	mesh_cache_header_t			"MBMC", MESH_CACHE_VERSION, flags, num_models
+	for each model with meshes:
+		float	xyz[num_verts * 3]
+		float	st[num_verts * 2]
+		float	normal[num_verts * 3]
+		uint	indexes[num_indexes]		model relative, three per triangle
+		mesh_cache_surface_t	surfaces[num_surfaces]
+	dshader_t	materials[num_materials]	name, surface and content flags
+	mesh_cache_model_t	models[num_models]	one per BSP model, offsets into the file
+	mesh_cache_trailer_t					ends the file, "MBMC" last
+
+The tables come last, so the cache is written in one pass as the models are
+converted. A model's surfaces are its meshes in the order the OBJ has them,
+each a range of its streams, so that the whole model can also be drawn with
+one index buffer. The vertices aren't welded across surfaces, like in the
+OBJ; they rarely share texture coordinates and normals anyway. The models
+carry hash_bsp_models' hashes to tell which ones a newer BSP changed.
+*/
+
+#ifdef _MSC_VER
+	#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "md3bsp2ase.h"
+
+#define CACHE_ALIGN			16
+#define CACHE_BATCH_SIZE	64	// meshes built, or formatted, at a time
+
+// A model's streams as they are built, before they are written out.
+typedef struct
+{
+	float *xyz, *st, *normal;
+	unsigned int *indexes;
+	mesh_cache_surface_t *surfaces;
+	int num_verts, max_verts;
+	int num_indexes, max_indexes;
+	int num_surfaces, max_surfaces;
+} cache_builder_t;
+
+typedef struct
+{
+	output_t out;
+	size_t offset;				// bytes written so far
+	unsigned int words[1024];	// byte swapping buffer, big-endian hosts only
+} cache_writer_t;
+
+typedef struct
+{
+	const bsp_surface_info_t *info;
+	int surf_index;
+	int merge;					// the mesh is still to be merged from the surface's planar group
+	bsp_mesh_t mesh;
+} cache_slot_t;
+
+static void free_cache_builder(cache_builder_t *b)
+{
+	free(b->xyz);
+	free(b->st);
+	free(b->normal);
+	free(b->indexes);
+	free(b->surfaces);
+	memset(b, 0, sizeof(*b));
+}
+
+// Makes room for the given number of vertices, indexes and surfaces more. Returns 0 or 11.
+static int reserve_cache_builder(cache_builder_t *b, int num_verts, int num_indexes, int num_surfaces)
+{
+	void *p;
+	int n;
+
+	if (b->num_verts + num_verts > b->max_verts)
+	{
+		n = max(b->num_verts + num_verts, b->max_verts * 2);
+		if (!(p = realloc(b->xyz, n * 3 * sizeof(*b->xyz))))
+			return 11;
+		b->xyz = p;
+		if (!(p = realloc(b->st, n * 2 * sizeof(*b->st))))
+			return 11;
+		b->st = p;
+		if (!(p = realloc(b->normal, n * 3 * sizeof(*b->normal))))
+			return 11;
+		b->normal = p;
+		b->max_verts = n;
+	}
+	if (b->num_indexes + num_indexes > b->max_indexes)
+	{
+		n = max(b->num_indexes + num_indexes, b->max_indexes * 2);
+		if (!(p = realloc(b->indexes, n * sizeof(*b->indexes))))
+			return 11;
+		b->indexes = p;
+		b->max_indexes = n;
+	}
+	if (b->num_surfaces + num_surfaces > b->max_surfaces)
+	{
+		n = max(b->num_surfaces + num_surfaces, b->max_surfaces * 2);
+		if (!(p = realloc(b->surfaces, n * sizeof(*b->surfaces))))
+			return 11;
+		b->surfaces = p;
+		b->max_surfaces = n;
+	}
+	return 0;
+}
+
+static void append_vert(cache_builder_t *b, int i, const drawVert_t *vert)
+{
+	VectorCopy(vert->xyz, b->xyz + i * 3);
+	b->st[i * 2 + 0] = vert->st[0];
+	b->st[i * 2 + 1] = vert->st[1];
+	VectorCopy(vert->normal, b->normal + i * 3);
+}
+
+// Patches go into the streams straight from their grid, row by row.
+static void append_grid(cache_builder_t *b, const bsp_mesh_t *mesh)
+{
+	const srfGridMesh_t *grid = mesh->grid;
+	const drawVert_t *row_verts;
+	unsigned int *tri = b->indexes + b->num_indexes, index;
+	int row, column, i = b->num_verts;
+
+	for (row = 0; row < mesh->num_rows; ++row)
+	{
+		row_verts = grid->verts + mesh->grid_rows[row] * grid->width;
+		for (column = 0; column < mesh->num_columns; ++column)
+			append_vert(b, i++, row_verts + mesh->grid_columns[column]);
+	}
+	// the triangles in the order expand_bsp_mesh lists them
+	for (row = 0; row < mesh->num_rows - 1; ++row)
+	{
+		for (column = 0; column < mesh->num_columns - 1; ++column, tri += 6)
+		{
+			index = (unsigned int)(b->num_verts + row * mesh->num_columns + column);
+			tri[0] = index;
+			tri[1] = index + mesh->num_columns;
+			tri[2] = index + 1;
+			tri[3] = index + 1;
+			tri[4] = index + mesh->num_columns;
+			tri[5] = index + mesh->num_columns + 1;
+		}
+	}
+}
+
+static void append_mesh(cache_builder_t *b, const bsp_mesh_t *mesh, int material, int surf_index)
+{
+	mesh_cache_surface_t *surface = &b->surfaces[b->num_surfaces++];
+	int i;
+
+	surface->material = material;
+	surface->surface = surf_index;
+	surface->type = mesh->info->type;
+	surface->surface_flags = mesh->info->surface_flags;
+	surface->first_vert = b->num_verts;
+	surface->num_verts = mesh->num_verts;
+	surface->first_index = b->num_indexes;
+	surface->num_indexes = mesh->num_indexes;
+
+	if (mesh->grid)
+		append_grid(b, mesh);
+	else
+	{
+		for (i = 0; i < mesh->num_verts; ++i)
+			append_vert(b, b->num_verts + i, &mesh->verts[i]);
+		for (i = 0; i < mesh->num_indexes; ++i)
+			b->indexes[b->num_indexes + i] = (unsigned int)(mesh->indexes[i] + b->num_verts);
+	}
+	b->num_verts += mesh->num_verts;
+	b->num_indexes += mesh->num_indexes;
+}
+
+// Writes 32-bit fields in little-endian order.
+static void write_words(cache_writer_t *w, const void *data, size_t count)
+{
+	const unsigned int *p = data;
+	size_t n;
+
+	w->offset += count * 4;
+	if (!HOST_BIG_ENDIAN)
+	{
+		output_write(&w->out, data, count * 4);
+		return;
+	}
+	for (; count > 0; count -= n, p += n)
+	{
+		n = min(count, sizeof(w->words) / sizeof(w->words[0]));
+		memcpy(w->words, p, n * 4);
+		swap_longs(w->words, n);
+		output_write(&w->out, w->words, n * 4);
+	}
+}
+
+// Starts the next block at an aligned offset and returns the offset.
+static unsigned int align_block(cache_writer_t *w)
+{
+	static const unsigned char zeros[CACHE_ALIGN];
+	size_t padding = (CACHE_ALIGN - w->offset % CACHE_ALIGN) % CACHE_ALIGN;
+
+	output_write(&w->out, zeros, padding);
+	w->offset += padding;
+	return (unsigned int)w->offset;
+}
+
+static void write_materials(cache_writer_t *w, const dshader_t *const *materials, int num_materials)
+{
+	dshader_t material;
+	int i;
+
+	for (i = 0; i < num_materials; ++i)
+	{
+		material = *materials[i];
+		if (HOST_BIG_ENDIAN)
+			swap_longs(material.shader, sizeof(material.shader) / 4);
+		write_words(w, &material, sizeof(material) / 4);
+	}
+}
+
+// Builds a model's meshes a batch at a time and writes out its streams. Returns 0 or 11.
+static int write_cache_model(const bsp_t *bsp, int model_index, const options_t *options, const sink_t *sink,
+	cache_writer_t *w, cache_builder_t *b, cache_slot_t *slots, int *material_of, const dshader_t **materials,
+	int *num_materials, mesh_cache_model_t *record)
+{
+	const bsp_model_info_t *model_info = &bsp->models[model_index];
+	const bsp_surface_info_t *info;
+	planar_groups_t groups;
+	char progress_name[32];
+	double start, next_report = 0;
+	int surf_index, count, shader_num, failed, retcode = 0, i;
+
+	memset(&groups, 0, sizeof(groups));
+	b->num_verts = b->num_indexes = b->num_surfaces = 0;
+	record->num_surfaces = model_info->num_meshes;
+	if (options->merge_planar && model_info->num_meshes > 1)
+	{
+		start = get_time();
+		retcode = group_planar_surfaces(bsp, model_info, &groups);
+		add_time(sink->stats, STAGE_MERGE, get_time() - start);
+		if (retcode != 0)
+			return retcode;
+		record->num_surfaces = groups.num_meshes;
+	}
+	// the index's totals bound the streams, so they normally don't grow while the model is built
+	if ((retcode = reserve_cache_builder(b, model_info->out_verts, model_info->out_indexes, record->num_surfaces)) != 0)
+	{
+		free_planar_groups(&groups);
+		return retcode;
+	}
+	sprintf(progress_name, "model #%d", model_index);
+
+	for (surf_index = 0, info = bsp->surfaces + model_info->first_surface;
+		surf_index < model_info->num_surfaces && !retcode;)
+	{
+		// build stage, on this thread like the OBJ exporter's
+		for (count = 0; count < CACHE_BATCH_SIZE && surf_index < model_info->num_surfaces && !retcode;
+			++surf_index, ++info)
+		{
+			if (info->kind != SURFACE_MESH || (groups.folded && groups.folded[surf_index]))
+				continue;
+			slots[count].merge = groups.next && groups.next[surf_index] >= 0;
+			if (!slots[count].merge && (retcode = get_bsp_mesh(bsp, info, sink, &slots[count].mesh)) != 0)
+				break;
+			slots[count].info = info;
+			slots[count].surf_index = surf_index;
+			++count;
+		}
+		if (retcode || !count)
+			break;
+
+		// merge and simplify stages
+		start = get_time();
+		failed = 0;
+#ifdef _OPENMP
+		#pragma omp parallel for schedule(dynamic) reduction(|:failed)
+#endif
+		for (i = 0; i < count; ++i)
+		{
+			if (slots[i].merge)
+			{
+				failed |= merge_planar_group(bsp, model_info, &groups, slots[i].surf_index,
+					&slots[i].mesh) != 0;
+			}
+		}
+		add_time(sink->stats, STAGE_MERGE, get_time() - start);
+		if (!failed && options->simplify.enabled)
+		{
+			start = get_time();
+#ifdef _OPENMP
+			#pragma omp parallel for schedule(dynamic) reduction(|:failed)
+#endif
+			for (i = 0; i < count; ++i)
+				failed |= simplify_bsp_mesh(&slots[i].mesh, &options->simplify) != 0;
+			add_time(sink->stats, STAGE_SIMPLIFY, get_time() - start);
+		}
+		if (failed)
+		{
+			retcode = 11;
+			break;
+		}
+
+		for (i = 0; i < count && !retcode; ++i)
+		{
+			if ((retcode = reserve_cache_builder(b, slots[i].mesh.num_verts, slots[i].mesh.num_indexes, 1)) != 0)
+				break;
+			shader_num = slots[i].info->surf->shaderNum;
+			if (material_of[shader_num] < 0)
+			{
+				material_of[shader_num] = *num_materials;
+				materials[(*num_materials)++] = slots[i].info->shader;
+			}
+			append_mesh(b, &slots[i].mesh, material_of[shader_num], slots[i].surf_index);
+			free_bsp_mesh_grid(&slots[i].mesh);
+		}
+		sink_progress(sink, &next_report, progress_name, b->num_surfaces, record->num_surfaces);
+	}
+	free_planar_groups(&groups);
+	if (retcode)
+		return retcode;
+
+	record->num_verts = b->num_verts;
+	record->num_indexes = b->num_indexes;
+	record->num_surfaces = b->num_surfaces;
+	if (!b->num_surfaces)
+		return 0;
+
+	start = get_time();
+	record->xyz_ofs = align_block(w);
+	write_words(w, b->xyz, b->num_verts * 3);
+	record->st_ofs = align_block(w);
+	write_words(w, b->st, b->num_verts * 2);
+	record->normal_ofs = align_block(w);
+	write_words(w, b->normal, b->num_verts * 3);
+	record->indexes_ofs = align_block(w);
+	write_words(w, b->indexes, b->num_indexes);
+	record->surfaces_ofs = align_block(w);
+	write_words(w, b->surfaces, b->num_surfaces * sizeof(*b->surfaces) / 4);
+	add_time(sink->stats, STAGE_FORMAT, get_time() - start);
+
+	add_count(sink->stats, COUNT_SURFACES, b->num_surfaces);
+	add_count(sink->stats, COUNT_VERTICES, b->num_verts);
+	add_count(sink->stats, COUNT_TRIANGLES, b->num_indexes / 3);
+	return 0;
+}
+
+int convert_bsp_to_mesh_cache(const bsp_t *bsp, const options_t *options, const sink_t *sink)
+{
+	cache_writer_t *w;
+	cache_builder_t builder;
+	cache_slot_t *slots;
+	mesh_cache_header_t header;
+	mesh_cache_trailer_t trailer;
+	mesh_cache_model_t *models;
+	const dshader_t **materials;
+	unsigned int *hashes;
+	sink_t raw;
+	int *material_of;
+	int num_shaders, num_materials = 0, model_index, retcode, closed, i;
+
+	// compressed, the cache couldn't be mapped
+	raw = *sink;
+	raw.compression = 0;
+
+	num_shaders = bsp->header->lumps[LUMP_SHADERS].filelen / (int)sizeof(dshader_t);
+	memset(&builder, 0, sizeof(builder));
+	w = malloc(sizeof(*w));
+	slots = calloc(CACHE_BATCH_SIZE, sizeof(*slots));
+	models = calloc(max(bsp->num_models, 1), sizeof(*models));
+	hashes = malloc(max(bsp->num_models, 1) * sizeof(*hashes));
+	material_of = malloc(max(num_shaders, 1) * sizeof(*material_of));
+	materials = malloc(max(num_shaders, 1) * sizeof(*materials));
+	if (!w || !slots || !models || !hashes || !material_of || !materials)
+	{
+		sink_log(sink, LOG_ERROR, "Memory allocation failed");
+		free(w);
+		free(slots);
+		free(models);
+		free(hashes);
+		free(material_of);
+		free(materials);
+		return 11;
+	}
+	for (i = 0; i < num_shaders; ++i)
+		material_of[i] = -1;
+	hash_bsp_models(bsp, hashes);
+
+	if ((retcode = open_output(&w->out, &raw, NULL)) == 0)
+	{
+		w->offset = 0;
+		memcpy(header.ident, MESH_CACHE_IDENT, sizeof(header.ident));
+		header.version = MESH_CACHE_VERSION;
+		header.flags = (options->merge_planar ? MESH_CACHE_MERGED : 0)
+			| (options->simplify.enabled ? MESH_CACHE_SIMPLIFIED : 0);
+		header.num_models = bsp->num_models;
+		output_write(&w->out, header.ident, sizeof(header.ident));
+		w->offset += sizeof(header.ident);
+		write_words(w, &header.version, 3);
+
+		for (model_index = 0; model_index < bsp->num_models && !retcode; ++model_index)
+		{
+			models[model_index].hash = hashes[model_index];
+			if (bsp->models[model_index].num_meshes < 1)
+				continue;
+			sink_log(sink, LOG_INFO, "Processing model #%d: %d exportable surfaces", model_index,
+				bsp->models[model_index].num_meshes);
+			retcode = write_cache_model(bsp, model_index, options, sink, w, &builder, slots, material_of, materials,
+				&num_materials, &models[model_index]);
+			if (retcode == 11)
+				sink_log(sink, LOG_ERROR, "Memory allocation failed");
+		}
+
+		if (!retcode)
+		{
+			trailer.materials_ofs = align_block(w);
+			write_materials(w, materials, num_materials);
+			trailer.models_ofs = align_block(w);
+			write_words(w, models, bsp->num_models * sizeof(*models) / 4);
+			trailer.num_materials = num_materials;
+			memcpy(trailer.ident, MESH_CACHE_IDENT, sizeof(trailer.ident));
+			align_block(w);
+			write_words(w, &trailer, 3);
+			output_write(&w->out, trailer.ident, sizeof(trailer.ident));
+			w->offset += sizeof(trailer.ident);
+			// the offsets are 32-bit
+			if (w->offset > 0xFFFFFFFFu)
+			{
+				sink_log(sink, LOG_ERROR, "The mesh cache would take more than 4 GB");
+				retcode = 18;
+			}
+		}
+
+		closed = close_output(&w->out);
+		retcode = retcode ? retcode : closed;
+	}
+
+	for (i = 0; i < CACHE_BATCH_SIZE; ++i)
+		free_bsp_mesh(&slots[i].mesh);
+	free_cache_builder(&builder);
+	free(w);
+	free(slots);
+	free(models);
+	free(hashes);
+	free(material_of);
+	free(materials);
+	return retcode;
+}
+
+// Checks that a block of count elements at offset lies within the file and is aligned for its fields.
+static int check_block(const mesh_cache_t *cache, unsigned int offset, long long count, size_t elem_size)
+{
+	return !(offset & 3) && check_range(offset, count, elem_size, cache->size);
+}
+
+// Everything is checked here, so that exporters can take the cache as it is.
+static int validate_mesh_cache(const mesh_cache_t *cache, const sink_t *sink)
+{
+	const mesh_cache_model_t *model;
+	const mesh_cache_surface_t *surface;
+	mesh_cache_streams_t streams;
+	int i, j, k;
+
+	for (i = 0; i < cache->num_materials; ++i)
+	{
+		if (!memchr(cache->materials[i].shader, 0, sizeof(cache->materials[i].shader)))
+		{
+			sink_log(sink, LOG_ERROR, "Corrupt mesh cache: material #%d has an unterminated name", i);
+			return 19;
+		}
+	}
+
+	for (i = 0, model = cache->models; i < cache->num_models; ++i, ++model)
+	{
+		if (model->num_verts < 0 || model->num_indexes < 0 || model->num_surfaces < 0)
+		{
+			sink_log(sink, LOG_ERROR, "Corrupt mesh cache: model #%d has a negative size", i);
+			return 19;
+		}
+		if (!model->num_surfaces)
+			continue;
+		if (!check_block(cache, model->xyz_ofs, model->num_verts, 3 * sizeof(float))
+			|| !check_block(cache, model->st_ofs, model->num_verts, 2 * sizeof(float))
+			|| !check_block(cache, model->normal_ofs, model->num_verts, 3 * sizeof(float))
+			|| !check_block(cache, model->indexes_ofs, model->num_indexes, sizeof(unsigned int))
+			|| !check_block(cache, model->surfaces_ofs, model->num_surfaces, sizeof(mesh_cache_surface_t)))
+		{
+			sink_log(sink, LOG_ERROR, "Corrupt mesh cache: model #%d is out of bounds", i);
+			return 19;
+		}
+
+		get_mesh_cache_streams(cache, i, &streams);
+		for (j = 0, surface = streams.surfaces; j < model->num_surfaces; ++j, ++surface)
+		{
+			if ((unsigned int)surface->material >= (unsigned int)cache->num_materials
+				|| !check_range(surface->first_vert, surface->num_verts, 1, model->num_verts)
+				|| !check_range(surface->first_index, surface->num_indexes, 1, model->num_indexes)
+				|| surface->num_indexes % 3)
+			{
+				sink_log(sink, LOG_ERROR, "Corrupt mesh cache: surface #%d of model #%d is out of bounds", j, i);
+				return 19;
+			}
+			for (k = 0; k < surface->num_indexes; ++k)
+			{
+				if (streams.indexes[surface->first_index + k] - (unsigned int)surface->first_vert
+					>= (unsigned int)surface->num_verts)
+				{
+					sink_log(sink, LOG_ERROR, "Corrupt mesh cache: surface #%d of model #%d indexes a missing "
+						"vertex", j, i);
+					return 19;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+int open_mesh_cache(const char *in_name, const unsigned char *data, size_t size, const sink_t *sink,
+	mesh_cache_t *cache)
+{
+	const mesh_cache_header_t *header;
+	const mesh_cache_trailer_t *trailer;
+	double start;
+	int retcode;
+
+	memset(cache, 0, sizeof(*cache));
+
+	if (size < sizeof(*header) + sizeof(*trailer) || size % 4
+		|| memcmp(data, MESH_CACHE_IDENT, 4) || memcmp(data + size - 4, MESH_CACHE_IDENT, 4))
+	{
+		sink_log(sink, LOG_ERROR, "Not a valid mesh cache");
+		return 13;
+	}
+
+	// everything past this point reads the file in native byte order
+	if (HOST_BIG_ENDIAN)
+	{
+		if (!(cache->native = malloc(size)))
+		{
+			sink_log(sink, LOG_ERROR, "Memory allocation failed");
+			return 11;
+		}
+		memcpy(cache->native, data, size);
+		swap_mesh_cache(cache->native, size);
+		data = cache->native;
+	}
+	header = (const mesh_cache_header_t *)data;
+	trailer = (const mesh_cache_trailer_t *)(data + size - sizeof(*trailer));
+
+	if (header->version != MESH_CACHE_VERSION)
+	{
+		sink_log(sink, LOG_ERROR, "Unsupported mesh cache version %d", header->version);
+		free_mesh_cache(cache);
+		return 14;
+	}
+
+	cache->name = in_name;
+	cache->buf = data;
+	cache->size = size;
+	cache->flags = header->flags;
+	cache->num_models = header->num_models;
+	cache->num_materials = trailer->num_materials;
+	if (cache->num_models < 0 || cache->num_materials < 0
+		|| !check_block(cache, trailer->models_ofs, cache->num_models, sizeof(mesh_cache_model_t))
+		|| !check_block(cache, trailer->materials_ofs, cache->num_materials, sizeof(dshader_t)))
+	{
+		sink_log(sink, LOG_ERROR, "Corrupt mesh cache: the tables are out of bounds");
+		free_mesh_cache(cache);
+		return 19;
+	}
+	cache->models = (const mesh_cache_model_t *)(data + trailer->models_ofs);
+	cache->materials = (const dshader_t *)(data + trailer->materials_ofs);
+
+	start = get_time();
+	retcode = validate_mesh_cache(cache, sink);
+	add_time(sink->stats, STAGE_VALIDATE, get_time() - start);
+	if (retcode != 0)
+		free_mesh_cache(cache);
+	return retcode;
+}
+
+void free_mesh_cache(mesh_cache_t *cache)
+{
+	free(cache->native);
+	memset(cache, 0, sizeof(*cache));
+}
+
+void get_mesh_cache_streams(const mesh_cache_t *cache, int model_index, mesh_cache_streams_t *streams)
+{
+	const mesh_cache_model_t *model = &cache->models[model_index];
+
+	streams->xyz = (const float *)(cache->buf + model->xyz_ofs);
+	streams->st = (const float *)(cache->buf + model->st_ofs);
+	streams->normal = (const float *)(cache->buf + model->normal_ofs);
+	streams->indexes = (const unsigned int *)(cache->buf + model->indexes_ofs);
+	streams->surfaces = (const mesh_cache_surface_t *)(cache->buf + model->surfaces_ofs);
+}
+
+// Same text as the map exporter writes for the surface, so that both ways to an OBJ agree.
+static void write_cache_surface_obj(output_t *out, const mesh_cache_t *cache, const mesh_cache_streams_t *streams,
+	int surface_index, int num_surfaces)
+{
+	const mesh_cache_surface_t *surface = &streams->surfaces[surface_index];
+	const float *v;
+	const unsigned int *tri;
+	int i;
+
+	output_printf(out,
+		"\n"
+		"# surface %d/%d (#%d, %s)\n"
+		"usemtl %s\n"
+		"g surf%d\n"
+		"o surf%d\n"
+		"\n",
+		surface_index + 1, num_surfaces, surface->surface, get_bsp_surface_type(surface->type),
+		cache->materials[surface->material].shader, surface->surface, surface->surface);
+
+	for (i = 0, v = streams->xyz + surface->first_vert * 3; i < surface->num_verts; ++i, v += 3)
+		output_printf(out, "v %f %f %f\n", v[0], v[1], v[2]);
+	output_printf(out, "\n");
+	for (i = 0, v = streams->st + surface->first_vert * 2; i < surface->num_verts; ++i, v += 2)
+		output_printf(out, "vt %f %f\n", v[0], 1.f - v[1]);
+	output_printf(out, "\n");
+	for (i = 0, v = streams->normal + surface->first_vert * 3; i < surface->num_verts; ++i, v += 3)
+		output_printf(out, "vn %f %f %f\n", v[0], v[1], v[2]);
+	output_printf(out,
+		"\n"
+		"s 1\n");
+
+	// indexes are model relative already, like the OBJ's
+	for (i = 0, tri = streams->indexes + surface->first_index; i < surface->num_indexes; i += 3, tri += 3)
+	{
+		output_printf(out, "f %u/%u/%u %u/%u/%u %u/%u/%u\n",
+			1 + tri[2], 1 + tri[2], 1 + tri[2],
+			1 + tri[1], 1 + tri[1], 1 + tri[1],
+			1 + tri[0], 1 + tri[0], 1 + tri[0]);
+	}
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// The same library the map exporter writes: every material the meshes use, sorted by name.
+static int write_cache_materials(const mesh_cache_t *cache, const options_t *options, const sink_t *sink)
+{
+	const char **names;
+	output_t out;
+	int retcode, i;
+
+	if (!(names = malloc(max(cache->num_materials, 1) * sizeof(*names))))
+	{
+		sink_log(sink, LOG_ERROR, "Memory allocation failed");
+		return 11;
+	}
+	for (i = 0; i < cache->num_materials; ++i)
+		names[i] = cache->materials[i].shader;
+	qsort(names, cache->num_materials, sizeof(*names), compare_names);
+
+	if ((retcode = open_output(&out, sink, "materials.mtl")) == 0)
+	{
+		output_printf(&out, "# generated by md3bsp2ase from %s\n", cache->name);
+		for (i = 0; i < cache->num_materials; ++i)
+		{
+			if (!i || strcmp(names[i], names[i - 1]))
+				write_mtl_material(&out, options->shaders, names[i]);
+		}
+		retcode = close_output(&out);
+	}
+	free(names);
+	return retcode;
+}
+
+int convert_mesh_cache_to_obj(const mesh_cache_t *cache, const options_t *options, const sink_t *sink)
+{
+	const mesh_cache_model_t *model;
+	mesh_cache_streams_t streams;
+	output_t out, *texts;
+	char name[32], progress_name[32];
+	double start, next_report = 0;
+	int model_index, first, count, failed, retcode = 0, closed, i;
+
+	if (!(texts = calloc(CACHE_BATCH_SIZE, sizeof(*texts))))
+	{
+		sink_log(sink, LOG_ERROR, "Memory allocation failed");
+		return 11;
+	}
+	for (i = 0; i < CACHE_BATCH_SIZE && !retcode; ++i)
+		retcode = open_memory_output(&texts[i]);
+
+	if (!retcode && options->materials)
+		retcode = write_cache_materials(cache, options, sink);
+
+	for (model_index = 0, model = cache->models; model_index < cache->num_models && !retcode;
+		++model_index, ++model)
+	{
+		if (model->num_surfaces < 1
+			|| (options->export_models && !options->export_models[model_index]))
+		{
+			continue;
+		}
+		sink_log(sink, LOG_INFO, "Processing model #%d: %d exportable surfaces", model_index, model->num_surfaces);
+		get_mesh_cache_streams(cache, model_index, &streams);
+
+		sprintf(name, "%04d.obj", model_index);
+		if ((retcode = open_output(&out, sink, name)) != 0)
+			break;
+		output_printf(&out, "# generated by md3bsp2ase from %s model #%d\n", cache->name, model_index);
+		if (options->materials)
+			write_mtllib(&out, sink, "materials.mtl");
+		sprintf(progress_name, "model #%d", model_index);
+
+		// format a batch in parallel, then append it in order
+		for (first = 0; first < model->num_surfaces && !retcode; first += count)
+		{
+			count = min(model->num_surfaces - first, CACHE_BATCH_SIZE);
+			start = get_time();
+			failed = 0;
+#ifdef _OPENMP
+			#pragma omp parallel for schedule(dynamic) reduction(|:failed)
+#endif
+			for (i = 0; i < count; ++i)
+			{
+				texts[i].used = 0;
+				write_cache_surface_obj(&texts[i], cache, &streams, first + i, model->num_surfaces);
+				failed |= texts[i].failed;
+			}
+			add_time(sink->stats, STAGE_FORMAT, get_time() - start);
+			if (failed)
+			{
+				sink_log(sink, LOG_ERROR, "Memory allocation failed");
+				retcode = 11;
+				break;
+			}
+
+			for (i = 0; i < count; ++i)
+			{
+				const mesh_cache_surface_t *surface = &streams.surfaces[first + i];
+
+				sink_log(sink, LOG_VERBOSE, "\tProcessing surface #%d: type %s, %d vertices, %d indices",
+					surface->surface, get_bsp_surface_type(surface->type), surface->num_verts,
+					surface->num_indexes);
+				output_write(&out, texts[i].buf, texts[i].used);
+				add_count(sink->stats, COUNT_SURFACES, 1);
+				add_count(sink->stats, COUNT_VERTICES, surface->num_verts);
+				add_count(sink->stats, COUNT_TRIANGLES, surface->num_indexes / 3);
+			}
+			sink_progress(sink, &next_report, progress_name, first + count, model->num_surfaces);
+		}
+
+		closed = close_output(&out);
+		retcode = retcode ? retcode : closed;
+	}
+
+	for (i = 0; i < CACHE_BATCH_SIZE; ++i)
+		close_output(&texts[i]);
+	free(texts);
+	return retcode;
+}
@@ -0,0 +1,981 @@
+/*
+MD3 and/or BSP to OBJ converter
+Written by Leszek Godlewski <github@inequation.org>
+The code in this file is placed in the public domain.
+*/
+
+/*
+Regression harness. Converts a fixed corpus of synthetic maps and models (see
+synth.c) in memory and compares every output with the reference files in the
+given directory: OBJs line by line, with vertex attributes allowed to differ
+within a tolerance and everything else, faces included, required to match
+exactly; any other output byte for byte. The first divergence of each output
+is reported. --update rewrites the references from the current build instead,
+which should only be done with a build whose output is known to be right.
+
+The byte_order case checks the swaps big-endian hosts load files with, which
+little-endian ones never run otherwise: the synthetic map, model and mesh
+cache are turned big-endian field by field here and must come back from
+swap_bsp, swap_md3 and swap_mesh_cache as they were.
+*/
+
+#ifdef _MSC_VER
+	#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+#include "md3bsp2ase.h"
+
+#define MAX_CAPTURES		64
+#define INDEX_NAME			"index.txt"	// every reference file, one per line
+
+typedef enum
+{
+	JOB_BSP,
+	JOB_CACHE,				// the map to a mesh cache in memory, and that to OBJs
+	JOB_MD3,				// convert_md3_parts_to_obj, so attachments and tags go through it as well
+	JOB_VAT,
+	JOB_ANIM,
+	JOB_LODS				// convert_md3_lods_to_obj on one of the served models
+} job_t;
+
+typedef struct
+{
+	const char *name;
+	job_t job;
+	synth_bsp_t bsp;
+	synth_md3_t md3;
+	int frame;
+	const char *primary;	// extension of the primary output's reference
+	int md3_tags;
+	int attach;				// attach the part model to tag_1
+	float simplify;			// triangle ratio to simplify down to, 0 leaves the meshes alone
+	int merge_planar;
+	int materials;			// against the index built from shader_script
+	int collision;			// contents to export collision for, 0 for none
+	const char *lod_name;	// the model JOB_LODS starts from
+} regress_case_t;
+
+// Small enough to keep the references in the tree, big enough to hit every surface type and patch size.
+static const regress_case_t cases[] =
+{
+	{ "map_mixed", JOB_BSP, { 8, 8, 8, 5, 3, 9, 1, 0, 0, 0, 0, 0 }, { 0 }, 0, ".obj", 0, 0, 0, 0, 0, 0, NULL },
+	{ "map_patches", JOB_BSP, { 0, 0, 12, 4, 3, 17, 7, 0, 0, 0, 0, 0 }, { 0 }, 0, ".obj", 0, 0, 0, 0, 0, 0, NULL },
+	{ "map_merged", JOB_BSP, { 6, 2, 2, 7, 3, 9, 3, 3, 0, 0, 0, 0 }, { 0 }, 0, ".obj", 0, 0, 0, 1, 0, 0, NULL },
+	{ "map_materials", JOB_BSP, { 8, 8, 8, 5, 3, 9, 1, 0, 0, 0, 0, 0 }, { 0 }, 0, ".obj", 0, 0, 0, 0, 1, 0, NULL },
+	{ "map_simplified", JOB_BSP, { 8, 8, 8, 5, 3, 9, 1, 0, 0, 0, 0, 0 }, { 0 }, 0, ".obj", 0, 0, 0.25f, 0, 0, 0,
+		NULL },
+	{ "map_cache", JOB_CACHE, { 6, 2, 2, 7, 3, 9, 3, 3, 0, 0, 0, 0 }, { 0 }, 0, ".obj", 0, 0, 0, 1, 1, 0, NULL },
+	{ "map_features", JOB_BSP, { 4, 0, 2, 5, 3, 9, 23, 0, 5, 3, 2, 6 }, { 0 }, 0, ".obj", 0, 0, 0, 0, 0,
+		CONTENTS_SOLID | CONTENTS_PLAYERCLIP, NULL },
+	// none of the brushes match, so there must be no collision OBJ
+	{ "map_no_collision", JOB_BSP, { 2, 0, 0, 5, 3, 9, 23, 0, 3, 0, 0, 0 }, { 0 }, 0, ".obj", 0, 0, 0, 0, 0,
+		CONTENTS_WATER, NULL },
+	{ "model_frame0", JOB_MD3, { 0 }, { 3, 80, 4, 2, 3 }, 0, ".obj", 0, 0, 0, 0, 0, 0, NULL },
+	{ "model_frame3", JOB_MD3, { 0 }, { 3, 80, 4, 2, 3 }, 3, ".obj", 0, 0, 0, 0, 0, 0, NULL },
+	{ "model_parts", JOB_MD3, { 0 }, { 2, 40, 4, 2, 5 }, 2, ".obj", 1, 1, 0, 0, 0, 0, NULL },
+	{ "model_materials", JOB_MD3, { 0 }, { 2, 40, 4, 2, 5 }, 0, ".obj", 0, 1, 0, 0, 1, 0, NULL },
+	{ "model_simplified", JOB_MD3, { 0 }, { 3, 80, 4, 2, 3 }, 0, ".obj", 0, 0, 0.5f, 0, 0, 0, NULL },
+	{ "model_vat", JOB_VAT, { 0 }, { 2, 40, 6, 0, 9 }, 0, ".obj", 0, 0, 0, 0, 0, 0, NULL },
+	{ "model_anim", JOB_ANIM, { 0 }, { 2, 40, 6, 0, 11 }, 0, ".anim", 0, 0, 0, 0, 0, 0, NULL },
+	// starting from a LOD in the middle of the chain, which has to find its way back to the base model
+	{ "model_lods", JOB_LODS, { 0 }, { 0 }, 1, ".obj", 0, 0, 0, 0, 0, 0, "synth_lod_1.md3" },
+	// no synth_gun.md3, so the "_1" is part of the name rather than a LOD suffix
+	{ "model_lod_lone", JOB_LODS, { 0 }, { 0 }, 0, ".obj", 0, 0, 0, 0, 0, 0, "synth_gun_1.md3" }
+};
+
+// What the read callback serves: the attachment, which the misc_models place as well, a chain of LODs
+// with the same surfaces and fewer vertices each, and a model that only looks like a LOD.
+static const struct
+{
+	const char *path;
+	synth_md3_t params;
+} served_models[] =
+{
+	{ "synth_part.md3", { 1, 24, 6, 1, 13 } },
+	{ "synth_lod.md3", { 2, 60, 3, 0, 17 } },
+	{ "synth_lod_1.md3", { 2, 30, 3, 0, 17 } },
+	{ "synth_lod_2.md3", { 2, 12, 3, 0, 17 } },
+	{ "synth_gun_1.md3", { 1, 30, 2, 0, 19 } }
+};
+
+#define NUM_SERVED_MODELS	(sizeof(served_models) / sizeof(served_models[0]))
+
+// Covers some of the synthetic shaders; the rest are left implicit.
+static const char shader_script[] =
+	"textures/synth/s0\n"
+	"{\n"
+	"\tqer_editorimage textures/synth/s0_editor.tga\n"
+	"\tsurfaceparm alphashadow\n"
+	"\tcull none\n"
+	"\t{\n"
+	"\t\tmap textures/synth/s0_leaves.tga\n"
+	"\t\talphaFunc GE128\n"
+	"\t}\n"
+	"\t{\n"
+	"\t\tmap $lightmap\n"
+	"\t\tblendFunc GL_DST_COLOR GL_ZERO\n"
+	"\t}\n"
+	"}\n"
+	"\n"
+	"// lightmap first, like most of the world\n"
+	"textures/synth/s1\n"
+	"{\n"
+	"\t{\n"
+	"\t\tmap $lightmap\n"
+	"\t}\n"
+	"\t{\n"
+	"\t\tmap textures/synth/s1_base.jpg\n"
+	"\t\tblendFunc filter\n"
+	"\t}\n"
+	"}\n"
+	"\n"
+	"textures/synth/s2\n"
+	"{\n"
+	"\tsurfaceparm nolightmap\n"
+	"\t{\n"
+	"\t\tanimMap 8 textures/synth/fire1 textures/synth/fire2\n"
+	"\t\tblendFunc add\n"
+	"\t}\n"
+	"}\n"
+	"\n"
+	"textures/synth/s3\n"
+	"{\n"
+	"\timplicitMask -\n"
+	"}\n"
+	"\n"
+	"textures/synth/s4\n"
+	"{\n"
+	"\t{\n"
+	"\t\tmap \"textures/synth/glass.tga\"\n"
+	"\t\tblendFunc GL_SRC_ALPHA GL_ONE_MINUS_SRC_ALPHA\n"
+	"\t}\n"
+	"}\n";
+
+#define NUM_CASES	(sizeof(cases) / sizeof(cases[0]))
+
+typedef struct
+{
+	char name[MAX_QPATH * 2];
+	output_t data;
+} capture_t;
+
+// Keeps every output in memory under the name of its reference file.
+typedef struct
+{
+	const regress_case_t *current;
+	capture_t captures[MAX_CAPTURES];
+	int count;
+	shader_index_t shaders;
+	unsigned char *models[NUM_SERVED_MODELS];	// served through the read callback
+	size_t model_sizes[NUM_SERVED_MODELS];
+} capture_sink_t;
+
+static void *capture_open(void *context, const char *name)
+{
+	capture_sink_t *cs = context;
+	capture_t *c = NULL;
+
+#ifdef _OPENMP
+	#pragma omp critical(capture_open)
+#endif
+	{
+		if (cs->count < MAX_CAPTURES)
+			c = &cs->captures[cs->count++];
+	}
+	if (!c)
+		return NULL;
+	if (open_memory_output(&c->data) != 0)
+		return NULL;
+	if (name)
+		sprintf(c->name, "%s_%.*s", cs->current->name, MAX_QPATH - 1, name);
+	else
+		sprintf(c->name, "%s%s", cs->current->name, cs->current->primary);
+	return c;
+}
+
+static void capture_reference(void *context, const char *name, char *buf, size_t size)
+{
+	const capture_sink_t *cs = context;
+
+	if (name)
+		snprintf(buf, size, "%s_%.*s", cs->current->name, MAX_QPATH - 1, name);
+	else
+		snprintf(buf, size, "%s%s", cs->current->name, cs->current->primary);
+}
+
+static int capture_write(void *context, void *stream, const void *data, size_t size)
+{
+	capture_t *c = stream;
+
+	(void)context;
+	output_write(&c->data, data, size);
+	return c->data.failed;
+}
+
+static int capture_close(void *context, void *stream)
+{
+	(void)context;
+	(void)stream;
+	return 0;
+}
+
+static void capture_log(void *context, int level, const char *message)
+{
+	(void)context;
+	(void)level;
+	fprintf(stderr, "%s\n", message);
+}
+
+static int capture_read(void *context, const char *path, const unsigned char **data, size_t *size)
+{
+	const capture_sink_t *cs = context;
+	unsigned int i;
+
+	for (i = 0; i < NUM_SERVED_MODELS; ++i)
+	{
+		if (!strcmp(path, served_models[i].path))
+		{
+			*data = cs->models[i];
+			*size = cs->model_sizes[i];
+			return 0;
+		}
+	}
+	return 3;
+}
+
+static void capture_release(void *context, const unsigned char *data)
+{
+	(void)context;
+	(void)data;
+}
+
+// The mesh cache only goes to memory, to be read back; the OBJs made from it are what gets compared.
+static void *cache_open(void *context, const char *name)
+{
+	(void)name;
+	return context;
+}
+
+static int cache_write(void *context, void *stream, const void *data, size_t size)
+{
+	output_t *cache = stream;
+
+	(void)context;
+	output_write(cache, data, size);
+	return cache->failed;
+}
+
+static int convert_bsp_via_cache(const bsp_t *bsp, const options_t *options, const sink_t *sink)
+{
+	mesh_cache_t mesh_cache;
+	output_t cache;
+	sink_t cache_sink;
+	int retcode;
+
+	if (open_memory_output(&cache) != 0)
+		return 11;
+	cache_sink = *sink;
+	cache_sink.context = &cache;
+	cache_sink.open = cache_open;
+	cache_sink.write = cache_write;
+	cache_sink.close = capture_close;
+	if ((retcode = convert_bsp_to_mesh_cache(bsp, options, &cache_sink)) == 0
+		&& (retcode = open_mesh_cache("synth.mcache", (const unsigned char *)cache.buf, cache.used, sink,
+			&mesh_cache)) == 0)
+	{
+		retcode = convert_mesh_cache_to_obj(&mesh_cache, options, sink);
+		free_mesh_cache(&mesh_cache);
+	}
+	close_output(&cache);
+	return retcode;
+}
+
+static void free_captures(capture_sink_t *cs)
+{
+	int i;
+
+	for (i = 0; i < cs->count; ++i)
+		close_output(&cs->captures[i].data);
+	cs->count = 0;
+}
+
+static void free_models(capture_sink_t *cs)
+{
+	unsigned int i;
+
+	for (i = 0; i < NUM_SERVED_MODELS; ++i)
+	{
+		free(cs->models[i]);
+		cs->models[i] = NULL;
+	}
+}
+
+static int run_case(const regress_case_t *rc, const shader_index_t *shaders, const sink_t *sink)
+{
+	options_t options;
+	unsigned char *data;
+	size_t size;
+	int retcode;
+
+	memset(&options, 0, sizeof(options));
+	options.collision = rc->collision != 0;
+	options.collision_contents = rc->collision ? rc->collision : CONTENTS_SOLID | CONTENTS_PLAYERCLIP;
+	options.md3_tags = rc->md3_tags;
+	options.merge_planar = rc->merge_planar;
+	options.materials = rc->materials;
+	options.shaders = shaders;
+	if (rc->simplify > 0)
+	{
+		options.simplify.enabled = 1;
+		options.simplify.ratio = rc->simplify;
+		options.simplify.max_error = FLT_MAX;
+	}
+	if (rc->attach)
+	{
+		options.md3_attachments[0].tag = "tag_1";
+		options.md3_attachments[0].path = "synth_part.md3";
+		options.num_md3_attachments = 1;
+	}
+
+	if (rc->job == JOB_LODS)
+		return convert_md3_lods_to_obj(rc->lod_name, rc->frame, &options, sink);
+	if (rc->job == JOB_BSP || rc->job == JOB_CACHE)
+	{
+		bsp_t bsp;
+
+		if (!(data = generate_bsp(&rc->bsp, &size)))
+			return 11;
+		if ((retcode = load_bsp("synth.bsp", data, size, sink, &bsp)) == 0)
+		{
+			if (rc->job == JOB_CACHE)
+				retcode = convert_bsp_via_cache(&bsp, &options, sink);
+			else
+				retcode = convert_bsp_to_obj(&bsp, &options, sink);
+			free_bsp(&bsp);
+		}
+	}
+	else
+	{
+		md3_model_t model;
+
+		if (!(data = generate_md3(&rc->md3, &size)))
+			return 11;
+		if ((retcode = load_md3("synth.md3", data, size, rc->job == JOB_MD3 ? rc->frame : 0, sink, &model)) == 0)
+		{
+			if (rc->job == JOB_VAT)
+				retcode = bake_md3_vat(&model, sink);
+			else if (rc->job == JOB_ANIM)
+				retcode = convert_md3_to_anim(&model, NULL, sink);
+			else
+				retcode = convert_md3_parts_to_obj(&model, rc->frame, &options, sink);
+			free_md3(&model);
+		}
+	}
+	free(data);
+	return retcode;
+}
+
+// Reverses the bytes of every word of count records, except those of the byte array at skip in each.
+static void reverse_records(unsigned char *p, size_t count, size_t stride, size_t word, size_t skip,
+	size_t skip_len)
+{
+	unsigned char t;
+	size_t i, j, k;
+
+	for (i = 0; i < count; ++i, p += stride)
+	{
+		for (j = 0; j + word <= stride; j += word)
+		{
+			if (j >= skip && j < skip + skip_len)
+				continue;
+			for (k = 0; k < word / 2; ++k)
+			{
+				t = p[j + k];
+				p[j + k] = p[j + word - 1 - k];
+				p[j + word - 1 - k] = t;
+			}
+		}
+	}
+}
+
+// A native order map the other way round, following its lumps with the native header.
+static void reverse_bsp(unsigned char *buf)
+{
+	const dheader_t *header = (const dheader_t *)buf;
+	unsigned char *lump;
+	int i, len;
+
+	for (i = 0; i < HEADER_LUMPS; ++i)
+	{
+		lump = buf + header->lumps[i].fileofs;
+		len = header->lumps[i].filelen;
+		switch (i)
+		{
+			case LUMP_ENTITIES:
+			case LUMP_LIGHTMAPS:
+			case LUMP_LIGHTGRID:
+				break;
+			case LUMP_VISIBILITY:
+				reverse_records(lump, min(len / 4, 2), 4, 4, 0, 0);
+				break;
+			case LUMP_SHADERS:
+				reverse_records(lump, len / sizeof(dshader_t), sizeof(dshader_t), 4, offsetof(dshader_t, shader),
+					MAX_QPATH);
+				break;
+			case LUMP_FOGS:
+				reverse_records(lump, len / sizeof(dfog_t), sizeof(dfog_t), 4, offsetof(dfog_t, shader), MAX_QPATH);
+				break;
+			case LUMP_DRAWVERTS:
+				reverse_records(lump, len / sizeof(drawVert_t), sizeof(drawVert_t), 4, offsetof(drawVert_t, color),
+					sizeof(((drawVert_t *)0)->color));
+				break;
+			default:
+				reverse_records(lump, len / 4, 4, 4, 0, 0);
+				break;
+		}
+	}
+	reverse_records(buf, 1, sizeof(*header), 4, 0, 0);
+}
+
+static void reverse_md3(unsigned char *buf)
+{
+	md3Header_t *header = (md3Header_t *)buf;
+	md3Surface_t *surf;
+	unsigned char *p;
+	int num_frames = header->numFrames, i, next;
+
+	reverse_records(buf + header->ofsFrames, num_frames, sizeof(md3Frame_t), 4, offsetof(md3Frame_t, name),
+		sizeof(((md3Frame_t *)0)->name));
+	reverse_records(buf + header->ofsTags, num_frames * header->numTags, sizeof(md3Tag_t), 4,
+		offsetof(md3Tag_t, name), MAX_QPATH);
+	for (i = 0, p = buf + header->ofsSurfaces; i < header->numSurfaces; ++i, p += next)
+	{
+		surf = (md3Surface_t *)p;
+		reverse_records(p + surf->ofsShaders, surf->numShaders, sizeof(md3Shader_t), 4,
+			offsetof(md3Shader_t, name), MAX_QPATH);
+		reverse_records(p + surf->ofsTriangles, surf->numTriangles * sizeof(md3Triangle_t) / 4, 4, 4, 0, 0);
+		reverse_records(p + surf->ofsSt, surf->numVerts * sizeof(md3St_t) / 4, 4, 4, 0, 0);
+		reverse_records(p + surf->ofsXyzNormals, surf->numVerts * num_frames * sizeof(md3XyzNormal_t) / 2, 2, 2, 0, 0);
+		next = surf->ofsEnd;
+		reverse_records(p, 1, sizeof(*surf), 4, offsetof(md3Surface_t, name), MAX_QPATH);
+	}
+	reverse_records(buf, 1, sizeof(*header), 4, offsetof(md3Header_t, name), MAX_QPATH);
+}
+
+static void reverse_mesh_cache(unsigned char *buf, size_t size)
+{
+	const mesh_cache_trailer_t *trailer = (const mesh_cache_trailer_t *)(buf + size - sizeof(*trailer));
+	size_t materials = trailer->materials_ofs, end = materials + trailer->num_materials * sizeof(dshader_t);
+
+	reverse_records(buf, 1, materials, 4, offsetof(mesh_cache_header_t, ident), 4);
+	reverse_records(buf + materials, trailer->num_materials, sizeof(dshader_t), 4, offsetof(dshader_t, shader),
+		MAX_QPATH);
+	reverse_records(buf + end, 1, size - end, 4, size - end - sizeof(*trailer) + offsetof(mesh_cache_trailer_t, ident),
+		4);
+}
+
+// Converts a map to a mesh cache in memory. Returns 0 or an error code.
+static int make_mesh_cache(const unsigned char *data, size_t size, const sink_t *sink, output_t *cache)
+{
+	options_t options;
+	sink_t cache_sink;
+	bsp_t bsp;
+	int retcode;
+
+	memset(&options, 0, sizeof(options));
+	options.merge_planar = 1;
+	if (open_memory_output(cache) != 0)
+		return 11;
+	cache_sink = *sink;
+	cache_sink.context = cache;
+	cache_sink.open = cache_open;
+	cache_sink.write = cache_write;
+	cache_sink.close = capture_close;
+	if ((retcode = load_bsp("synth.bsp", data, size, sink, &bsp)) == 0)
+	{
+		retcode = convert_bsp_to_mesh_cache(&bsp, &options, &cache_sink);
+		free_bsp(&bsp);
+	}
+	return retcode;
+}
+
+// Returns the number of failed checks.
+static int check_byte_order(const sink_t *sink)
+{
+	static const synth_bsp_t bsp_params = { 6, 3, 4, 5, 3, 9, 21, 2, 3, 2, 2, 2 };
+	static const synth_md3_t md3_params = { 3, 37, 3, 3, 23 };
+	unsigned char buf[4 * 40 + 3], expected[sizeof(buf)], *data, *copy;
+	output_t cache;
+	size_t size, count, offset, i;
+	int failures = 0;
+
+	// every count around the vector widths, at every alignment, and nothing past the end touched
+	for (count = 0; count <= 37; ++count)
+	{
+		for (offset = 0; offset < 4; ++offset)
+		{
+			for (i = 0; i < sizeof(buf); ++i)
+				buf[i] = expected[i] = (unsigned char)(i * 37 + 11);
+			reverse_records(expected + offset, count, 4, 4, 0, 0);
+			swap_longs(buf + offset, count);
+			if (memcmp(buf, expected, sizeof(buf)))
+			{
+				printf("byte_order: swap_longs of %d words at offset %d\n", (int)count, (int)offset);
+				++failures;
+			}
+			for (i = 0; i < sizeof(buf); ++i)
+				buf[i] = expected[i] = (unsigned char)(i * 37 + 11);
+			reverse_records(expected + offset, count, 2, 2, 0, 0);
+			swap_shorts(buf + offset, count);
+			if (memcmp(buf, expected, sizeof(buf)))
+			{
+				printf("byte_order: swap_shorts of %d words at offset %d\n", (int)count, (int)offset);
+				++failures;
+			}
+		}
+	}
+
+	// the reversals read the files' fields, so they only work on a native order image; big-endian hosts
+	// go through the swaps in every other case anyway
+	if (HOST_BIG_ENDIAN)
+		return failures;
+
+	if (!(data = generate_bsp(&bsp_params, &size)) || !(copy = malloc(size)))
+	{
+		free(data);
+		return failures + 1;
+	}
+	memcpy(copy, data, size);
+	reverse_bsp(copy);
+	swap_bsp(copy, size);
+	if (memcmp(copy, data, size))
+	{
+		printf("byte_order: swap_bsp doesn't undo the big-endian map\n");
+		++failures;
+	}
+	free(copy);
+
+	if (make_mesh_cache(data, size, sink, &cache) != 0 || !(copy = malloc(cache.used)))
+	{
+		printf("byte_order: failed to make the mesh cache\n");
+		++failures;
+	}
+	else
+	{
+		memcpy(copy, cache.buf, cache.used);
+		reverse_mesh_cache(copy, cache.used);
+		swap_mesh_cache(copy, cache.used);
+		if (memcmp(copy, cache.buf, cache.used))
+		{
+			printf("byte_order: swap_mesh_cache doesn't undo the big-endian cache\n");
+			++failures;
+		}
+		free(copy);
+	}
+	close_output(&cache);
+	free(data);
+
+	if (!(data = generate_md3(&md3_params, &size)) || !(copy = malloc(size)))
+	{
+		free(data);
+		return failures + 1;
+	}
+	memcpy(copy, data, size);
+	reverse_md3(copy);
+	swap_md3(copy, size);
+	if (memcmp(copy, data, size))
+	{
+		printf("byte_order: swap_md3 doesn't undo the big-endian model\n");
+		++failures;
+	}
+	free(copy);
+	free(data);
+
+	return failures;
+}
+
+// Loads a whole reference file. Returns NULL if it can't be read.
+static unsigned char *read_file(const char *path, size_t *size)
+{
+	unsigned char *buf;
+	FILE *f;
+	long len;
+
+	if (!(f = fopen(path, "rb")))
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (len < 0 || !(buf = malloc(len + 1)))
+	{
+		fclose(f);
+		return NULL;
+	}
+	if (fread(buf, 1, len, f) != (size_t)len)
+	{
+		free(buf);
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+	buf[len] = 0;
+	*size = (size_t)len;
+	return buf;
+}
+
+static int write_file(const char *path, const void *data, size_t size)
+{
+	FILE *f;
+	int failed;
+
+	if (!(f = fopen(path, "wb")))
+	{
+		fprintf(stderr, "Failed to open file %s\n", path);
+		return 4;
+	}
+	failed = fwrite(data, 1, size, f) != size;
+	failed |= fclose(f) != 0;
+	if (failed)
+	{
+		fprintf(stderr, "Failed to write file %s\n", path);
+		return 18;
+	}
+	return 0;
+}
+
+// Copies one line without its terminator into line, returns where the next one starts.
+static const char *next_line(const char *p, const char *end, char *line, size_t size)
+{
+	const char *eol = memchr(p, '\n', end - p);
+	size_t len;
+
+	if (!eol)
+		eol = end;
+	len = min((size_t)(eol - p), size - 1);
+	memcpy(line, p, len);
+	line[len] = 0;
+	if (len && line[len - 1] == '\r')
+		line[len - 1] = 0;
+	return eol < end ? eol + 1 : end;
+}
+
+static int floats_match(double a, double b, double tolerance)
+{
+	return fabs(a - b) <= tolerance * max(1.0, max(fabs(a), fabs(b)));
+}
+
+// v, vt and vn lines match if they have as many numbers and each is within the tolerance.
+static int lines_match(const char *expected, const char *actual, double tolerance)
+{
+	char *e_end, *a_end;
+	double e, a;
+
+	if (!strcmp(expected, actual))
+		return 1;
+	if (strncmp(expected, "v ", 2) && strncmp(expected, "vt ", 3) && strncmp(expected, "vn ", 3))
+		return 0;
+	if (strncmp(expected, actual, strchr(expected, ' ') - expected + 1))
+		return 0;
+
+	expected = strchr(expected, ' ');
+	actual = strchr(actual, ' ');
+	for (;;)
+	{
+		e = strtod(expected, &e_end);
+		a = strtod(actual, &a_end);
+		if (e_end == expected || a_end == actual)
+			break;
+		if (!floats_match(e, a, tolerance))
+			return 0;
+		expected = e_end;
+		actual = a_end;
+	}
+	// both lines must run out of numbers at the same time, with nothing but blanks left
+	return e_end == expected && a_end == actual && strspn(expected, " \t") == strlen(expected)
+		&& strspn(actual, " \t") == strlen(actual);
+}
+
+static int compare_obj(const char *name, const char *expected, size_t expected_size, const char *actual,
+	size_t actual_size, double tolerance)
+{
+	const char *e = expected, *e_end = expected + expected_size;
+	const char *a = actual, *a_end = actual + actual_size;
+	char e_line[1024], a_line[1024];
+	int line;
+
+	for (line = 1; e < e_end || a < a_end; ++line)
+	{
+		if (e >= e_end || a >= a_end)
+		{
+			printf("%s:%d: %s\n", name, line, e < e_end ? "output ends early" : "output has extra lines");
+			return 1;
+		}
+		e = next_line(e, e_end, e_line, sizeof(e_line));
+		a = next_line(a, a_end, a_line, sizeof(a_line));
+		if (!lines_match(e_line, a_line, tolerance))
+		{
+			printf("%s:%d: expected \"%.200s\", got \"%.200s\"\n", name, line, e_line, a_line);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int compare_bytes(const char *name, const unsigned char *expected, size_t expected_size,
+	const unsigned char *actual, size_t actual_size)
+{
+	size_t i, n = min(expected_size, actual_size);
+
+	for (i = 0; i < n && expected[i] == actual[i]; ++i)
+		;
+	if (i < n)
+	{
+		printf("%s: byte %lu differs, expected 0x%02x, got 0x%02x\n", name, (unsigned long)i, expected[i],
+			actual[i]);
+		return 1;
+	}
+	if (expected_size != actual_size)
+	{
+		printf("%s: expected %lu bytes, got %lu\n", name, (unsigned long)expected_size,
+			(unsigned long)actual_size);
+		return 1;
+	}
+	return 0;
+}
+
+static int ends_with(const char *s, const char *suffix)
+{
+	size_t len = strlen(s), suffix_len = strlen(suffix);
+
+	return len >= suffix_len && !strcmp(s + len - suffix_len, suffix);
+}
+
+// Puts dir/name in path. Returns 0, or 1 if it doesn't fit.
+static int join_path(char *path, size_t size, const char *dir, const char *name)
+{
+	int len = snprintf(path, size, "%s/%s", dir, name);
+
+	if (len < 0 || (size_t)len >= size)
+	{
+		printf("Path %s/%s is too long\n", dir, name);
+		return 1;
+	}
+	return 0;
+}
+
+// Returns the number of outputs that diverge from their references.
+static int compare_captures(const char *dir, const capture_sink_t *cs, double tolerance)
+{
+	char path[1024];
+	unsigned char *expected;
+	size_t size;
+	int i, failures = 0;
+
+	for (i = 0; i < cs->count; ++i)
+	{
+		const capture_t *c = &cs->captures[i];
+
+		if (join_path(path, sizeof(path), dir, c->name) != 0)
+		{
+			++failures;
+			continue;
+		}
+		if (!(expected = read_file(path, &size)))
+		{
+			printf("%s: no reference\n", c->name);
+			++failures;
+			continue;
+		}
+		if (ends_with(c->name, ".obj"))
+			failures += compare_obj(c->name, (const char *)expected, size, c->data.buf, c->data.used, tolerance);
+		else
+			failures += compare_bytes(c->name, expected, size, (const unsigned char *)c->data.buf, c->data.used);
+		free(expected);
+	}
+	return failures;
+}
+
+// Outputs listed in the index that the case no longer produces.
+static int find_missing(const char *index, size_t index_size, const regress_case_t *rc, const capture_sink_t *cs)
+{
+	const char *p = index, *end = index + index_size;
+	char line[MAX_QPATH * 2];
+	size_t len = strlen(rc->name);
+	int i, failures = 0;
+
+	while (p < end)
+	{
+		p = next_line(p, end, line, sizeof(line));
+		// names are <case><primary extension> or <case>_<output>
+		if (strncmp(line, rc->name, len) || (line[len] != '_' && strcmp(line + len, rc->primary)))
+			continue;
+		for (i = 0; i < cs->count && strcmp(cs->captures[i].name, line); ++i)
+			;
+		if (i == cs->count)
+		{
+			printf("%s: not produced\n", line);
+			++failures;
+		}
+	}
+	return failures;
+}
+
+static void print_usage(const char *exe)
+{
+	printf("Usage: %s [options] <reference dir>\n"
+		"Options:\n"
+		"  --update          write the current outputs as the new references\n"
+		"  --tolerance <x>   relative tolerance of OBJ vertex attributes\n"
+		"                    (default: 1e-4)\n"
+		"  --case <name>     only run the named case\n",
+		exe);
+}
+
+int main(int argc, char *argv[])
+{
+	static capture_sink_t cs;
+	const char *dir = NULL, *only = NULL;
+	char path[1024];
+	char *index = NULL;
+	size_t index_size = 0;
+	double tolerance = 1e-4;
+	int update = 0, retcode = 0, failures = 0, ran = 0, arg, i;
+	unsigned int k;
+	output_t new_index;
+	sink_t sink;
+
+	for (arg = 1; arg < argc; ++arg)
+	{
+		if (!strcmp(argv[arg], "--update"))
+			update = 1;
+		else if (!strcmp(argv[arg], "--tolerance") && arg + 1 < argc)
+			tolerance = atof(argv[++arg]);
+		else if (!strcmp(argv[arg], "--case") && arg + 1 < argc)
+			only = argv[++arg];
+		else if (!dir && argv[arg][0] != '-')
+			dir = argv[arg];
+		else
+		{
+			printf("Unknown option %s\n", argv[arg]);
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (!dir)
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	if (join_path(path, sizeof(path), dir, INDEX_NAME) != 0)
+		return 1;
+	if (!update && !(index = (char *)read_file(path, &index_size)))
+	{
+		printf("Failed to read %s; generate the references with --update\n", path);
+		return 3;
+	}
+	if (update && open_memory_output(&new_index) != 0)
+		return 11;
+
+	for (k = 0; k < NUM_SERVED_MODELS; ++k)
+	{
+		if (!(cs.models[k] = generate_md3(&served_models[k].params, &cs.model_sizes[k])))
+		{
+			free_models(&cs);
+			free(index);
+			return 11;
+		}
+	}
+	memset(&sink, 0, sizeof(sink));
+	sink.context = &cs;
+	sink.open = capture_open;
+	sink.write = capture_write;
+	sink.close = capture_close;
+	sink.log = capture_log;
+	sink.log_level = LOG_WARNING;
+	sink.read = capture_read;
+	sink.release = capture_release;
+	sink.reference = capture_reference;
+	if (add_shader_script(&cs.shaders, "synth.shader", shader_script, sizeof(shader_script) - 1, &sink) != 0)
+	{
+		free_shader_index(&cs.shaders);
+		free_models(&cs);
+		free(index);
+		return 11;
+	}
+
+	// nothing to update, only to check
+	if (!update && (!only || !strcmp(only, "byte_order")))
+	{
+		++ran;
+		i = check_byte_order(&sink);
+		printf("byte_order: %s\n", i ? "FAILED" : "ok");
+		failures += i;
+	}
+
+	for (k = 0; k < NUM_CASES && !retcode; ++k)
+	{
+		const regress_case_t *rc = &cases[k];
+
+		if (only && strcmp(only, rc->name))
+			continue;
+		++ran;
+		cs.current = rc;
+		if ((retcode = run_case(rc, &cs.shaders, &sink)) != 0)
+		{
+			printf("%s: conversion failed with code %d\n", rc->name, retcode);
+		}
+		else if (update)
+		{
+			for (i = 0; i < cs.count && !retcode; ++i)
+			{
+				if ((retcode = join_path(path, sizeof(path), dir, cs.captures[i].name)) != 0)
+					break;
+				retcode = write_file(path, cs.captures[i].data.buf, cs.captures[i].data.used);
+				output_printf(&new_index, "%s\n", cs.captures[i].name);
+			}
+		}
+		else
+		{
+			i = compare_captures(dir, &cs, tolerance) + find_missing(index, index_size, rc, &cs);
+			printf("%s: %s\n", rc->name, i ? "FAILED" : "ok");
+			failures += i;
+		}
+		free_captures(&cs);
+	}
+
+	if (update)
+	{
+		// a partial update keeps the rest of the index as it was
+		if (!retcode && !only)
+		{
+			if ((retcode = join_path(path, sizeof(path), dir, INDEX_NAME)) == 0)
+				retcode = write_file(path, new_index.buf, new_index.used);
+		}
+		close_output(&new_index);
+	}
+	free_shader_index(&cs.shaders);
+	free_models(&cs);
+	free(index);
+
+	if (!ran)
+	{
+		printf("No case named %s\n", only);
+		return 1;
+	}
+	if (retcode)
+		return retcode;
+	if (failures)
+	{
+		printf("%d output(s) diverged from the references\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,685 @@
+/*
+MD3 and/or BSP to OBJ converter
+Written by Leszek Godlewski <github@inequation.org>
+The code in this file is placed in the public domain.
+*/
+
+/*
+Shader script index. Scripts are parsed once into a hash table keyed by the
+shader name (lower case, forward slashes, no extension, the way the engine
+looks them up), which is never modified afterwards, so every conversion of a
+batch, on any thread, can share one. Only what a material needs is kept: the
+stages' textures and blending, surfaceparms, culling and the editor image.
+
+Materials are written as .mtl records: the texture the surface shows, and
+its alpha channel for alpha tested and blended shaders. Shaders without a
+script are implicit, like in the engine: their texture is named after them.
+*/
+
+#ifdef _MSC_VER
+	#define _CRT_SECURE_NO_WARNINGS
+	#define strncasecmp	_strnicmp
+#else
+	#include <strings.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "md3bsp2ase.h"
+
+#define ARENA_BLOCK_SIZE	65536
+
+// Strings and stage arrays of the index; blocks are never moved, so pointers into them stay valid.
+struct shader_arena_s
+{
+	shader_arena_t *next;
+	size_t used, size;
+};
+
+typedef struct
+{
+	const char *s;
+	int len;
+} script_token_t;
+
+typedef struct
+{
+	const char *p, *end;
+	int line;
+} script_lexer_t;
+
+enum
+{
+	FACTOR_NONE,
+	FACTOR_ZERO,
+	FACTOR_ONE,
+	FACTOR_SRC_COLOR,
+	FACTOR_ONE_MINUS_SRC_COLOR,
+	FACTOR_DST_COLOR,
+	FACTOR_ONE_MINUS_DST_COLOR,
+	FACTOR_SRC_ALPHA,
+	FACTOR_ONE_MINUS_SRC_ALPHA,
+	FACTOR_DST_ALPHA,
+	FACTOR_ONE_MINUS_DST_ALPHA,
+	FACTOR_SRC_ALPHA_SATURATE
+};
+
+static const char *const factor_names[] =
+{
+	"", "GL_ZERO", "GL_ONE", "GL_SRC_COLOR", "GL_ONE_MINUS_SRC_COLOR", "GL_DST_COLOR", "GL_ONE_MINUS_DST_COLOR",
+	"GL_SRC_ALPHA", "GL_ONE_MINUS_SRC_ALPHA", "GL_DST_ALPHA", "GL_ONE_MINUS_DST_ALPHA", "GL_SRC_ALPHA_SATURATE"
+};
+
+static const char *const blend_names[] = { "opaque", "alpha test", "blend", "add", "filter", "other" };
+
+typedef struct
+{
+	const char *name;
+	unsigned int surface_flags, content_flags;
+} surfaceparm_t;
+
+// q3map2's Enemy Territory table
+static const surfaceparm_t surfaceparms[] =
+{
+	{ "alphashadow", SURF_ALPHASHADOW, 0 },
+	{ "areaportal", 0, CONTENTS_AREAPORTAL },
+	{ "carpetsteps", SURF_CARPET, 0 },
+	{ "clipmissile", 0, CONTENTS_MISSILECLIP },
+	{ "clusterportal", 0, CONTENTS_CLUSTERPORTAL },
+	{ "detail", 0, CONTENTS_DETAIL },
+	{ "donotenter", 0, CONTENTS_DONOTENTER },
+	{ "donotenterlarge", 0, CONTENTS_DONOTENTER_LARGE },
+	{ "fog", 0, CONTENTS_FOG },
+	{ "glass", SURF_GLASS, 0 },
+	{ "grasssteps", SURF_GRASS, 0 },
+	{ "gravelsteps", SURF_GRAVEL, 0 },
+	{ "hint", SURF_HINT, 0 },
+	{ "ladder", SURF_LADDER, 0 },
+	{ "landmine", SURF_LANDMINE, 0 },
+	{ "lava", 0, CONTENTS_LAVA },
+	{ "lightfilter", SURF_LIGHTFILTER, 0 },
+	{ "lightgrid", 0, CONTENTS_LIGHTGRID },
+	{ "metalsteps", SURF_METAL, 0 },
+	{ "monsterclip", 0, CONTENTS_MONSTERCLIP },
+	{ "monsterslick", SURF_MONSTERSLICK, 0 },
+	{ "nodamage", SURF_NODAMAGE, 0 },
+	{ "nodlight", SURF_NODLIGHT, 0 },
+	{ "nodraw", SURF_NODRAW, 0 },
+	{ "nodrop", 0, CONTENTS_NODROP },
+	{ "noimpact", SURF_NOIMPACT, 0 },
+	{ "nolightmap", SURF_NOLIGHTMAP, 0 },
+	{ "nomarks", SURF_NOMARKS, 0 },
+	{ "nonsolid", SURF_NONSOLID, 0 },
+	{ "nosteps", SURF_NOSTEPS, 0 },
+	{ "origin", 0, CONTENTS_ORIGIN },
+	{ "playerclip", 0, CONTENTS_PLAYERCLIP },
+	{ "pointlight", SURF_POINTLIGHT, 0 },
+	{ "roofsteps", SURF_ROOF, 0 },
+	{ "rubble", SURF_RUBBLE, 0 },
+	{ "skip", SURF_SKIP, 0 },
+	{ "sky", SURF_SKY, 0 },
+	{ "slick", SURF_SLICK, 0 },
+	{ "slime", 0, CONTENTS_SLIME },
+	{ "snowsteps", SURF_SNOW, 0 },
+	{ "splash", SURF_SPLASH, 0 },
+	{ "structural", 0, CONTENTS_STRUCTURAL },
+	{ "trans", 0, CONTENTS_TRANSLUCENT },
+	{ "water", 0, CONTENTS_WATER },
+	{ "woodsteps", SURF_WOOD, 0 }
+};
+
+// A stage as it is being parsed, still pointing into the script.
+typedef struct
+{
+	script_token_t map;
+	int lightmap;
+	int src, dst;
+	int alpha_test;
+} pending_stage_t;
+
+static void *arena_alloc(shader_arena_t **arena, size_t size)
+{
+	shader_arena_t *block = *arena;
+	void *p;
+
+	size = (size + 7) & ~(size_t)7;
+	if (!block || block->size - block->used < size)
+	{
+		size_t block_size = max(size, ARENA_BLOCK_SIZE);
+
+		// the header is a multiple of 8 bytes on every ABI we build for
+		if (!(block = malloc(sizeof(*block) + block_size)))
+			return NULL;
+		block->next = *arena;
+		block->used = 0;
+		block->size = block_size;
+		*arena = block;
+	}
+	p = (char *)(block + 1) + block->used;
+	block->used += size;
+	return p;
+}
+
+static const char *arena_string(shader_arena_t **arena, const char *s, int len)
+{
+	char *copy;
+
+	if (!(copy = arena_alloc(arena, len + 1)))
+		return NULL;
+	memcpy(copy, s, len);
+	copy[len] = 0;
+	return copy;
+}
+
+/*
+Reads the next token. Unless cross_lines is set, stops at the end of the
+line and returns 0 there, like the engine's COM_ParseExt. Returns 0 at the
+end of the script too.
+*/
+static int next_token(script_lexer_t *lex, script_token_t *tok, int cross_lines)
+{
+	const char *p = lex->p;
+
+	for (;;)
+	{
+		while (p < lex->end && (unsigned char)*p <= ' ')
+		{
+			if (*p == '\n')
+			{
+				if (!cross_lines)
+				{
+					lex->p = p;
+					return 0;
+				}
+				++lex->line;
+			}
+			++p;
+		}
+		if (p + 1 < lex->end && p[0] == '/' && p[1] == '/')
+		{
+			while (p < lex->end && *p != '\n')
+				++p;
+			continue;
+		}
+		if (p + 1 < lex->end && p[0] == '/' && p[1] == '*')
+		{
+			for (p += 2; p + 1 < lex->end && (p[0] != '*' || p[1] != '/'); ++p)
+			{
+				if (*p == '\n')
+					++lex->line;
+			}
+			p = min(p + 2, lex->end);
+			continue;
+		}
+		break;
+	}
+	if (p >= lex->end)
+	{
+		lex->p = p;
+		return 0;
+	}
+
+	if (*p == '"')
+	{
+		tok->s = ++p;
+		while (p < lex->end && *p != '"' && *p != '\n')
+			++p;
+		tok->len = (int)(p - tok->s);
+		if (p < lex->end && *p == '"')
+			++p;
+	}
+	else
+	{
+		tok->s = p;
+		while (p < lex->end && (unsigned char)*p > ' ')
+			++p;
+		tok->len = (int)(p - tok->s);
+	}
+	lex->p = p;
+	return 1;
+}
+
+static void skip_rest_of_line(script_lexer_t *lex)
+{
+	script_token_t tok;
+
+	while (next_token(lex, &tok, 0))
+		;
+}
+
+static int token_is(const script_token_t *tok, const char *s)
+{
+	return (int)strlen(s) == tok->len && !strncasecmp(tok->s, s, tok->len);
+}
+
+static int parse_factor(const script_token_t *tok)
+{
+	int i;
+
+	for (i = FACTOR_ZERO; i <= FACTOR_SRC_ALPHA_SATURATE; ++i)
+	{
+		if (token_is(tok, factor_names[i]))
+			return i;
+	}
+	return FACTOR_NONE;
+}
+
+// What a stage looks like from behind: how it blends with what's already there.
+static int classify_blend(int src, int dst, int alpha_test)
+{
+	if (src == FACTOR_NONE || (src == FACTOR_ONE && dst == FACTOR_ZERO))
+		return alpha_test ? BLEND_ALPHA_TEST : BLEND_OPAQUE;
+	if ((src == FACTOR_ONE || src == FACTOR_SRC_ALPHA) && dst == FACTOR_ONE)
+		return BLEND_ADD;
+	if ((src == FACTOR_SRC_ALPHA || src == FACTOR_ONE) && dst == FACTOR_ONE_MINUS_SRC_ALPHA)
+		return BLEND_ALPHA;
+	if ((src == FACTOR_DST_COLOR && (dst == FACTOR_ZERO || dst == FACTOR_SRC_COLOR))
+		|| (src == FACTOR_ZERO && dst == FACTOR_SRC_COLOR))
+	{
+		return BLEND_FILTER;
+	}
+	return BLEND_OTHER;
+}
+
+// Lower case, forward slashes and no extension, truncated to MAX_QPATH - 1 characters.
+static void normalize_shader_name(const char *name, int len, char *out)
+{
+	int i, dot = -1;
+
+	len = min(len, MAX_QPATH - 1);
+	for (i = 0; i < len; ++i)
+	{
+		out[i] = name[i] == '\\' ? '/' : (char)tolower((unsigned char)name[i]);
+		if (out[i] == '.')
+			dot = i;
+		else if (out[i] == '/')
+			dot = -1;
+	}
+	out[dot >= 0 ? dot : len] = 0;
+}
+
+static unsigned int hash_name(const char *name)
+{
+	unsigned int h = 2166136261u;
+
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+	return h ^ (h >> 15);
+}
+
+static int grow_table(shader_index_t *index)
+{
+	int size = index->table_size ? index->table_size * 2 : 256, *table, i, slot;
+
+	if (!(table = malloc(size * sizeof(*table))))
+		return 0;
+	for (i = 0; i < size; ++i)
+		table[i] = -1;
+	for (i = 0; i < index->num_defs; ++i)
+	{
+		for (slot = hash_name(index->defs[i].name) & (size - 1); table[slot] >= 0; slot = (slot + 1) & (size - 1))
+			;
+		table[slot] = i;
+	}
+	free(index->table);
+	index->table = table;
+	index->table_size = size;
+	return 1;
+}
+
+static const shader_def_t *find_normalized(const shader_index_t *index, const char *key)
+{
+	int slot;
+
+	if (!index->table_size)
+		return NULL;
+	for (slot = hash_name(key) & (index->table_size - 1); index->table[slot] >= 0;
+		slot = (slot + 1) & (index->table_size - 1))
+	{
+		if (!strcmp(index->defs[index->table[slot]].name, key))
+			return &index->defs[index->table[slot]];
+	}
+	return NULL;
+}
+
+const shader_def_t *find_shader(const shader_index_t *index, const char *name)
+{
+	char key[MAX_QPATH];
+
+	if (!index)
+		return NULL;
+	normalize_shader_name(name, (int)strlen(name), key);
+	return find_normalized(index, key);
+}
+
+// Copies a parsed shader into the index, unless one of that name is already there. Returns 0 if memory ran out.
+static int add_shader(shader_index_t *index, const char *key, const char *script, shader_def_t *def,
+	const pending_stage_t *stages, int num_stages, const script_token_t *editor_image, const script_token_t *implicit)
+{
+	shader_def_t *defs;
+	int i, slot;
+
+	if (find_normalized(index, key))
+		return 1;
+	if ((index->num_defs + 1) * 2 > index->table_size && !grow_table(index))
+		return 0;
+	if (index->num_defs == index->max_defs)
+	{
+		int max_defs = index->max_defs ? index->max_defs * 2 : 256;
+
+		if (!(defs = realloc(index->defs, max_defs * sizeof(*defs))))
+			return 0;
+		index->defs = defs;
+		index->max_defs = max_defs;
+	}
+
+	def->name = arena_string(&index->arena, key, (int)strlen(key));
+	def->script = script;
+	def->stages = arena_alloc(&index->arena, max(num_stages, 1) * sizeof(*def->stages));
+	def->num_stages = num_stages;
+	if (!def->name || !def->stages)
+		return 0;
+	if (editor_image->len && !(def->editor_image = arena_string(&index->arena, editor_image->s, editor_image->len)))
+		return 0;
+	for (i = 0; i < num_stages; ++i)
+	{
+		shader_stage_t *stage = &def->stages[i];
+
+		stage->map = NULL;
+		if (stages[i].map.len && !(stage->map = arena_string(&index->arena, stages[i].map.s, stages[i].map.len)))
+			return 0;
+		stage->lightmap = stages[i].lightmap;
+		stage->blend = classify_blend(stages[i].src, stages[i].dst, stages[i].alpha_test);
+	}
+
+	// the engine sorts by the first stage; its texture is what the surface shows unless that's the lightmap
+	if (implicit->len)
+	{
+		if (token_is(implicit, "-"))
+			def->diffuse = def->name;
+		else if (!(def->diffuse = arena_string(&index->arena, implicit->s, implicit->len)))
+			return 0;
+	}
+	if (num_stages)
+		def->blend = def->stages[0].blend;
+	for (i = 0; i < num_stages && !def->diffuse; ++i)
+		def->diffuse = def->stages[i].map;
+	if (!def->diffuse)
+		def->diffuse = def->editor_image;
+
+	index->defs[index->num_defs] = *def;
+	for (slot = hash_name(key) & (index->table_size - 1); index->table[slot] >= 0;
+		slot = (slot + 1) & (index->table_size - 1))
+		;
+	index->table[slot] = index->num_defs++;
+	return 1;
+}
+
+// Like the renderer, only lines it doesn't know are skipped, so "{ map $lightmap }" works on one line.
+static void parse_stage(script_lexer_t *lex, pending_stage_t *stage)
+{
+	script_token_t tok, arg;
+
+	memset(stage, 0, sizeof(*stage));
+	while (next_token(lex, &tok, 1))
+	{
+		if (token_is(&tok, "}"))
+			return;
+		if ((token_is(&tok, "map") || token_is(&tok, "clampmap")) && next_token(lex, &arg, 0))
+		{
+			if (token_is(&arg, "$lightmap"))
+				stage->lightmap = 1;
+			else if (arg.s[0] != '$')
+				stage->map = arg;
+			continue;
+		}
+		else if (token_is(&tok, "animmap") && next_token(lex, &arg, 0) && next_token(lex, &arg, 0))
+		{
+			// the first frame stands for the whole animation
+			stage->map = arg;
+		}
+		else if (token_is(&tok, "blendfunc") && next_token(lex, &arg, 0))
+		{
+			if (token_is(&arg, "add"))
+			{
+				stage->src = FACTOR_ONE;
+				stage->dst = FACTOR_ONE;
+			}
+			else if (token_is(&arg, "filter"))
+			{
+				stage->src = FACTOR_DST_COLOR;
+				stage->dst = FACTOR_ZERO;
+			}
+			else if (token_is(&arg, "blend"))
+			{
+				stage->src = FACTOR_SRC_ALPHA;
+				stage->dst = FACTOR_ONE_MINUS_SRC_ALPHA;
+			}
+			else
+			{
+				stage->src = parse_factor(&arg);
+				stage->dst = next_token(lex, &arg, 0) ? parse_factor(&arg) : FACTOR_NONE;
+			}
+			continue;
+		}
+		else if (token_is(&tok, "alphafunc") && next_token(lex, &arg, 0))
+		{
+			stage->alpha_test = 1;
+			continue;
+		}
+		skip_rest_of_line(lex);
+	}
+}
+
+/*
+Parses one script into the index. The first definition of a name wins, like
+in q3map2. Syntax errors drop the rest of the script with a warning. Returns
+0 on success, 11 if memory ran out.
+*/
+int add_shader_script(shader_index_t *index, const char *script_name, const char *text, size_t size,
+	const sink_t *sink)
+{
+	pending_stage_t stages[MAX_SHADER_STAGES], ignored;
+	script_lexer_t lex;
+	script_token_t tok, arg, name, editor_image, implicit;
+	shader_def_t def;
+	const char *script;
+	char key[MAX_QPATH];
+	int num_stages, line;
+
+	if (!(script = arena_string(&index->arena, script_name, (int)strlen(script_name))))
+		return 11;
+	++index->num_scripts;
+
+	lex.p = text;
+	lex.end = text + size;
+	lex.line = 1;
+	while (next_token(&lex, &name, 1))
+	{
+		line = lex.line;
+		if (!next_token(&lex, &tok, 1) || !token_is(&tok, "{"))
+		{
+			sink_log(sink, LOG_WARNING, "WARNING: %s:%d: expected { after %.*s, skipping the rest of the script",
+				script_name, line, name.len, name.s);
+			return 0;
+		}
+
+		memset(&def, 0, sizeof(def));
+		memset(&editor_image, 0, sizeof(editor_image));
+		memset(&implicit, 0, sizeof(implicit));
+		num_stages = 0;
+		while (next_token(&lex, &tok, 1) && !token_is(&tok, "}"))
+		{
+			if (token_is(&tok, "{"))
+			{
+				// stages past the engine's limit are parsed all the same, just not kept
+				parse_stage(&lex, num_stages < MAX_SHADER_STAGES ? &stages[num_stages] : &ignored);
+				num_stages = min(num_stages + 1, MAX_SHADER_STAGES);
+				continue;
+			}
+			if (token_is(&tok, "qer_editorimage") && next_token(&lex, &arg, 0))
+			{
+				editor_image = arg;
+			}
+			else if ((token_is(&tok, "implicitmap") || token_is(&tok, "implicitmask")
+				|| token_is(&tok, "implicitblend")) && next_token(&lex, &arg, 0))
+			{
+				implicit = arg;
+				def.blend = token_is(&tok, "implicitmap") ? BLEND_OPAQUE
+					: token_is(&tok, "implicitmask") ? BLEND_ALPHA_TEST : BLEND_ALPHA;
+			}
+			else if (token_is(&tok, "cull") && next_token(&lex, &arg, 0))
+			{
+				def.two_sided = token_is(&arg, "none") || token_is(&arg, "disable") || token_is(&arg, "twosided");
+				continue;
+			}
+			else if (token_is(&tok, "surfaceparm") && next_token(&lex, &arg, 0))
+			{
+				int i;
+
+				for (i = 0; i < (int)(sizeof(surfaceparms) / sizeof(surfaceparms[0])); ++i)
+				{
+					if (token_is(&arg, surfaceparms[i].name))
+					{
+						def.surface_flags |= surfaceparms[i].surface_flags;
+						def.content_flags |= surfaceparms[i].content_flags;
+						break;
+					}
+				}
+				continue;
+			}
+			skip_rest_of_line(&lex);
+		}
+
+		normalize_shader_name(name.s, name.len, key);
+		if (!add_shader(index, key, script, &def, stages, num_stages, &editor_image, &implicit))
+			return 11;
+	}
+
+	return 0;
+}
+
+// Reads a script through the sink and parses it. Returns 0 on success, otherwise the read callback's or parser's code.
+int load_shader_script(shader_index_t *index, const char *path, const sink_t *sink)
+{
+	const unsigned char *data;
+	const char *name;
+	size_t size;
+	int retcode;
+
+	if (!sink->read)
+		return 3;
+	if ((retcode = sink->read(sink->context, path, &data, &size)) != 0)
+		return retcode;
+	if ((name = strrchr(path, '/')) == NULL && (name = strrchr(path, '\\')) == NULL)
+		name = path;
+	else
+		++name;
+	retcode = add_shader_script(index, name, (const char *)data, size, sink);
+	if (sink->release)
+		sink->release(sink->context, data);
+	return retcode;
+}
+
+/*
+Loads the scripts listed in <base_path>/scripts/shaderlist.txt, in order, as
+q3map2 does. Returns 0 on success, 3 if there is no list (the caller may
+then look for scripts itself), or 11 if memory ran out.
+*/
+int load_shader_list(shader_index_t *index, const char *base_path, const sink_t *sink)
+{
+	script_lexer_t lex;
+	script_token_t tok;
+	const unsigned char *data;
+	size_t size;
+	char *path;
+	int retcode = 0, result;
+
+	if (!sink->read || !(path = malloc(strlen(base_path) + 2 * MAX_QPATH + 32)))
+		return !sink->read ? 3 : 11;
+	sprintf(path, "%s%sscripts/shaderlist.txt", base_path, *base_path ? "/" : "");
+	if (sink->read(sink->context, path, &data, &size) != 0)
+	{
+		free(path);
+		return 3;
+	}
+
+	lex.p = (const char *)data;
+	lex.end = lex.p + size;
+	lex.line = 1;
+	while (!retcode && next_token(&lex, &tok, 1))
+	{
+		sprintf(path, "%s%sscripts/%.*s.shader", base_path, *base_path ? "/" : "", min(tok.len, MAX_QPATH), tok.s);
+		if ((result = load_shader_script(index, path, sink)) == 11)
+			retcode = 11;
+		else if (result != 0)
+			sink_log(sink, LOG_WARNING, "WARNING: failed to read shader script %s", path);
+	}
+
+	if (sink->release)
+		sink->release(sink->context, data);
+	free(path);
+	return retcode;
+}
+
+void free_shader_index(shader_index_t *index)
+{
+	shader_arena_t *block, *next;
+
+	for (block = index->arena; block; block = next)
+	{
+		next = block->next;
+		free(block);
+	}
+	free(index->defs);
+	free(index->table);
+	memset(index, 0, sizeof(*index));
+}
+
+// Whether the last path component has an extension.
+static int has_extension(const char *path)
+{
+	const char *dot = strrchr(path, '.');
+
+	return dot && !strchr(dot, '/') && !strchr(dot, '\\');
+}
+
+/*
+Writes one .mtl record. The texture is the shader's, or for shaders without a
+script the shader name itself; lacking an extension, it gets .tga, the first
+one the engine tries.
+*/
+void write_mtl_material(output_t *out, const shader_index_t *index, const char *name)
+{
+	const shader_def_t *def = find_shader(index, name);
+	const char *texture = def ? def->diffuse : name;
+
+	output_printf(out, "\nnewmtl %s\n", name);
+	if (def)
+	{
+		output_printf(out, "# %s, %s%s\n", def->script, blend_names[def->blend], def->two_sided ? ", two-sided" : "");
+	}
+	else
+	{
+		output_printf(out, "# implicit\n");
+	}
+	output_printf(out, "Kd 1.000000 1.000000 1.000000\n");
+	if (!texture)
+		return;
+	output_printf(out, "map_Kd %s%s\n", texture, has_extension(texture) ? "" : ".tga");
+	// the texture's alpha channel cuts out or fades the surface
+	if (def && (def->blend == BLEND_ALPHA_TEST || def->blend == BLEND_ALPHA))
+		output_printf(out, "map_d %s%s\n", texture, has_extension(texture) ? "" : ".tga");
+}
+
+// Points an OBJ at its material library, by whatever name the sink gives that output.
+void write_mtllib(output_t *out, const sink_t *sink, const char *mtl_name)
+{
+	char reference[1024];
+
+	sink_reference(sink, mtl_name, reference, sizeof(reference));
+	output_printf(out, "mtllib %s\n", reference);
+}
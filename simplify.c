@@ -0,0 +1,571 @@
+/*
+MD3 and/or BSP to OBJ converter
+Written by Leszek Godlewski <github@inequation.org>
+The code in this file is placed in the public domain.
+*/
+
+/*
+Quadric error metric mesh simplification (Garland & Heckbert), by half-edge
+collapses: a vertex is only ever merged into one of its neighbours, so no
+new positions or attributes are made up and the surviving vertices are
+output exactly as they came in.
+
+Vertices at the same position with the same attributes are welded first.
+Where they differ in attributes (a UV or normal seam) they are locked, as
+are the ends of open and non-manifold edges, so seams stay closed and the
+outline of every mesh is kept exactly: surfaces that meet other surfaces or
+other materials there still meet them after simplification.
+
+Collapses are done in passes, cheapest first, each vertex taking part in at
+most one collapse per pass, until the triangle target is reached or the next
+collapse would move the surface further than the error limit.
+*/
+
+#ifdef _MSC_VER
+	#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+
+#include "md3bsp2ase.h"
+
+// Symmetric 4x4 matrix, upper triangle row by row, plus the area it was accumulated over.
+typedef struct
+{
+	double a[10];
+	double weight;
+} quadric_t;
+
+typedef struct
+{
+	double cost;
+	int from, to;
+} collapse_t;
+
+typedef struct
+{
+	const float *xyz;
+	int num_verts;
+	int *tris;					// welded vertex indexes, three per triangle
+	int num_tris;
+	quadric_t *quadrics;
+	unsigned char *locked;
+	unsigned char *touched;		// vertices already part of a collapse in the current pass
+	int *into;					// collapse target of each vertex in the current pass
+	int *adjacency_offsets;		// triangles around each vertex, CSR style
+	int *adjacency;
+	collapse_t *collapses;
+} simplifier_t;
+
+static void add_plane(quadric_t *q, const double n[3], double d, double w)
+{
+	q->a[0] += w * n[0] * n[0];
+	q->a[1] += w * n[0] * n[1];
+	q->a[2] += w * n[0] * n[2];
+	q->a[3] += w * n[0] * d;
+	q->a[4] += w * n[1] * n[1];
+	q->a[5] += w * n[1] * n[2];
+	q->a[6] += w * n[1] * d;
+	q->a[7] += w * n[2] * n[2];
+	q->a[8] += w * n[2] * d;
+	q->a[9] += w * d * d;
+	q->weight += w;
+}
+
+static void add_quadric(quadric_t *q, const quadric_t *r)
+{
+	int i;
+
+	for (i = 0; i < 10; ++i)
+		q->a[i] += r->a[i];
+	q->weight += r->weight;
+}
+
+// Area weighted mean squared distance of p to the planes accumulated in both quadrics.
+static double collapse_error(const quadric_t *q, const quadric_t *r, const float *p)
+{
+	double a[10], x = p[0], y = p[1], z = p[2], e, w = q->weight + r->weight;
+	int i;
+
+	for (i = 0; i < 10; ++i)
+		a[i] = q->a[i] + r->a[i];
+	e = a[0] * x * x + 2 * a[1] * x * y + 2 * a[2] * x * z + 2 * a[3] * x
+		+ a[4] * y * y + 2 * a[5] * y * z + 2 * a[6] * y
+		+ a[7] * z * z + 2 * a[8] * z
+		+ a[9];
+	return w > 0 ? fabs(e) / w : 0;
+}
+
+// Unnormalized face normal, twice the triangle's area long.
+static void face_normal(const float *a, const float *b, const float *c, double n[3])
+{
+	double u[3], v[3];
+	int i;
+
+	for (i = 0; i < 3; ++i)
+	{
+		u[i] = (double)b[i] - a[i];
+		v[i] = (double)c[i] - a[i];
+	}
+	n[0] = u[1] * v[2] - u[2] * v[1];
+	n[1] = u[2] * v[0] - u[0] * v[2];
+	n[2] = u[0] * v[1] - u[1] * v[0];
+}
+
+static unsigned int hash_floats(const float *f, int count)
+{
+	unsigned int h = 2166136261u, bits;
+	int i;
+
+	for (i = 0; i < count; ++i)
+	{
+		// +0 and -0 are the same position
+		bits = 0;
+		if (f[i] != 0)
+			memcpy(&bits, &f[i], sizeof(bits));
+		h = (h ^ bits) * 16777619u;
+		h ^= h >> 15;
+	}
+	return h;
+}
+
+static unsigned int hash_edge(long long key)
+{
+	return (unsigned int)(((unsigned long long)key * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+static int table_size(int count)
+{
+	int size = 16;
+
+	while (size < count * 2)
+		size *= 2;
+	return size;
+}
+
+/*
+Welds vertices with the same position and attributes, writing the vertex each
+one is replaced by to weld[], and locks every vertex of a position that has
+more than one set of attributes. Returns 0 if memory ran out.
+*/
+static int weld_vertices(const float *xyz, const float *attributes, int num_attributes, int num_verts, int *weld,
+	unsigned char *locked)
+{
+	int size = table_size(num_verts), *table, *position, i, slot, other;
+
+	if (!(table = malloc(size * sizeof(*table))))
+		return 0;
+	if (!(position = malloc(num_verts * sizeof(*position))))
+	{
+		free(table);
+		return 0;
+	}
+	for (i = 0; i < size; ++i)
+		table[i] = -1;
+
+	for (i = 0; i < num_verts; ++i)
+	{
+		const float *p = xyz + i * 3;
+
+		weld[i] = i;
+		for (slot = hash_floats(p, 3) & (size - 1); (other = table[slot]) >= 0; slot = (slot + 1) & (size - 1))
+		{
+			if (p[0] == xyz[other * 3] && p[1] == xyz[other * 3 + 1] && p[2] == xyz[other * 3 + 2])
+				break;
+		}
+		if (other < 0)
+		{
+			table[slot] = i;
+			position[i] = i;
+			continue;
+		}
+		position[i] = other;
+		if (!num_attributes
+			|| !memcmp(attributes + i * num_attributes, attributes + other * num_attributes,
+				num_attributes * sizeof(*attributes)))
+			weld[i] = other;
+		else
+			locked[other] = 1;
+	}
+	// a seam locks every vertex on it, not just the first one seen
+	for (i = 0; i < num_verts; ++i)
+		locked[i] |= locked[position[i]];
+
+	free(position);
+	free(table);
+	return 1;
+}
+
+// Locks both ends of every edge that doesn't have exactly two triangles. Returns 0 if memory ran out.
+static int lock_open_edges(const int *tris, int num_tris, unsigned char *locked)
+{
+	int size = table_size(num_tris * 3), i, k, a, b, slot;
+	long long *keys, key;
+	int *counts;
+
+	keys = malloc(size * sizeof(*keys));
+	counts = calloc(size, sizeof(*counts));
+	if (!keys || !counts)
+	{
+		free(keys);
+		free(counts);
+		return 0;
+	}
+	for (i = 0; i < size; ++i)
+		keys[i] = -1;
+
+	for (i = 0; i < num_tris * 3; i += 3)
+	{
+		for (k = 0; k < 3; ++k)
+		{
+			a = min(tris[i + k], tris[i + (k + 1) % 3]);
+			b = max(tris[i + k], tris[i + (k + 1) % 3]);
+			key = (long long)a << 32 | b;
+			for (slot = hash_edge(key) & (size - 1); keys[slot] >= 0 && keys[slot] != key;
+				slot = (slot + 1) & (size - 1))
+				;
+			keys[slot] = key;
+			++counts[slot];
+		}
+	}
+	for (i = 0; i < size; ++i)
+	{
+		if (keys[i] >= 0 && counts[i] != 2)
+		{
+			locked[keys[i] >> 32] = 1;
+			locked[keys[i] & 0xFFFFFFFF] = 1;
+		}
+	}
+
+	free(keys);
+	free(counts);
+	return 1;
+}
+
+static void build_adjacency(simplifier_t *s)
+{
+	int *offsets = s->adjacency_offsets, i, v, sum, count;
+
+	memset(offsets, 0, (s->num_verts + 1) * sizeof(*offsets));
+	for (i = 0; i < s->num_tris * 3; ++i)
+		++offsets[s->tris[i]];
+	for (v = 0, sum = 0; v < s->num_verts; ++v)
+	{
+		count = offsets[v];
+		offsets[v] = sum;
+		sum += count;
+	}
+	offsets[s->num_verts] = sum;
+	// filling advances each vertex's offset to the start of the next one's list, shift them back
+	for (i = 0; i < s->num_tris * 3; ++i)
+		s->adjacency[offsets[s->tris[i]]++] = i / 3;
+	for (v = s->num_verts; v > 0; --v)
+		offsets[v] = offsets[v - 1];
+	offsets[0] = 0;
+}
+
+static int compare_collapses(const void *a, const void *b)
+{
+	const collapse_t *x = a, *y = b;
+
+	if (x->cost != y->cost)
+		return x->cost < y->cost ? -1 : 1;
+	if (x->from != y->from)
+		return x->from - y->from;
+	return x->to - y->to;
+}
+
+// Moving from onto to must not fold over or collapse any triangle that survives the move.
+static int collapse_flips(const simplifier_t *s, int from, int to)
+{
+	const float *p[3];
+	double n0[3], n1[3], dot, len0, len1;
+	int i, k, t, *tri;
+
+	for (i = s->adjacency_offsets[from]; i < s->adjacency_offsets[from + 1]; ++i)
+	{
+		t = s->adjacency[i];
+		tri = s->tris + t * 3;
+		if (tri[0] == to || tri[1] == to || tri[2] == to)
+			continue;
+		for (k = 0; k < 3; ++k)
+			p[k] = s->xyz + tri[k] * 3;
+		face_normal(p[0], p[1], p[2], n0);
+		for (k = 0; k < 3; ++k)
+		{
+			if (tri[k] == from)
+				p[k] = s->xyz + to * 3;
+		}
+		face_normal(p[0], p[1], p[2], n1);
+		dot = n0[0] * n1[0] + n0[1] * n1[1] + n0[2] * n1[2];
+		len0 = sqrt(n0[0] * n0[0] + n0[1] * n0[1] + n0[2] * n0[2]);
+		len1 = sqrt(n1[0] * n1[0] + n1[1] * n1[1] + n1[2] * n1[2]);
+		// more than about 75 degrees of turn, or down to a sliver, is too much for a single collapse
+		if (dot <= 0.25 * len0 * len1 || len1 <= 1e-6 * len0)
+			return 1;
+	}
+	return 0;
+}
+
+static int tri_has(const int *tri, int v)
+{
+	return tri[0] == v || tri[1] == v || tri[2] == v;
+}
+
+// Whether v has a triangle with both a and b, other than through skip.
+static int has_fan_edge(const simplifier_t *s, int v, int a, int b, int skip)
+{
+	const int *tri;
+	int i;
+
+	for (i = s->adjacency_offsets[v]; i < s->adjacency_offsets[v + 1]; ++i)
+	{
+		tri = s->tris + s->adjacency[i] * 3;
+		if (tri_has(tri, a) && tri_has(tri, b) && !tri_has(tri, skip))
+			return 1;
+	}
+	return 0;
+}
+
+// Moving from onto to must keep the surface manifold (the link condition): apart from the vertices opposite
+// their edge, the two must not share a neighbour, nor both have a triangle with the edge between those two
+// (as in a tetrahedron), or the collapse pinches the surface into duplicate or non-manifold triangles.
+static int collapse_breaks_link(const simplifier_t *s, int from, int to)
+{
+	int opposite[2] = { -1, -1 }, num_opposite = 0, i, j, k, w;
+	const int *tri;
+
+	for (i = s->adjacency_offsets[from]; i < s->adjacency_offsets[from + 1]; ++i)
+	{
+		tri = s->tris + s->adjacency[i] * 3;
+		for (k = 0; k < 3 && tri_has(tri, to); ++k)
+		{
+			// an edge with more than two triangles leaves its other opposites to be caught below
+			if (tri[k] != from && tri[k] != to && num_opposite < 2)
+				opposite[num_opposite++] = tri[k];
+		}
+	}
+	if (num_opposite == 2 && has_fan_edge(s, from, opposite[0], opposite[1], to)
+		&& has_fan_edge(s, to, opposite[0], opposite[1], from))
+	{
+		return 1;
+	}
+	for (i = s->adjacency_offsets[from]; i < s->adjacency_offsets[from + 1]; ++i)
+	{
+		tri = s->tris + s->adjacency[i] * 3;
+		if (tri_has(tri, to))
+			continue;
+		for (k = 0; k < 3; ++k)
+		{
+			w = tri[k];
+			if (w == from || w == opposite[0] || w == opposite[1])
+				continue;
+			for (j = s->adjacency_offsets[to]; j < s->adjacency_offsets[to + 1]; ++j)
+			{
+				if (tri_has(s->tris + s->adjacency[j] * 3, w))
+					return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+// One pass of non-overlapping collapses. Returns how many were made.
+static int collapse_pass(simplifier_t *s, int max_collapses, double max_cost)
+{
+	int num_collapses = 0, made = 0, i, k, a, b, t;
+	collapse_t *c;
+
+	build_adjacency(s);
+
+	for (i = 0; i < s->num_tris * 3; i += 3)
+	{
+		for (k = 0; k < 3; ++k)
+		{
+			a = s->tris[i + k];
+			b = s->tris[i + (k + 1) % 3];
+			if (!s->locked[a])
+			{
+				c = &s->collapses[num_collapses++];
+				c->from = a;
+				c->to = b;
+				c->cost = collapse_error(&s->quadrics[a], &s->quadrics[b], s->xyz + b * 3);
+			}
+			if (!s->locked[b])
+			{
+				c = &s->collapses[num_collapses++];
+				c->from = b;
+				c->to = a;
+				c->cost = collapse_error(&s->quadrics[a], &s->quadrics[b], s->xyz + a * 3);
+			}
+		}
+	}
+	qsort(s->collapses, num_collapses, sizeof(*s->collapses), compare_collapses);
+
+	memset(s->touched, 0, s->num_verts);
+	for (i = 0; i < num_collapses && made < max_collapses; ++i)
+	{
+		c = &s->collapses[i];
+		if (c->cost > max_cost)
+			break;
+		if (s->touched[c->from] || s->touched[c->to] || collapse_flips(s, c->from, c->to)
+			|| collapse_breaks_link(s, c->from, c->to))
+			continue;
+
+		s->into[c->from] = c->to;
+		add_quadric(&s->quadrics[c->to], &s->quadrics[c->from]);
+		// whatever shares a triangle with from changes shape, so it sits out the rest of the pass
+		for (k = s->adjacency_offsets[c->from]; k < s->adjacency_offsets[c->from + 1]; ++k)
+		{
+			t = s->adjacency[k];
+			s->touched[s->tris[t * 3]] = s->touched[s->tris[t * 3 + 1]] = s->touched[s->tris[t * 3 + 2]] = 1;
+		}
+		++made;
+	}
+	if (!made)
+		return 0;
+
+	// apply the collapses and drop the triangles they degenerate
+	for (i = 0, t = 0; i < s->num_tris * 3; i += 3)
+	{
+		a = s->into[s->tris[i]];
+		b = s->into[s->tris[i + 1]];
+		k = s->into[s->tris[i + 2]];
+		if (a == b || b == k || k == a)
+			continue;
+		s->tris[t++] = a;
+		s->tris[t++] = b;
+		s->tris[t++] = k;
+	}
+	s->num_tris = t / 3;
+	for (i = 0; i < s->num_verts; ++i)
+		s->into[i] = i;
+	return made;
+}
+
+static void free_simplifier(simplifier_t *s)
+{
+	free(s->tris);
+	free(s->quadrics);
+	free(s->locked);
+	free(s->touched);
+	free(s->into);
+	free(s->adjacency_offsets);
+	free(s->adjacency);
+	free(s->collapses);
+}
+
+/*
+Simplifies an indexed triangle list. xyz holds three floats per vertex,
+attributes num_attributes floats per vertex that must match for vertices at
+the same position to be welded (may be NULL if num_attributes is 0). Writes
+the remaining triangles to out_indexes, which must have room for
+num_indexes, as indexes of the original vertices, in the original winding.
+Returns the number of indexes written, or -1 if memory ran out.
+*/
+int simplify_mesh(const float *xyz, const float *attributes, int num_attributes, int num_verts,
+	const int *indexes, int num_indexes, const simplify_t *params, int *out_indexes)
+{
+	simplifier_t s;
+	int *weld = NULL, target, i, k, t;
+	double max_cost;
+	double n[3];
+
+	memset(&s, 0, sizeof(s));
+	s.xyz = xyz;
+	s.num_verts = num_verts;
+	s.tris = malloc(max(num_indexes, 1) * sizeof(*s.tris));
+	s.quadrics = calloc(max(num_verts, 1), sizeof(*s.quadrics));
+	s.locked = calloc(max(num_verts, 1), 1);
+	s.touched = malloc(max(num_verts, 1));
+	s.into = malloc(max(num_verts, 1) * sizeof(*s.into));
+	s.adjacency_offsets = malloc((num_verts + 1) * sizeof(*s.adjacency_offsets));
+	s.adjacency = malloc(max(num_indexes, 1) * sizeof(*s.adjacency));
+	s.collapses = malloc(max(num_indexes, 1) * 2 * sizeof(*s.collapses));
+	weld = malloc(max(num_verts, 1) * sizeof(*weld));
+	if (!s.tris || !s.quadrics || !s.locked || !s.touched || !s.into || !s.adjacency_offsets || !s.adjacency
+		|| !s.collapses || !weld || !weld_vertices(xyz, attributes, num_attributes, num_verts, weld, s.locked))
+	{
+		free(weld);
+		free_simplifier(&s);
+		return -1;
+	}
+
+	// welded triangles, without the ones that were degenerate to begin with
+	for (i = 0, t = 0; i + 2 < num_indexes; i += 3)
+	{
+		for (k = 0; k < 3; ++k)
+			s.tris[t + k] = weld[indexes[i + k]];
+		if (s.tris[t] != s.tris[t + 1] && s.tris[t + 1] != s.tris[t + 2] && s.tris[t + 2] != s.tris[t])
+			t += 3;
+	}
+	s.num_tris = t / 3;
+	free(weld);
+
+	if (!lock_open_edges(s.tris, s.num_tris, s.locked))
+	{
+		free_simplifier(&s);
+		return -1;
+	}
+
+	// every vertex starts with the planes of the triangles around it, weighted by their area
+	for (i = 0; i < s.num_tris * 3; i += 3)
+	{
+		double len, d;
+
+		face_normal(xyz + s.tris[i] * 3, xyz + s.tris[i + 1] * 3, xyz + s.tris[i + 2] * 3, n);
+		len = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+		if (len <= 0)
+			continue;
+		for (k = 0; k < 3; ++k)
+			n[k] /= len;
+		d = -(n[0] * xyz[s.tris[i] * 3] + n[1] * xyz[s.tris[i] * 3 + 1] + n[2] * xyz[s.tris[i] * 3 + 2]);
+		for (k = 0; k < 3; ++k)
+			add_plane(&s.quadrics[s.tris[i + k]], n, d, len * 0.5);
+	}
+	for (i = 0; i < num_verts; ++i)
+		s.into[i] = i;
+
+	target = (int)(params->ratio * s.num_tris + 0.5f);
+	max_cost = params->max_error < FLT_MAX ? (double)params->max_error * params->max_error : DBL_MAX;
+	// an interior collapse takes two triangles with it, so aim for half the difference per pass
+	while (s.num_tris > target && collapse_pass(&s, max((s.num_tris - target) / 2, 1), max_cost))
+		;
+
+	memcpy(out_indexes, s.tris, s.num_tris * 3 * sizeof(*out_indexes));
+	i = s.num_tris * 3;
+	free_simplifier(&s);
+	return i;
+}
+
+/*
+Renumbers the indexes to cover only the vertices they use, keeping the
+vertices' order. order receives the original index of each remaining
+vertex; the return value is their count.
+*/
+int compact_mesh(int *indexes, int num_indexes, int num_verts, int *order)
+{
+	int *remap, i, count = 0;
+
+	if (!(remap = malloc(max(num_verts, 1) * sizeof(*remap))))
+		return -1;
+	for (i = 0; i < num_verts; ++i)
+		remap[i] = -1;
+	for (i = 0; i < num_indexes; ++i)
+		remap[indexes[i]] = 0;
+	for (i = 0; i < num_verts; ++i)
+	{
+		if (remap[i] == 0)
+		{
+			order[count] = i;
+			remap[i] = count++;
+		}
+	}
+	for (i = 0; i < num_indexes; ++i)
+		indexes[i] = remap[indexes[i]];
+	free(remap);
+	return count;
+}
@@ -0,0 +1,570 @@
+/*
+MD3 and/or BSP to OBJ converter
+Written by Leszek Godlewski <github@inequation.org>
+The code in this file is placed in the public domain.
+*/
+
+#ifdef _MSC_VER
+	#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#if defined(_WIN32)
+	#define OUTPUT_THREADS
+	#define WIN32_LEAN_AND_MEAN
+	#include <windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+	#define OUTPUT_THREADS
+	#include <pthread.h>
+#endif
+
+#include "md3bsp2ase.h"
+
+#define OUTPUT_BUFFER_SIZE	(64 * 1024)
+#define OUTPUT_QUEUE_DEPTH	8
+#define MAX_LOG_MESSAGE		1024
+#define GZIP_BLOCK_SIZE		(128 * 1024)
+#define GZIP_BATCH_BLOCKS	16
+
+/*
+Compressed outputs collect GZIP_BATCH_BLOCKS blocks of raw text before
+deflating them all at once, one block per thread. The compressed blocks are
+then staged into ordinary output buffers in order, so the writer thread and
+the sink never know the difference.
+*/
+struct output_gzip_s
+{
+	int level;
+	unsigned int crc, isize;
+	char *stage;				// compressed bytes waiting for a full buffer
+	size_t staged;
+};
+
+#ifdef OUTPUT_THREADS
+
+/*
+Once an output fills its first buffer, a writer thread is started for it and
+every full buffer is handed over through a bounded ring, so formatting goes
+on while the sink writes. The producer only ever blocks when the writer is
+OUTPUT_QUEUE_DEPTH buffers behind.
+*/
+struct output_queue_s
+{
+	char *bufs[OUTPUT_QUEUE_DEPTH];
+	size_t sizes[OUTPUT_QUEUE_DEPTH];
+	int head, count;
+	int done;
+	int failed;				// set by the writer thread
+	double write_seconds;	// the writer thread's share of STAGE_WRITE, added up once it's stopped
+	const sink_t *sink;
+	void *stream;
+#ifdef _WIN32
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE filled, drained;
+	HANDLE thread;
+#else
+	pthread_mutex_t lock;
+	pthread_cond_t filled, drained;
+	pthread_t thread;
+#endif
+};
+
+#ifdef _WIN32
+	#define lock_queue(q)		EnterCriticalSection(&(q)->lock)
+	#define unlock_queue(q)		LeaveCriticalSection(&(q)->lock)
+	#define wait_queue(q, c)	SleepConditionVariableCS(&(q)->c, &(q)->lock, INFINITE)
+	#define signal_queue(q, c)	WakeConditionVariable(&(q)->c)
+#else
+	#define lock_queue(q)		pthread_mutex_lock(&(q)->lock)
+	#define unlock_queue(q)		pthread_mutex_unlock(&(q)->lock)
+	#define wait_queue(q, c)	pthread_cond_wait(&(q)->c, &(q)->lock)
+	#define signal_queue(q, c)	pthread_cond_signal(&(q)->c)
+#endif
+
+#ifdef _WIN32
+static DWORD WINAPI output_writer(void *param)
+#else
+static void *output_writer(void *param)
+#endif
+{
+	output_queue_t *q = param;
+	char *buf;
+	size_t size;
+	double start;
+	int failed = 0;
+
+	for (;;)
+	{
+		lock_queue(q);
+		while (!q->count && !q->done)
+			wait_queue(q, filled);
+		if (!q->count)
+		{
+			unlock_queue(q);
+			break;
+		}
+		// the slot stays taken until written, so the producer can't reuse the buffer meanwhile
+		buf = q->bufs[q->head];
+		size = q->sizes[q->head];
+		unlock_queue(q);
+
+		start = get_time();
+		if (!failed && q->sink->write(q->sink->context, q->stream, buf, size) != 0)
+			failed = 1;
+		start = get_time() - start;
+
+		lock_queue(q);
+		q->write_seconds += start;
+		q->head = (q->head + 1) % OUTPUT_QUEUE_DEPTH;
+		--q->count;
+		q->failed = failed;
+		signal_queue(q, drained);
+		unlock_queue(q);
+	}
+
+	return 0;
+}
+
+static void free_output_queue(output_queue_t *q)
+{
+	int i;
+
+	for (i = 0; i < OUTPUT_QUEUE_DEPTH; ++i)
+		free(q->bufs[i]);
+#ifdef _WIN32
+	DeleteCriticalSection(&q->lock);
+#else
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->filled);
+	pthread_cond_destroy(&q->drained);
+#endif
+	free(q);
+}
+
+// Returns NULL if the thread or its buffers can't be had, the output then simply stays synchronous.
+static output_queue_t *start_output_queue(const sink_t *sink, void *stream)
+{
+	output_queue_t *q;
+	int i;
+
+	if (!(q = calloc(1, sizeof(*q))))
+		return NULL;
+	q->sink = sink;
+	q->stream = stream;
+#ifdef _WIN32
+	InitializeCriticalSection(&q->lock);
+	InitializeConditionVariable(&q->filled);
+	InitializeConditionVariable(&q->drained);
+#else
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->filled, NULL);
+	pthread_cond_init(&q->drained, NULL);
+#endif
+	for (i = 0; i < OUTPUT_QUEUE_DEPTH; ++i)
+	{
+		if (!(q->bufs[i] = malloc(OUTPUT_BUFFER_SIZE)))
+		{
+			free_output_queue(q);
+			return NULL;
+		}
+	}
+#ifdef _WIN32
+	if (!(q->thread = CreateThread(NULL, 0, output_writer, q, 0, NULL)))
+#else
+	if (pthread_create(&q->thread, NULL, output_writer, q) != 0)
+#endif
+	{
+		free_output_queue(q);
+		return NULL;
+	}
+	return q;
+}
+
+// Hands the filled buffer to the writer thread and swaps in a free one.
+static void queue_output(output_t *out, char **buf, size_t size)
+{
+	output_queue_t *q = out->queue;
+	char *free_buf;
+	int slot;
+
+	lock_queue(q);
+	while (q->count == OUTPUT_QUEUE_DEPTH)
+		wait_queue(q, drained);
+	slot = (q->head + q->count) % OUTPUT_QUEUE_DEPTH;
+	free_buf = q->bufs[slot];
+	q->bufs[slot] = *buf;
+	q->sizes[slot] = size;
+	++q->count;
+	out->failed |= q->failed;
+	signal_queue(q, filled);
+	unlock_queue(q);
+	*buf = free_buf;
+}
+
+// Waits for everything queued to be written and stops the thread. Returns non-zero if any write failed.
+static int stop_output_queue(output_queue_t *q)
+{
+	int failed;
+
+	lock_queue(q);
+	q->done = 1;
+	signal_queue(q, filled);
+	unlock_queue(q);
+#ifdef _WIN32
+	WaitForSingleObject(q->thread, INFINITE);
+	CloseHandle(q->thread);
+#else
+	pthread_join(q->thread, NULL);
+#endif
+	failed = q->failed;
+	add_time(q->sink->stats, STAGE_WRITE, q->write_seconds);
+	free_output_queue(q);
+	return failed;
+}
+
+#endif // OUTPUT_THREADS
+
+// Passes one buffer of at most OUTPUT_BUFFER_SIZE bytes on to the sink. *buf may be swapped for a free one.
+static void write_output(output_t *out, char **buf, size_t size)
+{
+	double start;
+
+	if (!size || out->failed)
+		return;
+	add_count(out->sink->stats, COUNT_BYTES_OUT, size);
+
+#ifdef OUTPUT_THREADS
+	if (!out->queue && !out->synchronous)
+	{
+		if (!(out->queue = start_output_queue(out->sink, out->stream)))
+			out->synchronous = 1;
+	}
+	if (out->queue)
+	{
+		queue_output(out, buf, size);
+		return;
+	}
+#endif
+
+	start = get_time();
+	if (out->sink->write(out->sink->context, out->stream, *buf, size) != 0)
+		out->failed = 1;
+	add_time(out->sink->stats, STAGE_WRITE, get_time() - start);
+}
+
+static void stage_output(output_t *out, const void *data, size_t size)
+{
+	output_gzip_t *gz = out->gzip;
+	const char *p = data;
+	size_t chunk;
+
+	while (size)
+	{
+		if (gz->staged == OUTPUT_BUFFER_SIZE)
+		{
+			write_output(out, &gz->stage, gz->staged);
+			gz->staged = 0;
+		}
+		chunk = min(size, OUTPUT_BUFFER_SIZE - gz->staged);
+		memcpy(gz->stage + gz->staged, p, chunk);
+		gz->staged += chunk;
+		p += chunk;
+		size -= chunk;
+	}
+}
+
+// Deflates the batch in independent blocks, in parallel, and stages them in order.
+static void compress_output(output_t *out, int last)
+{
+	output_gzip_t *gz = out->gzip;
+	unsigned char *packed[GZIP_BATCH_BLOCKS];
+	size_t packed_size[GZIP_BATCH_BLOCKS];
+	unsigned int crc[GZIP_BATCH_BLOCKS];
+	double start;
+	int num_blocks, i;
+
+	if (out->failed)
+		return;
+	start = get_time();
+	// the last batch always gets at least one block to carry the final block flag
+	num_blocks = (int)((out->used + GZIP_BLOCK_SIZE - 1) / GZIP_BLOCK_SIZE);
+	if (last && !num_blocks)
+		num_blocks = 1;
+
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic) if(num_blocks > 1)
+#endif
+	for (i = 0; i < num_blocks; ++i)
+	{
+		const unsigned char *in = (const unsigned char *)out->buf + (size_t)i * GZIP_BLOCK_SIZE;
+		size_t size = min(out->used - (size_t)i * GZIP_BLOCK_SIZE, GZIP_BLOCK_SIZE);
+
+		packed_size[i] = 0;
+		crc[i] = crc32_update(0, in, size);
+		if ((packed[i] = malloc(deflate_bound(size))) != NULL)
+			packed_size[i] = deflate_chunk(in, size, gz->level, last && i == num_blocks - 1, packed[i]);
+	}
+	add_time(out->sink->stats, STAGE_COMPRESS, get_time() - start);
+
+	for (i = 0; i < num_blocks; ++i)
+	{
+		size_t size = min(out->used - (size_t)i * GZIP_BLOCK_SIZE, GZIP_BLOCK_SIZE);
+
+		if (!packed_size[i])
+			out->failed = 1;
+		if (!out->failed)
+		{
+			gz->crc = crc32_combine(gz->crc, crc[i], size);
+			gz->isize += (unsigned int)size;
+			stage_output(out, packed[i], packed_size[i]);
+		}
+		free(packed[i]);
+	}
+}
+
+static void flush_output(output_t *out)
+{
+	if (out->gzip)
+		compress_output(out, 0);
+	else
+		write_output(out, &out->buf, out->used);
+	out->used = 0;
+}
+
+static void free_output_gzip(output_t *out)
+{
+	if (!out->gzip)
+		return;
+	free(out->gzip->stage);
+	free(out->gzip);
+	out->gzip = NULL;
+}
+
+// Sets an output up for gzip: the raw buffer becomes a whole batch and the header is staged.
+static int start_output_gzip(output_t *out, int level)
+{
+	static const unsigned char header[10] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF };
+	char *buf;
+
+	if (!(out->gzip = calloc(1, sizeof(*out->gzip)))
+		|| !(out->gzip->stage = malloc(OUTPUT_BUFFER_SIZE))
+		|| !(buf = realloc(out->buf, GZIP_BLOCK_SIZE * GZIP_BATCH_BLOCKS)))
+	{
+		free_output_gzip(out);
+		return 0;
+	}
+	out->buf = buf;
+	out->capacity = GZIP_BLOCK_SIZE * GZIP_BATCH_BLOCKS;
+	out->gzip->level = level;
+	stage_output(out, header, sizeof(header));
+	return 1;
+}
+
+// Compresses what is left and stages the trailer: CRC-32 and size modulo 2^32, little endian.
+static void finish_output_gzip(output_t *out)
+{
+	output_gzip_t *gz = out->gzip;
+	unsigned char trailer[8];
+	int i;
+
+	compress_output(out, 1);
+	out->used = 0;
+	for (i = 0; i < 4; ++i)
+	{
+		trailer[i] = (unsigned char)(gz->crc >> (i * 8));
+		trailer[4 + i] = (unsigned char)(gz->isize >> (i * 8));
+	}
+	stage_output(out, trailer, sizeof(trailer));
+	write_output(out, &gz->stage, gz->staged);
+	gz->staged = 0;
+}
+
+// Makes room for at least size more bytes: streams flush, memory outputs grow. Returns 0 on failure.
+static int reserve_output(output_t *out, size_t size)
+{
+	char *buf;
+	size_t capacity;
+
+	if (out->used + size <= out->capacity)
+		return 1;
+	if (out->stream)
+	{
+		flush_output(out);
+		return size <= out->capacity;
+	}
+	for (capacity = out->capacity * 2; capacity < out->used + size; capacity *= 2)
+		;
+	if (!(buf = realloc(out->buf, capacity)))
+	{
+		out->failed = 1;
+		return 0;
+	}
+	out->buf = buf;
+	out->capacity = capacity;
+	return 1;
+}
+
+int open_output(output_t *out, const sink_t *sink, const char *name)
+{
+	memset(out, 0, sizeof(*out));
+	out->sink = sink;
+	out->capacity = OUTPUT_BUFFER_SIZE;
+	if (!(out->buf = malloc(out->capacity)))
+	{
+		sink_log(sink, LOG_ERROR, "Memory allocation failed");
+		return 11;
+	}
+	if (sink->compression > 0 && !start_output_gzip(out, min(sink->compression, 9)))
+	{
+		sink_log(sink, LOG_ERROR, "Memory allocation failed");
+		free(out->buf);
+		out->buf = NULL;
+		return 11;
+	}
+	if (!(out->stream = sink->open(sink->context, name)))
+	{
+		sink_log(sink, LOG_ERROR, "Failed to open output %s", name ? name : "(primary)");
+		free_output_gzip(out);
+		free(out->buf);
+		out->buf = NULL;
+		return 4;
+	}
+	add_count(sink->stats, COUNT_OUTPUTS, 1);
+	return 0;
+}
+
+int open_memory_output(output_t *out)
+{
+	memset(out, 0, sizeof(*out));
+	out->capacity = OUTPUT_BUFFER_SIZE;
+	if (!(out->buf = malloc(out->capacity)))
+		return 11;
+	return 0;
+}
+
+void output_printf(output_t *out, const char *format, ...)
+{
+	va_list args;
+	int len;
+
+	if (out->failed)
+		return;
+
+	va_start(args, format);
+	len = vsnprintf(out->buf + out->used, out->capacity - out->used, format, args);
+	va_end(args);
+	if (len >= 0 && (size_t)len < out->capacity - out->used)
+	{
+		out->used += len;
+		return;
+	}
+
+	// didn't fit, make room and try again
+	if (len < 0 || !reserve_output(out, (size_t)len + 1))
+	{
+		out->failed = 1;
+		return;
+	}
+	va_start(args, format);
+	vsnprintf(out->buf + out->used, out->capacity - out->used, format, args);
+	va_end(args);
+	out->used += len;
+}
+
+void output_write(output_t *out, const void *data, size_t size)
+{
+	const char *p = data;
+	size_t chunk;
+
+	if (out->failed)
+		return;
+
+	// memory outputs take it in one go, streams a buffer at a time
+	if (!out->stream && !reserve_output(out, size))
+		return;
+	while (size)
+	{
+		if (out->used == out->capacity)
+			flush_output(out);
+		chunk = min(size, out->capacity - out->used);
+		memcpy(out->buf + out->used, p, chunk);
+		out->used += chunk;
+		p += chunk;
+		size -= chunk;
+	}
+}
+
+int close_output(output_t *out)
+{
+	int failed = 0;
+
+	if (!out->stream)
+	{
+		// memory output
+		free(out->buf);
+		memset(out, 0, sizeof(*out));
+		return 0;
+	}
+
+	if (out->gzip)
+		finish_output_gzip(out);
+	else
+		flush_output(out);
+#ifdef OUTPUT_THREADS
+	if (out->queue)
+		failed = stop_output_queue(out->queue);
+#endif
+	failed = out->sink->close(out->sink->context, out->stream) != 0 || out->failed || failed;
+	free_output_gzip(out);
+	free(out->buf);
+	out->buf = NULL;
+	out->stream = NULL;
+	out->queue = NULL;
+	if (failed)
+	{
+		sink_log(out->sink, LOG_ERROR, "Failed to write output");
+		return 18;
+	}
+	return 0;
+}
+
+void sink_log(const sink_t *sink, int level, const char *format, ...)
+{
+	char message[MAX_LOG_MESSAGE];
+	va_list args;
+
+	if (!sink->log || level > sink->log_level)
+		return;
+
+	va_start(args, format);
+	vsnprintf(message, sizeof(message), format, args);
+	va_end(args);
+	message[sizeof(message) - 1] = 0;
+	sink->log(sink->context, level, message);
+}
+
+// Throttles progress reports; next_report starts out zeroed and is kept by the caller between calls.
+void sink_progress(const sink_t *sink, double *next_report, const char *what, int done, int total)
+{
+	double now;
+
+	if (!sink->progress)
+		return;
+	now = get_time();
+	if (done < total && now < *next_report)
+		return;
+	*next_report = now + 1.0 / PROGRESS_RATE;
+	sink->progress(sink->context, what, done, total);
+}
+
+void sink_reference(const sink_t *sink, const char *name, char *buf, size_t size)
+{
+	if (sink->reference)
+		sink->reference(sink->context, name, buf, size);
+	else
+		snprintf(buf, size, "%s", name ? name : "");
+}
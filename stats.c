@@ -0,0 +1,118 @@
+/*
+MD3 and/or BSP to OBJ converter
+Written by Leszek Godlewski <github@inequation.org>
+The code in this file is placed in the public domain.
+*/
+
+#ifdef _MSC_VER
+	#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+	#define WIN32_LEAN_AND_MEAN
+	#define PSAPI_VERSION	2		// GetProcessMemoryInfo lives in kernel32, no psapi.lib needed
+	#include <windows.h>
+	#include <psapi.h>
+#elif defined(__unix__) || defined(__APPLE__)
+	#include <time.h>
+	#include <sys/time.h>
+	#include <sys/resource.h>
+#endif
+
+#include "md3bsp2ase.h"
+
+static const char *const stage_names[NUM_STAGES] =
+{
+	"load", "validate", "tessellate", "normals", "merge", "simplify", "format", "compress", "write", "total"
+};
+
+static const char *const counter_names[NUM_COUNTERS] =
+{
+	"surfaces", "vertices", "triangles", "outputs", "bytes_out"
+};
+
+// Monotonic seconds from an arbitrary origin; only differences mean anything.
+double get_time(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER count, frequency;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+	return (double)count.QuadPart / (double)frequency.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+// Stages running on several threads at once add up their time, so they may exceed the wall time.
+void add_time(stats_t *stats, int stage, double seconds)
+{
+	if (!stats)
+		return;
+#ifdef _OPENMP
+	#pragma omp atomic
+#endif
+	stats->seconds[stage] += seconds;
+}
+
+void add_count(stats_t *stats, int counter, long long value)
+{
+	if (!stats)
+		return;
+#ifdef _OPENMP
+	#pragma omp atomic
+#endif
+	stats->counts[counter] += value;
+}
+
+// Peak resident set size of the whole process in bytes, 0 where unknown.
+long long get_peak_memory(void)
+{
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters;
+
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+	return (long long)counters.PeakWorkingSetSize;
+#elif defined(__unix__) || defined(__APPLE__)
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+	#ifdef __APPLE__
+		return (long long)usage.ru_maxrss;
+	#else
+		return (long long)usage.ru_maxrss * 1024;
+	#endif
+#else
+	return 0;
+#endif
+}
+
+/*
+One JSON object, stable keys so that reports from different asset builds can
+be diffed:
+{"seconds": {"load": ..., ..., "total": ...}, "counters": {"surfaces": ..., ..., "peak_memory": ...}}
+*/
+void write_stats_json(output_t *out, const stats_t *stats)
+{
+	int i;
+
+	output_printf(out, "{\n\t\"seconds\": {");
+	for (i = 0; i < NUM_STAGES; ++i)
+		output_printf(out, "%s\n\t\t\"%s\": %.6f", i ? "," : "", stage_names[i], stats->seconds[i]);
+	output_printf(out, "\n\t},\n\t\"counters\": {");
+	for (i = 0; i < NUM_COUNTERS; ++i)
+		output_printf(out, "\n\t\t\"%s\": %lld,", counter_names[i], stats->counts[i]);
+	output_printf(out, "\n\t\t\"peak_memory\": %lld\n\t}\n}\n", get_peak_memory());
+}
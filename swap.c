@@ -0,0 +1,251 @@
+/*
+MD3 and/or BSP to OBJ converter
+Written by Leszek Godlewski <github@inequation.org>
+The code in this file is placed in the public domain.
+*/
+
+#ifdef _MSC_VER
+	#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__SSSE3__) || defined(__AVX__)
+	#define SWAP_SSSE3
+	#include <tmmintrin.h>
+#elif defined(__VSX__) && defined(__BIG_ENDIAN__)
+	#define SWAP_VSX
+	#include <altivec.h>
+	#undef vector
+	#undef pixel
+	#undef bool
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	#define SWAP_NEON
+	#include <arm_neon.h>
+#endif
+
+#include "md3bsp2ase.h"
+
+/*
+Everything is swapped as raw 32-bit or 16-bit words through byte shuffles:
+floats never pass through FPU registers, so odd bit patterns such as
+signalling NaNs survive. The vector paths only need unaligned loads, the
+scalar tails handle whatever is left.
+*/
+
+void swap_longs(void *data, size_t count)
+{
+	unsigned char *p = data, t;
+	size_t i = 0;
+
+#if defined(SWAP_SSSE3)
+	const __m128i mask = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i *v = (__m128i *)(p + i * 4);
+		_mm_storeu_si128(v, _mm_shuffle_epi8(_mm_loadu_si128(v), mask));
+	}
+#elif defined(SWAP_VSX)
+	const __vector unsigned char mask = { 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 };
+	for (; i + 4 <= count; i += 4)
+	{
+		__vector unsigned char v = vec_xl(0, p + i * 4);
+		vec_xst(vec_perm(v, v, mask), 0, p + i * 4);
+	}
+#elif defined(SWAP_NEON)
+	for (; i + 4 <= count; i += 4)
+		vst1q_u8(p + i * 4, vrev32q_u8(vld1q_u8(p + i * 4)));
+#endif
+
+	for (p += i * 4; i < count; ++i, p += 4)
+	{
+		t = p[0]; p[0] = p[3]; p[3] = t;
+		t = p[1]; p[1] = p[2]; p[2] = t;
+	}
+}
+
+void swap_shorts(void *data, size_t count)
+{
+	unsigned char *p = data, t;
+	size_t i = 0;
+
+#if defined(SWAP_SSSE3)
+	const __m128i mask = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i *v = (__m128i *)(p + i * 2);
+		_mm_storeu_si128(v, _mm_shuffle_epi8(_mm_loadu_si128(v), mask));
+	}
+#elif defined(SWAP_VSX)
+	const __vector unsigned char mask = { 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 };
+	for (; i + 8 <= count; i += 8)
+	{
+		__vector unsigned char v = vec_xl(0, p + i * 2);
+		vec_xst(vec_perm(v, v, mask), 0, p + i * 2);
+	}
+#elif defined(SWAP_NEON)
+	for (; i + 8 <= count; i += 8)
+		vst1q_u8(p + i * 2, vrev16q_u8(vld1q_u8(p + i * 2)));
+#endif
+
+	for (p += i * 2; i < count; ++i, p += 2)
+	{
+		t = p[0]; p[0] = p[1]; p[1] = t;
+	}
+}
+
+// Swapping is its own inverse, so byte arrays embedded in a swapped struct are restored by swapping them again.
+static void restore_bytes(unsigned char *first, size_t count, size_t stride, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < count; ++i, first += stride)
+		swap_longs(first, len / 4);
+}
+
+/*
+Converts a whole BSP to native byte order in place. Every lump but the
+entity string, lightmaps, light grid and visibility bits is made of 32-bit
+fields, so those are swapped wholesale and the few byte arrays inside
+(shader names and vertex colors) are put back afterwards. Lumps out of
+bounds are left alone for validate_bsp to reject.
+*/
+void swap_bsp(unsigned char *buf, size_t size)
+{
+	dheader_t *header = (dheader_t *)buf;
+	unsigned char *lump;
+	int i, ofs, len;
+
+	swap_longs(header, sizeof(*header) / 4);
+	for (i = 0; i < HEADER_LUMPS; ++i)
+	{
+		ofs = header->lumps[i].fileofs;
+		len = header->lumps[i].filelen;
+		if (!check_range(ofs, len, 1, size) || (ofs & 3))
+			continue;
+		lump = buf + ofs;
+		switch (i)
+		{
+			case LUMP_ENTITIES:
+			case LUMP_LIGHTMAPS:
+			case LUMP_LIGHTGRID:
+				break;
+			case LUMP_VISIBILITY:
+				// numClusters and clusterBytes, followed by the bit vectors
+				swap_longs(lump, min(len / 4, 2));
+				break;
+			case LUMP_SHADERS:
+				swap_longs(lump, len / 4);
+				restore_bytes(lump + offsetof(dshader_t, shader), len / sizeof(dshader_t), sizeof(dshader_t),
+					MAX_QPATH);
+				break;
+			case LUMP_FOGS:
+				swap_longs(lump, len / 4);
+				restore_bytes(lump + offsetof(dfog_t, shader), len / sizeof(dfog_t), sizeof(dfog_t), MAX_QPATH);
+				break;
+			case LUMP_DRAWVERTS:
+				swap_longs(lump, len / 4);
+				restore_bytes(lump + offsetof(drawVert_t, color), len / sizeof(drawVert_t), sizeof(drawVert_t),
+					sizeof(((drawVert_t *)0)->color));
+				break;
+			default:
+				swap_longs(lump, len / 4);
+				break;
+		}
+	}
+}
+
+/*
+Converts a whole MD3 to native byte order in place, following the surface
+chain as far as it stays within the buffer. Vertices are 16-bit, everything
+else is 32-bit apart from the names.
+*/
+void swap_md3(unsigned char *buf, size_t size)
+{
+	md3Header_t *header = (md3Header_t *)buf;
+	md3Surface_t *surf;
+	long long offset;
+	int i, num_frames, num_tags;
+
+	swap_longs(header, sizeof(*header) / 4);
+	restore_bytes((unsigned char *)header->name, 1, 0, sizeof(header->name));
+	num_frames = header->numFrames;
+	num_tags = header->numTags;
+
+	if (check_range(header->ofsFrames, num_frames, sizeof(md3Frame_t), size) && !(header->ofsFrames & 3))
+	{
+		swap_longs(buf + header->ofsFrames, num_frames * sizeof(md3Frame_t) / 4);
+		restore_bytes(buf + header->ofsFrames + offsetof(md3Frame_t, name), num_frames, sizeof(md3Frame_t),
+			sizeof(((md3Frame_t *)0)->name));
+	}
+	if (num_tags >= 0 && num_tags <= MD3_MAX_TAGS
+		&& check_range(header->ofsTags, (long long)num_frames * num_tags, sizeof(md3Tag_t), size)
+		&& !(header->ofsTags & 3))
+	{
+		swap_longs(buf + header->ofsTags, (size_t)num_frames * num_tags * sizeof(md3Tag_t) / 4);
+		restore_bytes(buf + header->ofsTags, num_frames * num_tags, sizeof(md3Tag_t), MAX_QPATH);
+	}
+
+	offset = header->ofsSurfaces;
+	for (i = 0; i < header->numSurfaces && i < MD3_MAX_SURFACES; ++i)
+	{
+		if (!check_range(offset, 1, sizeof(md3Surface_t), size) || (offset & 3))
+			break;
+		surf = (md3Surface_t *)(buf + offset);
+		swap_longs(surf, sizeof(*surf) / 4);
+		restore_bytes((unsigned char *)surf->name, 1, 0, sizeof(surf->name));
+
+		if (check_range(surf->ofsShaders, surf->numShaders, sizeof(md3Shader_t), size - offset)
+			&& !(surf->ofsShaders & 3))
+		{
+			swap_longs((unsigned char *)surf + surf->ofsShaders, surf->numShaders * sizeof(md3Shader_t) / 4);
+			restore_bytes((unsigned char *)surf + surf->ofsShaders, surf->numShaders, sizeof(md3Shader_t), MAX_QPATH);
+		}
+		if (check_range(surf->ofsTriangles, surf->numTriangles, sizeof(md3Triangle_t), size - offset)
+			&& !(surf->ofsTriangles & 3))
+		{
+			swap_longs((unsigned char *)surf + surf->ofsTriangles, surf->numTriangles * sizeof(md3Triangle_t) / 4);
+		}
+		if (check_range(surf->ofsSt, surf->numVerts, sizeof(md3St_t), size - offset) && !(surf->ofsSt & 3))
+			swap_longs((unsigned char *)surf + surf->ofsSt, surf->numVerts * sizeof(md3St_t) / 4);
+		// as in validate_md3, the vertex frames are counted by the header, not the surface
+		if (surf->numVerts >= 0 && num_frames >= 0
+			&& check_range(surf->ofsXyzNormals, (long long)surf->numVerts * num_frames, sizeof(md3XyzNormal_t),
+				size - offset)
+			&& !(surf->ofsXyzNormals & 3))
+		{
+			swap_shorts((unsigned char *)surf + surf->ofsXyzNormals,
+				(size_t)surf->numVerts * num_frames * sizeof(md3XyzNormal_t) / 2);
+		}
+
+		if (surf->ofsEnd < (int)sizeof(md3Surface_t))
+			break;
+		offset += surf->ofsEnd;
+	}
+}
+
+/*
+Converts a whole mesh cache to native byte order in place. All of it but the
+identifiers and the material names is made of 32-bit fields, so it is
+swapped wholesale and those are put back afterwards.
+*/
+void swap_mesh_cache(unsigned char *buf, size_t size)
+{
+	mesh_cache_trailer_t *trailer;
+
+	if (size < sizeof(mesh_cache_header_t) + sizeof(*trailer))
+		return;
+	swap_longs(buf, size / 4);
+	trailer = (mesh_cache_trailer_t *)(buf + size - sizeof(*trailer));
+	restore_bytes(buf + offsetof(mesh_cache_header_t, ident), 1, 0, sizeof(trailer->ident));
+	restore_bytes((unsigned char *)trailer->ident, 1, 0, sizeof(trailer->ident));
+	if (check_range(trailer->materials_ofs, trailer->num_materials, sizeof(dshader_t), size)
+		&& !(trailer->materials_ofs & 3))
+	{
+		restore_bytes(buf + trailer->materials_ofs + offsetof(dshader_t, shader), trailer->num_materials,
+			sizeof(dshader_t), MAX_QPATH);
+	}
+}
@@ -0,0 +1,588 @@
+/*
+MD3 and/or BSP to OBJ converter
+Written by Leszek Godlewski <github@inequation.org>
+The code in this file is placed in the public domain.
+*/
+
+/*
+Synthetic inputs for the benchmark and the regression harness: valid BSP and
+MD3 files of any size, generated from a seed so that every run sees the same
+bytes. Everything is written field by field in little-endian order, so the
+files come out the same on any host. Not part of libmd3bsp.
+*/
+
+#ifdef _MSC_VER
+	#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "md3bsp2ase.h"
+
+#define SYNTH_SHADERS		8
+#define SYNTH_CELL			512.f	// spacing of the surfaces on the map's grid
+#define SYNTH_INSTANCES		3		// instances of each foliage surface
+#define SYNTH_MISC_MODEL	"synth_part.md3"
+
+static unsigned int next_random(unsigned int *state)
+{
+	// xorshift32, never seeded with 0
+	unsigned int x = *state ? *state : 0x9E3779B9u;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static float random_float(unsigned int *state)
+{
+	return (next_random(state) >> 8) / 16777216.f;
+}
+
+static void put_int(output_t *out, int value)
+{
+	unsigned int u = (unsigned int)value;
+	unsigned char b[4];
+
+	b[0] = (unsigned char)u;
+	b[1] = (unsigned char)(u >> 8);
+	b[2] = (unsigned char)(u >> 16);
+	b[3] = (unsigned char)(u >> 24);
+	output_write(out, b, sizeof(b));
+}
+
+static void put_short(output_t *out, int value)
+{
+	unsigned char b[2];
+
+	b[0] = (unsigned char)value;
+	b[1] = (unsigned char)((unsigned int)value >> 8);
+	output_write(out, b, sizeof(b));
+}
+
+static void put_float(output_t *out, float value)
+{
+	unsigned int u;
+
+	memcpy(&u, &value, sizeof(u));
+	put_int(out, (int)u);
+}
+
+// A zero padded, always terminated string field.
+static void put_name(output_t *out, const char *name, size_t size)
+{
+	char field[MAX_QPATH];
+
+	memset(field, 0, sizeof(field));
+	memcpy(field, name, min(strlen(name), min(size, sizeof(field)) - 1));
+	output_write(out, field, size);
+}
+
+static void put_bsp_vert(output_t *out, float x, float y, float z, float s, float t, const float normal[3])
+{
+	static const unsigned char color[4] = { 255, 255, 255, 255 };
+
+	put_float(out, x);
+	put_float(out, y);
+	put_float(out, z);
+	put_float(out, s);
+	put_float(out, t);
+	put_float(out, 0.f);
+	put_float(out, 0.f);
+	put_float(out, normal[0]);
+	put_float(out, normal[1]);
+	put_float(out, normal[2]);
+	output_write(out, color, sizeof(color));
+}
+
+// A plane followed by its flip, the way q3map pairs them up.
+static void put_plane_pair(output_t *out, float x, float y, float z, float dist)
+{
+	put_float(out, x);
+	put_float(out, y);
+	put_float(out, z);
+	put_float(out, dist);
+	put_float(out, -x);
+	put_float(out, -y);
+	put_float(out, -z);
+	put_float(out, -dist);
+}
+
+// lightmap is the origin and the three vectors, which flares keep their own data in, or NULL for none.
+static void put_bsp_surface(output_t *out, int shader, int type, int first_vert, int num_verts, int first_index,
+	int num_indexes, int patch_width, int patch_height, const float *lightmap)
+{
+	int i;
+
+	put_int(out, shader);
+	put_int(out, -1);			// fogNum
+	put_int(out, type);
+	put_int(out, first_vert);
+	put_int(out, num_verts);
+	put_int(out, first_index);
+	put_int(out, num_indexes);
+	put_int(out, -1);			// lightmapNum
+	for (i = 0; i < 4; ++i)
+		put_int(out, 0);		// lightmap rectangle
+	for (i = 0; i < 12; ++i)
+		put_float(out, lightmap ? lightmap[i] : 0.f);	// lightmapOrigin, lightmapVecs
+	put_int(out, patch_width);
+	put_int(out, patch_height);
+}
+
+// An odd control grid dimension in [min_size, max_size].
+static int random_patch_size(unsigned int *state, int min_size, int max_size)
+{
+	int steps = (max_size - min_size) / 2 + 1;
+
+	return min_size + 2 * (int)(next_random(state) % (unsigned int)steps);
+}
+
+/*
+Surfaces are laid out on a square grid of SYNTH_CELL sized cells: planar
+ones as flat grids of grid x grid vertices, triangle soups as the same grids
+with a bit of noise in height, patches as bumps with a random odd number of
+control points along each side. With tiles set, each planar grid is written
+as that many fragments along each side, with their own copies of the
+vertices they share. All of them belong to the world model.
+
+The map features follow: foliage surfaces as a single upright quad placed a
+few times, flares, brushes as boxes sunk into the ground with one top corner
+bevelled off, and misc_model entities placing SYNTH_MISC_MODEL at each cell
+with every kind of angle and scale key in turn. None of them take anything
+from the random sequence unless asked for, so the rest of the map stays the
+same.
+*/
+static int generate_bsp_lumps(const synth_bsp_t *params, output_t *lumps)
+{
+	static const float up[3] = { 0.f, 0.f, 1.f };
+	unsigned int state = params->seed;
+	int grid = max(params->grid, 2), patch_min, patch_max;
+	int num_surfaces = params->planar + params->soups + params->patches, cells;
+	int i, j, k, type, num_verts = 0, num_indexes = 0, first_vert, first_index, width, height;
+	int tiles = max(1, min(params->tiles, grid - 1)), written = 0, tile, i0, i1, j0, j1;
+	float x0, y0, amplitude;
+	float mins[3], maxs[3], lightmap[12], sign;
+	char name[MAX_QPATH];
+
+	patch_min = max(3, min(params->patch_min, MAX_PATCH_SIZE)) | 1;
+	patch_max = max(patch_min, min(params->patch_max, MAX_PATCH_SIZE));
+	if (!(patch_max & 1))
+		--patch_max;
+	for (cells = 1; cells * cells < num_surfaces; ++cells)
+		;
+
+	output_printf(&lumps[LUMP_ENTITIES], "{\n\"classname\" \"worldspawn\"\n}\n");
+	for (k = 0; k < params->misc_models; ++k)
+	{
+		output_printf(&lumps[LUMP_ENTITIES], "{\n\"classname\" \"misc_model\"\n\"model\" \"%s\"\n"
+			"\"origin\" \"%d %d 64\"\n", SYNTH_MISC_MODEL, (int)((k % cells + 0.5f) * SYNTH_CELL),
+			(int)((k / cells % cells + 0.5f) * SYNTH_CELL));
+		switch (k % 4)
+		{
+			case 0:
+				output_printf(&lumps[LUMP_ENTITIES], "\"angle\" \"90\"\n");
+				break;
+			case 1:
+				output_printf(&lumps[LUMP_ENTITIES], "\"angles\" \"30 45 10\"\n\"modelscale\" \"1.5\"\n");
+				break;
+			case 2:
+				output_printf(&lumps[LUMP_ENTITIES], "\"angles\" \"0 180 0\"\n\"modelscale_vec\" \"1 2 0.5\"\n");
+				break;
+			default:
+				break;
+		}
+		output_printf(&lumps[LUMP_ENTITIES], "}\n");
+	}
+	output_write(&lumps[LUMP_ENTITIES], "", 1);
+
+	for (i = 0; i < SYNTH_SHADERS; ++i)
+	{
+		sprintf(name, "textures/synth/s%d", i);
+		put_name(&lumps[LUMP_SHADERS], name, MAX_QPATH);
+		put_int(&lumps[LUMP_SHADERS], 0);
+		put_int(&lumps[LUMP_SHADERS], CONTENTS_SOLID);
+	}
+
+	for (k = 0; k < num_surfaces; ++k)
+	{
+		type = k < params->planar ? MST_PLANAR : k < params->planar + params->soups ? MST_TRIANGLE_SOUP : MST_PATCH;
+		x0 = (k % cells) * SYNTH_CELL;
+		y0 = (k / cells) * SYNTH_CELL;
+		first_vert = num_verts;
+		first_index = num_indexes;
+
+		if (type == MST_PATCH)
+		{
+			width = random_patch_size(&state, patch_min, patch_max);
+			height = random_patch_size(&state, patch_min, patch_max);
+			amplitude = 16.f + 112.f * random_float(&state);
+			for (j = 0; j < height; ++j)
+			{
+				for (i = 0; i < width; ++i)
+				{
+					float s = (float)i / (width - 1), t = (float)j / (height - 1);
+
+					put_bsp_vert(&lumps[LUMP_DRAWVERTS], x0 + s * (SYNTH_CELL - 64.f), y0 + t * (SYNTH_CELL - 64.f),
+						amplitude * sinf(s * 3.14159265f) * sinf(t * 3.14159265f), s, t, up);
+				}
+			}
+			num_verts += width * height;
+			put_bsp_surface(&lumps[LUMP_SURFACES], k % SYNTH_SHADERS, type, first_vert, width * height,
+				first_index, 0, width, height, NULL);
+			++written;
+			continue;
+		}
+
+		if (type == MST_PLANAR && tiles > 1)
+		{
+			for (tile = 0; tile < tiles * tiles; ++tile)
+			{
+				i0 = tile % tiles * (grid - 1) / tiles;
+				i1 = (tile % tiles + 1) * (grid - 1) / tiles;
+				j0 = tile / tiles * (grid - 1) / tiles;
+				j1 = (tile / tiles + 1) * (grid - 1) / tiles;
+				width = i1 - i0 + 1;
+				height = j1 - j0 + 1;
+				first_vert = num_verts;
+				first_index = num_indexes;
+				for (j = j0; j <= j1; ++j)
+				{
+					for (i = i0; i <= i1; ++i)
+					{
+						float s = (float)i / (grid - 1), t = (float)j / (grid - 1);
+
+						put_bsp_vert(&lumps[LUMP_DRAWVERTS], x0 + s * (SYNTH_CELL - 64.f),
+							y0 + t * (SYNTH_CELL - 64.f), 0.f, s, t, up);
+					}
+				}
+				for (j = 0; j < height - 1; ++j)
+				{
+					for (i = 0; i < width - 1; ++i)
+					{
+						int a = j * width + i;
+
+						put_int(&lumps[LUMP_DRAWINDEXES], a);
+						put_int(&lumps[LUMP_DRAWINDEXES], a + 1);
+						put_int(&lumps[LUMP_DRAWINDEXES], a + width + 1);
+						put_int(&lumps[LUMP_DRAWINDEXES], a);
+						put_int(&lumps[LUMP_DRAWINDEXES], a + width + 1);
+						put_int(&lumps[LUMP_DRAWINDEXES], a + width);
+					}
+				}
+				num_verts += width * height;
+				num_indexes += (width - 1) * (height - 1) * 6;
+				put_bsp_surface(&lumps[LUMP_SURFACES], k % SYNTH_SHADERS, type, first_vert, width * height,
+					first_index, num_indexes - first_index, 0, 0, NULL);
+				++written;
+			}
+			continue;
+		}
+
+		for (j = 0; j < grid; ++j)
+		{
+			for (i = 0; i < grid; ++i)
+			{
+				float s = (float)i / (grid - 1), t = (float)j / (grid - 1);
+
+				put_bsp_vert(&lumps[LUMP_DRAWVERTS], x0 + s * (SYNTH_CELL - 64.f), y0 + t * (SYNTH_CELL - 64.f),
+					type == MST_TRIANGLE_SOUP ? 8.f * random_float(&state) : 0.f, s, t, up);
+			}
+		}
+		for (j = 0; j < grid - 1; ++j)
+		{
+			for (i = 0; i < grid - 1; ++i)
+			{
+				int a = j * grid + i;
+
+				put_int(&lumps[LUMP_DRAWINDEXES], a);
+				put_int(&lumps[LUMP_DRAWINDEXES], a + 1);
+				put_int(&lumps[LUMP_DRAWINDEXES], a + grid + 1);
+				put_int(&lumps[LUMP_DRAWINDEXES], a);
+				put_int(&lumps[LUMP_DRAWINDEXES], a + grid + 1);
+				put_int(&lumps[LUMP_DRAWINDEXES], a + grid);
+			}
+		}
+		num_verts += grid * grid;
+		num_indexes += (grid - 1) * (grid - 1) * 6;
+		put_bsp_surface(&lumps[LUMP_SURFACES], k % SYNTH_SHADERS, type, first_vert, grid * grid,
+			first_index, num_indexes - first_index, 0, 0, NULL);
+		++written;
+	}
+
+	for (k = 0; k < params->foliage; ++k)
+	{
+		x0 = random_float(&state) * (cells * SYNTH_CELL - 64.f);
+		y0 = random_float(&state) * (cells * SYNTH_CELL - 64.f);
+		first_vert = num_verts;
+		first_index = num_indexes;
+		put_bsp_vert(&lumps[LUMP_DRAWVERTS], -8.f, 0.f, 0.f, 0.f, 1.f, up);
+		put_bsp_vert(&lumps[LUMP_DRAWVERTS], 8.f, 0.f, 0.f, 1.f, 1.f, up);
+		put_bsp_vert(&lumps[LUMP_DRAWVERTS], 8.f, 0.f, 32.f, 1.f, 0.f, up);
+		put_bsp_vert(&lumps[LUMP_DRAWVERTS], -8.f, 0.f, 32.f, 0.f, 0.f, up);
+		for (i = 0; i < SYNTH_INSTANCES; ++i)
+		{
+			put_bsp_vert(&lumps[LUMP_DRAWVERTS], x0 + random_float(&state) * 64.f,
+				y0 + random_float(&state) * 64.f, 0.f, 0.f, 0.f, up);
+		}
+		put_int(&lumps[LUMP_DRAWINDEXES], 0);
+		put_int(&lumps[LUMP_DRAWINDEXES], 1);
+		put_int(&lumps[LUMP_DRAWINDEXES], 2);
+		put_int(&lumps[LUMP_DRAWINDEXES], 0);
+		put_int(&lumps[LUMP_DRAWINDEXES], 2);
+		put_int(&lumps[LUMP_DRAWINDEXES], 3);
+		num_verts += 4 + SYNTH_INSTANCES;
+		num_indexes += 6;
+		put_bsp_surface(&lumps[LUMP_SURFACES], k % SYNTH_SHADERS, MST_FOLIAGE, first_vert, 4 + SYNTH_INSTANCES,
+			first_index, 6, SYNTH_INSTANCES, 4, NULL);
+		++written;
+	}
+
+	for (k = 0; k < params->flares; ++k)
+	{
+		// origin, color, then the normal in the third vector
+		memset(lightmap, 0, sizeof(lightmap));
+		lightmap[0] = random_float(&state) * cells * SYNTH_CELL;
+		lightmap[1] = random_float(&state) * cells * SYNTH_CELL;
+		lightmap[2] = 96.f;
+		for (i = 3; i < 6; ++i)
+			lightmap[i] = 0.25f + 0.75f * random_float(&state);
+		lightmap[11] = 1.f;
+		put_bsp_surface(&lumps[LUMP_SURFACES], k % SYNTH_SHADERS, MST_FLARE, num_verts, 0, num_indexes, 0, 0, 0,
+			lightmap);
+		++written;
+	}
+
+	for (k = 0; k < params->brushes; ++k)
+	{
+		for (i = 0; i < 3; ++i)
+		{
+			mins[i] = i < 2 ? random_float(&state) * (cells * SYNTH_CELL - 192.f) : -128.f;
+			maxs[i] = mins[i] + (i < 2 ? 64.f + 128.f * random_float(&state) : 112.f);
+		}
+		for (i = 0; i < 6; ++i)
+		{
+			sign = i & 1 ? -1.f : 1.f;
+			put_plane_pair(&lumps[LUMP_PLANES], i >> 1 == 0 ? sign : 0.f, i >> 1 == 1 ? sign : 0.f,
+				i >> 1 == 2 ? sign : 0.f, i & 1 ? -mins[i >> 1] : maxs[i >> 1]);
+			put_int(&lumps[LUMP_BRUSHSIDES], (k * 7 + i) * 2);
+			put_int(&lumps[LUMP_BRUSHSIDES], 0);
+		}
+		put_plane_pair(&lumps[LUMP_PLANES], 0.57735027f, 0.57735027f, 0.57735027f,
+			0.57735027f * (maxs[0] + maxs[1] + maxs[2]) - 16.f);
+		put_int(&lumps[LUMP_BRUSHSIDES], (k * 7 + 6) * 2);
+		put_int(&lumps[LUMP_BRUSHSIDES], 0);
+		put_int(&lumps[LUMP_BRUSHES], k * 7);
+		put_int(&lumps[LUMP_BRUSHES], 7);
+		put_int(&lumps[LUMP_BRUSHES], 0);
+	}
+
+	// the world model: bounds, then its surfaces and brushes
+	for (i = 0; i < 3; ++i)
+		put_float(&lumps[LUMP_MODELS], i < 2 ? 0.f : -128.f);
+	for (i = 0; i < 3; ++i)
+		put_float(&lumps[LUMP_MODELS], i < 2 ? cells * SYNTH_CELL : 128.f);
+	put_int(&lumps[LUMP_MODELS], 0);
+	put_int(&lumps[LUMP_MODELS], written);
+	put_int(&lumps[LUMP_MODELS], 0);
+	put_int(&lumps[LUMP_MODELS], max(params->brushes, 0));
+
+	for (i = 0; i < HEADER_LUMPS; ++i)
+	{
+		if (lumps[i].failed)
+			return 11;
+	}
+	return 0;
+}
+
+unsigned char *generate_bsp(const synth_bsp_t *params, size_t *size)
+{
+	static const unsigned char padding[4] = { 0, 0, 0, 0 };
+	output_t lumps[HEADER_LUMPS], out;
+	size_t offset;
+	int i, retcode = 0;
+
+	memset(lumps, 0, sizeof(lumps));
+	for (i = 0; i < HEADER_LUMPS && !retcode; ++i)
+		retcode = open_memory_output(&lumps[i]);
+	if (!retcode)
+		retcode = generate_bsp_lumps(params, lumps);
+	if (!retcode)
+		retcode = open_memory_output(&out);
+	if (retcode)
+	{
+		for (i = 0; i < HEADER_LUMPS; ++i)
+			close_output(&lumps[i]);
+		return NULL;
+	}
+
+	// header, then the lumps in order, each 4-byte aligned
+	put_int(&out, BSP_IDENT);
+	put_int(&out, BSP_VERSION);
+	for (i = 0, offset = sizeof(dheader_t); i < HEADER_LUMPS; ++i)
+	{
+		offset = (offset + 3) & ~(size_t)3;
+		put_int(&out, (int)offset);
+		put_int(&out, (int)lumps[i].used);
+		offset += lumps[i].used;
+	}
+	for (i = 0; i < HEADER_LUMPS; ++i)
+	{
+		output_write(&out, padding, (4 - (out.used & 3)) & 3);
+		output_write(&out, lumps[i].buf, lumps[i].used);
+		close_output(&lumps[i]);
+	}
+
+	if (out.failed)
+	{
+		close_output(&out);
+		return NULL;
+	}
+	// the memory output's buffer is handed over as is
+	*size = out.used;
+	return (unsigned char *)out.buf;
+}
+
+/*
+Every surface is a wavy cylinder of rows x columns vertices, as close to the
+requested vertex count as a grid allows, that ripples from frame to frame.
+*/
+unsigned char *generate_md3(const synth_md3_t *params, size_t *size)
+{
+	unsigned int state = params->seed;
+	int num_surfaces = max(1, min(params->surfaces, MD3_MAX_SURFACES));
+	int num_frames = max(1, min(params->frames, MD3_MAX_FRAMES));
+	int num_tags = max(0, min(params->tags, MD3_MAX_TAGS));
+	int columns, rows, num_verts, num_tris, surf_size, frames_size, tags_size;
+	int i, j, f, s, r, c;
+	output_t out;
+	char name[MAX_QPATH];
+
+	for (columns = 3; columns * columns < params->verts; ++columns)
+		;
+	rows = max(2, min(params->verts / columns, MD3_MAX_VERTS / columns));
+	num_verts = rows * columns;
+	num_tris = min(2 * (rows - 1) * columns, MD3_MAX_TRIANGLES);
+
+	surf_size = (int)(sizeof(md3Surface_t) + sizeof(md3Shader_t) + num_tris * sizeof(md3Triangle_t)
+		+ num_verts * sizeof(md3St_t) + num_verts * num_frames * sizeof(md3XyzNormal_t));
+	frames_size = num_frames * (int)sizeof(md3Frame_t);
+	tags_size = num_frames * num_tags * (int)sizeof(md3Tag_t);
+
+	if (open_memory_output(&out) != 0)
+		return NULL;
+
+	put_int(&out, MD3_IDENT);
+	put_int(&out, MD3_VERSION);
+	put_name(&out, "synth", MAX_QPATH);
+	put_int(&out, 0);
+	put_int(&out, num_frames);
+	put_int(&out, num_tags);
+	put_int(&out, num_surfaces);
+	put_int(&out, 0);
+	put_int(&out, sizeof(md3Header_t));
+	put_int(&out, sizeof(md3Header_t) + frames_size);
+	put_int(&out, sizeof(md3Header_t) + frames_size + tags_size);
+	put_int(&out, sizeof(md3Header_t) + frames_size + tags_size + num_surfaces * surf_size);
+
+	for (f = 0; f < num_frames; ++f)
+	{
+		for (i = 0; i < 6; ++i)
+			put_float(&out, i < 3 ? -64.f : 64.f);
+		for (i = 0; i < 3; ++i)
+			put_float(&out, 0.f);
+		put_float(&out, 111.f);
+		sprintf(name, "frame%d", f);
+		put_name(&out, name, 16);
+	}
+
+	for (f = 0; f < num_frames; ++f)
+	{
+		for (j = 0; j < num_tags; ++j)
+		{
+			sprintf(name, "tag_%d", j);
+			put_name(&out, name, MAX_QPATH);
+			put_float(&out, (float)f);
+			put_float(&out, 8.f * j);
+			put_float(&out, 32.f);
+			for (i = 0; i < 9; ++i)
+				put_float(&out, i % 4 ? 0.f : 1.f);
+		}
+	}
+
+	for (s = 0; s < num_surfaces; ++s)
+	{
+		int ofs_shaders = sizeof(md3Surface_t);
+		int ofs_tris = ofs_shaders + sizeof(md3Shader_t);
+		int ofs_st = ofs_tris + num_tris * sizeof(md3Triangle_t);
+		int ofs_xyz = ofs_st + num_verts * sizeof(md3St_t);
+		float radius = 8.f + 24.f * random_float(&state);
+
+		put_int(&out, MD3_IDENT);
+		sprintf(name, "surf%d", s);
+		put_name(&out, name, MAX_QPATH);
+		put_int(&out, 0);
+		put_int(&out, num_frames);
+		put_int(&out, 1);
+		put_int(&out, num_verts);
+		put_int(&out, num_tris);
+		put_int(&out, ofs_tris);
+		put_int(&out, ofs_shaders);
+		put_int(&out, ofs_st);
+		put_int(&out, ofs_xyz);
+		put_int(&out, surf_size);
+
+		sprintf(name, "textures/synth/s%d", s % SYNTH_SHADERS);
+		put_name(&out, name, MAX_QPATH);
+		put_int(&out, 0);
+
+		// two triangles per quad, wrapping around the cylinder
+		for (i = 0; i < num_tris / 2; ++i)
+		{
+			r = i / columns;
+			c = i % columns;
+			j = (c + 1) % columns;
+			put_int(&out, r * columns + c);
+			put_int(&out, (r + 1) * columns + c);
+			put_int(&out, r * columns + j);
+			put_int(&out, r * columns + j);
+			put_int(&out, (r + 1) * columns + c);
+			put_int(&out, (r + 1) * columns + j);
+		}
+
+		for (i = 0; i < num_verts; ++i)
+		{
+			put_float(&out, (float)(i % columns) / columns);
+			put_float(&out, (float)(i / columns) / (rows - 1));
+		}
+
+		for (f = 0; f < num_frames; ++f)
+		{
+			for (i = 0; i < num_verts; ++i)
+			{
+				// in double and rounded, so that the quantized values don't depend on the C library's sinf
+				double a = 6.283185307179586 * (i % columns) / columns;
+				double h = (double)(i / columns) / (rows - 1);
+				double w = radius + 2.0 * sin(a * 3.0 + f * 0.3 + h * 6.0);
+
+				put_short(&out, (int)floor(w * cos(a) * 64.0 + 0.5));
+				put_short(&out, (int)floor(w * sin(a) * 64.0 + 0.5));
+				put_short(&out, (int)floor((h * 96.0 + 16.0 * s) * 64.0 + 0.5));
+				// latitude and longitude bytes of a normal pointing away from the axis
+				put_short(&out, (((i % columns) * 255 / columns) << 8) | 64);
+			}
+		}
+	}
+
+	if (out.failed)
+	{
+		close_output(&out);
+		return NULL;
+	}
+	*size = out.used;
+	return (unsigned char *)out.buf;
+}
@@ -0,0 +1,335 @@
+/*
+MD3 and/or BSP to OBJ converter
+Written by Leszek Godlewski <github@inequation.org>
+The code in this file is placed in the public domain.
+*/
+
+/*
+Vertex animation texture baking. All vertices of all surfaces are laid out
+side by side, one texel column per vertex and one row per frame, in two
+RGBA16F DDS textures:
+	<out>_vat_pos.dds:	xyz = offset from the base mesh position (frame 0), a = texture u
+	<out>_vat_nrm.dds:	xyz = normal, a = texture v
+Offsets keep half precision usable, and the alpha channels carry the
+material texture coordinates because the base mesh's only OBJ UV channel is
+taken by the vertex ID: u addresses the texel column, v the first row.
+*/
+
+#ifdef _MSC_VER
+	#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _USE_MATH_DEFINES
+	#define _USE_MATH_DEFINES
+#endif
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define VAT_SSE2
+	#include <emmintrin.h>
+#endif
+#ifdef __F16C__
+	#include <immintrin.h>
+#endif
+
+#include "md3bsp2ase.h"
+
+#define DDS_FOURCC_A16B16G16R16F	113
+
+// The latitude and longitude bytes of an MD3 normal decode separably, so four 256-entry tables are enough.
+// Like the engine's, a step is 1/256th of a turn, so 255 falls just short of 0 rather than on it.
+static float lut_cos_lat[256], lut_sin_lat[256], lut_cos_lng[256], lut_sin_lng[256];
+
+static void init_normal_lut(void)
+{
+	int i;
+
+	for (i = 0; i < 256; ++i)
+	{
+		float a = i * ((float)M_PI * 2.f / 256.f);
+		lut_cos_lat[i] = lut_cos_lng[i] = cosf(a);
+		lut_sin_lat[i] = lut_sin_lng[i] = sinf(a);
+	}
+}
+
+static unsigned short float_to_half(float f)
+{
+	union { float f; unsigned int u; } v;
+	unsigned int sign, exponent, mantissa, h, rem, halfway;
+	int shift;
+
+	v.f = f;
+	sign = (v.u >> 16) & 0x8000;
+	exponent = (v.u >> 23) & 0xFF;
+	mantissa = v.u & 0x7FFFFF;
+
+	if (exponent == 0xFF)
+		return (unsigned short)(sign | 0x7C00 | (mantissa ? 0x200 : 0));
+	if (exponent > 142)		// overflow, clamp to infinity
+		return (unsigned short)(sign | 0x7C00);
+	if (exponent < 102)		// underflow, flush to zero
+		return (unsigned short)sign;
+
+	if (exponent < 113)
+	{
+		// denormal
+		mantissa |= 0x800000;
+		shift = 126 - exponent;
+		h = mantissa >> shift;
+	}
+	else
+	{
+		shift = 13;
+		h = ((exponent - 112) << 10) | (mantissa >> shift);
+	}
+
+	// round to nearest even; a carry into the exponent is still correct
+	rem = mantissa & ((1u << shift) - 1);
+	halfway = 1u << (shift - 1);
+	if (rem > halfway || (rem == halfway && (h & 1)))
+		++h;
+
+	return (unsigned short)(sign | h);
+}
+
+static void floats_to_halves(const float *in, unsigned short *out, int count)
+{
+	int i = 0;
+
+#ifdef __F16C__
+	for (; i + 4 <= count; i += 4)
+		_mm_storel_epi64((__m128i *)(out + i), _mm_cvtps_ph(_mm_loadu_ps(in + i), 0));
+#endif
+	for (; i < count; ++i)
+		out[i] = float_to_half(in[i]);
+}
+
+// Dequantizes one frame of a surface into 4 floats per vertex: positions (minus base, if given) and normals.
+static void dequantize_frame(const md3XyzNormal_t *in, int count, const float *base, float *pos, float *nrm)
+{
+	int i = 0;
+
+#ifdef VAT_SSE2
+	const __m128 scale = _mm_set1_ps((float)MD3_XYZ_SCALE);
+	// two vertices per iteration: x0 y0 z0 n0 x1 y1 z1 n1
+	for (; i + 2 <= count; i += 2)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+		// sign-extend the shorts to ints by unpacking them into the high halves and shifting back down
+		__m128 lo = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16)), scale);
+		__m128 hi = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16)), scale);
+		if (base)
+		{
+			lo = _mm_sub_ps(lo, _mm_loadu_ps(base + i * 4));
+			hi = _mm_sub_ps(hi, _mm_loadu_ps(base + i * 4 + 4));
+		}
+		_mm_storeu_ps(pos + i * 4, lo);
+		_mm_storeu_ps(pos + i * 4 + 4, hi);
+	}
+#endif
+	for (; i < count; ++i)
+	{
+		pos[i * 4 + 0] = in[i].xyz[0] * (float)MD3_XYZ_SCALE - (base ? base[i * 4 + 0] : 0.f);
+		pos[i * 4 + 1] = in[i].xyz[1] * (float)MD3_XYZ_SCALE - (base ? base[i * 4 + 1] : 0.f);
+		pos[i * 4 + 2] = in[i].xyz[2] * (float)MD3_XYZ_SCALE - (base ? base[i * 4 + 2] : 0.f);
+	}
+
+	for (i = 0; i < count; ++i)
+	{
+		int lat = (in[i].normal >> 8) & 0xFF, lng = in[i].normal & 0xFF;
+		nrm[i * 4 + 0] = lut_cos_lat[lat] * lut_sin_lng[lng];
+		nrm[i * 4 + 1] = lut_sin_lat[lat] * lut_sin_lng[lng];
+		nrm[i * 4 + 2] = lut_cos_lng[lng];
+	}
+}
+
+static void write_long(output_t *out, unsigned int l)
+{
+	unsigned char b[4];
+
+	b[0] = l & 0xFF;
+	b[1] = (l >> 8) & 0xFF;
+	b[2] = (l >> 16) & 0xFF;
+	b[3] = (l >> 24) & 0xFF;
+	output_write(out, b, 4);
+}
+
+static void write_dds_header(output_t *out, int width, int height)
+{
+	int i;
+
+	output_write(out, "DDS ", 4);
+	write_long(out, 124);							// size
+	write_long(out, 0x1 | 0x2 | 0x4 | 0x8 | 0x1000);	// caps, height, width, pitch, pixel format
+	write_long(out, height);
+	write_long(out, width);
+	write_long(out, width * 8);						// pitch
+	write_long(out, 0);								// depth
+	write_long(out, 0);								// mip map count
+	for (i = 0; i < 11; ++i)
+		write_long(out, 0);
+	// pixel format
+	write_long(out, 32);
+	write_long(out, 0x4);							// fourCC
+	write_long(out, DDS_FOURCC_A16B16G16R16F);
+	for (i = 0; i < 5; ++i)
+		write_long(out, 0);
+	write_long(out, 0x1000);						// texture
+	for (i = 0; i < 4; ++i)
+		write_long(out, 0);
+}
+
+// Channels are swapped to Y-up for OBJ consistency and stored little-endian.
+static void write_half_row(output_t *out, const unsigned short *halves, int width)
+{
+	unsigned char texel[8];
+	int i, c;
+
+	for (i = 0; i < width; ++i, halves += 4)
+	{
+		for (c = 0; c < 4; ++c)
+		{
+			unsigned short h = halves[c == 1 ? 2 : c == 2 ? 1 : c];
+			texel[c * 2] = h & 0xFF;
+			texel[c * 2 + 1] = h >> 8;
+		}
+		output_write(out, texel, sizeof(texel));
+	}
+}
+
+int bake_md3_vat(const md3_model_t *model, const sink_t *sink)
+{
+	const md3Surface_t *surf;
+	const md3Triangle_t *tri;
+	const md3St_t *st;
+	float *base, *pos, *nrm;
+	unsigned short *pos_half, *nrm_half;
+	output_t out, pos_out, nrm_out;
+	int num_frames, width, frame, column, i, j, retcode, closed;
+
+	num_frames = model->header->numFrames;
+	for (i = 0, width = 0, surf = first_md3_surface(model);
+		i < model->header->numSurfaces;
+		++i, surf = next_md3_surface(surf))
+	{
+		width += surf->numVerts;
+	}
+
+	sink_log(sink, LOG_INFO, "Baking VAT: %d vertices x %d frames", width, num_frames);
+	if (width > 16384 || num_frames > 16384)
+		sink_log(sink, LOG_WARNING, "WARNING: textures larger than 16384 texels are not supported by most GPUs");
+
+	base = malloc(sizeof(*base) * 4 * width);
+	pos = malloc(sizeof(*pos) * 4 * width);
+	nrm = malloc(sizeof(*nrm) * 4 * width);
+	pos_half = malloc(sizeof(*pos_half) * 4 * width);
+	nrm_half = malloc(sizeof(*nrm_half) * 4 * width);
+	memset(&pos_out, 0, sizeof(pos_out));
+	memset(&nrm_out, 0, sizeof(nrm_out));
+	if (!base || !pos || !nrm || !pos_half || !nrm_half)
+	{
+		sink_log(sink, LOG_ERROR, "Memory allocation failed");
+		retcode = 11;
+	}
+	else if ((retcode = open_output(&pos_out, sink, "vat_pos.dds")) == 0)
+	{
+		retcode = open_output(&nrm_out, sink, "vat_nrm.dds");
+	}
+
+	if (!retcode)
+	{
+		init_normal_lut();
+		write_dds_header(&pos_out, width, num_frames);
+		write_dds_header(&nrm_out, width, num_frames);
+
+		// frame 0 is the base mesh, every row stores offsets from it
+		for (i = 0, column = 0, surf = first_md3_surface(model);
+			i < model->header->numSurfaces;
+			++i, surf = next_md3_surface(surf))
+		{
+			dequantize_frame((const md3XyzNormal_t *)(((const unsigned char *)surf) + surf->ofsXyzNormals),
+				surf->numVerts, NULL, base + column * 4, nrm + column * 4);
+			column += surf->numVerts;
+		}
+
+		for (frame = 0; frame < num_frames; ++frame)
+		{
+			for (i = 0, column = 0, surf = first_md3_surface(model);
+				i < model->header->numSurfaces;
+				++i, surf = next_md3_surface(surf))
+			{
+				dequantize_frame((const md3XyzNormal_t *)(((const unsigned char *)surf) + surf->ofsXyzNormals)
+					+ frame * surf->numVerts,
+					surf->numVerts, base + column * 4, pos + column * 4, nrm + column * 4);
+				st = (const md3St_t *)(((const unsigned char *)surf) + surf->ofsSt);
+				for (j = 0; j < surf->numVerts; ++j, ++st, ++column)
+				{
+					pos[column * 4 + 3] = st->st[0];
+					nrm[column * 4 + 3] = st->st[1];
+				}
+			}
+			floats_to_halves(pos, pos_half, width * 4);
+			floats_to_halves(nrm, nrm_half, width * 4);
+			write_half_row(&pos_out, pos_half, width);
+			write_half_row(&nrm_out, nrm_half, width);
+		}
+	}
+
+	if (!retcode && (retcode = open_output(&out, sink, NULL)) == 0)
+	{
+		// the base mesh: frame 0 positions, UVs addressing the vertex's texel column
+		output_printf(&out,
+			"# generated by md3bsp2ase from %s\n"
+			"# vertex animation textures: vat_pos.dds, vat_nrm.dds (%d x %d)\n",
+			model->name, width, num_frames);
+		for (i = 0, column = 0, surf = first_md3_surface(model);
+			i < model->header->numSurfaces;
+			++i, surf = next_md3_surface(surf))
+		{
+			output_printf(&out,
+				"\n"
+				"# surface #%d\n"
+				"g %s\n"
+				"o %s\n"
+				"\n",
+					i, surf->name, surf->name);
+			for (j = 0; j < surf->numVerts; ++j)
+			{
+				output_printf(&out, "v %f %f %f\n",
+					base[(column + j) * 4 + 0], base[(column + j) * 4 + 2], base[(column + j) * 4 + 1]);
+			}
+			output_printf(&out, "\n");
+			// texel centres of the first row; OBJ's v axis points up, the texture's rows go down
+			for (j = 0; j < surf->numVerts; ++j)
+				output_printf(&out, "vt %f %f\n", (column + j + 0.5f) / width, 1.f - 0.5f / num_frames);
+			output_printf(&out,
+				"\n"
+				"s 1\n");
+			tri = (const md3Triangle_t *)(((const unsigned char *)surf) + surf->ofsTriangles);
+			for (j = 0; j < surf->numTriangles; ++j, ++tri)
+			{
+				output_printf(&out, "f %d/%d %d/%d %d/%d\n",
+					1 + tri->indexes[0] + column, 1 + tri->indexes[0] + column,
+					1 + tri->indexes[1] + column, 1 + tri->indexes[1] + column,
+					1 + tri->indexes[2] + column, 1 + tri->indexes[2] + column);
+			}
+			column += surf->numVerts;
+		}
+		retcode = close_output(&out);
+	}
+
+	closed = close_output(&pos_out);
+	retcode = retcode ? retcode : closed;
+	closed = close_output(&nrm_out);
+	retcode = retcode ? retcode : closed;
+	free(base);
+	free(pos);
+	free(nrm);
+	free(pos_half);
+	free(nrm_half);
+
+	return retcode;
+}
@@ -301,12 +301,20 @@ srfGridMesh_t *R_CreateSurfaceGridMesh( int width, int height,
 
 #ifdef PATCH_STITCHING
 	grid = /*ri.Hunk_Alloc*/ malloc( size );
+	if ( !grid ) {
+		return NULL;    // the caller reports running out of memory
+	}
 	Com_Memset( grid, 0, size );
 
 	grid->widthLodError = /*ri.Hunk_Alloc*/ malloc( width * 4 );
-	memcpy( grid->widthLodError, errorTable[0], width * 4 );
-
 	grid->heightLodError = /*ri.Hunk_Alloc*/ malloc( height * 4 );
+	if ( !grid->widthLodError || !grid->heightLodError ) {
+		free( grid->widthLodError );
+		free( grid->heightLodError );
+		free( grid );
+		return NULL;
+	}
+	memcpy( grid->widthLodError, errorTable[0], width * 4 );
 	memcpy( grid->heightLodError, errorTable[1], height * 4 );
 #else
 	grid = ri.Hunk_Alloc( size, h_low );
@@ -350,7 +358,7 @@ R_SubdividePatchToGrid
 */
 srfGridMesh_t *R_SubdividePatchToGrid( int width, int height,
 									   drawVert_t points[MAX_PATCH_SIZE*MAX_PATCH_SIZE],
-									   int r_subdivisions ) {
+									   int r_subdivisions, stats_t *stats ) {
 	int i, j, k, l;
 	drawVert_t prev, next, mid;
 	float len, maxLen;
@@ -358,6 +366,7 @@ srfGridMesh_t *R_SubdividePatchToGrid( int width, int height,
 	int t;
 	drawVert_t ctrl[MAX_GRID_SIZE][MAX_GRID_SIZE];
 	float errorTable[2][MAX_GRID_SIZE];
+	double start;
 
 	for ( i = 0 ; i < width ; i++ ) {
 		for ( j = 0 ; j < height ; j++ ) {
@@ -501,7 +510,9 @@ srfGridMesh_t *R_SubdividePatchToGrid( int width, int height,
 #endif
 
 	// calculate normals
+	start = get_time();
 	MakeMeshNormals( width, height, ctrl );
+	add_time( stats, STAGE_NORMALS, get_time() - start );
 
 	return R_CreateSurfaceGridMesh( width, height, ctrl, errorTable );
 }
\ No newline at end of file